@@ -31,16 +31,17 @@ namespace ImageResizer{
 			public ref class FastScalingPlugin : public ImageResizer::Resizing::BuilderExtension, IPlugin, IQuerystringPlugin
 			{
                 void SetupConvolutions(ExecutionContext^ c, NameValueCollection ^query, RenderOptions^ addTo){
-                    //No unsharp mask support until it is higher quality
-          /*          int kernel_radius = (int)GetDouble(query, "f.unsharp.radius", 0);
+                    int kernel_radius = (int)GetDouble(query, "f.unsharp.radius", 0);
                     double unsharp_sigma = GetDouble (query, "f.unsharp.sigma", 1.4);
+                    double amount = GetDouble (query, "f.unsharp.amount", 1);
+                    //0..255, summed across channels
                     double threshold = GetDouble (query, "f.unsharp.threshold", 0);
 
-                    if (kernel_radius > 0){
-
-                        addTo->KernelA_Struct = ConvolutionKernel_create_guassian_sharpen (c->GetContext (), unsharp_sigma, kernel_radius);
-
-                    }*/
+                    if (kernel_radius > 0 && amount > 0){
+                        //Applied along each axis while the rows are still linear floats
+                        addTo->KernelA_Struct = ConvolutionKernel_create_unsharp_mask (c->GetContext (), unsharp_sigma, kernel_radius, amount, (float)(threshold / 255.0));
+                        if (addTo->KernelA_Struct == nullptr) throw gcnew FastScalingException (c);
+                    }
 
                 }
 			protected:
@@ -148,7 +149,7 @@ namespace ImageResizer{
                         throw gcnew Exception ("&f is deprecated. Used &down.filter instead.");
                     }
 
-                    if (System::String::IsNullOrEmpty (query->Get ("f.sharpen")) && (fastScale == nullptr || fastScale->ToLowerInvariant () != sTrue)){
+                    if (System::String::IsNullOrEmpty (query->Get ("f.sharpen")) && System::String::IsNullOrEmpty (query->Get ("f.unsharp.radius")) && (fastScale == nullptr || fastScale->ToLowerInvariant () != sTrue)){
 						return RequestedAction::None;
 					}
 
@@ -174,9 +175,8 @@ namespace ImageResizer{
 
                     bool ignorealpha = ImageResizer::ExtensionMethods::NameValueCollectionExtensions::Get<bool> (query, "f.ignorealpha", mayIgnoreAlpha);
 
-                    bool sourceFormatInvalid = (source->PixelFormat != PixelFormat::Format32bppArgb &&
-                        source->PixelFormat != PixelFormat::Format24bppRgb &&
-                        source->PixelFormat != PixelFormat::Format32bppRgb);
+                    //GDI+ layouts FastScaling can read are unpacked as rows are; only the rest are copied first
+                    bool sourceFormatInvalid = WrappedBitmap::NativeFormat (source->PixelFormat) == 0;
 
                     Bitmap^ copy = nullptr;
                     Graphics^ copyGraphics = nullptr;
@@ -246,7 +246,7 @@ namespace ImageResizer{
 				}
 
                 virtual System::Collections::Generic::IEnumerable<System::String^>^ GetSupportedQuerystringKeys (){
-                    return gcnew array < String^, 1 > {"f.sharpen"}; //Only list the keys that would activate image processing by themselves, in the absence of any other commands
+                    return gcnew array < String^, 1 > {"f.sharpen", "f.unsharp.radius"}; //Only list the keys that would activate image processing by themselves, in the absence of any other commands
                 }
 
 			};
@@ -62,6 +62,13 @@ int  Context_error_reason(Context * context);
 
 void Context_free_static_caches(void);
 
+//The most capable instruction set detected (via cpuid) when the context was created
+SimdLevel Context_simd_level_supported(Context * context);
+//The instruction set kernels are currently dispatched to
+SimdLevel Context_simd_level(Context * context);
+//Forces kernels to use the given instruction set (or the best supported one below it). Returns the level actually selected.
+SimdLevel Context_set_simd_level(Context * context, SimdLevel level);
+
 
 //non-indexed bitmap
 typedef struct BitmapBgraStruct {
@@ -78,6 +85,8 @@ typedef struct BitmapBgraStruct {
     bool borrowed_pixels;
     //If false, we can even ignore the alpha channel on 4bpp
     bool alpha_meaningful;
+    //If true, color channels are already multiplied by alpha (as in GDI+ PArgb); only read when alpha is meaningful
+    bool alpha_premultiplied;
     //If false, we can edit pixels without affecting the stride
     bool pixels_readonly;
     //If false, we can change the stride of the image.
@@ -88,6 +97,9 @@ typedef struct BitmapBgraStruct {
 
     BitmapPixelFormat fmt;
 
+    //Indexed8: 256 BGRA entries (1024 bytes), which must outlive the bitmap. Never freed with it.
+    uint8_t * palette;
+
     //When using compositing mode blend_with_matte, this color will be used. We should probably define this as always being sRGBA, 4 bytes.
     uint8_t matte_color[4];
 
@@ -95,6 +107,24 @@ typedef struct BitmapBgraStruct {
 
 } BitmapBgra;
 
+//Planar Y'CbCr as JPEG decoders produce it: full range BT.601 (JFIF), each chroma sample centered on the luma pixels it covers
+typedef struct BitmapYCbCrStruct {
+
+    //luma width and height in pixels
+    uint32_t w;
+    uint32_t h;
+    //How many luma pixels each chroma sample spans, 1 to 4 (2 and 2 is 4:2:0). Chroma planes are w / subsampling_x by
+    //h / subsampling_y, rounded up.
+    uint32_t subsampling_x;
+    uint32_t subsampling_y;
+    //Y, Cb and Cr, one byte per sample, each with its own stride
+    unsigned char * planes[3];
+    uint32_t strides[3];
+    //If true, we don't dispose of the planes when we dispose the struct
+    bool borrowed_pixels;
+
+} BitmapYCbCr;
+
 
 
 
@@ -132,6 +162,18 @@ typedef struct InterpolationDetailsStruct {
 } InterpolationDetails;
 
 
+//Gaussian kernels at least this wide (in radius) are applied with the recursive filter by default; it's faster beyond it
+#define CONVOLUTION_RECURSIVE_MIN_RADIUS 8
+
+//The recursive filter's coefficients for a sigma (see blur.c)
+typedef struct {
+    float sigma; //What they were computed for; 0 if they haven't been
+    float b;
+    float a[3];
+    //Maps the last 3 causal outputs, less the edge pixel, to the first 3 anti-causal outputs past the end
+    float m[9];
+} RecursiveGaussian;
+
 typedef struct ConvolutionKernelStruct {
     float * kernel;
     uint32_t width;
@@ -139,8 +181,26 @@ typedef struct ConvolutionKernelStruct {
     float threshold_min_change; //These change values are on a somewhat arbitrary scale between 0 and 4;
     float threshold_max_change;
     float * buffer;
+    //Set by ConvolutionKernel_create_guassian_normalized and _sharpen. Other kernels (sigma 0) are always applied directly.
+    float sigma;
+    //When > 0, the kernel is (1 + sharpen_amount) times the identity less sharpen_amount times the Gaussian;
+    //1 for ConvolutionKernel_create_guassian_sharpen
+    float sharpen_amount;
+    //Convolution_auto uses the recursive filter once radius reaches CONVOLUTION_RECURSIVE_MIN_RADIUS
+    ConvolutionMethod method;
+    //Computed along with sigma
+    RecursiveGaussian recursive;
 } ConvolutionKernel;
 
+//A 3D color lookup table, as in an Adobe .cube file. Inputs are sRGB (0..1 within the domain) and the size^3 entries are
+//r, g, b triples, red changing fastest. Values between grid points are interpolated tetrahedrally.
+typedef struct ColorLut3DStruct {
+    uint32_t size;
+    float * table;
+    float domain_min[3];
+    float domain_max[3];
+} ColorLut3D;
+
 typedef struct RenderDetailsStruct {
     //Interpolation and scaling details
     InterpolationDetails * interpolation;
@@ -173,6 +233,9 @@ typedef struct RenderDetailsStruct {
     float color_matrix_data[25];
     float *color_matrix[5];
 
+    //If not NULL, applied after the color matrix, as the final pass encodes. Destroyed with the details.
+    ColorLut3D * color_lut;
+
     //Transpose, flipx, flipy - combined, these give you all 90 interval rotations
     bool post_transpose;
     bool post_flip_x;
@@ -181,6 +244,48 @@ typedef struct RenderDetailsStruct {
     //Enables profiling
     bool enable_profiling;
 
+    //Split row loops (scaling, rendering, and halving into a temporary image) into bands across up to this many threads.
+    //0 or 1 renders on the calling thread. Output is identical either way. With more than one thread, the context's
+    //heap manager may be called concurrently.
+    uint32_t threads;
+
+    //Scale vertically from a ring buffer of horizontally scaled rows, instead of a full-size transposed intermediate image.
+    //Ignored (the two-pass path is used) when rendering in place, with kernel_a/kernel_b, or when sharpen_percent_goal is
+    //more than the interpolation weights provide, so the output doesn't depend on it.
+    bool enable_streaming_vertical_pass;
+
+    //With Floatspace_as_is, scale opaque images (Bgr24, or Bgra32 without alpha_meaningful) in 14-bit fixed point straight
+    //from and to bytes, instead of through float buffers. Within 1 of the float result. Passes that apply kernels, color
+    //matrices or post-scaling sharpening, or that convert between formats, still use floats.
+    bool enable_integer_pipeline;
+
+    //Halve straight into the float rows of the first scaling pass, instead of into a temporary image that is quantized to
+    //bytes and decoded again. Used when halving into a temporary image would be, unless the integer pipeline could be.
+    //Averages are of decoded (and premultiplied) values, so output differs slightly from the temporary image's.
+    bool enable_fused_halving;
+
+    //Check whether every alpha byte of a Bgra32 source with alpha_meaningful is 0xff (stopping at the first that isn't).
+    //If so, the integer pipeline, when enabled, scales it as if alpha_meaningful were false; the float pipeline keeps 4
+    //channels but takes alpha as 1, skipping premultiplying, demultiplying and matting or composing. The float pipeline
+    //doesn't probe when that could change the output: with a color matrix, or composing (Blend_with_self) onto a canvas
+    //without meaningful alpha. Regions of interest aren't probed. On by default.
+    bool detect_opaque_alpha;
+
+    //Region of interest. When roi_output_w/h are set, the canvas receives only the canvas-sized rectangle at (roi_x, roi_y)
+    //of a roi_output_w x roi_output_h rendering, and only the weights and source pixels that rectangle needs are touched.
+    //Rendered as a TiledRenderer region, so halving is skipped, and post_transpose, kernels and sharpen_percent_goal beyond
+    //what the interpolation weights provide (which a full render applies to whole rows and columns) are Invalid_argument.
+    uint32_t roi_output_w;
+    uint32_t roi_output_h;
+    uint32_t roi_x;
+    uint32_t roi_y;
+
+    //How many output pixels (of the canvas, or of the roi_output_w x roi_output_h rendering) the source's width and height
+    //map onto, along the source's axes. 0 means the output size. Chroma planes of odd-sized Y'CbCr images reach half a
+    //luma pixel past the image, so they span a little more than the canvas.
+    double source_span_x;
+    double source_span_y;
+
 } RenderDetails;
 
 
@@ -188,6 +293,17 @@ typedef struct RenderDetailsStruct {
 BitmapBgra * BitmapBgra_create(Context * context, int sx, int sy, bool zeroed, BitmapPixelFormat format);
 BitmapBgra * BitmapBgra_create_header(Context * context, int sx, int sy);
 void BitmapBgra_destroy(Context * context, BitmapBgra * im);
+//Copies src to dest, a Bgr24 or Bgra32 image of the same size: gray is repeated over the colors, GDI+ layouts unpacked,
+//and wider channels rounded to bytes. Alpha is 255 where src has none. Premultiplied colors stay so, except 13-bit linear
+//ones, which are divided by alpha in linear light.
+bool BitmapBgra_convert(Context * context, const BitmapBgra * src, BitmapBgra * dest);
+
+BitmapYCbCr * BitmapYCbCr_create(Context * context, uint32_t w, uint32_t h, uint32_t subsampling_x, uint32_t subsampling_y);
+void BitmapYCbCr_destroy(Context * context, BitmapYCbCr * im);
+uint32_t BitmapYCbCr_plane_width(const BitmapYCbCr * im, int plane);
+uint32_t BitmapYCbCr_plane_height(const BitmapYCbCr * im, int plane);
+//Converts to a Bgr24 or Bgra32 image of the same size (with opaque alpha), repeating each chroma sample over its pixels
+bool BitmapYCbCr_to_bgra(Context * context, const BitmapYCbCr * src, BitmapBgra * dest);
 
 RenderDetails * RenderDetails_create(Context * context);
 RenderDetails * RenderDetails_create_with(Context * context, InterpolationFilter filter);
@@ -196,6 +312,66 @@ bool RenderDetails_render(Context * context, RenderDetails * details, BitmapBgra
 bool RenderDetails_render_in_place(Context * context, RenderDetails * details, BitmapBgra * edit_in_place);
 void RenderDetails_destroy(Context * context, RenderDetails * d);
 
+typedef struct StreamingRendererStruct StreamingRenderer;
+
+//Renders a source image that arrives top-down, a few rows at a time (e.g. from a scanline decoder). Memory use depends
+//on the widths and the vertical filter window, not the heights. post_transpose, post_flip_y, kernel_a/kernel_b, and
+//any sharpen_percent_goal the interpolation weights don't provide along both axes (which a render would apply to whole
+//rows and columns afterwards) cannot be streamed (Invalid_argument); halving is not performed. details must outlive
+//the renderer.
+StreamingRenderer * StreamingRenderer_create(Context * context, RenderDetails * details, uint32_t source_w, uint32_t source_h, BitmapPixelFormat source_format, bool source_alpha_meaningful, uint32_t canvas_w, uint32_t canvas_h);
+void StreamingRenderer_destroy(Context * context, StreamingRenderer * r);
+//Consumes the next rows of the source image from rows (any height, same width and format). Stops early, with
+//*rows_consumed < rows->h, when enough output is waiting that nothing more can be buffered - pull, then push the rest.
+bool StreamingRenderer_push_rows(Context * context, StreamingRenderer * r, BitmapBgra * rows, uint32_t * rows_consumed);
+//Writes up to max_rows finished output rows to canvas, starting at canvas_row. *rows_written may be 0 if more input is needed.
+bool StreamingRenderer_pull_rows(Context * context, StreamingRenderer * r, BitmapBgra * canvas, uint32_t canvas_row, uint32_t max_rows, uint32_t * rows_written);
+uint32_t StreamingRenderer_rows_pushed(const StreamingRenderer * r);
+uint32_t StreamingRenderer_rows_pulled(const StreamingRenderer * r);
+//True once every output row has been pulled
+bool StreamingRenderer_is_complete(const StreamingRenderer * r);
+
+typedef struct TiledRendererStruct TiledRenderer;
+
+//Renders arbitrary rectangles of a canvas_w x canvas_h rendering of the source, each from just the source window it
+//depends on, so neither image needs to be in memory (or even contiguous) at once. post_flip_x/post_flip_y are
+//supported; post_transpose, kernel_a/kernel_b, and any sharpen_percent_goal the interpolation weights don't provide
+//along both axes are not (Invalid_argument), and halving is not performed.
+//Output is identical however the canvas is divided up. details must outlive the renderer.
+TiledRenderer * TiledRenderer_create(Context * context, RenderDetails * details, uint32_t source_w, uint32_t source_h, BitmapPixelFormat source_format, bool source_alpha_meaningful, uint32_t canvas_w, uint32_t canvas_h);
+void TiledRenderer_destroy(Context * context, TiledRenderer * t);
+//The source rectangle (including filter overlap) needed to render the given canvas rectangle
+bool TiledRenderer_source_window(Context * context, TiledRenderer * t, uint32_t canvas_x, uint32_t canvas_y, uint32_t w, uint32_t h,
+                                 uint32_t * source_x, uint32_t * source_y, uint32_t * source_w, uint32_t * source_h);
+//Renders the canvas rectangle at (canvas_x, canvas_y), sized like region, into region. source holds the source image
+//starting at (source_x, source_y); it may be the whole image (0, 0) or any part that covers the rectangle's source window.
+bool TiledRenderer_render_region(Context * context, TiledRenderer * t, BitmapBgra * source, uint32_t source_x, uint32_t source_y,
+                                 uint32_t canvas_x, uint32_t canvas_y, BitmapBgra * region);
+
+//Renders canvas in tile_size x tile_size pieces, bounding the working memory by the tile size rather than the image size
+bool RenderDetails_render_tiled(Context * context, RenderDetails * details, BitmapBgra * source, BitmapBgra * canvas, uint32_t tile_size);
+
+//Renders planar Y'CbCr without upsampling its chroma first: each plane is scaled from its own size (with the same details,
+//in Floatspace_as_is, as the planes hold encoded values), and only the canvas-sized result is converted. A Gray8 canvas
+//receives the luma alone. The color matrix and color LUT are applied after conversion, so not to Gray8 canvases.
+bool RenderDetails_render_ycbcr(Context * context, RenderDetails * details, BitmapYCbCr * source, BitmapBgra * canvas);
+//Renders each plane of source to the same plane of canvas, for encoders that take planar Y'CbCr. The canvas may be
+//subsampled differently, but not when rendering a region of interest. The color matrix and color LUT are not applied.
+bool RenderDetails_render_ycbcr_planes(Context * context, RenderDetails * details, BitmapYCbCr * source, BitmapYCbCr * canvas);
+
+typedef struct RenderPlanStruct RenderPlan;
+
+//Precomputes everything a render of one source size and format to one canvas size needs - halving divisor, contributions,
+//sharpening, and the intermediate buffers - so each execution only reads pixels and writes pixels. Captures a copy of details
+//(kernel weights are still read from kernel_a/kernel_b, which must outlive the plan) and the context's current floatspace.
+//Up to max_concurrent_executions (at least 1) executions can run at once without allocating; more still work, but allocate.
+RenderPlan * RenderPlan_create(Context * context, RenderDetails * details, uint32_t source_w, uint32_t source_h,
+                               BitmapPixelFormat source_format, bool source_alpha_meaningful, uint32_t canvas_w, uint32_t canvas_h,
+                               uint32_t max_concurrent_executions);
+//Thread-safe, given a separate context per thread. Output is identical to RenderDetails_render with the same details.
+bool RenderPlan_execute(Context * context, RenderPlan * plan, BitmapBgra * source, BitmapBgra * canvas);
+void RenderPlan_destroy(Context * context, RenderPlan * plan);
+
 bool InterpolationDetails_interpolation_filter_exists(InterpolationFilter filter);
 InterpolationDetails * InterpolationDetails_create(Context * context);
 InterpolationDetails * InterpolationDetails_create_bicubic_custom(Context * context,double window, double blur, double B, double C);
@@ -205,6 +381,14 @@ double InterpolationDetails_percent_negative_weight(const InterpolationDetails *
 void InterpolationDetails_destroy(Context * context, InterpolationDetails *);
 
 uint32_t BitmapPixelFormat_bytes_per_pixel (BitmapPixelFormat format);
+//1, 3 or 4 (alpha last); 0 for an unknown format
+uint32_t BitmapPixelFormat_channels(BitmapPixelFormat format);
+//Whether channels are wider than a byte (Bgr48, Bgra64, BgraHalf). These are decoded and encoded through tables of
+//their own, and skip halving and the integer pipeline, which work on bytes.
+bool BitmapPixelFormat_is_wide(BitmapPixelFormat format);
+//The format rows of a GDI+ layout are unpacked to as they're read: Bgra32 for indexed and 16-bit pixels (alpha 255 where
+//there is none), Bgra64 for 13-bit linear ones. Other formats are returned as they are.
+BitmapPixelFormat BitmapPixelFormat_unpacked(BitmapPixelFormat format);
 
 typedef struct {
     float *Weights;/* Normalized weights of neighboring pixels */
@@ -220,6 +404,8 @@ typedef struct {
 } LineContributions;
 
 LineContributions * LineContributions_create(Context * context, const uint32_t output_line_size, const uint32_t input_line_size, const InterpolationDetails * details);
+//Only the windows for output pixels [from, from + count) of the line; ContribRow[0] is output pixel 'from'.
+LineContributions * LineContributions_create_range(Context * context, const uint32_t output_line_size, const uint32_t input_line_size, const InterpolationDetails * details, const uint32_t from, const uint32_t count);
 void LineContributions_destroy(Context * context, LineContributions * p);
 
 ConvolutionKernel * ConvolutionKernel_create(Context * context, uint32_t radius);
@@ -232,6 +418,16 @@ double ConvolutionKernel_sum(ConvolutionKernel* kernel);
 void ConvolutionKernel_normalize(ConvolutionKernel* kernel, float desiredSum);
 ConvolutionKernel* ConvolutionKernel_create_guassian_normalized(Context * context, double stdDev, uint32_t radius);
 ConvolutionKernel* ConvolutionKernel_create_guassian_sharpen(Context * context, double stdDev, uint32_t radius);
+//An unsharp mask for RenderDetails.kernel_a. Since kernels are applied along each axis, each pass sharpens by the amount
+//that, compounded, matches a 2D mask of this amount. Pixels whose channels change by less than threshold in total (0..1 per
+//channel) are left as they are.
+ConvolutionKernel* ConvolutionKernel_create_unsharp_mask(Context * context, double stdDev, uint32_t radius, double amount, float threshold);
+
+//An identity table with the given number of grid points per axis (2..256), over a domain of 0..1
+ColorLut3D * ColorLut3D_create(Context * context, uint32_t size);
+void ColorLut3D_destroy(Context * context, ColorLut3D * lut);
+//Parses the text of a .cube file. 1D tables and malformed files fail with Invalid_argument.
+ColorLut3D * ColorLut3D_parse_cube(Context * context, const char * text);
 
 
 bool BitmapBgra_populate_histogram (Context * context, BitmapBgra * bmp, uint64_t * histograms, uint32_t histogram_size_per_channel, uint32_t histogram_count, uint64_t * pixels_sampled);
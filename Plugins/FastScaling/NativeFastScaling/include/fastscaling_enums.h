@@ -86,13 +86,43 @@ ENUM_END (ProfilingEntryFlags)
 
 
 //Compact format for bitmaps. sRGB or gamma adjusted - *NOT* linear
+//The low byte is the size of a pixel. Bgr48 and Bgra64 hold native-endian 16-bit channels, BgraHalf IEEE half floats
+//(read as 0..1); alpha is linear in all of them.
+//The 0x200 formats are GDI+ layouts, only read (as sources), and unpacked as their rows are: Indexed8 into
+//BitmapBgra.palette, 16-bit little-endian 5-6-5, 5-5-5 and 1-5-5-5 pixels (red in the high bits), and the 13-bit *linear*
+//channels (0..8192) of 48 and 64 bpp bitmaps - premultiplied in linear light, for PArgb64, when alpha_premultiplied is set.
 ENUM_START (BitmapPixelFormat,_BitmapPixelFormat)
     Bgr24 = 3,
     Bgra32 = 4,
-    Gray8 = 1
+    Gray8 = 1,
+    Bgr48 = 6,
+    Bgra64 = 8,
+    BgraHalf = 0x108,
+    Indexed8 = 0x201,
+    Bgr565 = 0x202,
+    Bgr555 = 0x302,
+    Bgra5551 = 0x402,
+    Bgr48Linear = 0x206,
+    Bgra64Linear = 0x208
 ENUM_END (BitmapPixelFormat)
 
 
+//Instruction sets the native kernels can be dispatched to. Higher values imply the lower ones.
+ENUM_START (SimdLevel, _SimdLevel)
+    Simd_scalar = 0,
+    Simd_sse41 = 1,
+    Simd_avx2 = 2
+ENUM_END (SimdLevel)
+
+//How BitmapFloat_convolve_rows applies a Gaussian ConvolutionKernel. Direct convolution costs the kernel's width per
+//pixel; the recursive (Young-van Vliet) filter and the three box blurs cost the same at any sigma.
+ENUM_START (ConvolutionMethod, _ConvolutionMethod)
+    Convolution_auto = 0,
+    Convolution_direct = 1,
+    Convolution_recursive = 2,
+    Convolution_box = 3
+ENUM_END (ConvolutionMethod)
+
 ENUM_START (BitmapCompositingMode, _BitmapCompositingMode)
     Replace_self = 0,
     Blend_with_self = 1,
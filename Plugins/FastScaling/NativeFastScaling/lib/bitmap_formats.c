@@ -10,25 +10,50 @@
 #endif
 
 #include "fastscaling_private.h"
+#include "simd.h"
 
 const int MAX_BYTES_PP = 16;
 
 
-// Ha, ha. The result of sx * sy * MAX_BYTES_PP will overflow if the result is bigger than INT_MAX
-// causing it to wrap around and be true. This is what the sx < INT_MAX / sy code does
+// Rows are addressed through 32-bit strides, but row offsets are computed in size_t. So each dimension
+// (either may become a row, once transposed) must fit in a stride, and only the total size has to be addressable.
 
 static bool are_valid_bitmap_dimensions(int sx, int sy)
 {
     return (
                sx > 0 && sy > 0 // positive dimensions
-               && sx < INT_MAX / sy // no integer overflow
-               && sx * MAX_BYTES_PP < ((INT_MAX - MAX_BYTES_PP) / sy)); // then we can safely check
+               && sx < INT_MAX / MAX_BYTES_PP && sy < INT_MAX / MAX_BYTES_PP // a row or column fits in a stride
+               && (uint64_t)sx * (uint64_t)sy <= (uint64_t)(SIZE_MAX / MAX_BYTES_PP)); // the buffer is addressable
 }
 
 
 uint32_t BitmapPixelFormat_bytes_per_pixel (BitmapPixelFormat format)
 {
-    return (uint32_t)format;
+    return (uint32_t)format & 0xff;
+}
+
+uint32_t BitmapPixelFormat_channels(BitmapPixelFormat format)
+{
+    switch (format) {
+    case Gray8: return 1;
+    case Bgr24: case Bgr48: case Bgr565: case Bgr555: case Bgr48Linear: return 3;
+    case Bgra32: case Bgra64: case BgraHalf: case Indexed8: case Bgra5551: case Bgra64Linear: return 4;
+    }
+    return 0;
+}
+
+bool BitmapPixelFormat_is_wide(BitmapPixelFormat format)
+{
+    return format == Bgr48 || format == Bgra64 || format == BgraHalf;
+}
+
+BitmapPixelFormat BitmapPixelFormat_unpacked(BitmapPixelFormat format)
+{
+    switch (format) {
+    case Indexed8: case Bgr565: case Bgr555: case Bgra5551: return Bgra32;
+    case Bgr48Linear: case Bgra64Linear: return Bgra64;
+    default: return format;
+    }
 }
 
 
@@ -67,11 +92,11 @@ BitmapBgra * BitmapBgra_create(Context * context, int sx, int sy, bool zeroed, B
     im->pixels_readonly = false;
     im->stride_readonly = false;
     im->borrowed_pixels = false;
-    im->alpha_meaningful = im->fmt == Bgra32;
+    im->alpha_meaningful = BitmapPixelFormat_channels(im->fmt) == 4;
     if (zeroed) {
-        im->pixels = (unsigned char *)CONTEXT_calloc(context, im->h * im->stride, sizeof(unsigned char));
+        im->pixels = (unsigned char *)CONTEXT_calloc(context, (size_t)im->h * im->stride, sizeof(unsigned char));
     } else {
-        im->pixels = (unsigned char *)CONTEXT_malloc(context, im->h * im->stride);
+        im->pixels = (unsigned char *)CONTEXT_malloc(context, (size_t)im->h * im->stride);
     }
     if (im->pixels == NULL) {
         CONTEXT_free(context, im);
@@ -110,7 +135,7 @@ BitmapFloat * BitmapFloat_create_header(Context* context,int sx, int sy, int cha
     im->pixels_borrowed = true;
     im->channels = channels;
     im->float_stride = sx * channels;
-    im->float_count = im->float_stride * sy;
+    im->float_count = (size_t)im->float_stride * sy;
     im->alpha_meaningful = channels == 4;
     im->alpha_premultiplied = true;
     return im;
@@ -150,3 +175,82 @@ void BitmapFloat_destroy(Context* context, BitmapFloat * im)
     CONTEXT_free(context, im);
 }
 
+void BitmapFloat_reverse_row(BitmapFloat * img, const uint32_t row)
+{
+    float * pixels = img->pixels + (size_t)row * img->float_stride;
+    const uint32_t ch = img->channels;
+    for (uint32_t left = 0, right = (img->w - 1) * ch; left < right; left += ch, right -= ch) {
+        for (uint32_t c = 0; c < ch; c++) {
+            const float swap = pixels[left + c];
+            pixels[left + c] = pixels[right + c];
+            pixels[right + c] = swap;
+        }
+    }
+}
+
+
+//Bytes of the row whose 4th bytes, ANDed together, are all 0xff
+static bool alpha_row_opaque(const uint8_t * row, uint32_t count)
+{
+    uint8_t alpha = 0xff;
+    for (uint32_t i = 0; i < count; i++) {
+        alpha &= row[i * 4 + 3];
+    }
+    return alpha == 0xff;
+}
+
+#ifdef FASTSCALING_X86
+
+SIMD_TARGET_SSE2
+static bool BitmapBgra_is_opaque_sse2(const BitmapBgra * b)
+{
+    const __m128i colors = _mm_set1_epi32(0x00ffffff);
+    for (uint32_t y = 0; y < b->h; y++) {
+        const uint8_t * row = b->pixels + (size_t)y * b->stride;
+        __m128i all = _mm_set1_epi32(-1);
+        uint32_t x = 0;
+        for (; x + 4 <= b->w; x += 4) {
+            all = _mm_and_si128(all, _mm_loadu_si128((const __m128i *)(row + x * 4)));
+        }
+        all = _mm_or_si128(all, colors);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(all, _mm_set1_epi32(-1))) != 0xffff || !alpha_row_opaque(row + x * 4, b->w - x)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+SIMD_TARGET_AVX2
+static bool BitmapBgra_is_opaque_avx2(const BitmapBgra * b)
+{
+    const __m256i colors = _mm256_set1_epi32(0x00ffffff);
+    for (uint32_t y = 0; y < b->h; y++) {
+        const uint8_t * row = b->pixels + (size_t)y * b->stride;
+        __m256i all = _mm256_set1_epi32(-1);
+        uint32_t x = 0;
+        for (; x + 16 <= b->w; x += 16) {
+            all = _mm256_and_si256(all, _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(row + x * 4)),
+                                                         _mm256_loadu_si256((const __m256i *)(row + x * 4 + 32))));
+        }
+        all = _mm256_or_si256(all, colors);
+        if (!_mm256_testc_si256(all, _mm256_set1_epi32(-1)) || !alpha_row_opaque(row + x * 4, b->w - x)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+#endif
+
+bool BitmapBgra_is_opaque(Context * context, const BitmapBgra * b)
+{
+    if (b->fmt != Bgra32 || !b->alpha_meaningful) return true;
+#ifdef FASTSCALING_X86
+    if (context->simd.active >= Simd_avx2) return BitmapBgra_is_opaque_avx2(b);
+    if (context->simd.active >= Simd_sse41) return BitmapBgra_is_opaque_sse2(b);
+#endif
+    for (uint32_t y = 0; y < b->h; y++) {
+        if (!alpha_row_opaque(b->pixels + (size_t)y * b->stride, b->w)) return false;
+    }
+    return true;
+}
@@ -0,0 +1,325 @@
+/*
+ * Copyright (c) Imazen LLC.
+ * No part of this project, including this file, may be copied, modified,
+ * propagated, or distributed except as permitted in COPYRIGHT.txt.
+ * Licensed under the GNU Affero General Public License, Version 3.0.
+ * Commercial licenses available at http://imageresizing.net/
+ */
+#ifdef _MSC_VER
+#pragma unmanaged
+#endif
+
+#include "fastscaling_private.h"
+#include "simd.h"
+
+#include <string.h>
+
+//Gaussian blurs whose cost per pixel doesn't depend on sigma. Rows are copied into a scratch row of 4-float lanes per
+//pixel (3-channel pixels are padded), or with AVX2, 8-float lanes holding the same pixel of two rows. Gray rows take one
+//float of a lane each, so 4 (or 8) of them share it. The filters run over whole lanes, so channels and rows are
+//vectorized together. Pixels past either end repeat the edge pixel.
+
+//Young & van Vliet, "Recursive implementation of the Gaussian filter" (1995): a causal and an anti-causal 3rd order
+//filter. The anti-causal pass starts from the state it would have reached over an infinite run of the edge pixel
+//(as in Triggs & Sdika, 2006), so the edges match a direct convolution of the extended row.
+bool RecursiveGaussian_init(Context * context, RecursiveGaussian * g, double sigma)
+{
+    const double q = sigma >= 2.5 ? 0.98711 * sigma - 0.96330 : 3.97156 - 4.14554 * sqrt(1 - 0.26891 * sigma);
+    const double b0 = 1.57825 + 2.44413 * q + 1.4281 * q * q + 0.422205 * q * q * q;
+    const double a[3] = { (2.44413 * q + 2.85619 * q * q + 1.26661 * q * q * q) / b0, -(1.4281 * q * q + 1.26661 * q * q * q) / b0,
+                          0.422205 * q * q * q / b0 };
+    const double b = 1 - (a[0] + a[1] + a[2]);
+    g->b = (float)b;
+    for (int i = 0; i < 3; i++) g->a[i] = (float)a[i];
+
+    //Each causal output's effect is run out (with the input at the edge value) until it has decayed, then back
+    //through the anti-causal filter
+    const uint32_t length = (uint32_t)(sigma * 20) + 64;
+    double * run = (double *)CONTEXT_malloc(context, length * sizeof(double));
+    if (run == NULL) {
+        CONTEXT_error(context, Out_of_memory);
+        return false;
+    }
+    for (int j = 0; j < 3; j++) {
+        double state[3] = { 0, 0, 0 };
+        state[j] = 1;
+        for (uint32_t n = 0; n < length; n++) {
+            run[n] = a[0] * state[0] + a[1] * state[1] + a[2] * state[2];
+            state[2] = state[1];
+            state[1] = state[0];
+            state[0] = run[n];
+        }
+        double anti[3] = { 0, 0, 0 };
+        for (uint32_t n = length; n-- > 0;) {
+            const double v = b * run[n] + a[0] * anti[0] + a[1] * anti[1] + a[2] * anti[2];
+            anti[2] = anti[1];
+            anti[1] = anti[0];
+            anti[0] = v;
+            if (n < 3) g->m[n * 3 + j] = (float)v;
+        }
+    }
+    CONTEXT_free(context, run);
+    g->sigma = (float)sigma;
+    return true;
+}
+
+//The three box widths whose repeated application best matches sigma (Kovesi, "Fast almost-Gaussian filtering", 2010)
+static void box_radii_for_sigma(double sigma, uint32_t radii[3])
+{
+    const double variance = sigma * sigma;
+    int lower = (int)floor(sqrt(12 * variance / 3 + 1));
+    if (lower % 2 == 0) lower--;
+    const int boxes_at_lower = (int)floor((12 * variance - 3.0 * lower * lower - 12.0 * lower - 9) / (-4.0 * lower - 4) + 0.5);
+    for (int i = 0; i < 3; i++) {
+        const int width = i < boxes_at_lower ? lower : lower + 2;
+        radii[i] = (uint32_t)((width - 1) / 2);
+    }
+}
+
+typedef void (*recursive_row_function)(float * pixels, uint32_t count, const RecursiveGaussian * g);
+typedef void (*box_row_function)(const float * from, float * to, uint32_t count, uint32_t radius);
+
+//Scalar forms work on 4 lanes per pixel
+static void recursive_row(float * pixels, uint32_t count, const RecursiveGaussian * g)
+{
+    for (uint32_t c = 0; c < 4; c++) {
+        float * p = pixels + c;
+        const float edge = p[(count - 1) * 4];
+        float w1 = p[0], w2 = p[0], w3 = p[0];
+        for (uint32_t n = 0; n < count; n++) {
+            const float v = g->b * p[n * 4] + g->a[0] * w1 + g->a[1] * w2 + g->a[2] * w3;
+            p[n * 4] = v;
+            w3 = w2;
+            w2 = w1;
+            w1 = v;
+        }
+        float tail[3];
+        for (uint32_t k = 0; k < 3; k++) {
+            tail[k] = p[(count - 1 - umin(k, count - 1)) * 4] - edge;
+        }
+        float y1 = g->m[0] * tail[0] + g->m[1] * tail[1] + g->m[2] * tail[2] + edge;
+        float y2 = g->m[3] * tail[0] + g->m[4] * tail[1] + g->m[5] * tail[2] + edge;
+        float y3 = g->m[6] * tail[0] + g->m[7] * tail[1] + g->m[8] * tail[2] + edge;
+        for (uint32_t n = count; n-- > 0;) {
+            const float v = g->b * p[n * 4] + g->a[0] * y1 + g->a[1] * y2 + g->a[2] * y3;
+            p[n * 4] = v;
+            y3 = y2;
+            y2 = y1;
+            y1 = v;
+        }
+    }
+}
+
+static void box_row(const float * from, float * to, uint32_t count, uint32_t radius)
+{
+    const float scale = 1.0f / (float)(radius * 2 + 1);
+    const uint32_t last = count - 1;
+    for (uint32_t c = 0; c < 4; c++) {
+        float sum = (float)(radius + 1) * from[c];
+        for (uint32_t j = 1; j <= radius; j++) {
+            sum += from[umin(j, last) * 4 + c];
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            to[i * 4 + c] = sum * scale;
+            sum += from[umin(i + radius + 1, last) * 4 + c] - from[(i > radius ? i - radius : 0) * 4 + c];
+        }
+    }
+}
+
+#ifdef FASTSCALING_X86
+
+SIMD_TARGET_SSE2
+static void recursive_row_sse2(float * pixels, uint32_t count, const RecursiveGaussian * g)
+{
+    const __m128 b = _mm_set1_ps(g->b);
+    const __m128 a0 = _mm_set1_ps(g->a[0]);
+    const __m128 a1 = _mm_set1_ps(g->a[1]);
+    const __m128 a2 = _mm_set1_ps(g->a[2]);
+    const __m128 edge = _mm_loadu_ps(pixels + (count - 1) * 4);
+    __m128 w1 = _mm_loadu_ps(pixels), w2 = w1, w3 = w1;
+    for (uint32_t n = 0; n < count; n++) {
+        const __m128 v = _mm_add_ps(_mm_add_ps(_mm_mul_ps(b, _mm_loadu_ps(pixels + n * 4)), _mm_mul_ps(a0, w1)),
+                                    _mm_add_ps(_mm_mul_ps(a1, w2), _mm_mul_ps(a2, w3)));
+        _mm_storeu_ps(pixels + n * 4, v);
+        w3 = w2;
+        w2 = w1;
+        w1 = v;
+    }
+    __m128 tail[3];
+    for (uint32_t k = 0; k < 3; k++) {
+        tail[k] = _mm_sub_ps(_mm_loadu_ps(pixels + (count - 1 - umin(k, count - 1)) * 4), edge);
+    }
+    __m128 y[3];
+    for (int r = 0; r < 3; r++) {
+        y[r] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(g->m[r * 3]), tail[0]), _mm_mul_ps(_mm_set1_ps(g->m[r * 3 + 1]), tail[1])),
+                          _mm_add_ps(_mm_mul_ps(_mm_set1_ps(g->m[r * 3 + 2]), tail[2]), edge));
+    }
+    __m128 y1 = y[0], y2 = y[1], y3 = y[2];
+    for (uint32_t n = count; n-- > 0;) {
+        const __m128 v = _mm_add_ps(_mm_add_ps(_mm_mul_ps(b, _mm_loadu_ps(pixels + n * 4)), _mm_mul_ps(a0, y1)),
+                                    _mm_add_ps(_mm_mul_ps(a1, y2), _mm_mul_ps(a2, y3)));
+        _mm_storeu_ps(pixels + n * 4, v);
+        y3 = y2;
+        y2 = y1;
+        y1 = v;
+    }
+}
+
+SIMD_TARGET_SSE2
+static void box_row_sse2(const float * from, float * to, uint32_t count, uint32_t radius)
+{
+    const __m128 scale = _mm_set1_ps(1.0f / (float)(radius * 2 + 1));
+    const uint32_t last = count - 1;
+    __m128 sum = _mm_mul_ps(_mm_set1_ps((float)(radius + 1)), _mm_loadu_ps(from));
+    for (uint32_t j = 1; j <= radius; j++) {
+        sum = _mm_add_ps(sum, _mm_loadu_ps(from + umin(j, last) * 4));
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        _mm_storeu_ps(to + i * 4, _mm_mul_ps(sum, scale));
+        sum = _mm_add_ps(sum, _mm_sub_ps(_mm_loadu_ps(from + umin(i + radius + 1, last) * 4), _mm_loadu_ps(from + (i > radius ? i - radius : 0) * 4)));
+    }
+}
+
+//Two rows at once, in 8 lanes per pixel
+SIMD_TARGET_AVX2
+static void recursive_row_avx2(float * pixels, uint32_t count, const RecursiveGaussian * g)
+{
+    const __m256 b = _mm256_set1_ps(g->b);
+    const __m256 a0 = _mm256_set1_ps(g->a[0]);
+    const __m256 a1 = _mm256_set1_ps(g->a[1]);
+    const __m256 a2 = _mm256_set1_ps(g->a[2]);
+    const __m256 edge = _mm256_loadu_ps(pixels + (count - 1) * 8);
+    __m256 w1 = _mm256_loadu_ps(pixels), w2 = w1, w3 = w1;
+    for (uint32_t n = 0; n < count; n++) {
+        const __m256 v = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(b, _mm256_loadu_ps(pixels + n * 8)), _mm256_mul_ps(a0, w1)),
+                                       _mm256_add_ps(_mm256_mul_ps(a1, w2), _mm256_mul_ps(a2, w3)));
+        _mm256_storeu_ps(pixels + n * 8, v);
+        w3 = w2;
+        w2 = w1;
+        w1 = v;
+    }
+    __m256 tail[3];
+    for (uint32_t k = 0; k < 3; k++) {
+        tail[k] = _mm256_sub_ps(_mm256_loadu_ps(pixels + (count - 1 - umin(k, count - 1)) * 8), edge);
+    }
+    __m256 y[3];
+    for (int r = 0; r < 3; r++) {
+        y[r] = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(g->m[r * 3]), tail[0]), _mm256_mul_ps(_mm256_set1_ps(g->m[r * 3 + 1]), tail[1])),
+                             _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(g->m[r * 3 + 2]), tail[2]), edge));
+    }
+    __m256 y1 = y[0], y2 = y[1], y3 = y[2];
+    for (uint32_t n = count; n-- > 0;) {
+        const __m256 v = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(b, _mm256_loadu_ps(pixels + n * 8)), _mm256_mul_ps(a0, y1)),
+                                       _mm256_add_ps(_mm256_mul_ps(a1, y2), _mm256_mul_ps(a2, y3)));
+        _mm256_storeu_ps(pixels + n * 8, v);
+        y3 = y2;
+        y2 = y1;
+        y1 = v;
+    }
+}
+
+SIMD_TARGET_AVX2
+static void box_row_avx2(const float * from, float * to, uint32_t count, uint32_t radius)
+{
+    const __m256 scale = _mm256_set1_ps(1.0f / (float)(radius * 2 + 1));
+    const uint32_t last = count - 1;
+    __m256 sum = _mm256_mul_ps(_mm256_set1_ps((float)(radius + 1)), _mm256_loadu_ps(from));
+    for (uint32_t j = 1; j <= radius; j++) {
+        sum = _mm256_add_ps(sum, _mm256_loadu_ps(from + umin(j, last) * 8));
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        _mm256_storeu_ps(to + i * 8, _mm256_mul_ps(sum, scale));
+        sum = _mm256_add_ps(sum, _mm256_sub_ps(_mm256_loadu_ps(from + umin(i + radius + 1, last) * 8), _mm256_loadu_ps(from + (i > radius ? i - radius : 0) * 8)));
+    }
+}
+
+#endif
+
+bool BitmapFloat_blur_rows(Context * context, BitmapFloat * buf, const ConvolutionKernel * kernel, ConvolutionMethod method,
+                           uint32_t convolve_channels, uint32_t from_row, uint32_t row_count, float * scratch)
+{
+    const uint32_t ch = buf->channels;
+    const uint32_t w = buf->w;
+    if (ch > 4 || convolve_channels > ch || from_row + row_count > buf->h || kernel->sigma <= 0 ||
+        (method != Convolution_recursive && method != Convolution_box)) {
+        CONTEXT_error(context, Invalid_internal_state);
+        return false;
+    }
+    //Kernels get their coefficients when their sigma is set
+    if (method == Convolution_recursive && kernel->recursive.sigma != kernel->sigma) {
+        CONTEXT_error(context, Invalid_argument);
+        return false;
+    }
+    if (w == 0 || row_count == 0) return true;
+
+    uint32_t radii[3];
+    if (method == Convolution_box) {
+        box_radii_for_sigma(kernel->sigma, radii);
+    }
+    recursive_row_function recursive = recursive_row;
+    box_row_function box = box_row;
+    uint32_t lanes = 4;
+#ifdef FASTSCALING_X86
+    if (context->simd.active >= Simd_avx2) {
+        recursive = recursive_row_avx2;
+        box = box_row_avx2;
+        lanes = 8;
+    } else if (context->simd.active >= Simd_sse41) {
+        recursive = recursive_row_sse2;
+        box = box_row_sse2;
+    }
+#endif
+    const uint32_t slot = ch == 1 ? 1 : 4;
+    const uint32_t rows_per_pass = lanes / slot;
+    //Boxes alternate between the two halves
+    float * owned = scratch == NULL ? (float *)CONTEXT_malloc(context, (size_t)w * BLUR_SCRATCH_FLOATS_PER_PIXEL * sizeof(float)) : NULL;
+    if (scratch == NULL && owned == NULL) {
+        CONTEXT_error(context, Out_of_memory);
+        return false;
+    }
+    scratch = scratch == NULL ? owned : scratch;
+    float * other = scratch + (size_t)w * lanes;
+    const float threshold_min = kernel->threshold_min_change;
+    const float threshold_max = kernel->threshold_max_change;
+    const bool thresholds = threshold_min > 0 || threshold_max > 0;
+
+    for (uint32_t row = from_row; row < from_row + row_count; row += rows_per_pass) {
+        const uint32_t rows = umin(rows_per_pass, from_row + row_count - row);
+        memset(scratch, 0, (size_t)w * lanes * sizeof(float));
+        for (uint32_t r = 0; r < rows; r++) {
+            const float * src = buf->pixels + (size_t)(row + r) * buf->float_stride;
+            for (uint32_t x = 0; x < w; x++) {
+                memcpy(scratch + (size_t)x * lanes + r * slot, src + (size_t)x * ch, ch * sizeof(float));
+            }
+        }
+        const float * blurred = scratch;
+        if (method == Convolution_recursive) {
+            recursive(scratch, w, &kernel->recursive);
+        } else {
+            box(scratch, other, w, radii[0]);
+            box(other, scratch, w, radii[1]);
+            box(scratch, other, w, radii[2]);
+            blurred = other;
+        }
+        for (uint32_t r = 0; r < rows; r++) {
+            float * dest = buf->pixels + (size_t)(row + r) * buf->float_stride;
+            for (uint32_t x = 0; x < w; x++) {
+                const float * v = blurred + (size_t)x * lanes + r * slot;
+                float * p = dest + (size_t)x * ch;
+                float avg[4];
+                float change = 0;
+                for (uint32_t j = 0; j < convolve_channels; j++) {
+                    avg[j] = kernel->sharpen_amount > 0 ? p[j] + kernel->sharpen_amount * (p[j] - v[j]) : v[j];
+                }
+                if (thresholds) {
+                    for (uint32_t j = 0; j < convolve_channels; j++)
+                        change += (float)fabs(p[j] - avg[j]);
+                    if (change < threshold_min || change > threshold_max) continue;
+                }
+                memcpy(p, avg, convolve_channels * sizeof(float));
+            }
+        }
+    }
+    CONTEXT_free(context, owned);
+    return true;
+}
@@ -10,6 +10,7 @@
 #endif
 
 #include "fastscaling_private.h"
+#include "simd.h"
 
 
 bool BitmapFloat_linear_to_luv_rows(Context * context, BitmapFloat * bit, const uint32_t start_row, const  uint32_t row_count)
@@ -22,9 +23,9 @@ bool BitmapFloat_linear_to_luv_rows(Context * context, BitmapFloat * bit, const
         CONTEXT_error(context, Invalid_internal_state); //This algorithm can't handle padding, if present
         return false;
     }
-    float * start_at = bit->float_stride * start_row  + bit->pixels;
+    float * start_at = (size_t)(size_t)bit->float_stride * start_row + bit->pixels;
 
-    const float * end_at = bit->float_stride * (start_row + row_count) + bit->pixels;
+    const float * end_at = (size_t)bit->float_stride * (start_row + row_count) + bit->pixels;
 
     for (float* pix = start_at; pix < end_at; pix++) {
         linear_to_luv(pix);
@@ -42,9 +43,9 @@ bool BitmapFloat_luv_to_linear_rows(Context * context, BitmapFloat * bit, const
         CONTEXT_error(context, Invalid_internal_state);
         return false;
     }
-    float * start_at = bit->float_stride * start_row + bit->pixels;
+    float * start_at = (size_t)bit->float_stride * start_row + bit->pixels;
 
-    const float * end_at = bit->float_stride * (start_row + row_count) + bit->pixels;
+    const float * end_at = (size_t)bit->float_stride * (start_row + row_count) + bit->pixels;
 
     for (float* pix = start_at; pix < end_at; pix++) {
         luv_to_linear(pix);
@@ -54,24 +55,132 @@ bool BitmapFloat_luv_to_linear_rows(Context * context, BitmapFloat * bit, const
 
 
 
+//Rows of the matrix hold the contributions of r, g, b, a, and the offset; pixels are stored b, g, r, a
+static const uint32_t color_matrix_index[4] = { 2, 1, 0, 3 };
+
+#ifdef FASTSCALING_X86
+
+//The matrix in registers: the output a stored channel contributes to every channel, and the offsets
+typedef struct {
+    __m128 from[4];
+    __m128 offset;
+} ColorMatrixVectors;
+
+SIMD_TARGET_SSE2
+static void ColorMatrixVectors_init(ColorMatrixVectors * v, float * const __restrict m[5])
+{
+    const uint32_t * ix = color_matrix_index;
+    for (uint32_t i = 0; i < 4; i++) {
+        v->from[i] = _mm_setr_ps(m[ix[i]][2], m[ix[i]][1], m[ix[i]][0], m[ix[i]][3]);
+    }
+    v->offset = _mm_setr_ps(m[4][2], m[4][1], m[4][0], m[4][3]);
+}
+
+//Lanes 0..2 (and 3, for 4 channels) of the result; the alpha row is skipped for 3 channels, as in the scalar version
+SIMD_TARGET_SSE2
+static inline __m128 ColorMatrixVectors_apply(const ColorMatrixVectors * m, __m128 p, bool alpha)
+{
+    __m128 sum = _mm_add_ps(m->offset, _mm_mul_ps(m->from[0], _mm_shuffle_ps(p, p, _MM_SHUFFLE(0, 0, 0, 0))));
+    sum = _mm_add_ps(sum, _mm_mul_ps(m->from[1], _mm_shuffle_ps(p, p, _MM_SHUFFLE(1, 1, 1, 1))));
+    sum = _mm_add_ps(sum, _mm_mul_ps(m->from[2], _mm_shuffle_ps(p, p, _MM_SHUFFLE(2, 2, 2, 2))));
+    if (alpha) sum = _mm_add_ps(sum, _mm_mul_ps(m->from[3], _mm_shuffle_ps(p, p, _MM_SHUFFLE(3, 3, 3, 3))));
+    return sum;
+}
+
+SIMD_TARGET_SSE41
+static void BitmapBgra_apply_color_matrix_sse41(BitmapBgra * bmp, const uint32_t row, const uint32_t h, const uint32_t ch, float * const __restrict m[5])
+{
+    ColorMatrixVectors v;
+    ColorMatrixVectors_init(&v, m);
+    for (uint32_t y = row; y < h; y++) {
+        uint8_t * data = bmp->pixels + (size_t)bmp->stride * y;
+        for (uint32_t x = 0; x < bmp->w; x++, data += ch) {
+            uint32_t packed = 0;
+            memcpy(&packed, data, ch);
+            const __m128 p = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128((int)packed)));
+            const __m128 result = ColorMatrixVectors_apply(&v, p, ch == 4);
+            //Rounded as uchar_clamp_ff does
+            const __m128 clamped = _mm_min_ps(_mm_max_ps(result, _mm_setzero_ps()), _mm_set1_ps(255.0f));
+            const __m128i ints = _mm_cvttps_epi32(_mm_add_ps(clamped, _mm_set1_ps(0.5f)));
+            const __m128i words = _mm_packs_epi32(ints, ints);
+            packed = (uint32_t)_mm_cvtsi128_si32(_mm_packus_epi16(words, words));
+            memcpy(data, &packed, ch);
+        }
+    }
+}
+
+SIMD_TARGET_SSE2
+static void BitmapFloat_apply_color_matrix_sse2(BitmapFloat * bmp, const uint32_t row, const uint32_t h, float * const m[5])
+{
+    ColorMatrixVectors v;
+    ColorMatrixVectors_init(&v, m);
+    const uint32_t ch = bmp->channels;
+    for (uint32_t y = row; y < h; y++) {
+        float * data = bmp->pixels + (size_t)bmp->float_stride * y;
+        for (uint32_t x = 0; x < bmp->w; x++, data += ch) {
+            if (ch == 4) {
+                _mm_storeu_ps(data, ColorMatrixVectors_apply(&v, _mm_loadu_ps(data), true));
+            } else {
+                store3_ps(data, ColorMatrixVectors_apply(&v, load3_ps(data), false));
+            }
+        }
+    }
+}
+
+//Two 4-channel pixels per vector, with the matrix held in 5 registers
+SIMD_TARGET_AVX2
+static void BitmapFloat_apply_color_matrix_avx2(BitmapFloat * bmp, const uint32_t row, const uint32_t h, float * const m[5])
+{
+    ColorMatrixVectors v;
+    ColorMatrixVectors_init(&v, m);
+    const __m256 from_b = _mm256_broadcast_ps(&v.from[0]);
+    const __m256 from_g = _mm256_broadcast_ps(&v.from[1]);
+    const __m256 from_r = _mm256_broadcast_ps(&v.from[2]);
+    const __m256 from_a = _mm256_broadcast_ps(&v.from[3]);
+    const __m256 offset = _mm256_broadcast_ps(&v.offset);
+    for (uint32_t y = row; y < h; y++) {
+        float * data = bmp->pixels + (size_t)bmp->float_stride * y;
+        uint32_t x = 0;
+        for (; x + 2 <= bmp->w; x += 2, data += 8) {
+            const __m256 p = _mm256_loadu_ps(data);
+            __m256 sum = _mm256_fmadd_ps(from_b, _mm256_permute_ps(p, _MM_SHUFFLE(0, 0, 0, 0)), offset);
+            sum = _mm256_fmadd_ps(from_g, _mm256_permute_ps(p, _MM_SHUFFLE(1, 1, 1, 1)), sum);
+            sum = _mm256_fmadd_ps(from_r, _mm256_permute_ps(p, _MM_SHUFFLE(2, 2, 2, 2)), sum);
+            sum = _mm256_fmadd_ps(from_a, _mm256_permute_ps(p, _MM_SHUFFLE(3, 3, 3, 3)), sum);
+            _mm256_storeu_ps(data, sum);
+        }
+        for (; x < bmp->w; x++, data += 4) {
+            _mm_storeu_ps(data, ColorMatrixVectors_apply(&v, _mm_loadu_ps(data), true));
+        }
+    }
+}
+
+#endif
+
 bool BitmapBgra_apply_color_matrix(Context * context, BitmapBgra * bmp, const uint32_t row, const uint32_t count, float* const __restrict  m[5])
 {
     const uint32_t stride = bmp->stride;
     const uint32_t ch = BitmapPixelFormat_bytes_per_pixel(bmp->fmt);
     const uint32_t w = bmp->w;
     const uint32_t h = umin(row + count, bmp->h);
+#ifdef FASTSCALING_X86
+    if ((ch == 3 || ch == 4) && context->simd.active >= Simd_sse41) {
+        BitmapBgra_apply_color_matrix_sse41(bmp, row, h, ch, m);
+        return true;
+    }
+#endif
     if (ch == 4) {
 
         for (uint32_t y = row; y < h; y++)
             for (uint32_t x = 0; x < w; x++) {
-                uint8_t* const __restrict data = bmp->pixels + stride * y + x * ch;
+                uint8_t* const __restrict data = bmp->pixels + (size_t)stride * y + x * ch;
 
                 const uint8_t r = uchar_clamp_ff(m[0][0] * data[2] + m[1][0] * data[1] + m[2][0] * data[0] + m[3][0] * data[3] + m[4][0]);
                 const uint8_t g = uchar_clamp_ff(m[0][1] * data[2] + m[1][1] * data[1] + m[2][1] * data[0] + m[3][1] * data[3] + m[4][1]);
                 const uint8_t b = uchar_clamp_ff(m[0][2] * data[2] + m[1][2] * data[1] + m[2][2] * data[0] + m[3][2] * data[3] + m[4][2]);
                 const uint8_t a = uchar_clamp_ff(m[0][3] * data[2] + m[1][3] * data[1] + m[2][3] * data[0] + m[3][3] * data[3] + m[4][3]);
 
-                uint8_t* newdata = bmp->pixels + stride * y + x * ch;
+                uint8_t* newdata = bmp->pixels + (size_t)stride * y + x * ch;
                 newdata[0] = b;
                 newdata[1] = g;
                 newdata[2] = r;
@@ -81,13 +190,13 @@ bool BitmapBgra_apply_color_matrix(Context * context, BitmapBgra * bmp, const ui
 
         for (uint32_t y = row; y < h; y++)
             for (uint32_t x = 0; x < w; x++) {
-                unsigned char* const __restrict data = bmp->pixels + stride * y + x * ch;
+                unsigned char* const __restrict data = bmp->pixels + (size_t)stride * y + x * ch;
 
                 const uint8_t r = uchar_clamp_ff(m[0][0] * data[2] + m[1][0] * data[1] + m[2][0] * data[0] + m[4][0]);
                 const uint8_t g = uchar_clamp_ff(m[0][1] * data[2] + m[1][1] * data[1] + m[2][1] * data[0] + m[4][1]);
                 const uint8_t b = uchar_clamp_ff(m[0][2] * data[2] + m[1][2] * data[1] + m[2][2] * data[0] + m[4][2]);
 
-                uint8_t* newdata = bmp->pixels + stride * y + x * ch;
+                uint8_t* newdata = bmp->pixels + (size_t)stride * y + x * ch;
                 newdata[0] = b;
                 newdata[1] = g;
                 newdata[2] = r;
@@ -106,18 +215,28 @@ bool BitmapFloat_apply_color_matrix(Context * context, BitmapFloat * bmp, const
     const uint32_t ch = bmp->channels;
     const uint32_t w = bmp->w;
     const uint32_t h = umin(row + count,bmp->h);
+#ifdef FASTSCALING_X86
+    if (ch == 4 && context->simd.active >= Simd_avx2) {
+        BitmapFloat_apply_color_matrix_avx2(bmp, row, h, m);
+        return true;
+    }
+    if ((ch == 3 || ch == 4) && context->simd.active >= Simd_sse41) {
+        BitmapFloat_apply_color_matrix_sse2(bmp, row, h, m);
+        return true;
+    }
+#endif
     switch (ch) {
     case 4: {
         for (uint32_t y = row; y < h; y++)
             for (uint32_t x = 0; x < w; x++) {
-                float* const __restrict data = bmp->pixels + stride * y + x * ch;
+                float* const __restrict data = bmp->pixels + (size_t)stride * y + x * ch;
 
                 const float r = (m[0][0] * data[2] + m[1][0] * data[1] + m[2][0] * data[0] + m[3][0] * data[3] + m[4][0]);
                 const float g = (m[0][1] * data[2] + m[1][1] * data[1] + m[2][1] * data[0] + m[3][1] * data[3] + m[4][1]);
                 const float b = (m[0][2] * data[2] + m[1][2] * data[1] + m[2][2] * data[0] + m[3][2] * data[3] + m[4][2]);
                 const float a = (m[0][3] * data[2] + m[1][3] * data[1] + m[2][3] * data[0] + m[3][3] * data[3] + m[4][3]);
 
-                float * newdata = bmp->pixels + stride * y + x * ch;
+                float * newdata = bmp->pixels + (size_t)stride * y + x * ch;
                 newdata[0] = b;
                 newdata[1] = g;
                 newdata[2] = r;
@@ -131,13 +250,13 @@ bool BitmapFloat_apply_color_matrix(Context * context, BitmapFloat * bmp, const
         for (uint32_t y = row; y < h; y++)
             for (uint32_t x = 0; x < w; x++) {
 
-                float* const __restrict data = bmp->pixels + stride * y + x * ch;
+                float* const __restrict data = bmp->pixels + (size_t)stride * y + x * ch;
 
                 const float  r =  (m[0][0] * data[2] + m[1][0] * data[1] + m[2][0] * data[0] + m[4][0]);
                 const float g =  (m[0][1] * data[2] + m[1][1] * data[1] + m[2][1] * data[0] + m[4][1]);
                 const float b = (m[0][2] * data[2] + m[1][2] * data[1] + m[2][2] * data[0] + m[4][2]);
 
-                float * newdata = bmp->pixels + stride * y + x * ch;
+                float * newdata = bmp->pixels + (size_t)stride * y + x * ch;
                 newdata[0] = b;
                 newdata[1] = g;
                 newdata[2] = r;
@@ -151,7 +270,37 @@ bool BitmapFloat_apply_color_matrix(Context * context, BitmapFloat * bmp, const
     }
 }
 
+bool ColorMatrix_is_per_channel(float * const m[5], uint32_t channels)
+{
+    const uint32_t n = channels == 4 ? 4 : 3;
+    for (uint32_t i = 0; i < n; i++) {
+        for (uint32_t j = 0; j < n; j++) {
+            if (i != j && m[i][j] != 0) return false;
+        }
+    }
+    return true;
+}
+
+void ChannelTransform_from_color_matrix(float * const m[5], ChannelTransform * t)
+{
+    for (uint32_t c = 0; c < 4; c++) {
+        const uint32_t ix = color_matrix_index[c];
+        t->scale[c] = m[ix][ix];
+        t->offset[c] = m[4][ix];
+    }
+}
 
+void ChannelLuts_from_transform(Context * context, const ChannelTransform * t, ChannelLuts * luts)
+{
+    for (uint32_t c = 0; c < 3; c++) {
+        for (uint32_t n = 0; n < 256; n++) {
+            luts->lut[c][n] = Context_floatspace_to_srgb(context, t->scale[c] * Context_srgb_to_floatspace(context, (uint8_t)n) + t->offset[c]);
+        }
+    }
+    for (uint32_t n = 0; n < 256; n++) {
+        luts->lut[3][n] = (uint8_t)n;
+    }
+}
 
 bool BitmapBgra_populate_histogram (Context * context, BitmapBgra * bmp, uint64_t * histograms, const uint32_t histogram_size_per_channel, const uint32_t histogram_count, uint64_t * pixels_sampled)
 {
@@ -170,7 +319,7 @@ bool BitmapBgra_populate_histogram (Context * context, BitmapBgra * bmp, uint64_
 
             for (uint32_t y = row; y < h; y++){
                 for (uint32_t x = 0; x < w; x++) {
-                    uint8_t* const __restrict data = bmp->pixels + stride * y + x * ch;
+                    uint8_t* const __restrict data = bmp->pixels + (size_t)stride * y + x * ch;
 
                     histograms[(306 * data[2] + 601 * data[1] + 117 * data[0]) >> shift]++;
                 }
@@ -178,7 +327,7 @@ bool BitmapBgra_populate_histogram (Context * context, BitmapBgra * bmp, uint64_
         } else if (histogram_count == 3){
             for (uint32_t y = row; y < h; y++){
                 for (uint32_t x = 0; x < w; x++) {
-                    uint8_t* const __restrict data = bmp->pixels + stride * y + x * ch;
+                    uint8_t* const __restrict data = bmp->pixels + (size_t)stride * y + x * ch;
                     histograms[data[2] >> shift]++;
                     histograms[(data[1] >> shift) + histogram_size_per_channel]++;
                     histograms[(data[0] >> shift) + 2 * histogram_size_per_channel]++;
@@ -188,7 +337,7 @@ bool BitmapBgra_populate_histogram (Context * context, BitmapBgra * bmp, uint64_
         else if (histogram_count == 2){
             for (uint32_t y = row; y < h; y++){
                 for (uint32_t x = 0; x < w; x++) {
-                    uint8_t* const __restrict data = bmp->pixels + stride * y + x * ch;
+                    uint8_t* const __restrict data = bmp->pixels + (size_t)stride * y + x * ch;
                     //Calculate luminosity and saturation
                     histograms[(306 * data[2] + 601 * data[1] + 117 * data[0]) >> shift]++;
                     histograms[histogram_size_per_channel + (int_max(255,int_max(abs ((int)data[2] - (int)data[1]),abs ((int)data[1] - (int)data[0]))) >> shift)]++;
@@ -237,8 +386,35 @@ bool BitmapBgra_populate_histogram (Context * context, BitmapBgra * bmp, uint64_
 
 
 
+ //Each table entry holds the byte its bucket midpoint rounds to. Rather than encoding every midpoint (a pow() call each),
+ //we decode the 255 rounding thresholds once and walk both in order - both functions are monotonic.
+ static void Context_build_float_to_byte (Context * context){
+     float thresholds[256]; //thresholds[n] is the smallest floatspace value that encodes to n
+     thresholds[0] = 0;
+     for (uint32_t n = 1; n < 256; n++) {
+         thresholds[n] = Context_unit_to_floatspace (context, ((float)n - 0.5f) / 255.0f);
+     }
+     uint32_t n = 0;
+     for (uint32_t i = 0; i < FLOATSPACE_LUT_SIZE; i++) {
+         //The last entry is exactly 1.0, and has no bucket
+         const uint32_t bits = FLOATSPACE_LUT_MIN_BITS + (i << FLOATSPACE_LUT_SHIFT) + (i + 1 < FLOATSPACE_LUT_SIZE ? (1u << (FLOATSPACE_LUT_SHIFT - 1)) : 0);
+         float midpoint;
+         memcpy (&midpoint, &bits, sizeof midpoint);
+         while (n < 255 && midpoint >= thresholds[n + 1]) n++;
+         context->colorspace.float_to_byte[i] = (uint8_t)n;
+     }
+     memset (context->colorspace.float_to_byte + FLOATSPACE_LUT_SIZE, 0, FLOATSPACE_LUT_PADDING);
+ }
+
  void Context_set_floatspace (Context * context,  WorkingFloatspace space, float a, float b, float c){
+     if (context->colorspace.tables_valid && context->colorspace.floatspace == space &&
+         context->colorspace.params[0] == a && context->colorspace.params[1] == b && context->colorspace.params[2] == c) {
+         return;
+     }
      context->colorspace.floatspace = space;
+     context->colorspace.params[0] = a;
+     context->colorspace.params[1] = b;
+     context->colorspace.params[2] = c;
 
 
      context->colorspace.apply_srgb = (space & Floatspace_linear) > 0;
@@ -264,6 +440,10 @@ bool BitmapBgra_populate_histogram (Context * context, BitmapBgra * bmp, uint64_
      for (uint32_t n = 0; n < 256; n++) {
          context->colorspace.byte_to_float[n] = Context_srgb_to_floatspace_uncached (context, n);
      }
+     if (space != Floatspace_as_is) {
+         Context_build_float_to_byte (context);
+     }
+     context->colorspace.tables_valid = true;
  }
 
 
@@ -271,6 +451,64 @@ bool BitmapBgra_populate_histogram (Context * context, BitmapBgra * bmp, uint64_
 
 
 
+//Half float bits to float, for 0..1; the rest is clamped
+static float half_to_unit (uint16_t h){
+    if (h & 0x8000u) return 0; //Negative
+    if (h >= 0x3C00u) return h <= 0x7C00u ? 1.0f : 0.0f; //Above 1 or infinite, or NaN
+    const uint32_t exponent = h >> 10;
+    const uint32_t mantissa = h & 0x3ffu;
+    if (exponent == 0) return (float)mantissa * (1.0f / 16777216.0f);
+    const uint32_t bits = ((exponent + 112) << 23) | (mantissa << 13);
+    float v;
+    memcpy (&v, &bits, sizeof v);
+    return v;
+}
+
+bool Context_prepare_wide_tables (Context * context){
+    WideColorspaceInfo * wide = &context->wide;
+    if (wide->tables_valid && wide->floatspace == context->colorspace.floatspace &&
+        memcmp (wide->params, context->colorspace.params, sizeof wide->params) == 0) {
+        return true;
+    }
+    if (wide->word_to_float == NULL) {
+        wide->word_to_float = (float *)CONTEXT_malloc (context, sizeof(float) * (65536 * 3 + FLOATSPACE_LUT_SIZE + 1) +
+                                                                sizeof(uint16_t) * (GDI_LINEAR_MAX + 1));
+        if (wide->word_to_float == NULL) {
+            CONTEXT_error (context, Out_of_memory);
+            return false;
+        }
+        wide->half_to_float = wide->word_to_float + 65536;
+        wide->half_to_unit = wide->half_to_float + 65536;
+        wide->float_to_unit = wide->half_to_unit + 65536;
+        wide->linear_to_word = (uint16_t *)(wide->float_to_unit + FLOATSPACE_LUT_SIZE + 1);
+        for (uint32_t n = 0; n <= GDI_LINEAR_MAX; n++) {
+            wide->linear_to_word[n] = (uint16_t)(linear_to_srgb ((float)n / GDI_LINEAR_MAX) * (65535.0f / 255.0f) + 0.5f);
+        }
+    }
+    for (uint32_t n = 0; n < 65536; n++) {
+        wide->word_to_float[n] = Context_unit_to_floatspace (context, (float)n * (float)(1.0f / 65535.0f));
+        wide->half_to_unit[n] = half_to_unit ((uint16_t)n);
+    }
+    //Most halves clamp to 0 or 1, so only those in between are decoded
+    const float one = Context_unit_to_floatspace (context, 1.0f);
+    for (uint32_t n = 0; n < 65536; n++) {
+        const float unit = wide->half_to_unit[n];
+        wide->half_to_float[n] = n < 0x3C00u ? Context_unit_to_floatspace (context, unit) : (unit > 0 ? one : 0.0f);
+    }
+    for (uint32_t i = 0; i < FLOATSPACE_LUT_SIZE; i++) {
+        const uint32_t bits = FLOATSPACE_LUT_MIN_BITS + (i << FLOATSPACE_LUT_SHIFT);
+        float v;
+        memcpy (&v, &bits, sizeof v);
+        wide->float_to_unit[i] = Context_floatspace_to_unit_uncached (context, v);
+    }
+    //Interpolating from the last entry (1.0) reads one past it
+    wide->float_to_unit[FLOATSPACE_LUT_SIZE] = wide->float_to_unit[FLOATSPACE_LUT_SIZE - 1];
+    wide->floatspace = context->colorspace.floatspace;
+    memcpy (wide->params, context->colorspace.params, sizeof wide->params);
+    wide->tables_valid = true;
+    return true;
+}
+
 float Context_byte_to_floatspace (Context * c, uint8_t srgb_value){
     return Context_srgb_to_floatspace (c, srgb_value);
 }
@@ -83,8 +83,8 @@ static inline float sigmoid_inverse (const SigmoidInfo * info, float y){
 
 #endif
 
-static inline float Context_srgb_to_floatspace_uncached (Context * context, uint8_t value){
-    float v = ((float)value) * (float)(1.0f / 255.0f);
+//Maps 0..1 (with sRGB gamma) into the working floatspace. Also used to find the rounding thresholds of the encoding table.
+static inline float Context_unit_to_floatspace (Context * context, float v){
     if (context->colorspace.apply_srgb) v = srgb_to_linear (v);
     else if (context->colorspace.apply_gamma) v = remove_gamma (context, v);
 #ifdef EXPOSE_SIGMOID
@@ -93,13 +93,17 @@ static inline float Context_srgb_to_floatspace_uncached (Context * context, uint
     return v;
 }
 
+static inline float Context_srgb_to_floatspace_uncached (Context * context, uint8_t value){
+    return Context_unit_to_floatspace (context, ((float)value) * (float)(1.0f / 255.0f));
+}
+
 static inline float Context_srgb_to_floatspace (Context * context, uint8_t value){
     //if (!context->colorspace.apply_srgb) return Context_srgb_to_floatspace_uncached (context,value);
     // return context->colorspace.floatspace == Floatspace_as_is ? (value * (1.f/255.f)) :    context->colorspace.byte_to_float[value];
     return  context->colorspace.byte_to_float[value]; //2x faster, even if just multiplying by 1/255. 3x faster than the entire calculation.
 }
 
-static inline uint8_t Context_floatspace_to_srgb (Context * context, float space_value){
+static inline uint8_t Context_floatspace_to_srgb_uncached (Context * context, float space_value){
     float v = space_value;
 #ifdef EXPOSE_SIGMOID
     v = context->colorspace.apply_sigmoid ? sigmoid_inverse (&context->colorspace.sigmoid, v) : v;
@@ -110,6 +114,62 @@ static inline uint8_t Context_floatspace_to_srgb (Context * context, float space
     return uchar_clamp_ff(255.0f * v);
 }
 
+//The inverse of Context_unit_to_floatspace, unclamped
+static inline float Context_floatspace_to_unit_uncached (Context * context, float space_value){
+    float v = space_value;
+#ifdef EXPOSE_SIGMOID
+    v = context->colorspace.apply_sigmoid ? sigmoid_inverse (&context->colorspace.sigmoid, v) : v;
+#endif
+    if (context->colorspace.apply_gamma) return apply_gamma (context, v);
+    if (context->colorspace.apply_srgb) return linear_to_srgb (v) / 255.0f;
+    return v;
+}
+
+//Clamps to [2^-24, 1] (NaN becomes 2^-24) and returns the index into colorspace.float_to_byte
+static inline uint32_t floatspace_lut_index (float space_value){
+    float v = space_value >= 5.9604645e-8f ? space_value : 5.9604645e-8f;
+    v = v > 1.0f ? 1.0f : v;
+    uint32_t bits;
+    memcpy (&bits, &v, sizeof bits);
+    return (bits - FLOATSPACE_LUT_MIN_BITS) >> FLOATSPACE_LUT_SHIFT;
+}
+
+static inline uint8_t Context_floatspace_to_srgb (Context * context, float space_value){
+    if (context->colorspace.floatspace == Floatspace_as_is) return uchar_clamp_ff(255.0f * space_value);
+    return context->colorspace.float_to_byte[floatspace_lut_index (space_value)];
+}
+
+//Maps floatspace back to 0..1 (with sRGB gamma), for formats wider than a byte. Needs Context_prepare_wide_tables.
+static inline float Context_floatspace_to_unit (Context * context, float space_value){
+    if (context->colorspace.floatspace == Floatspace_as_is) {
+        return space_value > 0 ? (space_value < 1.0f ? space_value : 1.0f) : 0.0f;
+    }
+    const float * lut = context->wide.float_to_unit;
+    //Values below the table are rare enough to convert directly
+    if (!(space_value >= 5.9604645e-8f)) return space_value > 0 ? Context_floatspace_to_unit_uncached (context, space_value) : 0.0f;
+    const float v = space_value < 1.0f ? space_value : 1.0f;
+    uint32_t bits;
+    memcpy (&bits, &v, sizeof bits);
+    const uint32_t offset = bits - FLOATSPACE_LUT_MIN_BITS;
+    const uint32_t i = offset >> FLOATSPACE_LUT_SHIFT;
+    const float frac = (float)(offset & ((1u << FLOATSPACE_LUT_SHIFT) - 1)) * (1.0f / (1u << FLOATSPACE_LUT_SHIFT));
+    return lut[i] + (lut[i + 1] - lut[i]) * frac;
+}
+
+static inline uint16_t Context_floatspace_to_word (Context * context, float space_value){
+    return (uint16_t)(Context_floatspace_to_unit (context, space_value) * 65535.0f + 0.5f);
+}
+
+//Converts 0..1 to half float bits, rounding to nearest even. No sign, infinity or NaN to deal with.
+static inline uint16_t unit_to_half (float v){
+    uint32_t bits;
+    memcpy (&bits, &v, sizeof bits);
+    //Below 2^-14, halves are subnormal, in steps of 2^-24
+    if (bits < 0x38800000u) return (uint16_t)(v * 16777216.0f + 0.5f);
+    //Rebias the exponent from 127 to 15, and round away the 13 low mantissa bits
+    return (uint16_t)((bits - 0x38000000u + 0x0fffu + ((bits >> 13) & 1)) >> 13);
+}
+
 
 
 
@@ -217,6 +277,43 @@ bool BitmapFloat_luv_to_linear_rows(Context * context, BitmapFloat * bit, const
 bool BitmapFloat_apply_color_matrix(Context * context, BitmapFloat * bmp, const uint32_t row, const uint32_t count, float*  m[5]);
 bool BitmapBgra_apply_color_matrix(Context * context, BitmapBgra * bmp, const uint32_t row, const uint32_t count, float* const __restrict  m[5]);
 
+//A diagonal color matrix, as a scale and offset for each stored channel (b, g, r, a)
+typedef struct {
+    float scale[4];
+    float offset[4];
+} ChannelTransform;
+
+//Whether the matrix only scales and offsets each channel independently (as brightness, contrast and inversion do), so
+//it can be applied as pixels are encoded. 3-channel pixels ignore the alpha row and column, as BitmapFloat_apply_color_matrix does.
+bool ColorMatrix_is_per_channel(float * const m[5], uint32_t channels);
+void ChannelTransform_from_color_matrix(float * const m[5], ChannelTransform * t);
+
+//What each encoded byte becomes, for channels b, g, r and a
+typedef struct {
+    uint8_t lut[4][256];
+} ChannelLuts;
+
+//For pixels that never leave bytes: each is decoded to the working space, transformed, and encoded again. Alpha is left alone.
+void ChannelLuts_from_transform(Context * context, const ChannelTransform * t, ChannelLuts * luts);
+
+//Intervals in the tables that map the working floatspace to and from the sRGB inputs and outputs of a ColorLut3D
+#define COLOR_LUT_SHAPER_SIZE 4096
+
+//A ColorLut3D, ready to apply to floatspace pixels. The shapers are unused for Floatspace_as_is.
+typedef struct {
+    const ColorLut3D * lut;
+    float scale[3]; //Maps r, g, b within the domain to grid coordinates
+    float offset[3];
+    bool as_is;
+    float to_srgb[COLOR_LUT_SHAPER_SIZE + 1];
+    float from_srgb[COLOR_LUT_SHAPER_SIZE + 1];
+} ColorLutStage;
+
+ColorLutStage * ColorLutStage_create(Context * context, const ColorLut3D * lut);
+void ColorLutStage_destroy(Context * context, ColorLutStage * stage);
+//Premultiplied pixels are demultiplied for the lookup. Alpha is left alone.
+bool BitmapFloat_apply_color_lut(Context * context, BitmapFloat * bmp, const uint32_t row, const uint32_t count, const ColorLutStage * stage);
+
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,422 @@
+/*
+ * Copyright (c) Imazen LLC.
+ * No part of this project, including this file, may be copied, modified,
+ * propagated, or distributed except as permitted in COPYRIGHT.txt.
+ * Licensed under the GNU Affero General Public License, Version 3.0.
+ * Commercial licenses available at http://imageresizing.net/
+ */
+#ifdef _MSC_VER
+#pragma unmanaged
+#pragma warning(disable : 4996)
+#endif
+
+#include "fastscaling_private.h"
+#include "simd.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define COLOR_LUT_MAX_SIZE 256
+
+ColorLut3D * ColorLut3D_create(Context * context, uint32_t size)
+{
+    if (size < 2 || size > COLOR_LUT_MAX_SIZE) {
+        CONTEXT_error(context, Invalid_argument);
+        return NULL;
+    }
+    ColorLut3D * lut = CONTEXT_calloc_array(context, 1, ColorLut3D);
+    //One more float, so the last entry can be loaded as a vector of 4
+    float * table = CONTEXT_calloc_array(context, (size_t)size * size * size * 3 + 1, float);
+    if (lut == NULL || table == NULL) {
+        CONTEXT_free(context, lut);
+        CONTEXT_free(context, table);
+        CONTEXT_error(context, Out_of_memory);
+        return NULL;
+    }
+    lut->size = size;
+    lut->table = table;
+    for (uint32_t b = 0; b < size; b++) {
+        for (uint32_t g = 0; g < size; g++) {
+            for (uint32_t r = 0; r < size; r++) {
+                float * entry = table + (((size_t)b * size + g) * size + r) * 3;
+                entry[0] = r / (float)(size - 1);
+                entry[1] = g / (float)(size - 1);
+                entry[2] = b / (float)(size - 1);
+            }
+        }
+    }
+    for (int i = 0; i < 3; i++) {
+        lut->domain_min[i] = 0;
+        lut->domain_max[i] = 1;
+    }
+    return lut;
+}
+
+void ColorLut3D_destroy(Context * context, ColorLut3D * lut)
+{
+    if (lut != NULL) {
+        CONTEXT_free(context, lut->table);
+    }
+    CONTEXT_free(context, lut);
+}
+
+
+static const char * cube_skip_spaces(const char * s)
+{
+    while (*s == ' ' || *s == '\t') s++;
+    return s;
+}
+
+//Consumes the keyword if the line starts with it
+static bool cube_keyword(const char ** s, const char * keyword)
+{
+    const size_t length = strlen(keyword);
+    if (strncmp(*s, keyword, length) != 0) return false;
+    const char next = (*s)[length];
+    if (next != ' ' && next != '\t' && next != '\r' && next != '\n' && next != '\0') return false;
+    *s += length;
+    return true;
+}
+
+//Reads count numbers separated by spaces, none past the end of the line
+static bool cube_parse_floats(const char ** s, const char * line_end, float * values, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++) {
+        const char * start = cube_skip_spaces(*s);
+        if (start >= line_end) return false;
+        char * end;
+        values[i] = (float)strtod(start, &end);
+        if (end == start || end > line_end) return false;
+        *s = end;
+    }
+    return true;
+}
+
+ColorLut3D * ColorLut3D_parse_cube(Context * context, const char * text)
+{
+    ColorLut3D * lut = NULL;
+    float domain_min[3] = { 0, 0, 0 };
+    float domain_max[3] = { 1, 1, 1 };
+    size_t entries = 0;
+    size_t entry_count = 0;
+    bool valid = true;
+
+    const char * line = text;
+    while (valid && *line != '\0') {
+        const char * line_end = line + strcspn(line, "\r\n");
+        const char * s = cube_skip_spaces(line);
+
+        if (s == line_end || *s == '#' || cube_keyword(&s, "TITLE")) {
+            s = line_end;
+        } else if (cube_keyword(&s, "LUT_3D_SIZE")) {
+            float size;
+            valid = lut == NULL && cube_parse_floats(&s, line_end, &size, 1) && size >= 2 && size <= COLOR_LUT_MAX_SIZE &&
+                    size == (float)(uint32_t)size;
+            if (valid) {
+                lut = ColorLut3D_create(context, (uint32_t)size);
+                if (lut == NULL) {
+                    CONTEXT_add_to_callstack (context);
+                    return NULL;
+                }
+                entry_count = (size_t)lut->size * lut->size * lut->size;
+            }
+        } else if (cube_keyword(&s, "DOMAIN_MIN")) {
+            valid = cube_parse_floats(&s, line_end, domain_min, 3);
+        } else if (cube_keyword(&s, "DOMAIN_MAX")) {
+            valid = cube_parse_floats(&s, line_end, domain_max, 3);
+        } else if (cube_keyword(&s, "LUT_3D_INPUT_RANGE")) {
+            float range[2];
+            valid = cube_parse_floats(&s, line_end, range, 2);
+            for (int i = 0; valid && i < 3; i++) {
+                domain_min[i] = range[0];
+                domain_max[i] = range[1];
+            }
+        } else if (*s >= 'A' && *s <= 'Z') {
+            //Other keywords are metadata, unless they describe a 1D table
+            valid = !cube_keyword(&s, "LUT_1D_SIZE") && !cube_keyword(&s, "LUT_1D_INPUT_RANGE");
+            s = line_end;
+        } else {
+            valid = lut != NULL && entries < entry_count && cube_parse_floats(&s, line_end, lut->table + entries * 3, 3);
+            entries++;
+        }
+        valid = valid && cube_skip_spaces(s) == line_end;
+
+        line = line_end;
+        while (*line == '\r' || *line == '\n') line++;
+    }
+    for (int i = 0; i < 3; i++) {
+        valid = valid && domain_max[i] > domain_min[i];
+    }
+    if (!valid || lut == NULL || entries != entry_count) {
+        ColorLut3D_destroy(context, lut);
+        CONTEXT_error(context, Invalid_argument);
+        return NULL;
+    }
+    memcpy(lut->domain_min, domain_min, sizeof(domain_min));
+    memcpy(lut->domain_max, domain_max, sizeof(domain_max));
+    return lut;
+}
+
+
+//The inverse of Context_unit_to_floatspace
+static float floatspace_to_unit(Context * context, float v)
+{
+#ifdef EXPOSE_SIGMOID
+    if (context->colorspace.apply_sigmoid) v = sigmoid_inverse (&context->colorspace.sigmoid, v);
+#endif
+    if (context->colorspace.apply_gamma) return apply_gamma (context, v);
+    if (context->colorspace.apply_srgb) return linear_to_srgb (v) / 255.0f;
+    return v;
+}
+
+ColorLutStage * ColorLutStage_create(Context * context, const ColorLut3D * lut)
+{
+    ColorLutStage * stage = CONTEXT_calloc_array(context, 1, ColorLutStage);
+    if (stage == NULL) {
+        CONTEXT_error(context, Out_of_memory);
+        return NULL;
+    }
+    stage->lut = lut;
+    for (int i = 0; i < 3; i++) {
+        stage->scale[i] = (lut->size - 1) / (lut->domain_max[i] - lut->domain_min[i]);
+        stage->offset[i] = -lut->domain_min[i] * stage->scale[i];
+    }
+    stage->as_is = context->colorspace.floatspace == Floatspace_as_is;
+    if (!stage->as_is) {
+        for (uint32_t i = 0; i <= COLOR_LUT_SHAPER_SIZE; i++) {
+            const float v = i / (float)COLOR_LUT_SHAPER_SIZE;
+            stage->to_srgb[i] = floatspace_to_unit(context, v);
+            stage->from_srgb[i] = Context_unit_to_floatspace(context, v);
+        }
+    }
+    return stage;
+}
+
+void ColorLutStage_destroy(Context * context, ColorLutStage * stage)
+{
+    CONTEXT_free(context, stage);
+}
+
+//Linear interpolation within a shaper table, clamping v (and NaN) to 0..1
+static inline float ColorLutStage_shape(const float * table, float v)
+{
+    const float x = (v > 0 ? (v < 1 ? v : 1) : 0) * COLOR_LUT_SHAPER_SIZE;
+    const uint32_t i = umin((uint32_t)x, COLOR_LUT_SHAPER_SIZE - 1);
+    return table[i] + (x - i) * (table[i + 1] - table[i]);
+}
+
+//The grid cell of a coordinate, and the position within it
+static inline uint32_t ColorLutStage_cell(const ColorLutStage * stage, int channel, float v, float * fraction)
+{
+    const float last = (float)(stage->lut->size - 1);
+    const float x = v * stage->scale[channel] + stage->offset[channel];
+    const float clamped = x > 0 ? (x < last ? x : last) : 0;
+    const uint32_t i = umin((uint32_t)clamped, stage->lut->size - 2);
+    *fraction = clamped - i;
+    return i;
+}
+
+//Finds the tetrahedron of the cell (corners 0, a, b and the far corner) that holds the point. Returns the offset of the
+//cell, and the weight of each corner.
+static inline size_t ColorLutStage_tetrahedron(const ColorLutStage * stage, const float rgb[3], size_t * a, size_t * b, float w[4])
+{
+    const size_t n = stage->lut->size;
+    const size_t dr = 3, dg = 3 * n, db = 3 * n * n;
+    float fr, fg, fb;
+    const size_t cell = ColorLutStage_cell(stage, 0, rgb[0], &fr) * dr + ColorLutStage_cell(stage, 1, rgb[1], &fg) * dg +
+                        ColorLutStage_cell(stage, 2, rgb[2], &fb) * db;
+    float w1, w2, w3;
+    if (fr > fg) {
+        if (fg > fb) {
+            *a = dr; *b = dr + dg; w1 = fr; w2 = fg; w3 = fb;
+        } else if (fr > fb) {
+            *a = dr; *b = dr + db; w1 = fr; w2 = fb; w3 = fg;
+        } else {
+            *a = db; *b = db + dr; w1 = fb; w2 = fr; w3 = fg;
+        }
+    } else {
+        if (fb > fg) {
+            *a = db; *b = db + dg; w1 = fb; w2 = fg; w3 = fr;
+        } else if (fb > fr) {
+            *a = dg; *b = dg + db; w1 = fg; w2 = fb; w3 = fr;
+        } else {
+            *a = dg; *b = dg + dr; w1 = fg; w2 = fr; w3 = fb;
+        }
+    }
+    w[0] = 1 - w1;
+    w[1] = w1 - w2;
+    w[2] = w2 - w3;
+    w[3] = w3;
+    return cell;
+}
+
+static inline void ColorLutStage_apply_pixel(const ColorLutStage * stage, float * data, const bool premultiplied)
+{
+    const float alpha = premultiplied ? data[3] : 1;
+    if (alpha <= 0) return;
+    const float demultiply = premultiplied ? 1 / alpha : 1;
+    float rgb[3];
+    for (int i = 0; i < 3; i++) {
+        const float v = data[2 - i] * demultiply;
+        rgb[i] = stage->as_is ? v : ColorLutStage_shape(stage->to_srgb, v);
+    }
+    size_t a, b;
+    float w[4];
+    const size_t far_corner = 3 + 3 * (size_t)stage->lut->size * (stage->lut->size + 1);
+    const float * c = stage->lut->table + ColorLutStage_tetrahedron(stage, rgb, &a, &b, w);
+    float out[3];
+    for (int i = 0; i < 3; i++) {
+        const float v = w[0] * c[i] + w[1] * c[a + i] + w[2] * c[b + i] + w[3] * c[far_corner + i];
+        out[i] = (stage->as_is ? v : ColorLutStage_shape(stage->from_srgb, v)) * alpha;
+    }
+    data[0] = out[2];
+    data[1] = out[1];
+    data[2] = out[0];
+}
+
+static void BitmapFloat_apply_color_lut_scalar(BitmapFloat * bmp, const uint32_t row, const uint32_t h, const ColorLutStage * stage)
+{
+    const uint32_t ch = bmp->channels;
+    const bool premultiplied = ch == 4 && bmp->alpha_premultiplied;
+    for (uint32_t y = row; y < h; y++) {
+        float * data = bmp->pixels + (size_t)bmp->float_stride * y;
+        for (uint32_t x = 0; x < bmp->w; x++, data += ch) {
+            ColorLutStage_apply_pixel(stage, data, premultiplied);
+        }
+    }
+}
+
+#ifdef FASTSCALING_X86
+
+//ColorLutStage_shape for each lane
+SIMD_TARGET_SSE41
+static inline __m128 ColorLutStage_shape_sse41(const float * table, __m128 v)
+{
+    const __m128 x = _mm_mul_ps(_mm_min_ps(_mm_max_ps(v, _mm_setzero_ps()), _mm_set1_ps(1)), _mm_set1_ps(COLOR_LUT_SHAPER_SIZE));
+    const __m128 cell = _mm_min_ps(_mm_floor_ps(x), _mm_set1_ps(COLOR_LUT_SHAPER_SIZE - 1));
+    int32_t i[4];
+    _mm_storeu_si128((__m128i *)i, _mm_cvttps_epi32(cell));
+    const __m128 low = _mm_setr_ps(table[i[0]], table[i[1]], table[i[2]], table[i[3]]);
+    const __m128 high = _mm_setr_ps(table[i[0] + 1], table[i[1] + 1], table[i[2] + 1], table[i[3] + 1]);
+    return _mm_add_ps(low, _mm_mul_ps(_mm_sub_ps(x, cell), _mm_sub_ps(high, low)));
+}
+
+//Lanes 0..2 of one pixel's corners, weighted by lane k of each weight vector. The 4th float of each corner (the next entry,
+//or padding) is loaded and ignored.
+#define COLOR_LUT_BLEND_SSE41(k) \
+    _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_shuffle_ps(w0, w0, _MM_SHUFFLE(k, k, k, k)), _mm_loadu_ps(table + base[k])), \
+                          _mm_mul_ps(_mm_shuffle_ps(wa, wa, _MM_SHUFFLE(k, k, k, k)), _mm_loadu_ps(table + base[k] + corner_a[k]))), \
+               _mm_add_ps(_mm_mul_ps(_mm_shuffle_ps(wb, wb, _MM_SHUFFLE(k, k, k, k)), _mm_loadu_ps(table + base[k] + corner_b[k])), \
+                          _mm_mul_ps(_mm_shuffle_ps(wc, wc, _MM_SHUFFLE(k, k, k, k)), _mm_loadu_ps(table + base[k] + far_corner))))
+
+//Four pixels at a time: their channels are transposed into vectors to find the cells and tetrahedra without branches, then
+//each pixel's corners are blended as a vector of r, g, b
+SIMD_TARGET_SSE41
+static void BitmapFloat_apply_color_lut_sse41(BitmapFloat * bmp, const uint32_t row, const uint32_t h, const ColorLutStage * stage)
+{
+    const uint32_t ch = bmp->channels;
+    const bool premultiplied = ch == 4 && bmp->alpha_premultiplied;
+    const bool as_is = stage->as_is;
+    const float * const table = stage->lut->table;
+    const int32_t n = (int32_t)stage->lut->size;
+    const __m128i stride_r = _mm_set1_epi32(3), stride_g = _mm_set1_epi32(3 * n), stride_b = _mm_set1_epi32(3 * n * n);
+    const int32_t far_corner = 3 + 3 * n + 3 * n * n;
+    const __m128 scale_r = _mm_set1_ps(stage->scale[0]), scale_g = _mm_set1_ps(stage->scale[1]), scale_b = _mm_set1_ps(stage->scale[2]);
+    const __m128 offset_r = _mm_set1_ps(stage->offset[0]), offset_g = _mm_set1_ps(stage->offset[1]), offset_b = _mm_set1_ps(stage->offset[2]);
+    const __m128 last = _mm_set1_ps((float)(n - 1));
+    const __m128 last_cell = _mm_set1_ps((float)(n - 2));
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1);
+    for (uint32_t y = row; y < h; y++) {
+        float * data = bmp->pixels + (size_t)bmp->float_stride * y;
+        uint32_t x = 0;
+        for (; x + 4 <= bmp->w; x += 4, data += 4 * ch) {
+            const __m128 p0 = _mm_loadu_ps(data);
+            const __m128 p1 = _mm_loadu_ps(data + ch);
+            const __m128 p2 = _mm_loadu_ps(data + 2 * ch);
+            //For 3 channels, don't read past the last pixel
+            const __m128 p3 = ch == 4 ? _mm_loadu_ps(data + 3 * ch) : load3_ps(data + 3 * ch);
+            __m128 b = p0, g = p1, r = p2, a = p3;
+            _MM_TRANSPOSE4_PS(b, g, r, a);
+            __m128 alpha = one;
+            if (premultiplied) {
+                alpha = a;
+                //Transparent pixels are left alone; 1/0 is clamped away before it is used
+                const __m128 demultiply = _mm_div_ps(one, alpha);
+                b = _mm_mul_ps(b, demultiply);
+                g = _mm_mul_ps(g, demultiply);
+                r = _mm_mul_ps(r, demultiply);
+            }
+            if (!as_is) {
+                b = ColorLutStage_shape_sse41(stage->to_srgb, b);
+                g = ColorLutStage_shape_sse41(stage->to_srgb, g);
+                r = ColorLutStage_shape_sse41(stage->to_srgb, r);
+            }
+            //Grid coordinates; NaN becomes 0
+            const __m128 coord_r = _mm_min_ps(_mm_max_ps(_mm_add_ps(_mm_mul_ps(r, scale_r), offset_r), zero), last);
+            const __m128 coord_g = _mm_min_ps(_mm_max_ps(_mm_add_ps(_mm_mul_ps(g, scale_g), offset_g), zero), last);
+            const __m128 coord_b = _mm_min_ps(_mm_max_ps(_mm_add_ps(_mm_mul_ps(b, scale_b), offset_b), zero), last);
+            const __m128 cell_r = _mm_min_ps(_mm_floor_ps(coord_r), last_cell);
+            const __m128 cell_g = _mm_min_ps(_mm_floor_ps(coord_g), last_cell);
+            const __m128 cell_b = _mm_min_ps(_mm_floor_ps(coord_b), last_cell);
+            const __m128 fr = _mm_sub_ps(coord_r, cell_r);
+            const __m128 fg = _mm_sub_ps(coord_g, cell_g);
+            const __m128 fb = _mm_sub_ps(coord_b, cell_b);
+
+            //The tetrahedron runs from the cell's first corner along the axis of the largest fraction, then the middle one
+            const __m128 highest = _mm_max_ps(fr, _mm_max_ps(fg, fb));
+            const __m128 lowest = _mm_min_ps(fr, _mm_min_ps(fg, fb));
+            const __m128 middle = _mm_sub_ps(_mm_add_ps(fr, _mm_add_ps(fg, fb)), _mm_add_ps(highest, lowest));
+            //Ties pick different axes for the highest and lowest, unless all three are equal (when a and b are unweighted)
+            const __m128i highest_stride = _mm_blendv_epi8(_mm_blendv_epi8(stride_b, stride_g, _mm_castps_si128(_mm_cmpeq_ps(fg, highest))),
+                                                           stride_r, _mm_castps_si128(_mm_cmpeq_ps(fr, highest)));
+            const __m128i lowest_stride = _mm_blendv_epi8(_mm_blendv_epi8(stride_r, stride_g, _mm_castps_si128(_mm_cmpeq_ps(fg, lowest))),
+                                                          stride_b, _mm_castps_si128(_mm_cmpeq_ps(fb, lowest)));
+            int32_t base[4], corner_a[4], corner_b[4];
+            _mm_storeu_si128((__m128i *)base, _mm_add_epi32(_mm_add_epi32(_mm_mullo_epi32(_mm_cvttps_epi32(cell_r), stride_r),
+                                                                          _mm_mullo_epi32(_mm_cvttps_epi32(cell_g), stride_g)),
+                                                            _mm_mullo_epi32(_mm_cvttps_epi32(cell_b), stride_b)));
+            _mm_storeu_si128((__m128i *)corner_a, highest_stride);
+            _mm_storeu_si128((__m128i *)corner_b, _mm_sub_epi32(_mm_set1_epi32(far_corner), lowest_stride));
+            const __m128 w0 = _mm_sub_ps(one, highest);
+            const __m128 wa = _mm_sub_ps(highest, middle);
+            const __m128 wb = _mm_sub_ps(middle, lowest);
+            const __m128 wc = lowest;
+
+            //r, g, b of each pixel
+            __m128 out[4] = { COLOR_LUT_BLEND_SSE41(0), COLOR_LUT_BLEND_SSE41(1), COLOR_LUT_BLEND_SSE41(2), COLOR_LUT_BLEND_SSE41(3) };
+            float alphas[4];
+            _mm_storeu_ps(alphas, alpha);
+            for (uint32_t k = 0; k < 4; k++) {
+                if (alphas[k] <= 0) continue;
+                __m128 v = _mm_shuffle_ps(out[k], out[k], _MM_SHUFFLE(3, 0, 1, 2));
+                if (!as_is) v = ColorLutStage_shape_sse41(stage->from_srgb, v);
+                if (premultiplied) v = _mm_mul_ps(v, _mm_set1_ps(alphas[k]));
+                store3_ps(data + k * ch, v);
+            }
+        }
+        for (; x < bmp->w; x++, data += ch) {
+            ColorLutStage_apply_pixel(stage, data, premultiplied);
+        }
+    }
+}
+
+#undef COLOR_LUT_BLEND_SSE41
+
+#endif
+
+bool BitmapFloat_apply_color_lut(Context * context, BitmapFloat * bmp, const uint32_t row, const uint32_t count, const ColorLutStage * stage)
+{
+    if (bmp->channels < 3) {
+        CONTEXT_error(context, Unsupported_pixel_format);
+        return false;
+    }
+    const uint32_t h = umin(row + count, bmp->h);
+#ifdef FASTSCALING_X86
+    if (context->simd.active >= Simd_sse41) {
+        BitmapFloat_apply_color_lut_sse41(bmp, row, h, stage);
+        return true;
+    }
+#endif
+    BitmapFloat_apply_color_lut_scalar(bmp, row, h, stage);
+    return true;
+}
@@ -10,13 +10,77 @@
 #endif
 
 #include "fastscaling_private.h"
+#include "simd.h"
 
 #include <string.h>
 
 
+//The color of a premultiplied pixel, to the nearest byte
+static inline uint8_t demultiply_byte(uint8_t value, uint8_t alpha)
+{
+    return alpha == 0 ? 0 : (uint8_t)umin(255, ((uint32_t)value * 255 + alpha / 2) / alpha);
+}
+
+//The table index of a premultiplied 16-bit or half float channel, demultiplied
+static inline uint16_t demultiply_wide(const Context * context, bool half, uint16_t value, float alpha)
+{
+    float unit = alpha > 0 ? (half ? context->wide.half_to_unit[value] : (float)value * (1.0f / 65535.0f)) / alpha : 0.0f;
+    unit = unit < 1.0f ? unit : 1.0f;
+    return half ? unit_to_half(unit) : (uint16_t)(unit * 65535.0f + 0.5f);
+}
+
+//Rows of 16-bit or half float channels, with alpha (if kept) premultiplied, as for bytes
+static bool convert_wide_to_floatspace(Context * context, const BitmapBgra * src, uint32_t from_row, BitmapFloat * dest, uint32_t dest_row, uint32_t row_count)
+{
+    if (dest->channels < 3) {
+        CONTEXT_error(context, Unsupported_pixel_format);
+        return false;
+    }
+    if (!Context_prepare_wide_tables(context)) {
+        CONTEXT_add_to_callstack (context);
+        return false;
+    }
+    const bool half = src->fmt == BgraHalf;
+    const float * lut = half ? context->wide.half_to_float : context->wide.word_to_float;
+    const float * alpha_lut = context->wide.half_to_unit;
+    //Premultiplied values are demultiplied first, unless the floatspace is as_is, where they can be used as they are
+    const bool premultiplied = src->alpha_premultiplied && src->alpha_meaningful;
+    const bool as_is = context->colorspace.floatspace == Floatspace_as_is;
+    const uint32_t from_step = BitmapPixelFormat_channels(src->fmt);
+    const uint32_t to_step = dest->channels;
+    for (uint32_t row = 0; row < row_count; row++) {
+        const uint16_t * s = (const uint16_t *)(src->pixels + (size_t)(from_row + row) * src->stride);
+        float * buf = dest->pixels + ((size_t)dest->float_stride * (row + dest_row));
+        if (to_step == 3) {
+            for (uint32_t x = 0; x < src->w; x++, s += from_step, buf += 3) {
+                buf[0] = lut[s[0]];
+                buf[1] = lut[s[1]];
+                buf[2] = lut[s[2]];
+            }
+        } else {
+            for (uint32_t x = 0; x < src->w; x++, s += 4, buf += 4) {
+                const float alpha = half ? alpha_lut[s[3]] : (float)s[3] * (1.0f / 65535.0f);
+                buf[3] = alpha;
+                if (premultiplied && as_is) {
+                    for (int c = 0; c < 3; c++) buf[c] = half ? alpha_lut[s[c]] : lut[s[c]];
+                } else if (premultiplied) {
+                    for (int c = 0; c < 3; c++) buf[c] = alpha * lut[demultiply_wide(context, half, s[c], alpha)];
+                } else {
+                    buf[0] = alpha * lut[s[0]];
+                    buf[1] = alpha * lut[s[1]];
+                    buf[2] = alpha * lut[s[2]];
+                }
+            }
+        }
+    }
+    return true;
+}
+
 bool BitmapBgra_convert_srgb_to_linear(Context * context, BitmapBgra * src, uint32_t from_row, BitmapFloat * dest, uint32_t dest_row, uint32_t row_count)
 {
-    if (src->w != dest->w || BitmapPixelFormat_bytes_per_pixel(src->fmt) < dest->channels) {
+    //Gray8 may be widened to 3 channels
+    const bool widen = src->fmt == Gray8 && dest->channels == 3;
+    if (src->w != dest->w || (BitmapPixelFormat_channels(src->fmt) < dest->channels && !widen)) {
         CONTEXT_error(context, Invalid_internal_state);
         return false;
     }
@@ -24,6 +88,20 @@ bool BitmapBgra_convert_srgb_to_linear(Context * context, BitmapBgra * src, uint
         CONTEXT_error(context, Invalid_internal_state);
         return false;
     }
+    if (BitmapPixelFormat_unpacked(src->fmt) != src->fmt) {
+        if (!BitmapBgra_unpack_srgb_to_linear(context, src, from_row, dest, dest_row, row_count)) {
+            CONTEXT_add_to_callstack (context);
+            return false;
+        }
+        return true;
+    }
+    if (BitmapPixelFormat_is_wide(src->fmt)) {
+        if (!convert_wide_to_floatspace(context, src, from_row, dest, dest_row, row_count)) {
+            CONTEXT_add_to_callstack (context);
+            return false;
+        }
+        return true;
+    }
 
 
     const uint32_t w = src->w;
@@ -31,18 +109,51 @@ bool BitmapBgra_convert_srgb_to_linear(Context * context, BitmapBgra * src, uint
     const uint32_t from_step = BitmapPixelFormat_bytes_per_pixel(src->fmt);
     const uint32_t to_step = dest->channels;
     const uint32_t copy_step = umin(from_step, to_step);
+    //In Floatspace_as_is, premultiplied bytes are what premultiplying would give; otherwise they're demultiplied first
+    const bool premultiplied = src->alpha_premultiplied && src->alpha_meaningful;
+    //4 channels without meaningful alpha hold the colors as they are, and alpha 1
+    const bool opaque = to_step == 4 && !dest->alpha_meaningful;
+    const bool as_is = context->colorspace.floatspace == Floatspace_as_is;
 
     for (uint32_t row = 0; row < row_count; row++) {
-        uint8_t*    src_start = src->pixels + (from_row + row)*src->stride;
-
-        float* buf = dest->pixels + (dest->float_stride * (row + dest_row));
-        if (copy_step == 3) {
+        uint8_t*    src_start = src->pixels + (size_t)(from_row + row) * src->stride;
+
+        float* buf = dest->pixels + ((size_t)dest->float_stride * (row + dest_row));
+        if (widen) {
+            for (uint32_t x = 0; x < w; x++) {
+                const float v = Context_srgb_to_floatspace(context, src_start[x]);
+                buf[x * 3] = v;
+                buf[x * 3 + 1] = v;
+                buf[x * 3 + 2] = v;
+            }
+        } else if (copy_step == 1) {
+            for (uint32_t x = 0; x < w; x++) {
+                buf[x * to_step] = Context_srgb_to_floatspace(context, src_start[x * from_step]);
+            }
+        } else if (copy_step == 3) {
             for (uint32_t to_x = 0, bix = 0; bix < units; to_x += to_step, bix += from_step) {
                 buf[to_x] =     Context_srgb_to_floatspace(context, src_start[bix]);
                 buf[to_x + 1] = Context_srgb_to_floatspace (context, src_start[bix + 1]);
                 buf[to_x + 2] = Context_srgb_to_floatspace (context, src_start[bix + 2]);
             }
             //We're only working on a portion... dest->alpha_premultiplied = false;
+        } else if (copy_step == 4 && opaque) {
+            for (uint32_t to_x = 0, bix = 0; bix < units; to_x += to_step, bix += from_step) {
+                buf[to_x] = Context_srgb_to_floatspace(context, src_start[bix]);
+                buf[to_x + 1] = Context_srgb_to_floatspace(context, src_start[bix + 1]);
+                buf[to_x + 2] = Context_srgb_to_floatspace(context, src_start[bix + 2]);
+                buf[to_x + 3] = 1.0f;
+            }
+        } else if (copy_step == 4 && premultiplied) {
+            for (uint32_t to_x = 0, bix = 0; bix < units; to_x += to_step, bix += from_step) {
+                const uint8_t a = src_start[bix + 3];
+                const float alpha = ((float)a) / 255.0f;
+                for (uint32_t c = 0; c < 3; c++) {
+                    buf[to_x + c] = as_is ? Context_srgb_to_floatspace(context, src_start[bix + c])
+                                          : alpha * Context_srgb_to_floatspace(context, demultiply_byte(src_start[bix + c], a));
+                }
+                buf[to_x + 3] = alpha;
+            }
         } else if (copy_step == 4) {
             for (uint32_t to_x = 0, bix = 0; bix < units; to_x += to_step, bix += from_step) {
                 {
@@ -64,205 +175,716 @@ bool BitmapBgra_convert_srgb_to_linear(Context * context, BitmapBgra * src, uint
 }
 
 
-/*
-static void unpack24bitRow(uint32_t width, unsigned char* sourceLine, unsigned char* destArray){
-    for (uint32_t i = 0; i < width; i++){
-
-        memcpy(destArray + i * 4, sourceLine + i * 3, 3);
-        destArray[i * 4 + 3] = 255;
-    }
-}
-*/
-
-
 bool BitmapBgra_flip_vertical(Context * context, BitmapBgra * b)
 {
-    void* swap = CONTEXT_malloc(context,b->stride);
-    if (swap == NULL) {
-        CONTEXT_error(context, Out_of_memory);
-        return false;
-    }
+    //Swapped a piece at a time through the stack, so flipping never allocates
+    uint8_t swap[1024];
     //Dont' copy the full stride (padding), it could be windowed!
     uint32_t row_length = umin (b->stride, b->w *  BitmapPixelFormat_bytes_per_pixel (b->fmt));
     for (uint32_t i = 0; i < b->h / 2; i++) {
-        void* top = b->pixels + (i * b->stride);
-        void* bottom = b->pixels + ((b->h - 1 - i) * b->stride);
-        memcpy (swap, top, row_length);
-        memcpy(top, bottom, row_length);
-        memcpy (bottom, swap, row_length);
+        uint8_t * top = b->pixels + ((size_t)i * b->stride);
+        uint8_t * bottom = b->pixels + ((size_t)(b->h - 1 - i) * b->stride);
+        for (uint32_t offset = 0; offset < row_length; offset += sizeof(swap)) {
+            const uint32_t count = umin ((uint32_t)sizeof(swap), row_length - offset);
+            memcpy (swap, top + offset, count);
+            memcpy (top + offset, bottom + offset, count);
+            memcpy (bottom + offset, swap, count);
+        }
     }
-    CONTEXT_free(context,swap);
     return true;
 }
 
-/*
-static int  copy_bitmap_bgra(BitmapBgra * src, BitmapBgra * dst)
+bool BitmapFloat_demultiply_alpha(Context * context, BitmapFloat * src, const uint32_t from_row, const uint32_t row_count)
 {
-    // TODO: check sizes / overflows
-    if (dst->w != src->w || dst->h != src->h) return -1;
+    for (uint32_t row = from_row; row < from_row + row_count; row++) {
+        size_t start_ix = (size_t)row * src->float_stride;
+        size_t end_ix = start_ix + src->w * src->channels;
 
-    if (src->fmt == dst->fmt)
-    {
-        const uint32_t bytes_pp = BitmapPixelFormat_bytes_per_pixel (src->fmt);
-        // recalculate line width as it can be different from the stride
-        for (uint32_t y = 0; y < src->h; y++)
-            memcpy(dst->pixels + y*dst->stride, src->pixels + y*src->stride, src->w*bytes_pp);
-    }
-    else if (src->fmt == Bgr24 && dst->fmt == Bgra32)
-    {
-        for (uint32_t y = 0; y < src->h; y++)
-            unpack24bitRow(src->w, src->pixels + y*src->stride, dst->pixels + y*dst->stride);
-    }
-    else{
-        return -2;
+        for (size_t ix = start_ix; ix < end_ix; ix += 4) {
+            const float alpha = src->pixels[ix + 3];
+            if (alpha > 0) {
+                src->pixels[ix] /= alpha;
+                src->pixels[ix + 1] /= alpha;
+                src->pixels[ix + 2] /= alpha;
+            }
+        }
     }
-    return 0;
+    return true;
 }
-*/
 
-static bool BitmapFloat_blend_matte(Context * context, BitmapFloat * src, const uint32_t from_row, const uint32_t row_count, const uint8_t* const matte)
+
+//What happens to each pixel between the float buffer and the canvas. Blending onto the matte, or composing over the
+//canvas, also demultiplies.
+typedef struct {
+    bool blend_matte;
+    bool demultiply;
+    //Blend_with_self: composes over the canvas pixels. Fully transparent pixels leave them as they are.
+    bool compose;
+    //Whether the canvas alpha is used (and updated) by compose
+    bool dest_alpha;
+    bool copy_alpha;
+    //Compose leaves the canvas alpha as it is, if not meaningful
+    bool keep_alpha;
+    //Otherwise a 4th byte is set to opaque
+    bool clean_alpha;
+    //The canvas has 16-bit or half float channels
+    bool wide;
+    bool half;
+    //For premultiplied canvases, encoded colors are multiplied by alpha again. In Floatspace_as_is, rows already hold
+    //those values, so clamp_to_alpha replaces demultiplying and multiplying back.
+    bool premultiply;
+    bool clamp_to_alpha;
+    //Canvas colors are read back (to compose over them) premultiplied
+    bool canvas_premultiplied;
+    //b, g, r in floatspace, then alpha
+    float matte[4];
+    //A diagonal color matrix, applied before anything else
+    bool transform;
+    float scale[4];
+    float offset[4];
+} OutputStage;
+
+static void OutputStage_init(Context * context, OutputStage * stage, const BitmapFloat * src, const BitmapBgra * dest, bool matte_and_demultiply,
+                             const ChannelTransform * transform)
 {
+    const bool has_alpha = src->channels == 4;
+    stage->blend_matte = matte_and_demultiply && has_alpha && src->alpha_meaningful && dest->compositing_mode == Blend_with_matte;
+    stage->demultiply = matte_and_demultiply && has_alpha && src->alpha_premultiplied && dest->compositing_mode != Blend_with_self;
+    stage->compose = matte_and_demultiply && has_alpha && src->alpha_meaningful && dest->compositing_mode == Blend_with_self;
+    const bool dest_has_alpha = BitmapPixelFormat_channels(dest->fmt) == 4;
+    stage->dest_alpha = dest_has_alpha && dest->alpha_meaningful;
+    stage->copy_alpha = dest_has_alpha && has_alpha && src->alpha_meaningful && (!stage->compose || stage->dest_alpha);
+    stage->keep_alpha = stage->compose && dest_has_alpha && !stage->dest_alpha;
+    stage->clean_alpha = !stage->copy_alpha && !stage->keep_alpha && dest_has_alpha;
+    stage->wide = BitmapPixelFormat_is_wide(dest->fmt);
+    stage->half = dest->fmt == BgraHalf;
+    const bool premultiplied_dest = stage->copy_alpha && dest->alpha_meaningful && dest->alpha_premultiplied;
+    stage->clamp_to_alpha = premultiplied_dest && stage->demultiply && context->colorspace.floatspace == Floatspace_as_is;
+    stage->demultiply = stage->demultiply && !stage->clamp_to_alpha;
+    stage->premultiply = premultiplied_dest && !stage->clamp_to_alpha;
+    stage->canvas_premultiplied = stage->dest_alpha && dest->alpha_premultiplied;
     //We assume that matte is BGRA, regardless.
+    for (int i = 0; i < 3; i++) {
+        stage->matte[i] = Context_srgb_to_floatspace(context, dest->matte_color[i]);
+    }
+    stage->matte[3] = ((float)dest->matte_color[3]) / 255.0f;
+    stage->transform = transform != NULL;
+    for (int i = 0; i < 4; i++) {
+        stage->scale[i] = transform != NULL ? transform->scale[i] : 1.0f;
+        stage->offset[i] = transform != NULL ? transform->offset[i] : 0.0f;
+    }
+}
 
-    const float matte_a = ((float)matte[3]) / 255.0f;
-    const float b = Context_srgb_to_floatspace (context, matte[0]);
-    const float g = Context_srgb_to_floatspace (context, matte[1]);
-    const float r = Context_srgb_to_floatspace (context, matte[2]);
-
+typedef void (*encode_pixels_function)(Context * context, const OutputStage * stage, const float * src, uint32_t count, uint32_t ch,
+                                       uint8_t * dest, size_t dest_pixel_stride, uint32_t dest_bytes_pp);
 
+//The canvas pixel at p in floatspace, with its alpha (1 if not meaningful), for composing over it
+static inline void OutputStage_read_canvas(Context * context, const OutputStage * stage, const uint8_t * p, float * bgra)
+{
+    if (stage->wide) {
+        uint16_t v[4];
+        memcpy(v, p, sizeof(uint16_t) * (stage->dest_alpha ? 4 : 3));
+        const float * lut = stage->half ? context->wide.half_to_float : context->wide.word_to_float;
+        bgra[3] = !stage->dest_alpha ? 1.0f : (stage->half ? context->wide.half_to_unit[v[3]] : (float)v[3] * (1.0f / 65535.0f));
+        for (int c = 0; c < 3; c++) {
+            bgra[c] = lut[stage->canvas_premultiplied ? demultiply_wide(context, stage->half, v[c], bgra[3]) : v[c]];
+        }
+    } else {
+        for (int c = 0; c < 3; c++) {
+            bgra[c] = Context_srgb_to_floatspace(context, stage->canvas_premultiplied ? demultiply_byte(p[c], p[3]) : p[c]);
+        }
+        bgra[3] = stage->dest_alpha ? p[3] * (1.0f / 255.0f) : 1.0f;
+    }
+}
 
-    for (uint32_t row = from_row; row < from_row + row_count; row++) {
-        uint32_t start_ix = row * src->float_stride;
-        uint32_t end_ix = start_ix + src->w * src->channels;
+//Applies the stage to one pixel (b, g, r and alpha) about to be written over canvas. Returns false for pixels that
+//leave the canvas as it is.
+static inline bool OutputStage_apply(Context * context, const OutputStage * stage, float * px, uint32_t ch, const uint8_t * canvas)
+{
+    if (stage->transform) {
+        px[0] = px[0] * stage->scale[0] + stage->offset[0];
+        px[1] = px[1] * stage->scale[1] + stage->offset[1];
+        px[2] = px[2] * stage->scale[2] + stage->offset[2];
+        if (ch == 4) px[3] = px[3] * stage->scale[3] + stage->offset[3];
+    }
+    if (stage->blend_matte) {
+        const float a = (1.0f - px[3]) * stage->matte[3];
+        px[3] += a;
+        const float scale = 1.0f / px[3];
+        px[0] = (px[0] + stage->matte[0] * a) * scale;
+        px[1] = (px[1] + stage->matte[1] * a) * scale;
+        px[2] = (px[2] + stage->matte[2] * a) * scale;
+    } else if (stage->demultiply && px[3] > 0) {
+        const float scale = 1.0f / px[3];
+        px[0] *= scale;
+        px[1] *= scale;
+        px[2] *= scale;
+    } else if (stage->clamp_to_alpha) {
+        px[0] = px[0] < px[3] ? px[0] : px[3];
+        px[1] = px[1] < px[3] ? px[1] : px[3];
+        px[2] = px[2] < px[3] ? px[2] : px[3];
+    } else if (stage->compose) {
+        if (px[3] == 0 && px[0] == 0 && px[1] == 0 && px[2] == 0) return false;
+        //The canvas doesn't show through opaque pixels (or those that overshoot)
+        if (px[3] < 1) {
+            float under[4];
+            OutputStage_read_canvas(context, stage, canvas, under);
+            const float a = (1.0f - px[3]) * under[3];
+            px[0] += under[0] * a;
+            px[1] += under[1] * a;
+            px[2] += under[2] * a;
+            px[3] += a;
+        }
+        const float scale = px[3] > 0 ? 1.0f / px[3] : 0.0f;
+        px[0] *= scale;
+        px[1] *= scale;
+        px[2] *= scale;
+    }
+    return true;
+}
 
-        for (uint32_t ix = start_ix; ix < end_ix; ix += 4) {
-            const float src_a = src->pixels[ix + 3];
-            const float a = (1.0f - src_a) * matte_a;
-            const float final_alpha = src_a + a;
+static void encode_pixels(Context * context, const OutputStage * stage, const float * src, uint32_t count, uint32_t ch,
+                          uint8_t * dest, size_t dest_pixel_stride, uint32_t dest_bytes_pp)
+{
+    for (uint32_t i = 0; i < count; i++, src += ch, dest += dest_pixel_stride) {
+        float px[4] = { src[0], src[1], src[2], ch == 4 ? src[3] : 1.0f };
+        if (!OutputStage_apply(context, stage, px, ch, dest)) continue;
+        dest[0] = Context_floatspace_to_srgb(context, px[0]);
+        dest[1] = Context_floatspace_to_srgb(context, px[1]);
+        dest[2] = Context_floatspace_to_srgb(context, px[2]);
+        if (stage->copy_alpha) {
+            dest[3] = uchar_clamp_ff(px[3] * 255.0f);
+        }
+        if (stage->clean_alpha) {
+            dest[3] = 0xff;
+        }
+        if (stage->premultiply) {
+            dest[0] = (uint8_t)((dest[0] * dest[3] + 127) / 255);
+            dest[1] = (uint8_t)((dest[1] * dest[3] + 127) / 255);
+            dest[2] = (uint8_t)((dest[2] * dest[3] + 127) / 255);
+        }
+    }
+}
 
-            src->pixels[ix] = (src->pixels[ix] + b * a) / final_alpha;
-            src->pixels[ix + 1] = (src->pixels[ix + 1] + g * a) / final_alpha;
-            src->pixels[ix + 2] = (src->pixels[ix + 2] + r * a) / final_alpha;
-            src->pixels[ix + 3] = final_alpha;
+//Writes 16-bit or half float channels (Context_prepare_wide_tables must have been called). Gray rows go to b, g and r.
+static void encode_wide_pixels(Context * context, const OutputStage * stage, const float * src, uint32_t count, uint32_t ch,
+                               uint8_t * dest, size_t dest_pixel_stride, uint32_t dest_bytes_pp)
+{
+    const uint32_t g = ch >= 3 ? 1 : 0;
+    for (uint32_t i = 0; i < count; i++, src += ch, dest += dest_pixel_stride) {
+        float px[4] = { src[0], src[g], src[g * 2], ch == 4 ? src[3] : 1.0f };
+        if (!OutputStage_apply(context, stage, px, ch, dest)) continue;
+        const float alpha = px[3] > 0 ? (px[3] < 1.0f ? px[3] : 1.0f) : 0.0f;
+        const float color_scale = stage->premultiply ? alpha : 1.0f;
+        uint16_t out[4];
+        for (int c = 0; c < 3; c++) {
+            const float unit = Context_floatspace_to_unit(context, px[c]) * color_scale;
+            out[c] = stage->half ? unit_to_half(unit) : (uint16_t)(unit * 65535.0f + 0.5f);
+        }
+        if (stage->half) {
+            out[3] = stage->clean_alpha ? 0x3C00 : unit_to_half(alpha);
+        } else {
+            out[3] = stage->clean_alpha ? 0xffff : (uint16_t)(alpha * 65535.0f + 0.5f);
+        }
+        memcpy(dest, out, sizeof(uint16_t) * (stage->copy_alpha || stage->clean_alpha ? 4 : 3));
+    }
+}
 
+//Gray rows have no alpha to blend or compose (nor a transform, as the renderer widens them to apply one). Each value
+//is written to b, g and r of a color canvas, with opaque alpha.
+static void encode_gray_pixels(Context * context, const OutputStage * stage, const float * src, uint32_t count, uint32_t ch,
+                               uint8_t * dest, size_t dest_pixel_stride, uint32_t dest_bytes_pp)
+{
+    for (uint32_t i = 0; i < count; i++, dest += dest_pixel_stride) {
+        const uint8_t v = Context_floatspace_to_srgb(context, src[i]);
+        dest[0] = v;
+        if (dest_bytes_pp >= 3) {
+            dest[1] = v;
+            dest[2] = v;
+        }
+        if (dest_bytes_pp == 4) {
+            dest[3] = 0xff;
         }
     }
+}
 
+#ifdef FASTSCALING_X86
 
-    //Ensure alpha is demultiplied
-    return true;
+//Scales 0..1 to 0..255 and packs the 4 lanes into BGRA bytes, rounding like uchar_clamp_ff
+SIMD_TARGET_SSE2
+static inline uint32_t pack_unorm_sse2(__m128 v)
+{
+    const __m128 scaled = _mm_min_ps(_mm_max_ps(_mm_mul_ps(v, _mm_set1_ps(255.0f)), _mm_setzero_ps()), _mm_set1_ps(255.0f));
+    const __m128i ints = _mm_cvttps_epi32(_mm_add_ps(scaled, _mm_set1_ps(0.5f)));
+    const __m128i words = _mm_packs_epi32(ints, ints);
+    return (uint32_t)_mm_cvtsi128_si32(_mm_packus_epi16(words, words));
 }
 
-bool BitmapFloat_demultiply_alpha(Context * context, BitmapFloat * src, const uint32_t from_row, const uint32_t row_count)
+//The same arithmetic as encode_pixels, one pixel per vector
+SIMD_TARGET_SSE2
+static void encode_pixels_sse2(Context * context, const OutputStage * stage, const float * src, uint32_t count, uint32_t ch,
+                               uint8_t * dest, size_t dest_pixel_stride, uint32_t dest_bytes_pp)
 {
-    for (uint32_t row = from_row; row < from_row + row_count; row++) {
-        uint32_t start_ix = row * src->float_stride;
-        uint32_t end_ix = start_ix + src->w * src->channels;
-
-        for (uint32_t ix = start_ix; ix < end_ix; ix += 4) {
-            const float alpha = src->pixels[ix + 3];
-            if (alpha > 0) {
-                src->pixels[ix] /= alpha;
-                src->pixels[ix + 1] /= alpha;
-                src->pixels[ix + 2] /= alpha;
+    const bool use_lut = context->colorspace.floatspace != Floatspace_as_is;
+    const uint8_t * lut = context->colorspace.float_to_byte;
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 colors = _mm_castsi128_ps(_mm_setr_epi32(-1, -1, -1, 0));
+    const __m128 matte = _mm_loadu_ps(stage->matte);
+    const __m128 matte_alpha = _mm_set1_ps(stage->matte[3]);
+    const uint32_t alpha_bits = stage->copy_alpha || stage->keep_alpha ? 0 : 0xff000000u;
+    const __m128 scale = _mm_loadu_ps(stage->scale);
+    const __m128 offset = _mm_loadu_ps(stage->offset);
+    const float * decode = context->colorspace.byte_to_float;
+
+    for (uint32_t i = 0; i < count; i++, src += ch, dest += dest_pixel_stride) {
+        __m128 v = ch == 4 ? _mm_loadu_ps(src) : load3_ps(src);
+        if (stage->transform) {
+            v = _mm_add_ps(_mm_mul_ps(v, scale), offset);
+        }
+        if (stage->blend_matte) {
+            const __m128 alpha = _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 3, 3, 3));
+            const __m128 a = _mm_mul_ps(_mm_sub_ps(one, alpha), matte_alpha);
+            const __m128 final_alpha = _mm_add_ps(alpha, a);
+            const __m128 blended = _mm_mul_ps(_mm_add_ps(v, _mm_mul_ps(matte, a)), _mm_div_ps(one, final_alpha));
+            v = _mm_or_ps(_mm_and_ps(colors, blended), _mm_andnot_ps(colors, final_alpha));
+        } else if (stage->demultiply) {
+            const __m128 alpha = _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 3, 3, 3));
+            const __m128 scaled = _mm_and_ps(colors, _mm_cmpgt_ps(alpha, _mm_setzero_ps()));
+            v = _mm_mul_ps(v, _mm_or_ps(_mm_and_ps(scaled, _mm_div_ps(one, alpha)), _mm_andnot_ps(scaled, one)));
+        } else if (stage->clamp_to_alpha) {
+            const __m128 alpha = _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 3, 3, 3));
+            v = _mm_or_ps(_mm_and_ps(colors, _mm_min_ps(v, alpha)), _mm_andnot_ps(colors, v));
+        } else if (stage->compose) {
+            if (_mm_movemask_ps(_mm_cmpeq_ps(v, _mm_setzero_ps())) == 0xf) continue;
+            __m128 alpha = _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 3, 3, 3));
+            if (_mm_cvtss_f32(alpha) < 1) {
+                const float dest_a = stage->dest_alpha ? dest[3] * (1.0f / 255.0f) : 1.0f;
+                const __m128 a = _mm_mul_ps(_mm_sub_ps(one, alpha), _mm_set1_ps(dest_a));
+                //The canvas pixel, with 1 in alpha's lane, so a is added to alpha too
+                const __m128 canvas = _mm_setr_ps(decode[dest[0]], decode[dest[1]], decode[dest[2]], 1.0f);
+                v = _mm_add_ps(v, _mm_mul_ps(canvas, a));
+                alpha = _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 3, 3, 3));
             }
+            const __m128 scaled = _mm_and_ps(colors, _mm_cmpgt_ps(alpha, _mm_setzero_ps()));
+            v = _mm_mul_ps(v, _mm_or_ps(_mm_and_ps(scaled, _mm_div_ps(one, alpha)), _mm_andnot_ps(colors, one)));
+        }
+        //Alpha is always linear
+        uint32_t packed = pack_unorm_sse2(v);
+        if (use_lut) {
+            const __m128i index = floatspace_lut_index_sse2(v);
+            packed = (packed & 0xff000000u) | lut[_mm_cvtsi128_si32(index)] | ((uint32_t)lut[_mm_extract_epi16(index, 2)] << 8) | ((uint32_t)lut[_mm_extract_epi16(index, 4)] << 16);
+        }
+        packed |= alpha_bits;
+        if (stage->keep_alpha) {
+            packed = (packed & 0xffffffu) | ((uint32_t)dest[3] << 24);
+        }
+        if (dest_bytes_pp == 4) {
+            memcpy(dest, &packed, 4);
+        } else {
+            dest[0] = (uint8_t)packed;
+            dest[1] = (uint8_t)(packed >> 8);
+            dest[2] = (uint8_t)(packed >> 16);
         }
     }
-    return true;
 }
 
+//Vector forms of pack_unorm_sse2 and floatspace_lut_index_sse2, 8 values at a time
+SIMD_TARGET_AVX2
+static inline __m256i unorm_to_bytes_avx2(__m256 v)
+{
+    const __m256 scaled = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(v, _mm256_set1_ps(255.0f)), _mm256_setzero_ps()), _mm256_set1_ps(255.0f));
+    return _mm256_cvttps_epi32(_mm256_add_ps(scaled, _mm256_set1_ps(0.5f)));
+}
 
-bool BitmapFloat_copy_linear_over_srgb(Context * context, BitmapFloat * src, const uint32_t from_row, BitmapBgra * dest, const uint32_t dest_row, const uint32_t row_count, const uint32_t from_col, const uint32_t col_count, const bool transpose)
+SIMD_TARGET_AVX2
+static inline __m256i encode_avx2(const uint8_t * lut, __m256 v)
 {
+    if (lut == NULL) return unorm_to_bytes_avx2(v);
+    const __m256 clamped = _mm256_min_ps(_mm256_max_ps(v, _mm256_set1_ps(5.9604645e-8f)), _mm256_set1_ps(1.0f));
+    const __m256i index = _mm256_srli_epi32(_mm256_sub_epi32(_mm256_castps_si256(clamped), _mm256_set1_epi32((int)FLOATSPACE_LUT_MIN_BITS)), FLOATSPACE_LUT_SHIFT);
+    return _mm256_and_si256(_mm256_i32gather_epi32((const int *)lut, index, 1), _mm256_set1_epi32(0xff));
+}
 
-    const uint32_t dest_bytes_pp = BitmapPixelFormat_bytes_per_pixel (dest->fmt);
+//Eight pixels as planes of b, g, r and alpha, with the transform applied. 4-channel pixels are left in the order
+//0 2 4 6 1 3 5 7 by the interleaved loads; pack8_avx2 restores it.
+SIMD_TARGET_AVX2
+static inline void load8_avx2(const OutputStage * stage, const float * src, uint32_t ch, __m256 * b, __m256 * g, __m256 * r, __m256 * alpha)
+{
+    if (ch == 4) {
+        const __m256 p01 = _mm256_loadu_ps(src);
+        const __m256 p23 = _mm256_loadu_ps(src + 8);
+        const __m256 p45 = _mm256_loadu_ps(src + 16);
+        const __m256 p67 = _mm256_loadu_ps(src + 24);
+        const __m256 bg_low = _mm256_unpacklo_ps(p01, p23);
+        const __m256 bg_high = _mm256_unpacklo_ps(p45, p67);
+        const __m256 ra_low = _mm256_unpackhi_ps(p01, p23);
+        const __m256 ra_high = _mm256_unpackhi_ps(p45, p67);
+        *b = _mm256_castpd_ps(_mm256_unpacklo_pd(_mm256_castps_pd(bg_low), _mm256_castps_pd(bg_high)));
+        *g = _mm256_castpd_ps(_mm256_unpackhi_pd(_mm256_castps_pd(bg_low), _mm256_castps_pd(bg_high)));
+        *r = _mm256_castpd_ps(_mm256_unpacklo_pd(_mm256_castps_pd(ra_low), _mm256_castps_pd(ra_high)));
+        *alpha = _mm256_castpd_ps(_mm256_unpackhi_pd(_mm256_castps_pd(ra_low), _mm256_castps_pd(ra_high)));
+    } else {
+        const __m256i rgb_index = _mm256_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21);
+        *b = _mm256_i32gather_ps(src, rgb_index, 4);
+        *g = _mm256_i32gather_ps(src + 1, rgb_index, 4);
+        *r = _mm256_i32gather_ps(src + 2, rgb_index, 4);
+        *alpha = _mm256_set1_ps(1.0f);
+    }
+    if (stage->transform) {
+        *b = _mm256_fmadd_ps(*b, _mm256_set1_ps(stage->scale[0]), _mm256_set1_ps(stage->offset[0]));
+        *g = _mm256_fmadd_ps(*g, _mm256_set1_ps(stage->scale[1]), _mm256_set1_ps(stage->offset[1]));
+        *r = _mm256_fmadd_ps(*r, _mm256_set1_ps(stage->scale[2]), _mm256_set1_ps(stage->offset[2]));
+        if (ch == 4) *alpha = _mm256_fmadd_ps(*alpha, _mm256_set1_ps(stage->scale[3]), _mm256_set1_ps(stage->offset[3]));
+    }
+}
 
-    const uint32_t dest_row_stride = transpose ? dest_bytes_pp : dest->stride;
-    const uint32_t dest_pixel_stride = transpose ? dest->stride : dest_bytes_pp;
-    const uint32_t srcitems = umin(from_col + col_count, src->w) *src->channels;
-    const uint32_t ch = src->channels;
-    const bool copy_alpha = dest->fmt == Bgra32 && src->channels == 4 && src->alpha_meaningful;
-    const bool clean_alpha = !copy_alpha && dest->fmt == Bgra32;
+//Encodes the planes, and returns the packed pixels in order
+SIMD_TARGET_AVX2
+static inline __m256i pack8_avx2(const uint8_t * lut, uint32_t ch, __m256 b, __m256 g, __m256 r, __m256i alpha_bytes)
+{
+    const __m256i packed = _mm256_or_si256(_mm256_or_si256(encode_avx2(lut, b), _mm256_slli_epi32(encode_avx2(lut, g), 8)),
+                                           _mm256_or_si256(_mm256_slli_epi32(encode_avx2(lut, r), 16), _mm256_slli_epi32(alpha_bytes, 24)));
+    return ch == 4 ? _mm256_permutevar8x32_epi32(packed, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7)) : packed;
+}
 
-    for (uint32_t row = 0; row < row_count; row++) {
-        float * src_row = src->pixels + (row + from_row) * src->float_stride;
+//One reciprocal per 8 pixels, and each plane's table entries fetched by a single gather
+SIMD_TARGET_AVX2
+static inline __m256i encode8_avx2(const uint8_t * lut, const OutputStage * stage, const float * src, uint32_t ch)
+{
+    const __m256 one = _mm256_set1_ps(1.0f);
+    __m256 b, g, r, alpha;
+    load8_avx2(stage, src, ch, &b, &g, &r, &alpha);
+    if (stage->blend_matte) {
+        const __m256 a = _mm256_mul_ps(_mm256_sub_ps(one, alpha), _mm256_set1_ps(stage->matte[3]));
+        alpha = _mm256_add_ps(alpha, a);
+        const __m256 scale = _mm256_div_ps(one, alpha);
+        b = _mm256_mul_ps(_mm256_add_ps(b, _mm256_mul_ps(_mm256_set1_ps(stage->matte[0]), a)), scale);
+        g = _mm256_mul_ps(_mm256_add_ps(g, _mm256_mul_ps(_mm256_set1_ps(stage->matte[1]), a)), scale);
+        r = _mm256_mul_ps(_mm256_add_ps(r, _mm256_mul_ps(_mm256_set1_ps(stage->matte[2]), a)), scale);
+    } else if (stage->demultiply) {
+        const __m256 scale = _mm256_blendv_ps(one, _mm256_div_ps(one, alpha), _mm256_cmp_ps(alpha, _mm256_setzero_ps(), _CMP_GT_OQ));
+        b = _mm256_mul_ps(b, scale);
+        g = _mm256_mul_ps(g, scale);
+        r = _mm256_mul_ps(r, scale);
+    } else if (stage->clamp_to_alpha) {
+        b = _mm256_min_ps(b, alpha);
+        g = _mm256_min_ps(g, alpha);
+        r = _mm256_min_ps(r, alpha);
+    }
+    const __m256i alpha_bytes = stage->copy_alpha ? unorm_to_bytes_avx2(alpha) : _mm256_set1_epi32(0xff);
+    return pack8_avx2(lut, ch, b, g, r, alpha_bytes);
+}
 
-        uint8_t * dest_row_bytes = dest->pixels + (dest_row + row) * dest_row_stride + (from_col * dest_pixel_stride);
+//Composes eight 4-channel pixels over the canvas pixels (packed, in order). Blocks that are entirely transparent return
+//the canvas as it is, and blocks that are entirely opaque don't decode it. Sets *unchanged for the former.
+SIMD_TARGET_AVX2
+static inline __m256i compose8_avx2(const uint8_t * lut, const float * decode, const OutputStage * stage, const float * src, __m256i canvas,
+                                    bool * unchanged)
+{
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256i byte_mask = _mm256_set1_epi32(0xff);
+    __m256 b, g, r, alpha;
+    load8_avx2(stage, src, 4, &b, &g, &r, &alpha);
+    const __m256 transparent = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(b, zero, _CMP_EQ_OQ), _mm256_cmp_ps(g, zero, _CMP_EQ_OQ)),
+                                             _mm256_and_ps(_mm256_cmp_ps(r, zero, _CMP_EQ_OQ), _mm256_cmp_ps(alpha, zero, _CMP_EQ_OQ)));
+    *unchanged = _mm256_movemask_ps(transparent) == 0xff;
+    if (*unchanged) return canvas;
+
+    //In the order of the planes
+    const __m256i dest = _mm256_permutevar8x32_epi32(canvas, _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7));
+    if (_mm256_movemask_ps(_mm256_cmp_ps(alpha, one, _CMP_GE_OQ)) != 0xff) {
+        const __m256 dest_alpha = stage->dest_alpha ? _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(dest, 24)), _mm256_set1_ps(1.0f / 255.0f)) : one;
+        //The canvas doesn't show through opaque pixels (or those that overshoot)
+        const __m256 a = _mm256_mul_ps(_mm256_sub_ps(one, _mm256_min_ps(alpha, one)), dest_alpha);
+        b = _mm256_fmadd_ps(_mm256_i32gather_ps(decode, _mm256_and_si256(dest, byte_mask), 4), a, b);
+        g = _mm256_fmadd_ps(_mm256_i32gather_ps(decode, _mm256_and_si256(_mm256_srli_epi32(dest, 8), byte_mask), 4), a, g);
+        r = _mm256_fmadd_ps(_mm256_i32gather_ps(decode, _mm256_and_si256(_mm256_srli_epi32(dest, 16), byte_mask), 4), a, r);
+        alpha = _mm256_add_ps(alpha, a);
+    }
+    const __m256 scale = _mm256_and_ps(_mm256_div_ps(one, alpha), _mm256_cmp_ps(alpha, zero, _CMP_GT_OQ));
+    b = _mm256_mul_ps(b, scale);
+    g = _mm256_mul_ps(g, scale);
+    r = _mm256_mul_ps(r, scale);
+    const __m256i alpha_bytes = stage->copy_alpha ? unorm_to_bytes_avx2(alpha) :
+                                (stage->keep_alpha ? _mm256_srli_epi32(dest, 24) : byte_mask);
+    const __m256i composed = pack8_avx2(lut, 4, b, g, r, alpha_bytes);
+    return _mm256_blendv_epi8(composed, canvas, _mm256_castps_si256(_mm256_permutevar8x32_ps(transparent, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7))));
+}
 
-        for (uint32_t ix = from_col * ch; ix < srcitems; ix += ch) {
-            dest_row_bytes[0] = Context_floatspace_to_srgb (context, src_row[ix]);
-            dest_row_bytes[1] = Context_floatspace_to_srgb (context, src_row[ix + 1]);
-            dest_row_bytes[2] = Context_floatspace_to_srgb (context, src_row[ix + 2]);
-            if (copy_alpha) {
-                dest_row_bytes[3] = uchar_clamp_ff (src_row[ix + 3] * 255.0f);
+SIMD_TARGET_AVX2
+static void encode_pixels_avx2(Context * context, const OutputStage * stage, const float * src, uint32_t count, uint32_t ch,
+                               uint8_t * dest, size_t dest_pixel_stride, uint32_t dest_bytes_pp)
+{
+    const uint8_t * lut = context->colorspace.floatspace != Floatspace_as_is ? context->colorspace.float_to_byte : NULL;
+    uint32_t i = 0;
+    for (; i + 8 <= count; i += 8, src += 8 * ch) {
+        const __m256i packed = encode8_avx2(lut, stage, src, ch);
+        if (dest_pixel_stride == 4) {
+            _mm256_storeu_si256((__m256i *)dest, packed);
+            dest += 32;
+            continue;
+        }
+        uint32_t pixels[8];
+        _mm256_storeu_si256((__m256i *)pixels, packed);
+        for (int p = 0; p < 8; p++, dest += dest_pixel_stride) {
+            if (dest_bytes_pp == 4) {
+                memcpy(dest, &pixels[p], 4);
+            } else {
+                memcpy(dest, &pixels[p], 3);
+            }
+        }
+    }
+    encode_pixels_sse2(context, stage, src, count - i, ch, dest, dest_pixel_stride, dest_bytes_pp);
+}
 
+//encode_pixels_avx2 for stage->compose, which reads the canvas pixels before overwriting them
+SIMD_TARGET_AVX2
+static void compose_pixels_avx2(Context * context, const OutputStage * stage, const float * src, uint32_t count, uint32_t ch,
+                                uint8_t * dest, size_t dest_pixel_stride, uint32_t dest_bytes_pp)
+{
+    const uint8_t * lut = context->colorspace.floatspace != Floatspace_as_is ? context->colorspace.float_to_byte : NULL;
+    const float * decode = context->colorspace.byte_to_float;
+    uint32_t i = 0;
+    for (; i + 8 <= count; i += 8, src += 8 * ch) {
+        uint32_t pixels[8] = { 0 };
+        if (dest_pixel_stride != 4) {
+            for (int p = 0; p < 8; p++) {
+                memcpy(&pixels[p], dest + p * dest_pixel_stride, dest_bytes_pp);
             }
-            if (clean_alpha) {
-                dest_row_bytes[3] = 0xff;
+        }
+        const __m256i canvas = _mm256_loadu_si256(dest_pixel_stride == 4 ? (const __m256i *)dest : (const __m256i *)pixels);
+        bool unchanged;
+        const __m256i packed = compose8_avx2(lut, decode, stage, src, canvas, &unchanged);
+        if (unchanged) {
+            dest += 8 * dest_pixel_stride;
+        } else if (dest_pixel_stride == 4) {
+            _mm256_storeu_si256((__m256i *)dest, packed);
+            dest += 32;
+        } else {
+            _mm256_storeu_si256((__m256i *)pixels, packed);
+            for (int p = 0; p < 8; p++, dest += dest_pixel_stride) {
+                memcpy(dest, &pixels[p], dest_bytes_pp);
             }
-            dest_row_bytes += dest_pixel_stride;
         }
     }
-    return true;
-
+    encode_pixels_sse2(context, stage, src, count - i, ch, dest, dest_pixel_stride, dest_bytes_pp);
 }
 
-static bool BitmapFloat_compose_linear_over_srgb(Context * context, BitmapFloat * src, const uint32_t from_row, BitmapBgra * dest, const uint32_t dest_row, const uint32_t row_count, const uint32_t from_col, const uint32_t col_count, const bool transpose)
+//Stores 4 packed pixels, dropping their 4th bytes for a 3-byte canvas
+SIMD_TARGET_AVX2
+static inline void store4_pixels_avx2(uint8_t * dest, __m128i pixels, uint32_t dest_bytes_pp)
 {
+    if (dest_bytes_pp == 4) {
+        _mm_storeu_si128((__m128i *)dest, pixels);
+        return;
+    }
+    const __m128i packed = _mm_shuffle_epi8(pixels, _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1));
+    const uint32_t last = (uint32_t)_mm_extract_epi32(packed, 2);
+    _mm_storel_epi64((__m128i *)dest, packed);
+    memcpy(dest + 8, &last, 4);
+}
 
-    const uint32_t dest_bytes_pp = BitmapPixelFormat_bytes_per_pixel (dest->fmt);
-    const uint32_t dest_row_stride = transpose ? dest_bytes_pp : dest->stride;
-    const uint32_t dest_pixel_stride = transpose ? dest->stride : dest_bytes_pp;
-    const uint32_t srcitems = umin(from_col + col_count, src->w) *src->channels;
-    const uint32_t ch = src->channels;
-
-    const bool dest_alpha = dest->fmt == Bgra32 && dest->alpha_meaningful;
+//Eight gray values as opaque BGRA pixels
+SIMD_TARGET_AVX2
+static inline __m256i gray8_to_bgra_avx2(__m256i values)
+{
+    return _mm256_or_si256(_mm256_mullo_epi32(values, _mm256_set1_epi32(0x010101)), _mm256_set1_epi32((int)0xff000000u));
+}
 
-    const uint8_t dest_alpha_index = dest_alpha ? 3 : 0;
-    const float dest_alpha_to_float_coeff = dest_alpha ? 1.0f / 255.0f : 0.0f;
-    const float dest_alpha_to_float_offset = dest_alpha ? 0.0f : 1.0f;
-    for (uint32_t row = 0; row < row_count; row++) {
-        //const float * const __restrict src_row = src->pixels + (row + from_row) * src->float_stride;
-        float * src_row = src->pixels + (row + from_row) * src->float_stride;
+//Eight gray values in the low 8 bytes
+SIMD_TARGET_AVX2
+static inline __m128i gray8_to_bytes_avx2(__m256i values)
+{
+    const __m128i words = _mm_packus_epi32(_mm256_castsi256_si128(values), _mm256_extracti128_si256(values, 1));
+    return _mm_packus_epi16(words, words);
+}
 
-        uint8_t * dest_row_bytes = dest->pixels + (dest_row + row) * dest_row_stride + (from_col * dest_pixel_stride);
+SIMD_TARGET_AVX2
+static void encode_gray_pixels_avx2(Context * context, const OutputStage * stage, const float * src, uint32_t count, uint32_t ch,
+                                    uint8_t * dest, size_t dest_pixel_stride, uint32_t dest_bytes_pp)
+{
+    const uint8_t * lut = context->colorspace.floatspace != Floatspace_as_is ? context->colorspace.float_to_byte : NULL;
+    uint32_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const __m256i values = encode_avx2(lut, _mm256_loadu_ps(src + i));
+        if (dest_pixel_stride == 1) {
+            _mm_storel_epi64((__m128i *)dest, gray8_to_bytes_avx2(values));
+            dest += 8;
+            continue;
+        }
+        const __m256i packed = gray8_to_bgra_avx2(values);
+        if (dest_pixel_stride == 4) {
+            _mm256_storeu_si256((__m256i *)dest, packed);
+            dest += 32;
+            continue;
+        }
+        uint32_t pixels[8];
+        _mm256_storeu_si256((__m256i *)pixels, packed);
+        for (int p = 0; p < 8; p++, dest += dest_pixel_stride) {
+            memcpy(dest, &pixels[p], dest_bytes_pp);
+        }
+    }
+    encode_gray_pixels(context, stage, src + i, count - i, ch, dest, dest_pixel_stride, dest_bytes_pp);
+}
 
-        for (uint32_t ix = from_col * ch; ix < srcitems; ix += ch) {
+//Writes 8 gray rows into 8 adjacent columns of a Gray8 canvas, transposing blocks of 8x8 bytes in registers
+SIMD_TARGET_AVX2
+static void encode_transposed_gray_rows_avx2(Context * context, const OutputStage * stage, const float * src, size_t src_stride, uint32_t count,
+                                             uint8_t * dest, size_t dest_stride)
+{
+    const uint8_t * lut = context->colorspace.floatspace != Floatspace_as_is ? context->colorspace.float_to_byte : NULL;
+    uint32_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i rows[8];
+        for (int r = 0; r < 8; r++) {
+            rows[r] = gray8_to_bytes_avx2(encode_avx2(lut, _mm256_loadu_ps(src + r * src_stride + i)));
+        }
+        //Byte pairs, then quads, then each pixel's 8 rows
+        const __m128i pairs[4] = { _mm_unpacklo_epi8(rows[0], rows[1]), _mm_unpacklo_epi8(rows[2], rows[3]),
+                                   _mm_unpacklo_epi8(rows[4], rows[5]), _mm_unpacklo_epi8(rows[6], rows[7]) };
+        const __m128i quads[4] = { _mm_unpacklo_epi16(pairs[0], pairs[1]), _mm_unpackhi_epi16(pairs[0], pairs[1]),
+                                   _mm_unpacklo_epi16(pairs[2], pairs[3]), _mm_unpackhi_epi16(pairs[2], pairs[3]) };
+        const __m128i columns[4] = { _mm_unpacklo_epi32(quads[0], quads[2]), _mm_unpackhi_epi32(quads[0], quads[2]),
+                                     _mm_unpacklo_epi32(quads[1], quads[3]), _mm_unpackhi_epi32(quads[1], quads[3]) };
+        uint8_t * d = dest + (size_t)i * dest_stride;
+        for (int p = 0; p < 4; p++) {
+            _mm_storel_epi64((__m128i *)(d + (size_t)(p * 2) * dest_stride), columns[p]);
+            _mm_storel_epi64((__m128i *)(d + (size_t)(p * 2 + 1) * dest_stride), _mm_unpackhi_epi64(columns[p], columns[p]));
+        }
+    }
+    for (uint32_t row = 0; row < 8; row++) {
+        encode_gray_pixels(context, stage, src + row * src_stride + i, count - i, 1, dest + row + (size_t)i * dest_stride, dest_stride, 1);
+    }
+}
 
-            const uint8_t dest_b = dest_row_bytes[0];
-            const uint8_t dest_g = dest_row_bytes[1];
-            const uint8_t dest_r = dest_row_bytes[2];
-            const uint8_t dest_a = dest_row_bytes[dest_alpha_index];
+//Writes 4 rows into 4 adjacent columns of the canvas, in blocks of 8 pixels per row. Each block is transposed in
+//registers, so each canvas row receives its 4 pixels in a single store, rather than one pixel at a time as each row passes.
+SIMD_TARGET_AVX2
+static void encode_transposed_rows_avx2(Context * context, const OutputStage * stage, const float * src, size_t src_stride, uint32_t count,
+                                        uint32_t ch, uint8_t * dest, size_t dest_stride, uint32_t dest_bytes_pp)
+{
+    const uint8_t * lut = context->colorspace.floatspace != Floatspace_as_is ? context->colorspace.float_to_byte : NULL;
+    uint32_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const float * s = src + (size_t)i * ch;
+        const __m256i row0 = ch == 1 ? gray8_to_bgra_avx2(encode_avx2(lut, _mm256_loadu_ps(s))) : encode8_avx2(lut, stage, s, ch);
+        const __m256i row1 = ch == 1 ? gray8_to_bgra_avx2(encode_avx2(lut, _mm256_loadu_ps(s + src_stride))) : encode8_avx2(lut, stage, s + src_stride, ch);
+        const __m256i row2 = ch == 1 ? gray8_to_bgra_avx2(encode_avx2(lut, _mm256_loadu_ps(s + src_stride * 2))) : encode8_avx2(lut, stage, s + src_stride * 2, ch);
+        const __m256i row3 = ch == 1 ? gray8_to_bgra_avx2(encode_avx2(lut, _mm256_loadu_ps(s + src_stride * 3))) : encode8_avx2(lut, stage, s + src_stride * 3, ch);
+        //Pixels 0 1 4 5, then 2 3 6 7, as pairs from rows 0 and 1, then rows 2 and 3
+        const __m256i low01 = _mm256_unpacklo_epi32(row0, row1);
+        const __m256i low23 = _mm256_unpacklo_epi32(row2, row3);
+        const __m256i high01 = _mm256_unpackhi_epi32(row0, row1);
+        const __m256i high23 = _mm256_unpackhi_epi32(row2, row3);
+        const __m256i columns[4] = { _mm256_unpacklo_epi64(low01, low23), _mm256_unpackhi_epi64(low01, low23),
+                                     _mm256_unpacklo_epi64(high01, high23), _mm256_unpackhi_epi64(high01, high23) };
+        uint8_t * d = dest + (size_t)i * dest_stride;
+        for (int p = 0; p < 4; p++) {
+            store4_pixels_avx2(d + (size_t)p * dest_stride, _mm256_castsi256_si128(columns[p]), dest_bytes_pp);
+            store4_pixels_avx2(d + (size_t)(p + 4) * dest_stride, _mm256_extracti128_si256(columns[p], 1), dest_bytes_pp);
+        }
+    }
+    const encode_pixels_function encode = ch == 1 ? encode_gray_pixels : encode_pixels_sse2;
+    for (uint32_t row = 0; row < 4; row++) {
+        encode(context, stage, src + row * src_stride + (size_t)i * ch, count - i, ch, dest + row * dest_bytes_pp + (size_t)i * dest_stride,
+               dest_stride, dest_bytes_pp);
+    }
+}
 
-            const float src_b = src_row[ix + 0];
-            const float src_g = src_row[ix + 1];
-            const float src_r = src_row[ix + 2];
-            const float src_a = src_row[ix + 3];
-            const float a = (1.0f - src_a) * (dest_alpha_to_float_coeff * dest_a + dest_alpha_to_float_offset);
+#endif
 
-            const float b = Context_srgb_to_floatspace (context, dest_b) * a + src_b;
-            const float g = Context_srgb_to_floatspace (context, dest_g) * a + src_g;
-            const float r = Context_srgb_to_floatspace (context, dest_r) * a + src_r;
+//Maps b, g and r of 'rows' lines of 'count' pixels
+static void apply_channel_luts(const ChannelLuts * luts, uint8_t * dest, uint32_t count, size_t pixel_stride, uint32_t rows, size_t row_stride)
+{
+    for (uint32_t row = 0; row < rows; row++) {
+        uint8_t * p = dest + row * row_stride;
+        for (uint32_t i = 0; i < count; i++, p += pixel_stride) {
+            p[0] = luts->lut[0][p[0]];
+            p[1] = luts->lut[1][p[1]];
+            p[2] = luts->lut[2][p[2]];
+        }
+    }
+}
 
-            const float final_alpha = src_a + a;
+void BitmapBgra_apply_channel_luts(BitmapBgra * b, uint32_t from, uint32_t count, bool columns, const ChannelLuts * luts)
+{
+    const uint32_t bpp = BitmapPixelFormat_bytes_per_pixel(b->fmt);
+    if (columns) {
+        apply_channel_luts(luts, b->pixels + (size_t)from * bpp, count, bpp, b->h, b->stride);
+    } else {
+        apply_channel_luts(luts, b->pixels + (size_t)from * b->stride, b->w, bpp, count, b->stride);
+    }
+}
 
-            dest_row_bytes[0] = Context_floatspace_to_srgb (context, b / final_alpha);
-            dest_row_bytes[1] = Context_floatspace_to_srgb (context,g / final_alpha);
-            dest_row_bytes[2] = Context_floatspace_to_srgb (context,r / final_alpha);
-            if (dest_alpha) {
-                dest_row_bytes[3] =  uchar_clamp_ff(final_alpha * 255);
+static bool BitmapFloat_encode_rows(Context * context, const OutputStage * stage, BitmapFloat * src, const uint32_t from_row, BitmapBgra * dest,
+                                    const uint32_t dest_row, const uint32_t row_count, const uint32_t from_col, const uint32_t col_count, const bool transpose)
+{
+    const uint32_t dest_bytes_pp = BitmapPixelFormat_bytes_per_pixel(dest->fmt);
+    const size_t dest_row_stride = transpose ? dest_bytes_pp : dest->stride;
+    const size_t dest_pixel_stride = transpose ? dest->stride : dest_bytes_pp;
+    const uint32_t ch = src->channels;
+    const uint32_t count = from_col < src->w ? umin(col_count, src->w - from_col) : 0;
+    //Gray rows can be written to any canvas, color ones only to color canvases
+    if (ch == 2 || ch > 4 || (ch >= 3 && dest_bytes_pp < 3)) {
+        CONTEXT_error(context, Unsupported_pixel_format);
+        return false;
+    }
+    uint32_t row = 0;
+    encode_pixels_function encode = ch == 1 ? encode_gray_pixels : encode_pixels;
+    if (stage->wide) {
+        if (!Context_prepare_wide_tables(context)) {
+            CONTEXT_add_to_callstack (context);
+            return false;
+        }
+        encode = encode_wide_pixels;
+    }
+#ifdef FASTSCALING_X86
+    if (stage->wide || stage->premultiply) {
+        //No vectorized encoders for wide canvases, nor for multiplying encoded colors by alpha
+    } else if (ch == 1) {
+        if (context->simd.active >= Simd_avx2) {
+            encode = encode_gray_pixels_avx2;
+            for (; transpose && dest_bytes_pp == 1 && row + 8 <= row_count; row += 8) {
+                encode_transposed_gray_rows_avx2(context, stage, src->pixels + (size_t)(row + from_row) * src->float_stride + from_col, src->float_stride, count,
+                                                 dest->pixels + (dest_row + row) + from_col * dest_pixel_stride, dest->stride);
             }
-            dest_row_bytes += dest_pixel_stride;
+            for (; transpose && dest_bytes_pp >= 3 && row + 4 <= row_count; row += 4) {
+                encode_transposed_rows_avx2(context, stage, src->pixels + (size_t)(row + from_row) * src->float_stride + from_col, src->float_stride, count, ch,
+                                            dest->pixels + (dest_row + row) * dest_row_stride + from_col * dest_pixel_stride, dest->stride, dest_bytes_pp);
+            }
+        }
+    } else if (context->simd.active >= Simd_avx2 && ch <= 4 && dest_bytes_pp >= 3) {
+        encode = stage->compose ? compose_pixels_avx2 : encode_pixels_avx2;
+        //Transposing one row at a time would write each canvas row a pixel at a time, once per row
+        for (; transpose && !stage->compose && row + 4 <= row_count; row += 4) {
+            encode_transposed_rows_avx2(context, stage, src->pixels + (size_t)(row + from_row) * src->float_stride + (size_t)from_col * ch, src->float_stride, count, ch,
+                                        dest->pixels + (dest_row + row) * dest_row_stride + from_col * dest_pixel_stride, dest->stride, dest_bytes_pp);
         }
+    } else if (context->simd.active >= Simd_sse41 && ch <= 4 && dest_bytes_pp >= 3) {
+        encode = encode_pixels_sse2;
+    }
+#endif
+    for (; row < row_count; row++) {
+        encode(context, stage, src->pixels + (size_t)(row + from_row) * src->float_stride + (size_t)from_col * ch, count, ch,
+               dest->pixels + (dest_row + row) * dest_row_stride + from_col * dest_pixel_stride, dest_pixel_stride, dest_bytes_pp);
     }
     return true;
-
 }
 
+bool BitmapFloat_copy_linear_over_srgb(Context * context, BitmapFloat * src, const uint32_t from_row, BitmapBgra * dest, const uint32_t dest_row, const uint32_t row_count, const uint32_t from_col, const uint32_t col_count, const bool transpose)
+{
+    OutputStage stage;
+    OutputStage_init(context, &stage, src, dest, false, NULL);
+    if (!BitmapFloat_encode_rows(context, &stage, src, from_row, dest, dest_row, row_count, from_col, col_count, transpose)) {
+        CONTEXT_add_to_callstack (context);
+        return false;
+    }
+    return true;
+}
 
-
-
-bool BitmapFloat_pivoting_composite_linear_over_srgb(Context * context, BitmapFloat * src, uint32_t from_row, BitmapBgra * dest, uint32_t dest_row, uint32_t row_count, bool transpose)
+bool BitmapFloat_pivoting_composite_linear_over_srgb(Context * context, BitmapFloat * src, uint32_t from_row, BitmapBgra * dest, uint32_t dest_row, uint32_t row_count, bool transpose,
+                                                     const ChannelTransform * transform)
 {
     if (transpose ? src->w != dest->h : src->w != dest->w) {
         //TODO: Add more bounds checks
@@ -270,21 +892,6 @@ bool BitmapFloat_pivoting_composite_linear_over_srgb(Context * context, BitmapFl
         return false;
     }
 
-    if (src->alpha_meaningful && src->channels == 4 && dest->compositing_mode == Blend_with_matte) {
-        if (!BitmapFloat_blend_matte(context, src, from_row, row_count, dest->matte_color)) {
-            CONTEXT_add_to_callstack (context);
-            return false;
-        }
-        src->alpha_premultiplied = false;
-    }
-    if (src->channels == 4 && src->alpha_premultiplied && dest->compositing_mode != Blend_with_self) {
-        //Demultiply
-        if (!BitmapFloat_demultiply_alpha(context, src, from_row, row_count)) {
-            CONTEXT_add_to_callstack (context);
-            return false;
-        }
-    }
-
     bool can_compose = dest->compositing_mode == Blend_with_self && src->alpha_meaningful && src->channels == 4;
 
     if (can_compose && !src->alpha_premultiplied) {
@@ -293,45 +900,12 @@ bool BitmapFloat_pivoting_composite_linear_over_srgb(Context * context, BitmapFl
         return false;
     }
 
-    //Tiling does not appear to show benefits when benchmarking - only briefly investigated
-    bool tile_when_transposing = false;
-
-    if (transpose && tile_when_transposing) {
-
-        //Let's try to tile within 2kb, get some cache coherency
-        const float dest_opt_rows = 2048.0f / (float)dest->stride;
-
-        const int tile_width = int_max(4, (int)dest_opt_rows);
-        const int tiles = src->w / tile_width;
-
-        if (can_compose) {
-            for (int i = 0; i < tiles; i++) {
-                if (!BitmapFloat_compose_linear_over_srgb(context, src, from_row, dest, dest_row, row_count, i * tile_width, tile_width, transpose)) {
-                    CONTEXT_add_to_callstack (context);
-                    return false;
-                }
-            }
-        } else {
-            for (int i = 0; i < tiles; i++) {
-                if (!BitmapFloat_copy_linear_over_srgb(context, src, from_row, dest, dest_row, row_count, i * tile_width, tile_width, transpose)) {
-                    CONTEXT_add_to_callstack (context);
-                    return false;
-                }
-            }
-        }
-    } else {
-        if (can_compose) {
-            if (!BitmapFloat_compose_linear_over_srgb(context, src, from_row, dest, dest_row, row_count, 0, src->w, transpose)) {
-                CONTEXT_add_to_callstack (context);
-                return false;
-            }
-        } else {
-            if (!BitmapFloat_copy_linear_over_srgb(context, src, from_row, dest, dest_row, row_count, 0,src->w,transpose)) {
-                CONTEXT_add_to_callstack (context);
-                return false;
-            }
-        }
+    //Matte blending or composing over the canvas, demultiplying and encoding happen in one pass, leaving src as it was
+    OutputStage stage;
+    OutputStage_init(context, &stage, src, dest, true, transform);
+    if (!BitmapFloat_encode_rows(context, &stage, src, from_row, dest, dest_row, row_count, 0, src->w, transpose)) {
+        CONTEXT_add_to_callstack (context);
+        return false;
     }
-
     return true;
 }
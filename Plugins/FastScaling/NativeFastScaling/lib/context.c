@@ -132,9 +132,48 @@ void Context_initialize(Context * context)
     //memset(context->error.callstack, 0, sizeof context->error.callstack);
     context->error.reason = No_Error;
     DefaultHeapManager_initialize(&context->heap);
+    context->simd.supported = Simd_detect_supported_level();
+    context->simd.active = context->simd.supported;
+    context->colorspace.tables_valid = false;
+    context->wide.word_to_float = NULL;
+    context->wide.tables_valid = false;
     Context_set_floatspace (context, Floatspace_as_is, 0.0f, 0.0f, 0.0f);
 }
 
+bool Context_initialize_worker(Context * context, Context * worker, uint32_t log_capacity)
+{
+    memcpy(worker, context, sizeof(Context));
+    worker->error.callstack_count = 0;
+    worker->error.reason = No_Error;
+    worker->log.log = NULL;
+    worker->log.capacity = 0;
+    worker->log.count = 0;
+    if (context->log.log != NULL && !Context_enable_profiling(worker, umax(1, log_capacity))) {
+        CONTEXT_add_to_callstack (worker);
+        memcpy(&context->error, &worker->error, sizeof(ErrorInfo));
+        return false;
+    }
+    return true;
+}
+
+void Context_terminate_worker(Context * context, Context * worker)
+{
+    if (worker->log.log != NULL) {
+        const uint32_t recorded = umin(worker->log.count, worker->log.capacity);
+        for (uint32_t i = 0; i < recorded; i++) {
+            if (context->log.count < context->log.capacity) {
+                context->log.log[context->log.count] = worker->log.log[i];
+            }
+            context->log.count++;
+        }
+        CONTEXT_free(context, worker->log.log);
+        worker->log.log = NULL;
+    }
+    if (worker->error.reason != No_Error && context->error.reason == No_Error) {
+        memcpy(&context->error, &worker->error, sizeof(ErrorInfo));
+    }
+}
+
 Context * Context_create(void)
 {
     Context * c = (Context *)malloc(sizeof(Context));
@@ -151,6 +190,7 @@ void Context_terminate(Context * context)
             context->heap._context_terminate(context);
         }
         CONTEXT_free(context, context->log.log);
+        CONTEXT_free(context, context->wide.word_to_float);
     }
 }
 void Context_destroy(Context * context)
@@ -214,6 +254,22 @@ ProfilingLog * Context_get_profiler_log(Context * context)
     return &context->log;
 }
 
+SimdLevel Context_simd_level_supported(Context * context)
+{
+    return context->simd.supported;
+}
+
+SimdLevel Context_simd_level(Context * context)
+{
+    return context->simd.active;
+}
+
+SimdLevel Context_set_simd_level(Context * context, SimdLevel level)
+{
+    context->simd.active = level <= context->simd.supported ? level : context->simd.supported;
+    return context->simd.active;
+}
+
 
 /* Aligned allocations
 
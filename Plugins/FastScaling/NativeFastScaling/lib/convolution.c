@@ -10,8 +10,10 @@
 #endif
 
 #include "fastscaling_private.h"
+#include "simd.h"
 
 #include <string.h>
+#include <float.h>
 
 #ifndef _MSC_VER
 #include <alloca.h>
@@ -93,6 +95,12 @@ ConvolutionKernel * ConvolutionKernel_create_guassian_normalized(Context * conte
     ConvolutionKernel *kernel = ConvolutionKernel_create_guassian(context, stdDev, radius);
     if (kernel != NULL) {
         ConvolutionKernel_normalize(kernel, 1);
+        kernel->sigma = (float)stdDev;
+        if (!RecursiveGaussian_init(context, &kernel->recursive, kernel->sigma)) {
+            CONTEXT_add_to_callstack (context);
+            ConvolutionKernel_destroy(context, kernel);
+            return NULL;
+        }
     }
     return kernel;
 }
@@ -110,21 +118,108 @@ ConvolutionKernel * ConvolutionKernel_create_guassian_sharpen(Context * context,
             }
         }
         ConvolutionKernel_normalize(kernel, 1);
+        kernel->sigma = (float)stdDev;
+        kernel->sharpen_amount = 1;
+        if (!RecursiveGaussian_init(context, &kernel->recursive, kernel->sigma)) {
+            CONTEXT_add_to_callstack (context);
+            ConvolutionKernel_destroy(context, kernel);
+            return NULL;
+        }
     }
     return kernel;
 }
 
+ConvolutionKernel * ConvolutionKernel_create_unsharp_mask(Context * context, double stdDev, uint32_t radius, double amount, float threshold)
+{
+    ConvolutionKernel *kernel = ConvolutionKernel_create_guassian_sharpen(context, stdDev, radius);
+    if (kernel != NULL) {
+        //(1 + a)^2 = 1 + amount, for the highest frequencies, once both passes have run
+        const float per_axis = (float)(sqrt(1 + amount) - 1);
+        //Blend the sharpen kernel (amount 1) toward the identity
+        for (uint32_t i = 0; i < kernel->width; i++) {
+            kernel->kernel[i] = per_axis * kernel->kernel[i] + (i == radius ? 1 - per_axis : 0);
+        }
+        kernel->sharpen_amount = per_axis;
+        kernel->threshold_min_change = threshold;
+        kernel->threshold_max_change = threshold > 0 ? FLT_MAX : 0;
+    }
+    return kernel;
+}
+
+ConvolutionMethod ConvolutionKernel_select_method(const ConvolutionKernel * kernel)
+{
+    //The recursive filter's coefficients are only fit for sigma >= 0.5
+    if (kernel->sigma < 0.5f) return Convolution_direct;
+    if (kernel->method != Convolution_auto) return kernel->method;
+    return kernel->radius >= CONVOLUTION_RECURSIVE_MIN_RADIUS ? Convolution_recursive : Convolution_direct;
+}
+
+#ifdef FASTSCALING_X86
+
+//One window, with a pixel's 3 or 4 channels in each vector. Every tap but the last may read a 4th float for 3-channel pixels.
+SIMD_TARGET_SSE2
+static void convolve_pixel_sse2(const float * src, const float * kern, uint32_t width, uint32_t step, float * avg)
+{
+    //Two sums, so consecutive taps don't wait on each other's additions
+    __m128 even = _mm_setzero_ps();
+    __m128 odd = _mm_setzero_ps();
+    uint32_t t = 0;
+    for (; t + 2 < width; t += 2) {
+        even = _mm_add_ps(even, _mm_mul_ps(_mm_set1_ps(kern[t]), _mm_loadu_ps(src + t * step)));
+        odd = _mm_add_ps(odd, _mm_mul_ps(_mm_set1_ps(kern[t + 1]), _mm_loadu_ps(src + (t + 1) * step)));
+    }
+    for (; t + 1 < width; t++) {
+        even = _mm_add_ps(even, _mm_mul_ps(_mm_set1_ps(kern[t]), _mm_loadu_ps(src + t * step)));
+    }
+    const __m128 last = step == 4 ? _mm_loadu_ps(src + t * 4) : load3_ps(src + t * 3);
+    const __m128 sum = _mm_add_ps(_mm_add_ps(even, _mm_mul_ps(_mm_set1_ps(kern[t]), last)), odd);
+    if (step == 4) {
+        _mm_storeu_ps(avg, sum);
+    } else {
+        store3_ps(avg, sum);
+    }
+}
+
+//One gray window, 4 taps per vector
+SIMD_TARGET_SSE2
+static float convolve_gray_sse2(const float * src, const float * kern, uint32_t width)
+{
+    __m128 sum = _mm_setzero_ps();
+    uint32_t t = 0;
+    for (; t + 4 <= width; t += 4) {
+        sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(kern + t), _mm_loadu_ps(src + t)));
+    }
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    float avg = _mm_cvtss_f32(_mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1)));
+    for (; t < width; t++) {
+        avg += kern[t] * src[t];
+    }
+    return avg;
+}
+
+#endif
 
-bool BitmapFloat_convolve_rows(Context * context, BitmapFloat * buf,  ConvolutionKernel *kernel, uint32_t convolve_channels, uint32_t from_row, int row_count)
+bool BitmapFloat_convolve_rows(Context * context, BitmapFloat * buf,  ConvolutionKernel *kernel, uint32_t convolve_channels, uint32_t from_row, int row_count,
+                               float * blur_scratch)
 {
 
     const uint32_t radius = kernel->radius;
-    const float threshold_min = kernel->threshold_min_change;
-    const float threshold_max = kernel->threshold_max_change;
 
     //Do nothing unless the image is at least half as wide as the kernel.
     if (buf->w < radius + 1) return true;
 
+    const ConvolutionMethod method = ConvolutionKernel_select_method(kernel);
+    if (method != Convolution_direct) {
+        if (!BitmapFloat_blur_rows(context, buf, kernel, method, convolve_channels, from_row, row_count < 0 ? buf->h - from_row : (uint32_t)row_count,
+                                   blur_scratch)) {
+            CONTEXT_add_to_callstack(context);
+            return false;
+        }
+        return true;
+    }
+    const float threshold_min = kernel->threshold_min_change;
+    const float threshold_max = kernel->threshold_max_change;
+
     const uint32_t buffer_count = radius + 1;
     const uint32_t w = buf->w;
     const int32_t int_w = (int32_t)buf->w;
@@ -141,9 +236,14 @@ bool BitmapFloat_convolve_rows(Context * context, BitmapFloat * buf,  Convolutio
 
     const int  wrap_mode = 0;
 
+#ifdef FASTSCALING_X86
+    //Windows that lie within the row are summed a pixel per vector
+    const bool vectorized = context->simd.active >= Simd_sse41 && ch_used == step && (step == 1 || step == 3 || step == 4);
+#endif
+
     for (uint32_t row = from_row; row < until_row; row++) {
 
-        float* __restrict source_buffer = &buf->pixels[row * buf->float_stride];
+        float* __restrict source_buffer = &buf->pixels[(size_t)row * buf->float_stride];
         int circular_idx = 0;
 
         for (uint32_t ndx = 0; ndx < w + buffer_count; ndx++) {
@@ -165,7 +265,7 @@ bool BitmapFloat_convolve_rows(Context * context, BitmapFloat * buf,  Convolutio
                         float total_weight = 0;
                         /* Accumulate each channel */
                         for (i = left; i <= right; i++) {
-                            if (i > 0 && i < int_w){
+                            if (i >= 0 && i < int_w){
                                 const float weight = kern[i - left];
                                 total_weight += weight;
                                 for (uint32_t j = 0; j < ch_used; j++)
@@ -185,7 +285,16 @@ bool BitmapFloat_convolve_rows(Context * context, BitmapFloat * buf,  Convolutio
                                 avg[j] += weight * source_buffer[ix * step + j];
                         }
                     }
-                } else {
+                }
+#ifdef FASTSCALING_X86
+                else if (vectorized && step == 1) {
+                    avg[0] = convolve_gray_sse2(&source_buffer[left], kern, kernel->width);
+                }
+                else if (vectorized) {
+                    convolve_pixel_sse2(&source_buffer[left * step], kern, kernel->width, step, avg);
+                }
+#endif
+                else {
                     /* Accumulate each channel */
                     for (i = left; i <= right; i++) {
                         const float weight = kern[i - left];
@@ -207,7 +316,7 @@ bool BitmapFloat_convolve_rows(Context * context, BitmapFloat * buf,  Convolutio
                     }
                 }
             }
-            circular_idx = (circular_idx + 1) % buffer_count;
+            if (++circular_idx == (int)buffer_count) circular_idx = 0;
 
         }
     }
@@ -233,7 +342,7 @@ static void BgraSharpenInPlaceX(BitmapBgra * im, float pct)
 
     for (y = 0; y < sy; y++)
     {
-        unsigned char *row = im->pixels + y * stride;
+        unsigned char *row = im->pixels + (size_t)y * stride;
         for (current = bytes_pp, prev = 0, next = bytes_pp + bytes_pp; next < stride; prev = current, current = next, next += bytes_pp){
             //We never sharpen the alpha channel
             //TODO - we need to buffer the left pixel to prevent it from affecting later calculations
@@ -277,6 +386,16 @@ SharpenBgraFloatInPlace(float* buf, unsigned int count, double pct,
             left_a = a;
         }
     }
+    // gray
+    else if (step == 1) {
+        float left = buf[0];
+
+        for (ndx = 1; ndx < count - 1; ndx++) {
+            const float v = buf[ndx];
+            buf[ndx] = left * c_o + v * c_i + buf[ndx + 1] * c_o;
+            left = v;
+        }
+    }
     // otherwise do the same thing without 4th chan
     // (ifs in loops are expensive..)
     else {
@@ -311,7 +430,7 @@ bool BitmapFloat_sharpen_rows(Context * context, BitmapFloat * im, uint32_t star
         return false;        
     }
     for (uint32_t row = start_row; row < start_row + row_count; row++) {
-        SharpenBgraFloatInPlace(im->pixels + (im->float_stride * row), im->w, pct, im->channels);
+        SharpenBgraFloatInPlace(im->pixels + ((size_t)im->float_stride * row), im->w, pct, im->channels);
     }
     return true;
 }
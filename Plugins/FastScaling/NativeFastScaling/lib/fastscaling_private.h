@@ -12,6 +12,7 @@
 
 #include "fastscaling.h"
 #include "math_functions.h"
+#include <string.h>
 
 
 
@@ -32,7 +33,7 @@ typedef struct BitmapFloatStruct {
     //If true, don't dispose the buffer with the struct
     bool pixels_borrowed;
     //The number of floats in the buffer
-    uint32_t float_count;
+    size_t float_count;
     //The number of floats between (0,0) and (0,1)
     uint32_t float_stride;
 
@@ -90,8 +91,18 @@ typedef struct _SigmoidInfo {
 
 #endif
 
+//The float -> byte table is indexed by the exponent and top 10 mantissa bits of values in [2^-24, 1]
+#define FLOATSPACE_LUT_MIN_BITS 0x33800000u //2^-24
+#define FLOATSPACE_LUT_SHIFT 13
+#define FLOATSPACE_LUT_SIZE (((0x3F800000u - FLOATSPACE_LUT_MIN_BITS) >> FLOATSPACE_LUT_SHIFT) + 1)
+//Zeroed bytes after the table, so a 4-byte gather of any entry stays within it
+#define FLOATSPACE_LUT_PADDING 3
+
 typedef struct _ColorspaceInfo {
     float byte_to_float[256]; //Converts 0..255 -> 0..1, but knowing that 0.255 has sRGB gamma.
+    uint8_t float_to_byte[FLOATSPACE_LUT_SIZE + FLOATSPACE_LUT_PADDING]; //Inverse of byte_to_float. Unused for Floatspace_as_is
+    bool tables_valid; //Both tables match floatspace and params
+    float params[3]; //The a, b, c values passed to Context_set_floatspace
     WorkingFloatspace floatspace;
     bool apply_srgb;
     bool apply_gamma;
@@ -104,6 +115,32 @@ typedef struct _ColorspaceInfo {
 
 } ColorspaceInfo;
 
+//The largest channel value of GDI+'s 48 and 64 bpp formats (Bgr48Linear, Bgra64Linear)
+#define GDI_LINEAR_MAX 8192
+
+//Tables for formats wider than a byte, built on first use (Context_prepare_wide_tables) for the floatspace of the
+//moment. Kept out of ColorspaceInfo, which is copied by value, as they're much larger. One allocation holds all five.
+typedef struct _WideColorspaceInfo {
+    float * word_to_float; //65536 entries: 16-bit value -> floatspace
+    float * half_to_float; //65536 entries: half float bits -> floatspace, clamped to 0..1 first
+    float * half_to_unit; //65536 entries: half float bits -> 0..1, for alpha
+    float * float_to_unit; //FLOATSPACE_LUT_SIZE + 1 entries, indexed like float_to_byte and interpolated: floatspace -> 0..1
+    uint16_t * linear_to_word; //8193 entries: GDI+ 13-bit linear -> 16-bit sRGB. The same in any floatspace.
+    bool tables_valid;
+    WorkingFloatspace floatspace;
+    float params[3];
+} WideColorspaceInfo;
+
+
+
+/** Context: CPU dispatch **/
+
+typedef struct _SimdInfo {
+    SimdLevel supported; //Detected once, when the context is initialized
+    SimdLevel active; //What kernels dispatch on. May be forced lower than supported (for testing or benchmarking)
+} SimdInfo;
+
+SimdLevel Simd_detect_supported_level(void);
 
 
 /** Context: main structure **/
@@ -113,6 +150,8 @@ typedef struct ContextStruct {
     HeapManager heap;
     ProfilingLog log;
     ColorspaceInfo colorspace;
+    WideColorspaceInfo wide;
+    SimdInfo simd;
 } Context;
 
 
@@ -122,6 +161,15 @@ typedef struct ContextStruct {
 void Context_initialize(Context * context);
 void Context_terminate(Context * context);
 
+//Prepares a copy of the context for a worker thread. It shares the heap manager and colorspace tables, but has its own
+//error state and (if profiling is enabled) its own log of up to log_capacity entries.
+bool Context_initialize_worker(Context * context, Context * worker, uint32_t log_capacity);
+//Appends the worker's log to the context's, takes the worker's error if the context doesn't already have one, and frees the worker log.
+void Context_terminate_worker(Context * context, Context * worker);
+//Builds context->wide for the current floatspace, unless it's already built. Workers share the tables, so they're
+//prepared before bands start.
+bool Context_prepare_wide_tables(Context * context);
+
 
 void * Context_calloc(Context * context, size_t, size_t, const char * file, int line);
 void * Context_malloc(Context * context, size_t, const char * file, int line);
@@ -167,8 +215,107 @@ BitmapFloat * BitmapFloat_create(Context * context, int sx, int sy, int channels
 
 void BitmapFloat_destroy(Context * context, BitmapFloat * im);
 
+//Mirrors a single row horizontally
+void BitmapFloat_reverse_row(BitmapFloat * img, const uint32_t row);
+
+//Each output pixel takes exactly one input pixel. Used in place of scaling along an axis that isn't resized.
+LineContributions * LineContributions_create_identity(Context * context, const uint32_t line_size);
+
+//As LineContributions_create_range, for an input line that maps onto output_span output pixels rather than exactly onto
+//the output line. Windows of output pixels past the span are clamped to the input's edge.
+LineContributions * LineContributions_create_span(Context * context, const double output_span, const uint32_t input_line_size,
+                                                  const InterpolationDetails * details, const uint32_t from, const uint32_t count);
+
+//The weight output_pixel gives input_pixel; 0 outside its window
+float LineContributions_weight(const LineContributions * p, uint32_t output_pixel, uint32_t input_pixel);
+
+//LineContributions laid out for vectorized scaling. Every window has the same number of taps - the widest window rounded up
+//to a multiple of tap_multiple, but no more than the input line - with zeros filling each window out. Windows near the end
+//of the line start early instead of running past it, so all Taps input pixels from Left[u] can always be read.
+typedef struct {
+    uint32_t LineLength;
+    uint32_t Taps;
+    //Pixel-major: output u's weights are Weights[u * Taps + t]. Tap-major: tap t of every output pixel is
+    //Weights[t * OutputStride + u], so adjacent output pixels can share a vector. OutputStride is LineLength rounded up to 8.
+    bool TapMajor;
+    uint32_t OutputStride;
+    int * Left; //OutputStride entries
+    float * Weights; //32-byte aligned
+    void * allocation;
+    double percent_negative;
+} PaddedContributions;
+
+PaddedContributions * PaddedContributions_create(Context * context, const LineContributions * from, uint32_t input_line_size, uint32_t tap_multiple, bool tap_major);
+void PaddedContributions_destroy(Context * context, PaddedContributions * p);
+//Same as LineContributions_weight, for either layout
+float PaddedContributions_weight(const PaddedContributions * p, uint32_t output_pixel, uint32_t input_pixel);
+
+#define FIXED_WEIGHT_BITS 14
+
+//Pixel-major padded contributions quantized to signed fixed point; every window's weights sum to exactly 1 << FIXED_WEIGHT_BITS
+typedef struct {
+    uint32_t LineLength;
+    uint32_t Taps;
+    int * Left;
+    int16_t * Weights; //Weights[u * Taps + t]
+} FixedContributions;
+
+FixedContributions * FixedContributions_create(Context * context, const PaddedContributions * from);
+void FixedContributions_destroy(Context * context, FixedContributions * p);
+
 bool BitmapFloat_scale_rows(Context * context, BitmapFloat * from, uint32_t from_row, BitmapFloat * to, uint32_t to_row, uint32_t row_count, PixelContributions * weights);
-bool BitmapFloat_convolve_rows(Context * context, BitmapFloat * buf, ConvolutionKernel *kernel,  uint32_t convolve_channels, uint32_t from_row, int row_count);
+
+//Scales a single row of interleaved floats; source_w is the number of pixels in the source row.
+typedef void (*scale_row_function)(const float * __restrict source, uint32_t source_w, float * __restrict dest, uint32_t dest_w, const PixelContributions * weights);
+
+//Returns a vectorized row scaler for the given instruction set and channel count, or NULL if the scalar code should be used.
+scale_row_function ScaleRow_select(SimdLevel level, uint32_t channels);
+
+//Scales rows with padded contributions. Any channel count and layout works; some have vectorized kernels.
+bool BitmapFloat_scale_rows_padded(Context * context, BitmapFloat * from, uint32_t from_row, BitmapFloat * to, uint32_t to_row, uint32_t row_count, const PaddedContributions * weights);
+
+//Scales 8-bit rows of src straight into rows (or, transposed, columns) of dst, in integer arithmetic. The formats must
+//match; with 4 bytes per pixel, alpha isn't scaled but set to 255. Only correct for Floatspace_as_is and opaque images.
+bool BitmapBgra_scale_rows_fixed(Context * context, const BitmapBgra * src, uint32_t from_row, uint32_t row_count, BitmapBgra * dst, bool transpose, const FixedContributions * weights);
+
+//Scratch space for BitmapBgra_scale_rows_decoding: a strip of decoded pixels, and the windows that fit in it
+typedef struct {
+    float * pixels; //size 4-channel pixels
+    int * left; //size entries
+    uint32_t size;
+} DecodingStrip;
+
+//Sized for weights' windows, so a strip holds at least 4 of them
+DecodingStrip * DecodingStrip_create(Context * context, const PaddedContributions * weights);
+void DecodingStrip_destroy(Context * context, DecodingStrip * strip);
+
+//Scales 8-bit rows of src into float rows of to, decoding and premultiplying each tap as it is read, instead of decoding
+//whole rows into a buffer first. Same result as BitmapBgra_convert_srgb_to_linear then BitmapFloat_scale_rows_padded.
+//weights must be pixel-major; strip must have been created for them.
+bool BitmapBgra_scale_rows_decoding(Context * context, const BitmapBgra * src, uint32_t from_row, BitmapFloat * to, uint32_t to_row,
+                                    uint32_t row_count, const PaddedContributions * weights, DecodingStrip * strip);
+
+typedef void (*scale_padded_row_function)(const float * __restrict source, uint32_t source_w, float * __restrict dest, const PaddedContributions * weights);
+
+//A vectorized padded row scaler, or NULL if there isn't one for this combination
+scale_padded_row_function ScalePaddedRow_select(SimdLevel level, uint32_t channels, bool tap_major);
+//blur_scratch is as for BitmapFloat_blur_rows
+bool BitmapFloat_convolve_rows(Context * context, BitmapFloat * buf, ConvolutionKernel *kernel,  uint32_t convolve_channels, uint32_t from_row, int row_count,
+                               float * blur_scratch);
+
+//Which method BitmapFloat_convolve_rows will use for the kernel
+ConvolutionMethod ConvolutionKernel_select_method(const ConvolutionKernel * kernel);
+//Fills in g for sigma
+bool RecursiveGaussian_init(Context * context, RecursiveGaussian * g, double sigma);
+
+//Two rows of pixels in 8-float lanes
+#define BLUR_SCRATCH_FLOATS_PER_PIXEL 16
+
+//Applies a Gaussian (or Gaussian sharpening) kernel by its sigma with the recursive or box method, at a cost per pixel
+//that doesn't depend on sigma. Pixels past the ends of rows repeat the edge pixels. scratch holds
+//BLUR_SCRATCH_FLOATS_PER_PIXEL floats per pixel of a row, or is NULL, and is then allocated for the call.
+bool BitmapFloat_blur_rows(Context * context, BitmapFloat * buf, const ConvolutionKernel * kernel, ConvolutionMethod method,
+                           uint32_t convolve_channels, uint32_t from_row, uint32_t row_count, float * scratch);
 
 bool BitmapFloat_sharpen_rows(Context * context, BitmapFloat * im, uint32_t start_row, uint32_t row_count, double pct);
 
@@ -180,15 +327,29 @@ bool BitmapBgra_convert_srgb_to_linear(Context * context,
                                        uint32_t dest_row,
                                        uint32_t row_count);
 
+//Unpacks count pixels of row y of b, from column x, to BitmapPixelFormat_unpacked(b->fmt) in dest. b must be in a GDI+
+//layout (and Indexed8 have a palette). 13-bit linear ones need the wide tables (Context_prepare_wide_tables), and come
+//out with straight alpha.
+bool BitmapBgra_unpack_pixels(Context * context, const BitmapBgra * b, uint32_t x, uint32_t y, uint32_t count, uint8_t * dest);
+//BitmapBgra_convert_srgb_to_linear for GDI+ layouts: pixels are unpacked a chunk at a time, into a buffer on the stack
+bool BitmapBgra_unpack_srgb_to_linear(Context * context, const BitmapBgra * src, uint32_t from_row, BitmapFloat * dest,
+                                      uint32_t dest_row, uint32_t row_count);
+
+//transform, if not NULL, is applied to each pixel first, as BitmapFloat_apply_color_matrix would apply its matrix
 bool BitmapFloat_pivoting_composite_linear_over_srgb(Context * context,
         BitmapFloat * src,
         uint32_t from_row,
         BitmapBgra * dest,
         uint32_t dest_row,
         uint32_t row_count,
-        bool transpose);
+        bool transpose,
+        const ChannelTransform * transform);
+
+//Maps b, g and r of rows (or columns) from..from + count through luts
+void BitmapBgra_apply_channel_luts(BitmapBgra * b, uint32_t from, uint32_t count, bool columns, const ChannelLuts * luts);
 
 bool BitmapBgra_flip_vertical(Context * context, BitmapBgra * b);
+bool BitmapBgra_is_opaque(Context * context, const BitmapBgra * b);
 
 bool BitmapFloat_demultiply_alpha(
     Context * context,
@@ -207,10 +368,176 @@ bool BitmapFloat_copy_linear_over_srgb(
     const uint32_t col_count,
     const bool transpose);
 
-bool Halve(Context * context, const BitmapBgra * from, BitmapBgra * to, int divisor);
+/** Streaming: a vertical pass over a ring buffer of horizontally scaled rows **/
+
+typedef struct StreamingScalerStruct {
+    LineContributions * contrib_x; //NULL when the width is unchanged
+    LineContributions * contrib_y;
+    int * min_left_y; //min_left_y[n] is the lowest source row any output row >= n still needs
+    BitmapFloat * source_row; //The decoded source row, before horizontal scaling. NULL when the width is unchanged
+    BitmapFloat * ring; //Horizontally scaled rows. Source row n is stored at row (n % ring->h)
+    uint32_t source_w;
+    uint32_t source_h;
+    uint32_t output_w;
+    uint32_t output_h;
+    uint32_t rows_pushed;
+    uint32_t rows_pulled;
+} StreamingScaler;
+
+//interpolation may be NULL if neither dimension changes. span_x and span_y are as RenderDetails_source_span returns them.
+StreamingScaler * StreamingScaler_create(Context * context, const InterpolationDetails * interpolation, uint32_t source_w, uint32_t source_h, uint32_t channels,
+                                         uint32_t output_w, uint32_t output_h, double span_x, double span_y);
+//Takes ownership of the contributions, even on failure. contrib_x may be NULL when the width is unchanged.
+StreamingScaler * StreamingScaler_create_from_contributions(Context * context, LineContributions * contrib_x, LineContributions * contrib_y, uint32_t source_w, uint32_t source_h, uint32_t channels);
+void StreamingScaler_destroy(Context * context, StreamingScaler * s);
+//Decodes and horizontally scales source row 'rows_pushed' (read from source->pixels row 'row'). Fails if that would evict a row still needed - pull first.
+bool StreamingScaler_push_row(Context * context, StreamingScaler * s, BitmapBgra * source, uint32_t row);
+//True when the next output row's contribution window has been pushed
+bool StreamingScaler_output_ready(const StreamingScaler * s);
+//True when the next push_row call would not overwrite a row still needed by an output row
+bool StreamingScaler_can_push(const StreamingScaler * s);
+//Writes the next output row (premultiplied, in the working floatspace) to dest row dest_row
+bool StreamingScaler_pull_row(Context * context, StreamingScaler * s, BitmapFloat * dest, uint32_t dest_row);
+
+struct StreamingRendererStruct {
+    RenderDetails * details;
+    StreamingScaler * scaler;
+    BitmapFloat * queue; //Finished output rows waiting to be pulled. A ring, like the scaler's
+    uint32_t queue_start;
+    uint32_t queue_count;
+    BitmapPixelFormat source_format;
+    bool source_alpha_meaningful;
+    bool color_matrix_per_channel; //Then channel_transform replaces the color matrix
+    ChannelTransform channel_transform;
+    ColorLutStage * color_lut; //details->color_lut, when set
+};
+
+//Takes ownership of the scaler, even on failure. Doesn't validate details.
+StreamingRenderer * StreamingRenderer_create_from_scaler(Context * context, RenderDetails * details, StreamingScaler * scaler, BitmapPixelFormat source_format, bool source_alpha_meaningful);
+
+/** Tiling: rendering rectangles of the canvas from the source windows they depend on **/
+
+struct TiledRendererStruct {
+    RenderDetails * details;
+    uint32_t source_w;
+    uint32_t source_h;
+    uint32_t canvas_w;
+    uint32_t canvas_h;
+    BitmapPixelFormat source_format;
+    bool source_alpha_meaningful;
+};
+
+//Renders details' region of interest into canvas, which is sized to it
+bool RenderDetails_render_roi(Context * context, RenderDetails * details, BitmapBgra * source, BitmapBgra * canvas);
+
+/** Rendering **/
+
+typedef struct RenderPassStruct {
+    LineContributions * contrib; //NULL when the pass doesn't scale
+    bool destroy_contrib;
+    PaddedContributions * padded; //contrib in the padded layout, when there is a vectorized kernel for it
+    FixedContributions * fixed; //Set when the pass scales bytes in fixed point, instead of through floats
+    struct RenderBandStruct * bands;
+    uint32_t band_count;
+    uint32_t halving_divisor; //What the bands have room to halve by; 1 when they don't halve
+    bool color_matrix_per_channel; //Then channel_transform is applied as the pass encodes, instead of the color matrix
+    ChannelTransform channel_transform;
+    ChannelLuts * channel_luts; //channel_transform for the integer pipeline
+    ColorLutStage * color_lut; //details->color_lut, for the final pass
+} RenderPass;
+
+struct RendererStruct {
+    RenderDetails * details;
+    bool destroy_details;
+    BitmapBgra * source;
+    bool destroy_source;
+    BitmapBgra * canvas;
+    BitmapBgra * transposed;
+    //Prepared by a RenderPlan, and used instead of allocating them. NULL otherwise.
+    RenderPass * passes[2];
+    BitmapBgra * halving_buffer;
+    RenderPass * halving_pass; //Halves the source into halving_buffer
+    //What the source will be halved by, picked from details by Renderer_create; 0 once halved. details is left as it was.
+    uint32_t halving_divisor;
+    //Set when halving was deferred to the first pass, which then reads the full-size source
+    uint32_t fused_halving_divisor;
+    //Set when the source's alpha is meaningful but all 0xff. The float passes still scale 4 channels, but with alpha
+    //taken as 1, skipping premultiplying, demultiplying, and matting or composing the output.
+    bool opaque_alpha;
+};
+
+Renderer * Renderer_create(Context * context, BitmapBgra * source, BitmapBgra * canvas, RenderDetails * details);
+Renderer * Renderer_create_in_place(Context * context, BitmapBgra * editInPlace, RenderDetails * details);
+void Renderer_destroy(Context * context, Renderer * r);
+bool Renderer_perform_render(Context * context, Renderer * r);
+
+//Whether a render from source to canvas that halves would halve within its first pass (see enable_fused_halving)
+bool Renderer_can_fuse_halving(Context * context, const RenderDetails * details, const BitmapBgra * source, const BitmapBgra * canvas);
+
+//The format rows are scaled in, as floats with that many channels: Bgra32 without meaningful alpha is scaled as Bgr24,
+//and Gray8 is widened to Bgr24 on the final pass when the color matrix or color LUT are applied there
+BitmapPixelFormat RenderDetails_scaling_format(const RenderDetails * details, BitmapPixelFormat source_format, bool alpha_meaningful, bool final_pass);
+
+//How many output pixels the source's width (or height) maps onto: source_span_x (or _y), or output_size when that's 0
+double RenderDetails_source_span(const RenderDetails * details, bool height, uint32_t output_size);
+
+//Whether a pass scaled with contrib (NULL when it isn't scaled) sharpens its rows afterwards, because the weights fall short of
+//sharpen_percent_goal. Streamed rows have no columns to sharpen, so renderers that stream reject details that need it.
+bool RenderDetails_sharpens_rows(const RenderDetails * details, const LineContributions * contrib);
+
+//The halving divisor Renderer_create would pick when details->halving_divisor is 0
+int RenderDetails_determine_divisor(const RenderDetails * details, uint32_t source_w, uint32_t source_h, uint32_t canvas_w, uint32_t canvas_h);
+
+//Prepares the contributions, bands and buffers for one pass from pSrc to pDst, which are only used for their size and format.
+//contrib is borrowed; if NULL (and the pass scales) it is created. With private_kernels, kernel scratch space isn't shared
+//with details, so passes made from the same details can run concurrently. halving_divisor is what RenderPass_run will be given.
+RenderPass * RenderPass_create(Context * context, const RenderDetails * details, const BitmapBgra * pSrc, const BitmapBgra * pDst,
+                               bool transpose, int call_number, LineContributions * contrib, bool private_kernels, uint32_t halving_divisor);
+//With a halving_divisor above 1, pSrc is the unhalved source, read through BitmapBgra_halve_srgb_to_linear; flip_source
+//reads its halved rows bottom-up. Not available to integer passes, and only with the divisor the pass was created for.
+//With opaque_alpha, pSrc's alpha is taken as 1 (see RendererStruct.opaque_alpha).
+bool RenderPass_run(Context * context, RenderPass * pass, BitmapBgra * pSrc, BitmapBgra * pDst, uint32_t halving_divisor, bool flip_source,
+                    bool opaque_alpha);
+//A pass that halves pSrc into pDst (again only used for their size and format) when run with halving_divisor
+RenderPass * RenderPass_create_halving(Context * context, const RenderDetails * details, const BitmapBgra * pSrc, const BitmapBgra * pDst,
+                                       uint32_t halving_divisor);
+void RenderPass_destroy(Context * context, RenderPass * pass);
+
+/** Threading **/
+
+#define FASTSCALING_MAX_THREADS 64
+
+typedef void (*parallel_work_function)(void * item);
+
+//Calls work on each of count items (item_size bytes apart) concurrently; the first runs on the calling thread.
+//Returns once all have completed. If a thread can't be started, its item runs on the calling thread afterwards.
+void Threads_run_parallel(parallel_work_function work, void * items, size_t item_size, uint32_t count);
+
+//Atomically sets *flag from 0 to 1. False if it was already set.
+bool Threads_try_acquire(volatile long * flag);
+void Threads_release(volatile long * flag);
+
+//Scratch space for halving rows of up to columns values: their sums, and with unpack, a row of unpacked GDI+ pixels
+typedef struct {
+    float * values;
+    uint8_t * unpacked;
+    uint32_t columns;
+} HalvingSums;
+
+HalvingSums * HalvingSums_create(Context * context, uint32_t columns, bool unpack);
+void HalvingSums_destroy(Context * context, HalvingSums * sums);
+
+//sums may be NULL, and are then allocated for the call. Otherwise they need room for to->w * divisor unpacked pixels.
+bool Halve(Context * context, const BitmapBgra * from, BitmapBgra * to, int divisor, HalvingSums * sums);
 
 bool HalveInPlace(Context * context, BitmapBgra * from, int divisor);
 
+//Averages divisor x divisor blocks of src into row_count floatspace rows of dest, as BitmapBgra_convert_srgb_to_linear
+//would for a halved copy of src, but without quantizing to bytes in between. from_row counts halved rows; with flip,
+//they are counted from the bottom. sums are as for Halve.
+bool BitmapBgra_halve_srgb_to_linear(Context * context, const BitmapBgra * src, uint32_t divisor, uint32_t from_row, bool flip,
+                                     BitmapFloat * dest, uint32_t dest_row, uint32_t row_count, HalvingSums * sums);
+
 
 
 #ifndef _TIMERS_IMPLEMENTED
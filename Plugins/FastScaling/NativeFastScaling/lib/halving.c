@@ -0,0 +1,482 @@
+/*
+ * Copyright (c) Imazen LLC.
+ * No part of this project, including this file, may be copied, modified,
+ * propagated, or distributed except as permitted in COPYRIGHT.txt.
+ * Licensed under the GNU Affero General Public License, Version 3.0.
+ * Commercial licenses available at http://imageresizing.net/
+ */
+#ifdef _MSC_VER
+#pragma unmanaged
+#endif
+
+#include "fastscaling_private.h"
+#include "simd.h"
+
+/*
+ * Halving averages each divisor x divisor block of pixels into one. Each output row is made in two steps: the divisor
+ * source rows are added up column by column, then every divisor adjacent columns are added up and divided.
+ *
+ * With Floatspace_as_is, the sums are of the bytes themselves (in uint16, which holds 16 x 16 x 255), and the average
+ * is truncated. Otherwise the sums are of floatspace values, and the average is encoded with the floatspace table.
+ * Vectorized and scalar versions of each step add in the same order, so they produce identical output.
+ */
+
+//Sums are padded, so 3-channel pixels can be loaded 4 values at a time
+#define HALVING_SUM_PADDING 8
+
+static void sum_row_bytes(const uint8_t * row, uint16_t * sums, const uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++) {
+        sums[i] = (uint16_t)(sums[i] + row[i]);
+    }
+}
+
+static void sum_row_floats(Context * context, const uint8_t * row, float * sums, const uint32_t count)
+{
+    const float * lut = context->colorspace.byte_to_float;
+    for (uint32_t i = 0; i < count; i++) {
+        sums[i] += lut[row[i]];
+    }
+}
+
+static void reduce_bytes(const uint16_t * sums, uint8_t * dest, const uint32_t to_w, const uint32_t bpp, const uint32_t divisor)
+{
+    const uint32_t block = divisor * divisor;
+    for (uint32_t x = 0; x < to_w; x++) {
+        for (uint32_t ch = 0; ch < bpp; ch++) {
+            uint32_t sum = 0;
+            for (uint32_t k = 0; k < divisor; k++) {
+                sum += sums[(x * divisor + k) * bpp + ch];
+            }
+            dest[x * bpp + ch] = (uint8_t)(sum / block);
+        }
+    }
+}
+
+static void reduce_floats(Context * context, const float * sums, uint8_t * dest, const uint32_t to_w, const uint32_t bpp, const uint32_t divisor)
+{
+    const float block = (float)(divisor * divisor);
+    for (uint32_t x = 0; x < to_w; x++) {
+        for (uint32_t ch = 0; ch < bpp; ch++) {
+            float sum = 0;
+            for (uint32_t k = 0; k < divisor; k++) {
+                sum += sums[(x * divisor + k) * bpp + ch];
+            }
+            dest[x * bpp + ch] = Context_floatspace_to_srgb(context, sum / block);
+        }
+    }
+}
+
+#ifdef FASTSCALING_X86
+
+SIMD_TARGET_SSE2
+static void sum_row_bytes_sse2(const uint8_t * row, uint16_t * sums, const uint32_t count)
+{
+    const __m128i zero = _mm_setzero_si128();
+    uint32_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        const __m128i bytes = _mm_loadu_si128((const __m128i *)(row + i));
+        __m128i * lo = (__m128i *)(sums + i);
+        __m128i * hi = (__m128i *)(sums + i + 8);
+        _mm_storeu_si128(lo, _mm_add_epi16(_mm_loadu_si128(lo), _mm_unpacklo_epi8(bytes, zero)));
+        _mm_storeu_si128(hi, _mm_add_epi16(_mm_loadu_si128(hi), _mm_unpackhi_epi8(bytes, zero)));
+    }
+    sum_row_bytes(row + i, sums + i, count - i);
+}
+
+//Eight table lookups per gather
+SIMD_TARGET_AVX2
+static void sum_row_floats_avx2(Context * context, const uint8_t * row, float * sums, const uint32_t count)
+{
+    const float * lut = context->colorspace.byte_to_float;
+    uint32_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const __m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(row + i)));
+        _mm256_storeu_ps(sums + i, _mm256_add_ps(_mm256_loadu_ps(sums + i), _mm256_i32gather_ps(lut, index, 4)));
+    }
+    sum_row_floats(context, row + i, sums + i, count - i);
+}
+
+//Divides the four sums by block, truncating. Adding half before scaling by the reciprocal keeps every quotient exact
+//for sums below 2^16.
+SIMD_TARGET_SSE2
+static inline uint32_t divide_sums_sse2(__m128i sums32, const __m128 reciprocal)
+{
+    const __m128 quotient = _mm_mul_ps(_mm_add_ps(_mm_cvtepi32_ps(sums32), _mm_set1_ps(0.5f)), reciprocal);
+    const __m128i words = _mm_packs_epi32(_mm_cvttps_epi32(quotient), _mm_setzero_si128());
+    return (uint32_t)_mm_cvtsi128_si32(_mm_packus_epi16(words, words));
+}
+
+static inline void write_halved_pixel(uint8_t * dest, const uint32_t bpp, const uint32_t packed)
+{
+    if (bpp == 4) {
+        memcpy(dest, &packed, 4);
+    } else {
+        dest[0] = (uint8_t)packed;
+        dest[1] = (uint8_t)(packed >> 8);
+        dest[2] = (uint8_t)(packed >> 16);
+    }
+}
+
+//divisor and bpp are constants wherever this is inlined
+SIMD_TARGET_SSE2
+static inline void reduce_bytes_sse2(const uint16_t * sums, uint8_t * dest, const uint32_t to_w, const uint32_t bpp, const uint32_t divisor)
+{
+    const __m128 reciprocal = _mm_set1_ps(1.0f / (float)(divisor * divisor));
+    const __m128i zero = _mm_setzero_si128();
+    for (uint32_t x = 0; x < to_w; x++) {
+        const uint16_t * s = sums + x * divisor * bpp;
+        __m128i sum = _mm_loadl_epi64((const __m128i *)s);
+        for (uint32_t k = 1; k < divisor; k++) {
+            sum = _mm_add_epi16(sum, _mm_loadl_epi64((const __m128i *)(s + k * bpp)));
+        }
+        write_halved_pixel(dest + x * bpp, bpp, divide_sums_sse2(_mm_unpacklo_epi16(sum, zero), reciprocal));
+    }
+}
+
+SIMD_TARGET_SSE2
+static inline void reduce_floats_sse2(Context * context, const float * sums, uint8_t * dest, const uint32_t to_w, const uint32_t bpp, const uint32_t divisor)
+{
+    const uint8_t * lut = context->colorspace.float_to_byte;
+    const __m128 block = _mm_set1_ps((float)(divisor * divisor));
+    for (uint32_t x = 0; x < to_w; x++) {
+        const float * s = sums + x * divisor * bpp;
+        __m128 sum = _mm_loadu_ps(s);
+        for (uint32_t k = 1; k < divisor; k++) {
+            sum = _mm_add_ps(sum, _mm_loadu_ps(s + k * bpp));
+        }
+        const __m128i index = floatspace_lut_index_sse2(_mm_div_ps(sum, block));
+        const uint32_t packed = lut[_mm_cvtsi128_si32(index)] | ((uint32_t)lut[_mm_extract_epi16(index, 2)] << 8) |
+                                ((uint32_t)lut[_mm_extract_epi16(index, 4)] << 16) | ((uint32_t)lut[_mm_extract_epi16(index, 6)] << 24);
+        write_halved_pixel(dest + x * bpp, bpp, packed);
+    }
+}
+
+//Specialized for the common divisors, so the column loops unroll
+#define HALVING_DISPATCH(call, bpp, divisor) \
+    if (bpp == 4) { \
+        switch (divisor) { \
+        case 2: call(4, 2); break; \
+        case 3: call(4, 3); break; \
+        case 4: call(4, 4); break; \
+        default: call(4, divisor); break; \
+        } \
+    } else { \
+        switch (divisor) { \
+        case 2: call(3, 2); break; \
+        case 3: call(3, 3); break; \
+        case 4: call(3, 4); break; \
+        default: call(3, divisor); break; \
+        } \
+    }
+
+SIMD_TARGET_SSE2
+static void reduce_bytes_sse2_dispatch(const uint16_t * sums, uint8_t * dest, const uint32_t to_w, const uint32_t bpp, const uint32_t divisor)
+{
+#define REDUCE_BYTES(b, d) reduce_bytes_sse2(sums, dest, to_w, b, d)
+    HALVING_DISPATCH(REDUCE_BYTES, bpp, divisor)
+#undef REDUCE_BYTES
+}
+
+SIMD_TARGET_SSE2
+static void reduce_floats_sse2_dispatch(Context * context, const float * sums, uint8_t * dest, const uint32_t to_w, const uint32_t bpp, const uint32_t divisor)
+{
+#define REDUCE_FLOATS(b, d) reduce_floats_sse2(context, sums, dest, to_w, b, d)
+    HALVING_DISPATCH(REDUCE_FLOATS, bpp, divisor)
+#undef REDUCE_FLOATS
+}
+
+#undef HALVING_DISPATCH
+
+#endif
+
+HalvingSums * HalvingSums_create(Context * context, uint32_t columns, bool unpack)
+{
+    HalvingSums * sums = CONTEXT_calloc_array(context, 1, HalvingSums);
+    if (sums == NULL) {
+        CONTEXT_error(context, Out_of_memory);
+        return NULL;
+    }
+    sums->columns = columns;
+    //Floats are the widest sums
+    sums->values = (float *)CONTEXT_calloc(context, columns + HALVING_SUM_PADDING, sizeof(float));
+    sums->unpacked = unpack ? (uint8_t *)CONTEXT_malloc(context, columns) : NULL;
+    if (sums->values == NULL || (unpack && sums->unpacked == NULL)) {
+        HalvingSums_destroy(context, sums);
+        CONTEXT_error(context, Out_of_memory);
+        return NULL;
+    }
+    return sums;
+}
+
+void HalvingSums_destroy(Context * context, HalvingSums * sums)
+{
+    if (sums == NULL) return;
+    CONTEXT_free(context, sums->values);
+    CONTEXT_free(context, sums->unpacked);
+    CONTEXT_free(context, sums);
+}
+
+static bool Halve_rows(Context * context, const BitmapBgra * from, uint8_t * to_pixels, const uint32_t to_w, const uint32_t to_h, const size_t to_stride,
+                       const int divisor, HalvingSums * scratch)
+{
+    //GDI+ layouts are unpacked a row at a time, and halved as what they unpack to
+    const bool unpack = BitmapPixelFormat_unpacked(from->fmt) != from->fmt;
+    const uint32_t bpp = BitmapPixelFormat_bytes_per_pixel(BitmapPixelFormat_unpacked(from->fmt));
+    if (divisor < 1 || divisor > 16) {
+        CONTEXT_error(context, Invalid_argument);
+        return false;
+    }
+    if ((bpp != 1 && bpp != 3 && bpp != 4) || to_w * (uint32_t)divisor > from->w || to_h * (uint32_t)divisor > from->h) {
+        CONTEXT_error(context, Invalid_internal_state);
+        return false;
+    }
+    const bool linear = context->colorspace.floatspace != Floatspace_as_is;
+    const uint32_t columns = to_w * divisor * bpp;
+    const size_t sum_size = linear ? sizeof(float) : sizeof(uint16_t);
+    HalvingSums * owned = scratch == NULL ? HalvingSums_create(context, columns, unpack) : NULL;
+    if (scratch == NULL && owned == NULL) {
+        CONTEXT_add_to_callstack (context);
+        return false;
+    }
+    scratch = scratch == NULL ? owned : scratch;
+    if (scratch->columns < columns || (unpack && scratch->unpacked == NULL)) {
+        CONTEXT_error(context, Invalid_internal_state);
+        return false;
+    }
+    void * sums = scratch->values;
+    memset(sums, 0, (columns + HALVING_SUM_PADDING) * sum_size);
+    uint8_t * unpacked = scratch->unpacked;
+#ifdef FASTSCALING_X86
+    const bool sse = context->simd.active >= Simd_sse41;
+    const bool avx2 = context->simd.active >= Simd_avx2;
+    //Columns of gray are reduced one value at a time
+    const bool sse_reduce = sse && bpp >= 3;
+#endif
+
+    for (uint32_t y = 0; y < to_h; y++) {
+        memset(sums, 0, columns * sum_size);
+        for (int d = 0; d < divisor; d++) {
+            const uint8_t * row = from->pixels + (size_t)(y * divisor + d) * from->stride;
+            if (unpack) {
+                if (!BitmapBgra_unpack_pixels(context, from, 0, y * divisor + d, to_w * divisor, unpacked)) {
+                    HalvingSums_destroy(context, owned);
+                    CONTEXT_add_to_callstack (context);
+                    return false;
+                }
+                row = unpacked;
+            }
+#ifdef FASTSCALING_X86
+            if (linear && avx2) {
+                sum_row_floats_avx2(context, row, (float *)sums, columns);
+                continue;
+            }
+            if (!linear && sse) {
+                sum_row_bytes_sse2(row, (uint16_t *)sums, columns);
+                continue;
+            }
+#endif
+            if (linear) {
+                sum_row_floats(context, row, (float *)sums, columns);
+            } else {
+                sum_row_bytes(row, (uint16_t *)sums, columns);
+            }
+        }
+        uint8_t * dest = to_pixels + (size_t)y * to_stride;
+#ifdef FASTSCALING_X86
+        if (sse_reduce) {
+            if (linear) {
+                reduce_floats_sse2_dispatch(context, (const float *)sums, dest, to_w, bpp, divisor);
+            } else {
+                reduce_bytes_sse2_dispatch((const uint16_t *)sums, dest, to_w, bpp, divisor);
+            }
+            continue;
+        }
+#endif
+        if (linear) {
+            reduce_floats(context, (const float *)sums, dest, to_w, bpp, divisor);
+        } else {
+            reduce_bytes((const uint16_t *)sums, dest, to_w, bpp, divisor);
+        }
+    }
+    HalvingSums_destroy(context, owned);
+    return true;
+}
+
+bool Halve(Context * context, const BitmapBgra * from, BitmapBgra * to, int divisor, HalvingSums * sums)
+{
+    //Force the from and to formats to be the same, once unpacked
+    if (BitmapPixelFormat_unpacked(from->fmt) != to->fmt) {
+        CONTEXT_error(context, Invalid_internal_state);
+        return false;
+    }
+    if (!Halve_rows(context, from, to->pixels, to->w, to->h, to->stride, divisor, sums)) {
+        CONTEXT_add_to_callstack (context);
+        return false;
+    }
+    return true;
+}
+
+//Each output row is written no later in memory than the first source row it reads, and only after reading them all
+bool HalveInPlace(Context * context, BitmapBgra * from, int divisor)
+{
+    //Unpacked rows could be wider than the packed ones they'd be written over
+    if (divisor < 1 || divisor > 16 || BitmapPixelFormat_unpacked(from->fmt) != from->fmt) {
+        CONTEXT_error(context, Invalid_argument);
+        return false;
+    }
+    const uint32_t to_w = from->w / divisor;
+    const uint32_t to_h = from->h / divisor;
+    const uint32_t to_stride = to_w * BitmapPixelFormat_bytes_per_pixel (from->fmt);
+    bool r = Halve_rows(context, from, from->pixels, to_w, to_h, to_stride, divisor, NULL);
+    if (!r) {
+        CONTEXT_add_to_callstack (context);
+    }
+    from->w = to_w;
+    from->h = to_h;
+    from->stride = to_stride;
+    return r;
+}
+
+/*
+ * Fused halving: averages divisor x divisor blocks straight into the float rows the scaling passes read, instead of into
+ * an 8-bit image that is then decoded again. Colors are decoded before averaging, and with 4 channels the average is of
+ * premultiplied values, as the scaling weights are applied to.
+ */
+
+static void sum_row_premultiplied(Context * context, const uint8_t * row, float * sums, const uint32_t pixels)
+{
+    const float * lut = context->colorspace.byte_to_float;
+    for (uint32_t i = 0; i < pixels; i++) {
+        const float alpha = ((float)row[i * 4 + 3]) / 255.0f;
+        sums[i * 4] += alpha * lut[row[i * 4]];
+        sums[i * 4 + 1] += alpha * lut[row[i * 4 + 1]];
+        sums[i * 4 + 2] += alpha * lut[row[i * 4 + 2]];
+        sums[i * 4 + 3] += alpha;
+    }
+}
+
+//sums holds step values per column; the first channels of them are averaged
+static void reduce_to_floats(const float * sums, float * dest, const uint32_t to_w, const uint32_t step, const uint32_t channels, const uint32_t divisor)
+{
+    const float scale = 1.0f / (float)(divisor * divisor);
+    for (uint32_t x = 0; x < to_w; x++) {
+        for (uint32_t ch = 0; ch < channels; ch++) {
+            float sum = 0;
+            for (uint32_t k = 0; k < divisor; k++) {
+                sum += sums[(x * divisor + k) * step + ch];
+            }
+            dest[x * channels + ch] = sum * scale;
+        }
+    }
+}
+
+#ifdef FASTSCALING_X86
+
+//Two pixels per step
+SIMD_TARGET_AVX2
+static void sum_row_premultiplied_avx2(Context * context, const uint8_t * row, float * sums, const uint32_t pixels)
+{
+    const float * lut = context->colorspace.byte_to_float;
+    uint32_t i = 0;
+    for (; i + 2 <= pixels; i += 2) {
+        const __m256i bytes = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(row + i * 4)));
+        const __m256 alpha = _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_shuffle_epi32(bytes, _MM_SHUFFLE(3, 3, 3, 3))), _mm256_set1_ps(255.0f));
+        const __m256 premultiplied = _mm256_blend_ps(_mm256_mul_ps(alpha, _mm256_i32gather_ps(lut, bytes, 4)), alpha, 0x88);
+        _mm256_storeu_ps(sums + i * 4, _mm256_add_ps(_mm256_loadu_ps(sums + i * 4), premultiplied));
+    }
+    sum_row_premultiplied(context, row + i * 4, sums + i * 4, pixels - i);
+}
+
+//Reads 4 values per column, so sums must be padded. With 3 channels, each store spills into the next pixel, which is
+//written after it; the last pixel is stored separately.
+SIMD_TARGET_SSE2
+static void reduce_to_floats_sse2(const float * sums, float * dest, const uint32_t to_w, const uint32_t step, const uint32_t channels, const uint32_t divisor)
+{
+    const __m128 scale = _mm_set1_ps(1.0f / (float)(divisor * divisor));
+    for (uint32_t x = 0; x < to_w; x++) {
+        const float * s = sums + x * divisor * step;
+        __m128 sum = _mm_loadu_ps(s);
+        for (uint32_t k = 1; k < divisor; k++) {
+            sum = _mm_add_ps(sum, _mm_loadu_ps(s + k * step));
+        }
+        sum = _mm_mul_ps(sum, scale);
+        if (channels == 4 || x + 1 < to_w) {
+            _mm_storeu_ps(dest + x * channels, sum);
+        } else {
+            float last[4];
+            _mm_storeu_ps(last, sum);
+            memcpy(dest + x * channels, last, 3 * sizeof(float));
+        }
+    }
+}
+
+#endif
+
+bool BitmapBgra_halve_srgb_to_linear(Context * context, const BitmapBgra * src, uint32_t divisor, uint32_t from_row, bool flip,
+                                     BitmapFloat * dest, uint32_t dest_row, uint32_t row_count, HalvingSums * scratch)
+{
+    const uint32_t bpp = BitmapPixelFormat_bytes_per_pixel(src->fmt);
+    const uint32_t channels = dest->channels;
+    if (divisor < 1 || divisor > 16 || (bpp != 1 && bpp != 3 && bpp != 4) || channels > bpp || (channels < 3 && channels != bpp)) {
+        CONTEXT_error(context, Invalid_internal_state);
+        return false;
+    }
+    const uint32_t to_w = src->w / divisor;
+    const uint32_t to_h = src->h / divisor;
+    if (dest->w != to_w || from_row + row_count > to_h || dest_row + row_count > dest->h) {
+        CONTEXT_error(context, Invalid_internal_state);
+        return false;
+    }
+    const bool premultiply = channels == 4;
+    const uint32_t columns = to_w * divisor * bpp;
+    HalvingSums * owned = scratch == NULL ? HalvingSums_create(context, columns, false) : NULL;
+    if (scratch == NULL && owned == NULL) {
+        CONTEXT_add_to_callstack (context);
+        return false;
+    }
+    scratch = scratch == NULL ? owned : scratch;
+    if (scratch->columns < columns) {
+        CONTEXT_error(context, Invalid_internal_state);
+        return false;
+    }
+    float * sums = scratch->values;
+    memset(sums, 0, (columns + HALVING_SUM_PADDING) * sizeof(float));
+#ifdef FASTSCALING_X86
+    const bool sse = context->simd.active >= Simd_sse41;
+    const bool avx2 = context->simd.active >= Simd_avx2;
+#endif
+
+    for (uint32_t row = 0; row < row_count; row++) {
+        const uint32_t y = flip ? to_h - 1 - (from_row + row) : from_row + row;
+        memset(sums, 0, columns * sizeof(float));
+        for (uint32_t d = 0; d < divisor; d++) {
+            const uint8_t * line = src->pixels + (size_t)(y * divisor + d) * src->stride;
+#ifdef FASTSCALING_X86
+            if (avx2) {
+                if (premultiply) {
+                    sum_row_premultiplied_avx2(context, line, sums, to_w * divisor);
+                } else {
+                    sum_row_floats_avx2(context, line, sums, columns);
+                }
+                continue;
+            }
+#endif
+            if (premultiply) {
+                sum_row_premultiplied(context, line, sums, to_w * divisor);
+            } else {
+                sum_row_floats(context, line, sums, columns);
+            }
+        }
+        float * dest_line = dest->pixels + (size_t)(dest_row + row) * dest->float_stride;
+#ifdef FASTSCALING_X86
+        if (sse && channels >= 3) {
+            reduce_to_floats_sse2(sums, dest_line, to_w, bpp, channels, divisor);
+            continue;
+        }
+#endif
+        reduce_to_floats(sums, dest_line, to_w, bpp, channels, divisor);
+    }
+    HalvingSums_destroy(context, owned);
+    return true;
+}
@@ -0,0 +1,375 @@
+/*
+ * Copyright (c) Imazen LLC.
+ * No part of this project, including this file, may be copied, modified,
+ * propagated, or distributed except as permitted in COPYRIGHT.txt.
+ * Licensed under the GNU Affero General Public License, Version 3.0.
+ * Commercial licenses available at http://imageresizing.net/
+ */
+#ifdef _MSC_VER
+#pragma unmanaged
+#endif
+
+#include "fastscaling_private.h"
+#include "simd.h"
+#include <string.h>
+
+/*
+ * GDI+ layouts (palette indices, 16-bit packed pixels, 13-bit linear channels) are unpacked a chunk at a time as their
+ * rows are read, so a locked bitmap can be rendered without being copied into one of our formats first. Unpacked pixels
+ * are always 4 channels wide, which the vectorized unpackers write whole, and the decoders read as 3 when alpha isn't
+ * meaningful.
+ */
+
+//Pixels unpacked at a time; 8 bytes each covers Bgra64
+#define UNPACK_CHUNK 256
+
+//Widened by repeating the high bits, so the extremes stay 0 and 255
+static inline uint8_t widen5(uint32_t v)
+{
+    return (uint8_t)((v << 3) | (v >> 2));
+}
+
+static inline uint8_t widen6(uint32_t v)
+{
+    return (uint8_t)((v << 2) | (v >> 4));
+}
+
+//Rounds a 16-bit channel to the nearest byte; (w * 255 + 32767) / 65535, without dividing
+static inline uint8_t narrow_word(uint32_t w)
+{
+    const uint32_t t = umin(w + 128, 65535);
+    return (uint8_t)((t - (t >> 8)) >> 8);
+}
+
+static void unpack_indexed_row(const uint8_t * palette, const uint8_t * src, uint8_t * dest, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++) {
+        memcpy(dest + i * 4, palette + src[i] * 4, 4);
+    }
+}
+
+static void unpack_16bit_row(BitmapPixelFormat fmt, const uint8_t * src, uint8_t * dest, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++, dest += 4) {
+        const uint32_t v = src[i * 2] | ((uint32_t)src[i * 2 + 1] << 8);
+        dest[0] = widen5(v & 0x1f);
+        if (fmt == Bgr565) {
+            dest[1] = widen6((v >> 5) & 0x3f);
+            dest[2] = widen5(v >> 11);
+        } else {
+            dest[1] = widen5((v >> 5) & 0x1f);
+            dest[2] = widen5((v >> 10) & 0x1f);
+        }
+        dest[3] = fmt == Bgra5551 && (v & 0x8000) == 0 ? 0 : 0xff;
+    }
+}
+
+//To Bgra64 words in the source encoding. Premultiplied channels are divided by alpha while still linear.
+static void unpack_linear_row(const Context * context, BitmapPixelFormat fmt, bool premultiplied, const uint8_t * src, uint8_t * dest,
+                              uint32_t count)
+{
+    const uint16_t * table = context->wide.linear_to_word;
+    const uint32_t ch = BitmapPixelFormat_channels(fmt);
+    for (uint32_t i = 0; i < count; i++) {
+        uint16_t s[4];
+        memcpy(s, src + (size_t)i * ch * 2, ch * 2);
+        const uint32_t a = ch == 4 ? umin(s[3], GDI_LINEAR_MAX) : GDI_LINEAR_MAX;
+        uint16_t out[4];
+        for (uint32_t c = 0; c < 3; c++) {
+            uint32_t v = umin(s[c], GDI_LINEAR_MAX);
+            if (premultiplied) {
+                v = a == 0 ? 0 : umin(GDI_LINEAR_MAX, (v * GDI_LINEAR_MAX + a / 2) / a);
+            }
+            out[c] = table[v];
+        }
+        out[3] = (uint16_t)((a * 65535 + GDI_LINEAR_MAX / 2) / GDI_LINEAR_MAX);
+        memcpy(dest + (size_t)i * 8, out, 8);
+    }
+}
+
+#ifdef FASTSCALING_X86
+
+SIMD_TARGET_AVX2
+static void unpack_indexed_row_avx2(const uint8_t * palette, const uint8_t * src, uint8_t * dest, uint32_t count)
+{
+    uint32_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const __m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(src + i)));
+        _mm256_storeu_si256((__m256i *)(dest + i * 4), _mm256_i32gather_epi32((const int *)palette, index, 4));
+    }
+    unpack_indexed_row(palette, src + i, dest + i * 4, count - i);
+}
+
+SIMD_TARGET_SSE41
+static inline __m128i widen5_sse41(__m128i v)
+{
+    return _mm_or_si128(_mm_slli_epi16(v, 3), _mm_srli_epi16(v, 2));
+}
+
+//8 pixels at a time: each channel widened in its own 16-bit lanes, then interleaved into BGRA
+SIMD_TARGET_SSE41
+static void unpack_16bit_row_sse41(BitmapPixelFormat fmt, const uint8_t * src, uint8_t * dest, uint32_t count)
+{
+    const __m128i mask5 = _mm_set1_epi16(0x1f);
+    const __m128i alpha_high = _mm_set1_epi16((short)0xff00);
+    uint32_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const __m128i v = _mm_loadu_si128((const __m128i *)(src + i * 2));
+        const __m128i b = widen5_sse41(_mm_and_si128(v, mask5));
+        __m128i g, r;
+        if (fmt == Bgr565) {
+            g = _mm_and_si128(_mm_srli_epi16(v, 5), _mm_set1_epi16(0x3f));
+            g = _mm_or_si128(_mm_slli_epi16(g, 2), _mm_srli_epi16(g, 4));
+            r = widen5_sse41(_mm_srli_epi16(v, 11));
+        } else {
+            g = widen5_sse41(_mm_and_si128(_mm_srli_epi16(v, 5), mask5));
+            r = widen5_sse41(_mm_and_si128(_mm_srli_epi16(v, 10), mask5));
+        }
+        //The top bit, spread over the lane, is the 1-bit alpha
+        const __m128i a = fmt == Bgra5551 ? _mm_and_si128(_mm_srai_epi16(v, 15), alpha_high) : alpha_high;
+        const __m128i bg = _mm_or_si128(b, _mm_slli_epi16(g, 8));
+        const __m128i ra = _mm_or_si128(r, a);
+        _mm_storeu_si128((__m128i *)(dest + i * 4), _mm_unpacklo_epi16(bg, ra));
+        _mm_storeu_si128((__m128i *)(dest + i * 4 + 16), _mm_unpackhi_epi16(bg, ra));
+    }
+    unpack_16bit_row(fmt, src + i * 2, dest + i * 4, count - i);
+}
+
+//Reads 16 bytes for every 12 it uses, so stops 2 pixels short; those are left to the caller
+SIMD_TARGET_SSE41
+static uint32_t pad_bgr_row_sse41(const uint8_t * src, uint8_t * dest, uint32_t count)
+{
+    const __m128i shuffle = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m128i alpha = _mm_set1_epi32((int)0xff000000u);
+    uint32_t i = 0;
+    for (; i + 6 <= count; i += 4) {
+        const __m128i v = _mm_loadu_si128((const __m128i *)(src + i * 3));
+        _mm_storeu_si128((__m128i *)(dest + i * 4), _mm_or_si128(_mm_shuffle_epi8(v, shuffle), alpha));
+    }
+    return i;
+}
+
+//Writes 16 bytes for every 12, so also stops 2 pixels short, not to write past the row
+SIMD_TARGET_SSE41
+static uint32_t strip_alpha_row_sse41(const uint8_t * src, uint8_t * dest, uint32_t count)
+{
+    const __m128i shuffle = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    uint32_t i = 0;
+    for (; i + 6 <= count; i += 4) {
+        const __m128i v = _mm_loadu_si128((const __m128i *)(src + i * 4));
+        _mm_storeu_si128((__m128i *)(dest + i * 3), _mm_shuffle_epi8(v, shuffle));
+    }
+    return i;
+}
+
+SIMD_TARGET_SSE41
+static uint32_t narrow_words_sse41(const uint16_t * src, uint8_t * dest, uint32_t count)
+{
+    const __m128i half = _mm_set1_epi16(128);
+    uint32_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i lo = _mm_adds_epu16(_mm_loadu_si128((const __m128i *)(src + i)), half);
+        __m128i hi = _mm_adds_epu16(_mm_loadu_si128((const __m128i *)(src + i + 8)), half);
+        lo = _mm_srli_epi16(_mm_sub_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+        hi = _mm_srli_epi16(_mm_sub_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+        _mm_storeu_si128((__m128i *)(dest + i), _mm_packus_epi16(lo, hi));
+    }
+    return i;
+}
+
+#endif
+
+bool BitmapBgra_unpack_pixels(Context * context, const BitmapBgra * b, uint32_t x, uint32_t y, uint32_t count, uint8_t * dest)
+{
+    const uint8_t * src = b->pixels + (size_t)y * b->stride + (size_t)x * BitmapPixelFormat_bytes_per_pixel(b->fmt);
+#ifdef FASTSCALING_X86
+    const bool sse = context->simd.active >= Simd_sse41;
+    const bool avx2 = context->simd.active >= Simd_avx2;
+#endif
+    switch (b->fmt) {
+    case Indexed8:
+        if (b->palette == NULL) {
+            CONTEXT_error(context, Invalid_argument);
+            return false;
+        }
+#ifdef FASTSCALING_X86
+        if (avx2) {
+            unpack_indexed_row_avx2(b->palette, src, dest, count);
+            return true;
+        }
+#endif
+        unpack_indexed_row(b->palette, src, dest, count);
+        return true;
+    case Bgr565: case Bgr555: case Bgra5551:
+#ifdef FASTSCALING_X86
+        if (sse) {
+            unpack_16bit_row_sse41(b->fmt, src, dest, count);
+            return true;
+        }
+#endif
+        unpack_16bit_row(b->fmt, src, dest, count);
+        return true;
+    case Bgr48Linear: case Bgra64Linear:
+        unpack_linear_row(context, b->fmt, b->alpha_premultiplied && b->alpha_meaningful, src, dest, count);
+        return true;
+    default:
+        CONTEXT_error(context, Unsupported_pixel_format);
+        return false;
+    }
+}
+
+bool BitmapBgra_unpack_srgb_to_linear(Context * context, const BitmapBgra * src, uint32_t from_row, BitmapFloat * dest,
+                                      uint32_t dest_row, uint32_t row_count)
+{
+    const BitmapPixelFormat unpacked = BitmapPixelFormat_unpacked(src->fmt);
+    if (BitmapPixelFormat_is_wide(unpacked) && !Context_prepare_wide_tables(context)) {
+        CONTEXT_add_to_callstack (context);
+        return false;
+    }
+    if (src->w != dest->w || from_row + row_count > src->h || dest_row + row_count > dest->h) {
+        CONTEXT_error(context, Invalid_internal_state);
+        return false;
+    }
+    uint64_t chunk[UNPACK_CHUNK];
+    //A one-row view of the chunk, and of the part of the dest row it decodes to
+    BitmapBgra view = *src;
+    view.fmt = unpacked;
+    view.h = 1;
+    view.stride = sizeof(chunk);
+    view.pixels = (unsigned char *)chunk;
+    view.alpha_premultiplied = false;
+    BitmapFloat strip = *dest;
+    strip.h = 1;
+    for (uint32_t row = 0; row < row_count; row++) {
+        for (uint32_t x = 0; x < src->w; x += UNPACK_CHUNK) {
+            const uint32_t count = umin(UNPACK_CHUNK, src->w - x);
+            if (!BitmapBgra_unpack_pixels(context, src, x, from_row + row, count, view.pixels)) {
+                CONTEXT_add_to_callstack (context);
+                return false;
+            }
+            view.w = count;
+            strip.w = count;
+            strip.pixels = dest->pixels + (size_t)(dest_row + row) * dest->float_stride + (size_t)x * dest->channels;
+            if (!BitmapBgra_convert_srgb_to_linear(context, &view, 0, &strip, 0, 1)) {
+                CONTEXT_add_to_callstack (context);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+//Narrows count pixels of ch 16-bit (or half float) channels to Bgra32
+static void narrow_wide_pixels(Context * context, BitmapPixelFormat fmt, uint32_t ch, const uint8_t * src, uint8_t * dest, uint32_t count)
+{
+    uint16_t words[UNPACK_CHUNK * 4];
+    uint8_t bytes[UNPACK_CHUNK * 4];
+    memcpy(words, src, (size_t)count * ch * 2);
+    const uint32_t values = count * ch;
+    uint32_t i = 0;
+    if (fmt == BgraHalf) {
+        for (; i < values; i++) {
+            bytes[i] = (uint8_t)(context->wide.half_to_unit[words[i]] * 255.0f + 0.5f);
+        }
+    } else {
+#ifdef FASTSCALING_X86
+        if (context->simd.active >= Simd_sse41) {
+            i = narrow_words_sse41(words, bytes, values);
+        }
+#endif
+        for (; i < values; i++) {
+            bytes[i] = narrow_word(words[i]);
+        }
+    }
+    for (uint32_t p = 0; p < count; p++) {
+        memcpy(dest + p * 4, bytes + p * ch, 3);
+        dest[p * 4 + 3] = ch == 4 ? bytes[p * ch + 3] : 0xff;
+    }
+}
+
+//Writes count Bgra32 pixels to dest as Bgr24 or Bgra32
+static void write_bgra_pixels(Context * context, const uint8_t * bgra, uint8_t * dest, uint32_t dest_bpp, uint32_t count)
+{
+    if (dest_bpp == 4) {
+        memcpy(dest, bgra, (size_t)count * 4);
+        return;
+    }
+    uint32_t i = 0;
+#ifdef FASTSCALING_X86
+    if (context->simd.active >= Simd_sse41) {
+        i = strip_alpha_row_sse41(bgra, dest, count);
+    }
+#endif
+    for (; i < count; i++) {
+        memcpy(dest + i * 3, bgra + i * 4, 3);
+    }
+}
+
+bool BitmapBgra_convert(Context * context, const BitmapBgra * src, BitmapBgra * dest)
+{
+    if (src->w != dest->w || src->h != dest->h) {
+        CONTEXT_error(context, Invalid_BitmapBgra_dimensions);
+        return false;
+    }
+    const uint32_t src_ch = BitmapPixelFormat_channels(src->fmt);
+    if ((dest->fmt != Bgr24 && dest->fmt != Bgra32) || src_ch == 0) {
+        CONTEXT_error(context, Unsupported_pixel_format);
+        return false;
+    }
+    const BitmapPixelFormat unpacked = BitmapPixelFormat_unpacked(src->fmt);
+    const bool wide = BitmapPixelFormat_is_wide(unpacked);
+    if (wide && !Context_prepare_wide_tables(context)) {
+        CONTEXT_add_to_callstack (context);
+        return false;
+    }
+    const uint32_t src_bpp = BitmapPixelFormat_bytes_per_pixel(src->fmt);
+    const uint32_t dest_bpp = BitmapPixelFormat_bytes_per_pixel(dest->fmt);
+    uint64_t chunk[UNPACK_CHUNK];
+    uint8_t bgra[UNPACK_CHUNK * 4];
+    for (uint32_t y = 0; y < src->h; y++) {
+        const uint8_t * src_row = src->pixels + (size_t)y * src->stride;
+        uint8_t * dest_row = dest->pixels + (size_t)y * dest->stride;
+        //Byte formats convert straight across; the others go through Bgra32 pixels a chunk at a time
+        if (src->fmt == dest->fmt) {
+            memcpy(dest_row, src_row, (size_t)src->w * src_bpp);
+            continue;
+        }
+        if (src->fmt == Bgra32) {
+            write_bgra_pixels(context, src_row, dest_row, dest_bpp, src->w);
+            continue;
+        }
+        if (src->fmt == Bgr24) {
+            uint32_t x = 0;
+#ifdef FASTSCALING_X86
+            if (context->simd.active >= Simd_sse41) {
+                x = pad_bgr_row_sse41(src_row, dest_row, src->w);
+            }
+#endif
+            for (; x < src->w; x++) {
+                memcpy(dest_row + x * 4, src_row + x * 3, 3);
+                dest_row[x * 4 + 3] = 0xff;
+            }
+            continue;
+        }
+        for (uint32_t x = 0; x < src->w; x += UNPACK_CHUNK) {
+            const uint32_t count = umin(UNPACK_CHUNK, src->w - x);
+            if (src->fmt == Gray8) {
+                for (uint32_t i = 0; i < count; i++) {
+                    const uint8_t v = src_row[x + i];
+                    bgra[i * 4] = bgra[i * 4 + 1] = bgra[i * 4 + 2] = v;
+                    bgra[i * 4 + 3] = 0xff;
+                }
+            } else if (unpacked == src->fmt) {
+                narrow_wide_pixels(context, src->fmt, src_ch, src_row + (size_t)x * src_bpp, bgra, count);
+            } else if (!BitmapBgra_unpack_pixels(context, src, x, y, count, wide ? (uint8_t *)chunk : bgra)) {
+                CONTEXT_add_to_callstack (context);
+                return false;
+            } else if (wide) {
+                narrow_wide_pixels(context, Bgra64, 4, (const uint8_t *)chunk, bgra, count);
+            }
+            write_bgra_pixels(context, bgra, dest_row + (size_t)x * dest_bpp, dest_bpp, count);
+        }
+    }
+    dest->alpha_premultiplied = src->alpha_premultiplied && src->fmt != Bgra64Linear && src->fmt != Bgr48Linear;
+    return true;
+}
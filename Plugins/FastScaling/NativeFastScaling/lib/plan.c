@@ -0,0 +1,269 @@
+/*
+ * Copyright (c) Imazen LLC.
+ * No part of this project, including this file, may be copied, modified,
+ * propagated, or distributed except as permitted in COPYRIGHT.txt.
+ * Licensed under the GNU Affero General Public License, Version 3.0.
+ * Commercial licenses available at http://imageresizing.net/
+ */
+#ifdef _MSC_VER
+#pragma unmanaged
+#endif
+
+#include "fastscaling_private.h"
+
+//Everything one execution writes to. Each is used by one execution at a time.
+typedef struct {
+    BitmapBgra * halved; //NULL when the plan doesn't halve
+    RenderPass * halving; //Set along with halved
+    BitmapBgra * transposed;
+    RenderPass * passes[2];
+    volatile long in_use;
+} RenderPlanWorkspace;
+
+struct RenderPlanStruct {
+    RenderDetails details; //A copy, with interpolation pointing to our own copy
+    InterpolationDetails interpolation;
+    bool has_interpolation;
+    WorkingFloatspace floatspace;
+    float floatspace_params[3];
+    uint32_t source_w;
+    uint32_t source_h;
+    BitmapPixelFormat source_format;
+    bool source_alpha_meaningful;
+    uint32_t canvas_w;
+    uint32_t canvas_h;
+    uint32_t halving_divisor;
+    //Workspace 0 owns the contributions; the others borrow them
+    RenderPlanWorkspace * workspaces;
+    uint32_t workspace_count;
+};
+
+static void RenderPlan_copy_details(const RenderPlan * plan, RenderDetails * details, InterpolationDetails * interpolation)
+{
+    *details = plan->details;
+    for (int i = 0; i < 5; i++) {
+        details->color_matrix[i] = &(details->color_matrix_data[i * 5]);
+    }
+    if (plan->has_interpolation) {
+        *interpolation = plan->interpolation;
+        details->interpolation = interpolation;
+    }
+}
+
+static void RenderPlanWorkspace_destroy(Context * context, RenderPlanWorkspace * w)
+{
+    RenderPass_destroy(context, w->passes[0]);
+    RenderPass_destroy(context, w->passes[1]);
+    RenderPass_destroy(context, w->halving);
+    BitmapBgra_destroy(context, w->transposed);
+    BitmapBgra_destroy(context, w->halved);
+    memset(w, 0, sizeof(RenderPlanWorkspace));
+}
+
+//Allocates the buffers and passes for one execution. shared may be NULL, or a workspace whose contributions to borrow.
+static bool RenderPlanWorkspace_initialize(Context * context, const RenderPlan * plan, RenderPlanWorkspace * w, const RenderPlanWorkspace * shared)
+{
+    memset(w, 0, sizeof(RenderPlanWorkspace));
+    const uint32_t divisor = umax(1, plan->halving_divisor);
+    //Only the size and format of these are used
+    BitmapBgra source;
+    memset(&source, 0, sizeof(source));
+    source.w = plan->source_w / divisor;
+    source.h = plan->source_h / divisor;
+    source.fmt = plan->source_format;
+    source.alpha_meaningful = plan->source_alpha_meaningful;
+    BitmapBgra canvas = source;
+    canvas.w = plan->canvas_w;
+    canvas.h = plan->canvas_h;
+    BitmapBgra unhalved = source;
+    unhalved.w = plan->source_w;
+    unhalved.h = plan->source_h;
+
+    //A fused halving pass needs no halved copy
+    const bool fused = divisor > 1 && Renderer_can_fuse_halving(context, &plan->details, &source, &canvas);
+    if (divisor > 1 && !fused) {
+        w->halved = BitmapBgra_create(context, source.w, source.h, true, BitmapPixelFormat_unpacked(source.fmt));
+        if (w->halved == NULL) {
+            CONTEXT_add_to_callstack (context);
+            return false;
+        }
+        w->halving = RenderPass_create_halving(context, &plan->details, &unhalved, w->halved, divisor);
+        if (w->halving == NULL) {
+            CONTEXT_add_to_callstack (context);
+            RenderPlanWorkspace_destroy(context, w);
+            return false;
+        }
+        //Halving unpacks GDI+ layouts, so the passes read what it wrote
+        source.fmt = w->halved->fmt;
+    }
+    const bool skip_last_transpose = plan->details.post_transpose;
+    w->transposed = BitmapBgra_create(context, source.h, skip_last_transpose ? canvas.h : canvas.w, false,
+                                      BitmapPixelFormat_unpacked(plan->source_format));
+    if (w->transposed == NULL) {
+        CONTEXT_add_to_callstack (context);
+        RenderPlanWorkspace_destroy(context, w);
+        return false;
+    }
+    w->transposed->alpha_meaningful = plan->source_alpha_meaningful;
+    w->passes[0] = RenderPass_create(context, &plan->details, &source, w->transposed, true, 1,
+                                     shared == NULL ? NULL : shared->passes[0]->contrib, true, fused ? divisor : 1);
+    if (w->passes[0] == NULL) {
+        CONTEXT_add_to_callstack (context);
+        RenderPlanWorkspace_destroy(context, w);
+        return false;
+    }
+    w->passes[1] = RenderPass_create(context, &plan->details, w->transposed, &canvas, !skip_last_transpose, 2,
+                                     shared == NULL ? NULL : shared->passes[1]->contrib, true, 1);
+    if (w->passes[1] == NULL) {
+        CONTEXT_add_to_callstack (context);
+        RenderPlanWorkspace_destroy(context, w);
+        return false;
+    }
+    return true;
+}
+
+void RenderPlan_destroy(Context * context, RenderPlan * plan)
+{
+    if (plan == NULL) return;
+    if (plan->workspaces != NULL) {
+        //Workspace 0 owns the shared contributions, so goes last
+        for (uint32_t i = plan->workspace_count; i > 0; i--) {
+            RenderPlanWorkspace_destroy(context, &plan->workspaces[i - 1]);
+        }
+        CONTEXT_free(context, plan->workspaces);
+    }
+    CONTEXT_free(context, plan);
+}
+
+RenderPlan * RenderPlan_create(Context * context, RenderDetails * details, uint32_t source_w, uint32_t source_h,
+                               BitmapPixelFormat source_format, bool source_alpha_meaningful, uint32_t canvas_w, uint32_t canvas_h,
+                               uint32_t max_concurrent_executions)
+{
+    if (details->roi_output_w > 0 || details->roi_output_h > 0) {
+        CONTEXT_error(context, Invalid_argument);
+        return NULL;
+    }
+    if (source_w == 0 || source_h == 0 || canvas_w == 0 || canvas_h == 0) {
+        CONTEXT_error(context, Invalid_argument);
+        return NULL;
+    }
+    const bool scaling_required = details->post_transpose ? (canvas_w != source_h || canvas_h != source_w) :
+                                  (canvas_w != source_w || canvas_h != source_h);
+    if (scaling_required && details->interpolation == NULL) {
+        CONTEXT_error(context, Interpolation_details_missing);
+        return NULL;
+    }
+    RenderPlan * plan = CONTEXT_calloc_array(context, 1, RenderPlan);
+    if (plan == NULL) {
+        CONTEXT_error(context, Out_of_memory);
+        return NULL;
+    }
+    plan->details = *details;
+    plan->details.enable_streaming_vertical_pass = false;
+    plan->has_interpolation = details->interpolation != NULL;
+    if (plan->has_interpolation) {
+        plan->interpolation = *details->interpolation;
+        plan->details.interpolation = &plan->interpolation;
+        //The same interpolation sharpening Renderer_perform_render applies, baked into the contributions
+        if (details->sharpen_percent_goal > 0 && details->minimum_sample_window_to_interposharpen <= plan->interpolation.window) {
+            plan->interpolation.sharpen_percent_goal = details->sharpen_percent_goal;
+        }
+    }
+    for (int i = 0; i < 5; i++) {
+        plan->details.color_matrix[i] = &(plan->details.color_matrix_data[i * 5]);
+    }
+    plan->floatspace = context->colorspace.floatspace;
+    memcpy(plan->floatspace_params, context->colorspace.params, sizeof(plan->floatspace_params));
+    plan->source_w = source_w;
+    plan->source_h = source_h;
+    plan->source_format = source_format;
+    plan->source_alpha_meaningful = source_alpha_meaningful;
+    plan->canvas_w = canvas_w;
+    plan->canvas_h = canvas_h;
+    //As in Renderer_create, wide formats aren't halved
+    plan->halving_divisor = BitmapPixelFormat_is_wide(BitmapPixelFormat_unpacked(source_format)) ? 1 : details->halving_divisor > 0 ? details->halving_divisor :
+                            (uint32_t)RenderDetails_determine_divisor(details, source_w, source_h, canvas_w, canvas_h);
+    if (plan->halving_divisor > 16) {
+        CONTEXT_error(context, Invalid_argument);
+        RenderPlan_destroy(context, plan);
+        return NULL;
+    }
+    //Workspaces are sized for the halved source, and executions are told the divisor; neither reads this
+    plan->details.halving_divisor = 0;
+
+    plan->workspace_count = umax(1, max_concurrent_executions);
+    plan->workspaces = CONTEXT_calloc_array(context, plan->workspace_count, RenderPlanWorkspace);
+    if (plan->workspaces == NULL) {
+        CONTEXT_error(context, Out_of_memory);
+        RenderPlan_destroy(context, plan);
+        return NULL;
+    }
+    for (uint32_t i = 0; i < plan->workspace_count; i++) {
+        if (!RenderPlanWorkspace_initialize(context, plan, &plan->workspaces[i], i == 0 ? NULL : &plan->workspaces[0])) {
+            CONTEXT_add_to_callstack (context);
+            RenderPlan_destroy(context, plan);
+            return NULL;
+        }
+    }
+    return plan;
+}
+
+bool RenderPlan_execute(Context * context, RenderPlan * plan, BitmapBgra * source, BitmapBgra * canvas)
+{
+    if (source->w != plan->source_w || source->h != plan->source_h || source->fmt != plan->source_format ||
+        source->alpha_meaningful != plan->source_alpha_meaningful || canvas->w != plan->canvas_w || canvas->h != plan->canvas_h) {
+        CONTEXT_error(context, Invalid_argument);
+        return false;
+    }
+    //GDI+ layouts are only ever read
+    if (BitmapPixelFormat_unpacked(canvas->fmt) != canvas->fmt) {
+        CONTEXT_error(context, Unsupported_pixel_format);
+        return false;
+    }
+    //A no-op unless the context has been switched to another floatspace
+    Context_set_floatspace(context, plan->floatspace, plan->floatspace_params[0], plan->floatspace_params[1], plan->floatspace_params[2]);
+
+    RenderPlanWorkspace * workspace = NULL;
+    for (uint32_t i = 0; i < plan->workspace_count && workspace == NULL; i++) {
+        if (Threads_try_acquire(&plan->workspaces[i].in_use)) {
+            workspace = &plan->workspaces[i];
+        }
+    }
+    //More concurrent executions than the plan was made for. Still correct, but this one allocates.
+    RenderPlanWorkspace temporary;
+    if (workspace == NULL) {
+        if (!RenderPlanWorkspace_initialize(context, plan, &temporary, &plan->workspaces[0])) {
+            CONTEXT_add_to_callstack (context);
+            return false;
+        }
+    }
+    RenderPlanWorkspace * w = workspace == NULL ? &temporary : workspace;
+
+    //The renderer writes to its details and interpolation, so each execution gets its own copy
+    RenderDetails details;
+    InterpolationDetails interpolation;
+    RenderPlan_copy_details(plan, &details, &interpolation);
+
+    Renderer r;
+    memset(&r, 0, sizeof(r));
+    r.details = &details;
+    r.source = source;
+    r.canvas = canvas;
+    r.transposed = w->transposed;
+    r.halving_buffer = w->halved;
+    r.halving_pass = w->halving;
+    r.halving_divisor = plan->halving_divisor;
+    r.passes[0] = w->passes[0];
+    r.passes[1] = w->passes[1];
+
+    bool result = Renderer_perform_render(context, &r);
+    if (!result) {
+        CONTEXT_add_to_callstack (context);
+    }
+    if (workspace == NULL) {
+        RenderPlanWorkspace_destroy(context, &temporary);
+    } else {
+        Threads_release(&workspace->in_use);
+    }
+    return result;
+}
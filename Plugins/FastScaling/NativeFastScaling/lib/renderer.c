@@ -19,22 +19,6 @@
 #include <stdio.h>
 #include <string.h>
 
-typedef struct RendererStruct {
-    RenderDetails * details;
-    bool destroy_details;
-    BitmapBgra * source;
-    bool destroy_source;
-    BitmapBgra * canvas;
-    BitmapBgra * transposed;
-} Renderer;
-
-
-Renderer * Renderer_create(Context * context, BitmapBgra * source, BitmapBgra * canvas, RenderDetails * details);
-Renderer * Renderer_create_in_place(Context * context, BitmapBgra * editInPlace, RenderDetails * details);
-bool Renderer_perform_render(Context * context, Renderer * r);
-void Renderer_destroy(Context * context, Renderer * r);
-
-
 RenderDetails * RenderDetails_create(Context * context)
 {
     RenderDetails * d = CONTEXT_calloc_array(context, 1, RenderDetails);
@@ -51,6 +35,7 @@ RenderDetails * RenderDetails_create(Context * context)
     d->halving_acceptable_pixel_loss = 0;
     d->minimum_sample_window_to_interposharpen = 1.5;
     d->apply_color_matrix = false;
+    d->detect_opaque_alpha = true;
     return d;
 }
 
@@ -77,20 +62,54 @@ void RenderDetails_destroy(Context * context, RenderDetails * d)
         InterpolationDetails_destroy(context, d->interpolation);
         ConvolutionKernel_destroy(context, d->kernel_a);
         ConvolutionKernel_destroy(context, d->kernel_b);
+        ColorLut3D_destroy(context, d->color_lut);
     }
     CONTEXT_free(context, d);
 }
 
+//Whether taking the alpha of an opaque source as 1 changes nothing: no color matrix can alter it, and composing onto
+//a canvas whose alpha isn't meaningful would have left that alpha as it was
+static bool Renderer_can_take_alpha_as_opaque(const RenderDetails * details, const BitmapBgra * canvas)
+{
+    return !details->apply_color_matrix && !(canvas->compositing_mode == Blend_with_self && !canvas->alpha_meaningful);
+}
+
 bool RenderDetails_render(
     Context * context,
     RenderDetails * details,
     BitmapBgra * source,
     BitmapBgra * canvas)
 {
-
+    //A region's cost scales with its source window, so the whole source isn't probed for opaque alpha
+    if (details->roi_output_w > 0 || details->roi_output_h > 0) {
+        bool result = RenderDetails_render_roi(context, details, source, canvas);
+        if (!result) {
+            CONTEXT_add_to_callstack (context);
+        }
+        return result;
+    }
 
     bool destroy_source = false;
 
+    //An opaque source is scaled through a borrowed header that doesn't claim meaningful alpha, so the integer pipeline
+    //can take it. With floats, 3 channels measured slower than 4 premultiplied ones, so there the renderer keeps 4 and
+    //takes alpha as 1 instead (see RendererStruct.opaque_alpha).
+    const bool integer = details->enable_integer_pipeline && context->colorspace.floatspace == Floatspace_as_is && canvas->fmt == Bgra32;
+    const bool opaque = details->detect_opaque_alpha && source->fmt == Bgra32 && source->alpha_meaningful &&
+                        (integer || Renderer_can_take_alpha_as_opaque(details, canvas)) && BitmapBgra_is_opaque(context, source);
+    if (opaque && integer) {
+        BitmapBgra * header = BitmapBgra_create_header(context, source->w, source->h);
+        if (header == NULL) {
+            CONTEXT_add_to_callstack (context);
+            return false;
+        }
+        *header = *source;
+        header->borrowed_pixels = true;
+        header->alpha_meaningful = false;
+        source = header;
+        destroy_source = true;
+    }
+
     Renderer * r = Renderer_create(context, source, canvas, details);
     if (r == NULL) {
         CONTEXT_add_to_callstack (context);
@@ -101,6 +120,7 @@ bool RenderDetails_render(
     }
     r->destroy_details = false;
     r->destroy_source = destroy_source;
+    r->opaque_alpha = opaque && !integer;
     bool result = Renderer_perform_render(context, r);
     if (!result) {
         CONTEXT_add_to_callstack (context);
@@ -138,21 +158,19 @@ static float Renderer_percent_loss (int from_width, int to_width, int from_heigh
     return (float)fmax (lost_rows * scale_factor_y, lost_columns * scale_factor_x);
 }
 
-static int Renderer_determine_divisor(Renderer * r)
+int RenderDetails_determine_divisor(const RenderDetails * details, uint32_t source_w, uint32_t source_h, uint32_t canvas_w, uint32_t canvas_h)
 {
-    if (r->canvas == NULL) return 0;
+    int width = details->post_transpose ? canvas_h : canvas_w;
+    int height = details->post_transpose ? canvas_w : canvas_h;
 
-    int width = r->details->post_transpose ? r->canvas->h : r->canvas->w;
-    int height = r->details->post_transpose ? r->canvas->w : r->canvas->h;
 
+    double divisor_max = fmin((double)source_w / (double)width,
+                              (double)source_h / (double)height);
 
-    double divisor_max = fmin((double)r->source->w / (double)width,
-                              (double)r->source->h / (double)height);
-
-    divisor_max = divisor_max / r->details->interpolate_last_percent;
+    divisor_max = divisor_max / details->interpolate_last_percent;
 
     int divisor = (int)floor(divisor_max);
-    while (divisor > 0 && Renderer_percent_loss (r->source->w, width, r->source->h, height, divisor) > r->details->halving_acceptable_pixel_loss) {
+    while (divisor > 0 && Renderer_percent_loss (source_w, width, source_h, height, divisor) > details->halving_acceptable_pixel_loss) {
         divisor--;
     }
     return int_min(16, int_max(1, divisor));
@@ -182,6 +200,11 @@ Renderer * Renderer_create_in_place(Context * context, BitmapBgra * editInPlace,
         CONTEXT_error(context, Transpose_not_permitted_in_place);
         return NULL;
     }
+    //GDI+ layouts are only ever read
+    if (BitmapPixelFormat_unpacked(editInPlace->fmt) != editInPlace->fmt) {
+        CONTEXT_error(context, Unsupported_pixel_format);
+        return NULL;
+    }
     Renderer * r = CONTEXT_calloc_array(context, 1, Renderer);
     if (r == NULL) {
         CONTEXT_error(context, Out_of_memory);
@@ -198,11 +221,17 @@ Renderer * Renderer_create_in_place(Context * context, BitmapBgra * editInPlace,
     r->source = editInPlace;
     r->destroy_source = false;
     r->details = details;
+    r->halving_divisor = details->halving_divisor;
     return r;
 }
 
 Renderer * Renderer_create(Context * context, BitmapBgra * source, BitmapBgra * canvas, RenderDetails * details)
 {
+    //GDI+ layouts are only ever read
+    if (canvas != NULL && BitmapPixelFormat_unpacked(canvas->fmt) != canvas->fmt) {
+        CONTEXT_error(context, Unsupported_pixel_format);
+        return NULL;
+    }
     Renderer * r = CONTEXT_calloc_array(context, 1, Renderer);
     if (r == NULL) {
         CONTEXT_error(context, Out_of_memory);
@@ -220,8 +249,13 @@ Renderer * Renderer_create(Context * context, BitmapBgra * source, BitmapBgra *
             return NULL;
         }
     }
-    if (r->details->halving_divisor == 0) {
-        r->details->halving_divisor = Renderer_determine_divisor(r);
+    r->halving_divisor = details->halving_divisor;
+    //Halving averages bytes, so wide formats (and 13-bit linear ones, which unpack to 16 bits) are scaled in full
+    if (BitmapPixelFormat_is_wide(BitmapPixelFormat_unpacked(source->fmt))) {
+        r->halving_divisor = 1;
+    }
+    if (r->halving_divisor == 0 && canvas != NULL) {
+        r->halving_divisor = (uint32_t)RenderDetails_determine_divisor(details, source->w, source->h, canvas->w, canvas->h);
     }
     return r;
 }
@@ -240,6 +274,365 @@ static void SimpleRenderInPlace(void)
 */
 
 
+static bool ApplyConvolutionsFloat1D(Context * context, const RenderDetails * details, BitmapFloat * img, const uint32_t from_row, const uint32_t row_count,
+                                     double sharpening_applied, float * blur_scratch)
+{
+    if (details->kernel_a != NULL){
+        prof_start (context, "convolve kernel a", false);
+        if (!BitmapFloat_convolve_rows (context, img, details->kernel_a, img->channels, from_row, row_count, blur_scratch)) {
+            CONTEXT_add_to_callstack (context);
+            return false;
+        }
+        prof_stop (context, "convolve kernel a", true, false);
+    }
+    if (details->kernel_b != NULL){
+        prof_start (context, "convolve kernel b", false);
+        if (!BitmapFloat_convolve_rows (context, img, details->kernel_b, img->channels, from_row, row_count, blur_scratch)) {
+            CONTEXT_add_to_callstack (context);
+            return false;
+        }
+        prof_stop (context, "convolve kernel b", true, false);
+    }
+    if (details->sharpen_percent_goal > sharpening_applied + 0.01) {
+        prof_start(context,"SharpenBgraFloatRowsInPlace", false);
+        if (!BitmapFloat_sharpen_rows(context, img, from_row, row_count, details->sharpen_percent_goal - sharpening_applied)) {
+            CONTEXT_add_to_callstack (context);
+            return false;
+        }
+        prof_stop(context,"SharpenBgraFloatRowsInPlace", true, false);
+    }
+    return true;
+}
+
+BitmapPixelFormat RenderDetails_scaling_format(const RenderDetails * details, BitmapPixelFormat source_format, bool alpha_meaningful, bool final_pass)
+{
+    //GDI+ layouts are scaled like what they unpack to, and wide formats like the 8-bit ones with the same channels
+    source_format = BitmapPixelFormat_unpacked(source_format);
+    if (source_format == Bgr48) source_format = Bgr24;
+    if (source_format == Bgra64 || source_format == BgraHalf) source_format = Bgra32;
+    if (source_format == Bgra32 && !alpha_meaningful) return Bgr24;
+    if (source_format == Gray8 && final_pass && (details->apply_color_matrix || details->color_lut != NULL)) return Bgr24;
+    return source_format;
+}
+
+double RenderDetails_source_span(const RenderDetails * details, bool height, uint32_t output_size)
+{
+    const double span = height ? details->source_span_y : details->source_span_x;
+    return span > 0 ? span : (double)output_size;
+}
+
+bool RenderDetails_sharpens_rows(const RenderDetails * details, const LineContributions * contrib)
+{
+    return details->sharpen_percent_goal > (contrib == NULL ? 0 : contrib->percent_negative) + 0.01;
+}
+
+//A matrix that only scales and offsets each channel is applied as the rows are encoded, rather than in a pass of its own.
+//Not with a color LUT, which has to see the matrix's output.
+static bool RenderDetails_color_matrix_per_channel(const RenderDetails * details, BitmapPixelFormat scaling_format)
+{
+    return details->apply_color_matrix && details->color_lut == NULL &&
+           ColorMatrix_is_per_channel(details->color_matrix, BitmapPixelFormat_bytes_per_pixel(scaling_format));
+}
+
+static bool ApplyColorMatrix(Context * context, RenderDetails * details, BitmapFloat * img, const uint32_t row_count)
+{
+    prof_start(context,"apply_color_matrix_float", false);
+    bool b= BitmapFloat_apply_color_matrix(context, img, 0, row_count, details->color_matrix);
+    prof_stop(context,"apply_color_matrix_float", true, false);
+    return b;
+}
+
+static bool ApplyColorLut(Context * context, const ColorLutStage * stage, BitmapFloat * img, const uint32_t row_count)
+{
+    prof_start(context,"apply_color_lut", false);
+    bool b = BitmapFloat_apply_color_lut(context, img, 0, row_count, stage);
+    prof_stop(context,"apply_color_lut", true, false);
+    return b;
+}
+
+
+/*
+ * Row loops can be split into bands of rows, each rendered by its own thread. Every row is processed exactly as it
+ * would be on a single thread, so the output is identical. Bands get their own float buffers and kernel scratch space,
+ * allocated up-front on the calling thread, and their own Context (see Context_initialize_worker).
+ */
+
+typedef struct RenderBandStruct RenderBand;
+
+typedef bool (*render_band_function)(Context * context, RenderBand * band);
+
+struct RenderBandStruct {
+    Context context; //Only used when there is more than one band
+    RenderDetails details; //A copy of the render details, referring to this band's kernels
+    ConvolutionKernel kernel_a;
+    ConvolutionKernel kernel_b;
+    BitmapFloat * source_buf;
+    BitmapFloat * dest_buf;
+    BitmapBgra * src;
+    BitmapBgra * dst;
+    const LineContributions * contrib;
+    const PaddedContributions * padded; //Used instead of contrib for scaling when set
+    const FixedContributions * fixed;
+    bool decode_while_scaling; //Scale straight from src with BitmapBgra_scale_rows_decoding, unless halving
+    DecodingStrip * decoding_strip; //Its scratch space, when decode_while_scaling
+    HalvingSums * halving_sums; //Scratch space for halving, when the band halves
+    float * blur_scratch; //For kernels applied by their sigma, when there are any
+    const ChannelTransform * channel_transform; //Replaces the color matrix, when set
+    const ChannelLuts * channel_luts; //The same, for the integer pipeline
+    const ColorLutStage * color_lut; //Applied after the color matrix, when set
+    bool transpose;
+    bool flip_source; //Read the halved source rows bottom-up
+    bool opaque_alpha; //src's alpha is all 0xff: rows are scaled with alpha 1, and aren't premultiplied, matted or composed
+    int call_number;
+    int divisor;
+    uint32_t from_row;
+    uint32_t row_count;
+    render_band_function render;
+    bool success;
+};
+
+static uint32_t Renderer_band_count(const RenderDetails * details, const uint32_t row_count)
+{
+    //Fewer rows than this per band aren't worth a thread
+    const uint32_t minimum_band_rows = 32;
+    return umax(1, umin(umin(details->threads, FASTSCALING_MAX_THREADS), row_count / minimum_band_rows));
+}
+
+static bool ConvolutionKernel_copy_for_band(Context * context, const ConvolutionKernel * from, ConvolutionKernel * to)
+{
+    *to = *from;
+    to->buffer = (float *)CONTEXT_malloc(context, (from->radius + 2) * 4 * sizeof(float));
+    if (to->buffer == NULL) {
+        CONTEXT_error(context, Out_of_memory);
+        return false;
+    }
+    return true;
+}
+
+static void RenderBands_destroy(Context * context, RenderBand * bands, const uint32_t band_count)
+{
+    if (bands == NULL) return;
+    for (uint32_t i = 0; i < band_count; i++) {
+        BitmapFloat_destroy(context, bands[i].source_buf);
+        BitmapFloat_destroy(context, bands[i].dest_buf);
+        DecodingStrip_destroy(context, bands[i].decoding_strip);
+        HalvingSums_destroy(context, bands[i].halving_sums);
+        CONTEXT_free(context, bands[i].blur_scratch);
+        if (bands[i].details.kernel_a == &bands[i].kernel_a) CONTEXT_free(context, bands[i].kernel_a.buffer);
+        if (bands[i].details.kernel_b == &bands[i].kernel_b) CONTEXT_free(context, bands[i].kernel_b.buffer);
+    }
+    CONTEXT_free(context, bands);
+}
+
+static bool ConvolutionKernel_blurs(const ConvolutionKernel * kernel)
+{
+    return kernel != NULL && ConvolutionKernel_select_method(kernel) != Convolution_direct;
+}
+
+//Bands start on a multiple of buffer_rows, so rows are batched the same way as on a single thread
+static uint32_t RenderBands_boundary(const uint32_t band, const uint32_t band_count, const uint32_t row_count, const uint32_t buffer_rows)
+{
+    if (band >= band_count) return row_count;
+    const uint32_t boundary = (uint32_t)((uint64_t)row_count * band / band_count);
+    return buffer_rows > 1 ? boundary - boundary % buffer_rows : boundary;
+}
+
+//Splits row_count rows into bands that share everything in prototype. source_w/dest_w of 0 skip creating that buffer.
+//Kernels are copied when there is more than one band, or when private_kernels is set (so concurrent passes don't share them).
+static RenderBand * RenderBands_create(Context * context, const RenderBand * prototype, const uint32_t band_count, const uint32_t row_count,
+                                       const uint32_t source_w, const uint32_t dest_w, const uint32_t buffer_rows, const BitmapPixelFormat format,
+                                       const bool private_kernels)
+{
+    RenderBand * bands = CONTEXT_calloc_array(context, band_count, RenderBand);
+    if (bands == NULL) {
+        CONTEXT_error(context, Out_of_memory);
+        return NULL;
+    }
+    for (uint32_t i = 0; i < band_count; i++) {
+        RenderBand * band = &bands[i];
+        *band = *prototype;
+        band->source_buf = NULL;
+        band->dest_buf = NULL;
+        band->decoding_strip = NULL;
+        band->halving_sums = NULL;
+        band->blur_scratch = NULL;
+        band->from_row = RenderBands_boundary(i, band_count, row_count, buffer_rows);
+        band->row_count = RenderBands_boundary(i + 1, band_count, row_count, buffer_rows) - band->from_row;
+
+        //Kernels hold scratch space, so concurrent bands can't share them
+        const bool copy_kernels = band_count > 1 || private_kernels;
+        if (copy_kernels && band->details.kernel_a != NULL) {
+            if (!ConvolutionKernel_copy_for_band(context, band->details.kernel_a, &band->kernel_a)) {
+                CONTEXT_add_to_callstack (context);
+                RenderBands_destroy(context, bands, i);
+                return NULL;
+            }
+            band->details.kernel_a = &band->kernel_a;
+        }
+        if (copy_kernels && band->details.kernel_b != NULL) {
+            if (!ConvolutionKernel_copy_for_band(context, band->details.kernel_b, &band->kernel_b)) {
+                CONTEXT_add_to_callstack (context);
+                RenderBands_destroy(context, bands, i + 1);
+                return NULL;
+            }
+            band->details.kernel_b = &band->kernel_b;
+        }
+        if (source_w > 0) {
+            band->source_buf = BitmapFloat_create(context, source_w, buffer_rows, format, false);
+            if (band->source_buf == NULL) {
+                CONTEXT_add_to_callstack (context);
+                RenderBands_destroy(context, bands, i + 1);
+                return NULL;
+            }
+        }
+        if (dest_w > 0) {
+            band->dest_buf = BitmapFloat_create(context, dest_w, buffer_rows, format, false);
+            if (band->dest_buf == NULL) {
+                CONTEXT_add_to_callstack (context);
+                RenderBands_destroy(context, bands, i + 1);
+                return NULL;
+            }
+        }
+        //Kernels are applied to the dest buffer, or without one, the source buffer
+        const uint32_t kernel_w = dest_w > 0 ? dest_w : source_w;
+        if (kernel_w > 0 && (ConvolutionKernel_blurs(band->details.kernel_a) || ConvolutionKernel_blurs(band->details.kernel_b))) {
+            band->blur_scratch = CONTEXT_calloc_array(context, (size_t)kernel_w * BLUR_SCRATCH_FLOATS_PER_PIXEL, float);
+            if (band->blur_scratch == NULL) {
+                CONTEXT_error(context, Out_of_memory);
+                RenderBands_destroy(context, bands, i + 1);
+                return NULL;
+            }
+        }
+        if (band->decode_while_scaling) {
+            band->decoding_strip = DecodingStrip_create(context, band->padded);
+            if (band->decoding_strip == NULL) {
+                CONTEXT_add_to_callstack (context);
+                RenderBands_destroy(context, bands, i + 1);
+                return NULL;
+            }
+        }
+    }
+    return bands;
+}
+
+//Gives each band room to halve rows of up to columns values
+static bool RenderBands_create_halving_sums(Context * context, RenderBand * bands, const uint32_t band_count, const uint32_t columns, const bool unpack)
+{
+    for (uint32_t i = 0; i < band_count; i++) {
+        bands[i].halving_sums = HalvingSums_create(context, columns, unpack);
+        if (bands[i].halving_sums == NULL) {
+            CONTEXT_add_to_callstack (context);
+            return false;
+        }
+    }
+    return true;
+}
+
+static void RenderBand_run(void * item)
+{
+    RenderBand * band = (RenderBand *)item;
+    band->success = band->render(&band->context, band);
+}
+
+static bool RenderBands_run(Context * context, RenderBand * bands, const uint32_t band_count)
+{
+    if (band_count == 1) {
+        return bands[0].render(context, &bands[0]);
+    }
+    //Workers share the context's tables, so they can't be the ones to build them
+    if ((BitmapPixelFormat_is_wide(BitmapPixelFormat_unpacked(bands[0].src->fmt)) || BitmapPixelFormat_is_wide(bands[0].dst->fmt)) && !Context_prepare_wide_tables(context)) {
+        CONTEXT_add_to_callstack (context);
+        return false;
+    }
+    const uint32_t log_capacity = (context->log.capacity - umin(context->log.count, context->log.capacity)) / band_count;
+    for (uint32_t i = 0; i < band_count; i++) {
+        if (!Context_initialize_worker(context, &bands[i].context, log_capacity)) {
+            for (uint32_t j = 0; j < i; j++) {
+                Context_terminate_worker(context, &bands[j].context);
+            }
+            CONTEXT_add_to_callstack (context);
+            return false;
+        }
+    }
+    Threads_run_parallel(RenderBand_run, bands, sizeof(RenderBand), band_count);
+
+    bool success = true;
+    for (uint32_t i = 0; i < band_count; i++) {
+        Context_terminate_worker(context, &bands[i].context);
+        success = success && bands[i].success;
+    }
+    if (!success) {
+        CONTEXT_add_to_callstack (context);
+    }
+    return success;
+}
+
+
+static bool Halve_band(Context * context, RenderBand * band)
+{
+    //Views of just this band's rows
+    BitmapBgra from = *band->src;
+    BitmapBgra to = *band->dst;
+    from.pixels += (size_t)band->from_row * band->divisor * from.stride;
+    from.h = band->row_count * band->divisor;
+    to.pixels += (size_t)band->from_row * to.stride;
+    to.h = band->row_count;
+    if (!Halve(context, &from, &to, band->divisor, band->halving_sums)) {
+        CONTEXT_add_to_callstack (context);
+        return false;
+    }
+    return true;
+}
+
+RenderPass * RenderPass_create_halving(Context * context, const RenderDetails * details, const BitmapBgra * pSrc, const BitmapBgra * pDst,
+                                       uint32_t halving_divisor)
+{
+    RenderPass * pass = CONTEXT_calloc_array(context, 1, RenderPass);
+    if (pass == NULL) {
+        CONTEXT_error(context, Out_of_memory);
+        return NULL;
+    }
+    pass->band_count = Renderer_band_count(details, pDst->h);
+    pass->halving_divisor = halving_divisor;
+    //Halving reads neither the details nor their kernels
+    RenderBand prototype;
+    memset(&prototype, 0, sizeof(prototype));
+    prototype.render = Halve_band;
+    pass->bands = RenderBands_create(context, &prototype, pass->band_count, pDst->h, 0, 0, 0, pSrc->fmt, false);
+    if (pass->bands == NULL) {
+        CONTEXT_add_to_callstack (context);
+        RenderPass_destroy(context, pass);
+        return NULL;
+    }
+    const BitmapPixelFormat unpacked = BitmapPixelFormat_unpacked(pSrc->fmt);
+    if (!RenderBands_create_halving_sums(context, pass->bands, pass->band_count, pDst->w * halving_divisor * BitmapPixelFormat_bytes_per_pixel(unpacked),
+                                         unpacked != pSrc->fmt)) {
+        CONTEXT_add_to_callstack (context);
+        RenderPass_destroy(context, pass);
+        return NULL;
+    }
+    return pass;
+}
+
+//Halving in place can't be split, as each band would overwrite rows the band above it reads
+static bool Renderer_halve_in_bands(Context * context, const Renderer * r, BitmapBgra * from, BitmapBgra * to, int divisor)
+{
+    RenderPass * pass = r->halving_pass != NULL ? r->halving_pass : RenderPass_create_halving(context, r->details, from, to, (uint32_t)divisor);
+    if (pass == NULL) {
+        CONTEXT_add_to_callstack (context);
+        return false;
+    }
+    bool success = RenderPass_run(context, pass, from, to, (uint32_t)divisor, false, false);
+    if (!success) {
+        CONTEXT_add_to_callstack (context);
+    }
+    if (pass != r->halving_pass) {
+        RenderPass_destroy(context, pass);
+    }
+    return success;
+}
+
+
 // TODO: find better name
 static bool HalveInTempImage(Context * context, Renderer * r, int divisor)
 {
@@ -251,40 +644,64 @@ static bool HalveInTempImage(Context * context, Renderer * r, int divisor)
     prof_start(context,"create temp image for halving", false);
     int halved_width = (int)(r->source->w / divisor);
     int halved_height = (int)(r->source->h / divisor);
-    BitmapBgra * tmp_im = BitmapBgra_create(context, halved_width, halved_height, true, r->source->fmt);
+    //GDI+ layouts are halved as they're unpacked
+    const BitmapPixelFormat halved_format = BitmapPixelFormat_unpacked(r->source->fmt);
+    BitmapBgra * tmp_im = r->halving_buffer != NULL ? r->halving_buffer : BitmapBgra_create(context, halved_width, halved_height, true, halved_format);
     if (tmp_im == NULL) {
         CONTEXT_add_to_callstack (context);
         return false;
     }
+    if (tmp_im->w != (uint32_t)halved_width || tmp_im->h != (uint32_t)halved_height || tmp_im->fmt != halved_format) {
+        CONTEXT_error(context, Invalid_internal_state);
+        return false;
+    }
     // from here we have a temp image
     prof_stop(context,"create temp image for halving", true, false);
 
-    if (!Halve(context, r->source, tmp_im, divisor)) {
+    if (!Renderer_halve_in_bands(context, r, r->source, tmp_im, divisor)) {
         // we cannot return here, or tmp_im will leak
         CONTEXT_add_to_callstack (context);
         result = false;
     }
     tmp_im->alpha_meaningful = r->source->alpha_meaningful;
+    tmp_im->alpha_premultiplied = r->source->alpha_premultiplied;
 
     if (r->destroy_source) {
         BitmapBgra_destroy(context,r->source);
     }
     r->source = tmp_im;
-    r->destroy_source = true; //Cleanup tmp_im
+    r->destroy_source = tmp_im != r->halving_buffer; //Cleanup tmp_im
     return result;
 }
 
+bool Renderer_can_fuse_halving(Context * context, const RenderDetails * details, const BitmapBgra * source, const BitmapBgra * canvas)
+{
+    const bool streaming = details->enable_streaming_vertical_pass && details->kernel_a == NULL && details->kernel_b == NULL;
+    //Integer passes read bytes, so keep the temporary image for them
+    const bool integer = details->enable_integer_pipeline && context->colorspace.floatspace == Floatspace_as_is;
+    //The fused pass decodes straight alpha; averaging premultiplied bytes is right as they are
+    const bool premultiplied = source->alpha_meaningful && source->alpha_premultiplied;
+    return details->enable_fused_halving && canvas != NULL && !source->can_reuse_space && !streaming && !integer && !premultiplied &&
+           (source->fmt == Gray8 || source->fmt == Bgr24 || source->fmt == Bgra32);
+}
+
 static bool Renderer_complete_halving(Context * context, Renderer * r)
 {
-    int divisor = r->details->halving_divisor;
+    int divisor = (int)r->halving_divisor;
     if (divisor <= 1) {
         return true;
     }
+    r->halving_divisor = 0; //Don't halve twice
+    if (Renderer_can_fuse_halving(context, r->details, r->source, r->canvas)) {
+        r->fused_halving_divisor = (uint32_t)divisor;
+        return true;
+    }
     bool result = true;
     prof_start(context, "CompleteHalving", false);
-    r->details->halving_divisor = 0; //Don't halve twice
 
-    result = r->source->can_reuse_space ? HalveInPlace (context, r->source, divisor) : HalveInTempImage (context, r, divisor);
+    //Unpacked pixels are larger, so they can't be written over the packed ones
+    const bool in_place = r->source->can_reuse_space && BitmapPixelFormat_unpacked(r->source->fmt) == r->source->fmt;
+    result = in_place ? HalveInPlace (context, r->source, divisor) : HalveInTempImage (context, r, divisor);
     if (!result){
         CONTEXT_add_to_callstack (context);
     }
@@ -294,231 +711,466 @@ static bool Renderer_complete_halving(Context * context, Renderer * r)
 }
 
 
-static bool ApplyConvolutionsFloat1D(Context * context, const Renderer * r, BitmapFloat * img, const uint32_t from_row, const uint32_t row_count, double sharpening_applied)
+//Decodes rows of the band's source into buf, halving them first if the pass was given the unhalved source
+static bool RenderBand_load_rows(Context * context, RenderBand * band, uint32_t source_start_row, BitmapFloat * buf, uint32_t row_count)
 {
-    if (r->details->kernel_a != NULL){
-        prof_start (context, "convolve kernel a", false);
-        if (!BitmapFloat_convolve_rows (context, img, r->details->kernel_a, img->channels, from_row, row_count)) {
-            CONTEXT_add_to_callstack (context);
-            return false;
-        }
-        prof_stop (context, "convolve kernel a", true, false);
+    const bool loaded = band->divisor > 1
+                        ? BitmapBgra_halve_srgb_to_linear(context, band->src, band->divisor, source_start_row, band->flip_source, buf, 0, row_count,
+                                                          band->halving_sums)
+                        : BitmapBgra_convert_srgb_to_linear(context, band->src, source_start_row, buf, 0, row_count);
+    if (!loaded) {
+        CONTEXT_add_to_callstack (context);
     }
-    if (r->details->kernel_b != NULL){
-        prof_start (context, "convolve kernel b", false);
-        if (!BitmapFloat_convolve_rows (context, img, r->details->kernel_b, img->channels, from_row, row_count)) {
+    return loaded;
+}
+
+//Fills row_count rows of the band's dest_buf with scaled rows from source_start_row on
+static bool RenderBand_scale_rows(Context * context, RenderBand * band, uint32_t source_start_row, uint32_t row_count)
+{
+    if (band->decode_while_scaling && band->divisor <= 1 && !band->opaque_alpha) {
+        prof_start(context,"scale_rows_decoding", false);
+        if (!BitmapBgra_scale_rows_decoding(context, band->src, source_start_row, band->dest_buf, 0, row_count, band->padded,
+                                            band->decoding_strip)) {
             CONTEXT_add_to_callstack (context);
             return false;
         }
-        prof_stop (context, "convolve kernel b", true, false);
+        prof_stop(context,"scale_rows_decoding", true, false);
+        return true;
     }
-    if (r->details->sharpen_percent_goal > sharpening_applied + 0.01) {
-        prof_start(context,"SharpenBgraFloatRowsInPlace", false);
-        if (!BitmapFloat_sharpen_rows(context, img, from_row, row_count, r->details->sharpen_percent_goal - sharpening_applied)) {
-            CONTEXT_add_to_callstack (context);
-            return false;
-        }
-        prof_stop(context,"SharpenBgraFloatRowsInPlace", true, false);
+    prof_start(context,"convert_srgb_to_linear", false);
+    if (!RenderBand_load_rows(context, band, source_start_row, band->source_buf, row_count)) {
+        CONTEXT_add_to_callstack (context);
+        return false;
     }
-    return true;
-}
+    prof_stop(context,"convert_srgb_to_linear", true, false);
 
-static bool ApplyColorMatrix(Context * context, const Renderer * r, BitmapFloat * img, const uint32_t row_count)
-{
-    prof_start(context,"apply_color_matrix_float", false);
-    bool b= BitmapFloat_apply_color_matrix(context, img, 0, row_count, r->details->color_matrix);
-    prof_stop(context,"apply_color_matrix_float", true, false);
-    return b;
+    prof_start(context,"ScaleBgraFloatRows", false);
+    const bool scaled = band->padded != NULL ? BitmapFloat_scale_rows_padded(context, band->source_buf, 0, band->dest_buf, 0, row_count, band->padded)
+                                             : BitmapFloat_scale_rows(context, band->source_buf, 0, band->dest_buf, 0, row_count, band->contrib->ContribRow);
+    if (!scaled) {
+        CONTEXT_add_to_callstack (context);
+        return false;
+    }
+    prof_stop(context,"ScaleBgraFloatRows", true, false);
+    return true;
 }
 
-
-static bool ScaleAndRender1D(Context * context, const Renderer * r,
-                             BitmapBgra * pSrc,
-                             BitmapBgra * pDst,
-                             const RenderDetails * details,
-                             bool transpose,
-                             int call_number)
+static bool ScaleAndRender1D_band(Context * context, RenderBand * band)
 {
-    LineContributions * contrib = NULL;
-    BitmapFloat * source_buf = NULL;
-    BitmapFloat * dest_buf = NULL;
-
-    uint32_t from_count = pSrc->w;
-    uint32_t to_count = transpose ? pDst->h : pDst->w;
+    //How many rows to buffer and process at a time.
+    const uint32_t buffer_row_count = band->source_buf->h;
+    BitmapFloat * source_buf = band->source_buf;
+    BitmapFloat * dest_buf = band->dest_buf;
+    RenderDetails * details = &band->details;
 
-    bool success = true;
+    source_buf->alpha_meaningful = band->src->alpha_meaningful && !band->opaque_alpha;
+    dest_buf->alpha_meaningful = source_buf->alpha_meaningful;
 
-    if (details->interpolation->window == 0) {
-        CONTEXT_error(context, Invalid_argument);
-        return false;
-    }
+    source_buf->alpha_premultiplied = source_buf->channels == 4 && !band->opaque_alpha;
+    dest_buf->alpha_premultiplied = source_buf->alpha_premultiplied;
 
+    /* Scale each set of lines */
+    for (uint32_t source_start_row = band->from_row; source_start_row < band->from_row + band->row_count; source_start_row += buffer_row_count) {
+        const uint32_t row_count = umin(band->from_row + band->row_count - source_start_row, buffer_row_count);
 
-    //How many rows to buffer and process at a time.
-    const uint32_t buffer_row_count = 4; //using buffer=5 seems about 6% better than most other non-zero values.
+        if (!RenderBand_scale_rows(context, band, source_start_row, row_count)) {
+            CONTEXT_add_to_callstack (context);
+            return false;
+        }
 
-    //How many bytes per pixel are we scaling?
-    BitmapPixelFormat scaling_format = (pSrc->fmt == Bgra32 && !pSrc->alpha_meaningful) ? Bgr24 : pSrc->fmt;
+        if (!ApplyConvolutionsFloat1D(context, details, dest_buf, 0, row_count, band->contrib->percent_negative, band->blur_scratch)) {
+            CONTEXT_add_to_callstack (context);
+            return false;
+        }
+        if (details->apply_color_matrix && band->call_number == 2 && band->channel_transform == NULL) {
+            if (!ApplyColorMatrix(context, details, dest_buf, row_count)) {
+                CONTEXT_add_to_callstack (context);
+                return false;
+            }
+        }
+        if (band->color_lut != NULL && !ApplyColorLut(context, band->color_lut, dest_buf, row_count)) {
+            CONTEXT_add_to_callstack (context);
+            return false;
+        }
 
-    prof_start(context,"contributions_calc", false);
+        prof_start(context,"pivoting_composite_linear_over_srgb", false);
+        if (!BitmapFloat_pivoting_composite_linear_over_srgb(context, dest_buf, 0, band->dst, source_start_row, row_count, band->transpose,
+                                                             band->channel_transform)) {
+            CONTEXT_add_to_callstack (context);
+            return false;
+        }
+        prof_stop(context,"pivoting_composite_linear_over_srgb", true, false);
 
-    contrib = LineContributions_create(context, to_count, from_count, details->interpolation);
-    if (contrib == NULL) {
-        CONTEXT_add_to_callstack (context);
-        success = false;
-        goto cleanup;
     }
-    prof_stop(context,"contributions_calc", true, false);
-
-
-    prof_start(context,"create_bitmap_float (buffers)", false);
+    return true;
+}
 
-    source_buf = BitmapFloat_create(context, from_count, buffer_row_count, scaling_format, false);
-    if (source_buf == NULL) {
+static bool ScaleAndRender1D_band_fixed(Context * context, RenderBand * band)
+{
+    prof_start(context,"scale_rows_fixed", false);
+    if (!BitmapBgra_scale_rows_fixed(context, band->src, band->from_row, band->row_count, band->dst, band->transpose, band->fixed)) {
         CONTEXT_add_to_callstack (context);
-        success = false;
-        goto cleanup;
+        return false;
     }
-    dest_buf = BitmapFloat_create(context, to_count, buffer_row_count, scaling_format, false);
-    if (dest_buf == NULL) {
-        CONTEXT_add_to_callstack (context);
-        success = false;
-        goto cleanup;
+    if (band->channel_luts != NULL) {
+        BitmapBgra_apply_channel_luts(band->dst, band->from_row, band->row_count, band->transpose, band->channel_luts);
     }
-    source_buf->alpha_meaningful = pSrc->alpha_meaningful;
-    dest_buf->alpha_meaningful = source_buf->alpha_meaningful;
-
-    source_buf->alpha_premultiplied = source_buf->channels == 4;
-    dest_buf->alpha_premultiplied = source_buf->alpha_premultiplied;
+    prof_stop(context,"scale_rows_fixed", true, false);
+    return true;
+}
 
-    prof_stop(context,"create_bitmap_float (buffers)", true, false);
+static bool Render1D_band(Context * context, RenderBand * band)
+{
+    //How many rows to buffer and process at a time.
+    const uint32_t buffer_row_count = band->source_buf->h;
+    BitmapFloat * buf = band->source_buf;
+    RenderDetails * details = &band->details;
 
+    buf->alpha_meaningful = band->src->alpha_meaningful && !band->opaque_alpha;
+    buf->alpha_premultiplied = buf->channels == 4 && !band->opaque_alpha;
 
     /* Scale each set of lines */
-    for (uint32_t source_start_row = 0; source_start_row < pSrc->h; source_start_row += buffer_row_count) {
-        const uint32_t row_count = umin(pSrc->h - source_start_row, buffer_row_count);
-
-        prof_start(context,"convert_srgb_to_linear", false);
-        if (!BitmapBgra_convert_srgb_to_linear(context,pSrc, source_start_row, source_buf, 0, row_count)) {
-            CONTEXT_add_to_callstack (context);
-            success=false;
-            goto cleanup;
-        }
-        prof_stop(context,"convert_srgb_to_linear", true, false);
+    for (uint32_t source_start_row = band->from_row; source_start_row < band->from_row + band->row_count; source_start_row += buffer_row_count) {
+        const uint32_t row_count = umin(band->from_row + band->row_count - source_start_row, buffer_row_count);
 
-        prof_start(context,"ScaleBgraFloatRows", false);
-        if (!BitmapFloat_scale_rows(context, source_buf, 0, dest_buf, 0, row_count, contrib->ContribRow)) {
+        if (!RenderBand_load_rows(context, band, source_start_row, buf, row_count)) {
             CONTEXT_add_to_callstack (context);
-            success=false;
-            goto cleanup;
+            return false;
         }
-        prof_stop(context,"ScaleBgraFloatRows", true, false);
-
-
-        if (!ApplyConvolutionsFloat1D(context, r, dest_buf, 0, row_count, contrib->percent_negative)) {
+        if (!ApplyConvolutionsFloat1D(context, details, buf, 0, row_count, 0, band->blur_scratch)) {
             CONTEXT_add_to_callstack (context);
-            success=false;
-            goto cleanup;
+            return false;
         }
-        if (details->apply_color_matrix && call_number == 2) {
-            if (!ApplyColorMatrix(context, r, dest_buf, row_count)) {
+        if (details->apply_color_matrix && band->call_number == 2 && band->channel_transform == NULL) {
+            if (!ApplyColorMatrix(context, details, buf, row_count)) {
                 CONTEXT_add_to_callstack (context);
-                success=false;
-                goto cleanup;
+                return false;
             }
         }
-
-        prof_start(context,"pivoting_composite_linear_over_srgb", false);
-        if (!BitmapFloat_pivoting_composite_linear_over_srgb(context, dest_buf, 0, pDst, source_start_row, row_count, transpose)) {
+        if (band->color_lut != NULL && !ApplyColorLut(context, band->color_lut, buf, row_count)) {
             CONTEXT_add_to_callstack (context);
-            success=false;
-            goto cleanup;
+            return false;
         }
-        prof_stop(context,"pivoting_composite_linear_over_srgb", true, false);
 
+        if (!BitmapFloat_pivoting_composite_linear_over_srgb(context, buf, 0, band->dst, source_start_row, row_count, band->transpose,
+                                                             band->channel_transform)) {
+            CONTEXT_add_to_callstack (context);
+            return false;
+        }
     }
     //sRGB sharpening
     //Color matrix
-
-
-cleanup:
-    //p->Start("Free Contributions,FloatBuffers", false);
-
-    if (contrib != NULL) LineContributions_destroy(context, contrib);
-
-    if (source_buf != NULL) BitmapFloat_destroy(context, source_buf);
-    if (dest_buf != NULL) BitmapFloat_destroy(context, dest_buf);
-    ///p->Stop("Free Contributions,FloatBuffers", true, false);
-
-    return success;
+    return true;
 }
 
+void RenderPass_destroy(Context * context, RenderPass * pass)
+{
+    if (pass == NULL) return;
+    RenderBands_destroy(context, pass->bands, pass->band_count);
+    PaddedContributions_destroy(context, pass->padded);
+    FixedContributions_destroy(context, pass->fixed);
+    CONTEXT_free(context, pass->channel_luts);
+    ColorLutStage_destroy(context, pass->color_lut);
+    if (pass->destroy_contrib) {
+        LineContributions_destroy(context, pass->contrib);
+    }
+    CONTEXT_free(context, pass);
+}
 
+//Whether the float pipeline would do nothing the integer one can't: no gamma, alpha, format conversion, or float-only steps
+static bool RenderPass_can_use_integer_pipeline(Context * context, const RenderDetails * details, const BitmapBgra * pSrc, const BitmapBgra * pDst,
+                                                int call_number, const LineContributions * contrib)
+{
+    const bool opaque = pSrc->fmt == Bgr24 || !pSrc->alpha_meaningful;
+    return details->enable_integer_pipeline && context->colorspace.floatspace == Floatspace_as_is && opaque &&
+           pSrc->fmt == pDst->fmt && (pSrc->fmt == Bgr24 || pSrc->fmt == Bgra32) &&
+           details->kernel_a == NULL && details->kernel_b == NULL &&
+           !(details->apply_color_matrix && call_number == 2 && !RenderDetails_color_matrix_per_channel(details, Bgr24)) &&
+           !(details->color_lut != NULL && call_number == 2) &&
+           !RenderDetails_sharpens_rows(details, contrib);
+}
 
-static bool Render1D(Context * context,
-                     const Renderer * r,
-                     BitmapBgra * pSrc,
-                     BitmapBgra * pDst,
-                     const RenderDetails * details,
-                     bool transpose,
-                     int call_number)
+RenderPass * RenderPass_create(Context * context, const RenderDetails * details, const BitmapBgra * pSrc, const BitmapBgra * pDst,
+                               bool transpose, int call_number, LineContributions * contrib, bool private_kernels, uint32_t halving_divisor)
 {
+    const uint32_t from_count = pSrc->w;
+    const uint32_t to_count = transpose ? pDst->h : pDst->w;
+    //The first pass scales the source's rows, and the second its columns
+    const double span = RenderDetails_source_span(details, call_number == 2, to_count);
+    const bool perfect_size = span == to_count &&
+                              (transpose ? (pSrc->h == pDst->w && pDst->h == pSrc->w) : (pSrc->w == pDst->w && pSrc->h == pDst->h));
+
+    //How many bytes per pixel are we scaling?
+    BitmapPixelFormat scaling_format = RenderDetails_scaling_format(details, pSrc->fmt, pSrc->alpha_meaningful, call_number == 2);
 
-    bool success= true;
     //How many rows to buffer and process at a time.
-    uint32_t buffer_row_count = 4; //using buffer=5 seems about 6% better than most other non-zero values.
+    //using buffer=5 seems about 6% better than most other non-zero values. Gray rows are smaller, and are transposed 8 at a time.
+    const uint32_t buffer_row_count = scaling_format == Gray8 ? 8 : 4;
 
-    //How many bytes per pixel are we scaling?
-    BitmapPixelFormat scaling_format = (pSrc->fmt == Bgra32 && !pSrc->alpha_meaningful) ? Bgr24 : pSrc->fmt;
+    if (!perfect_size && details->interpolation == NULL) {
+        CONTEXT_error(context, Interpolation_details_missing);
+        return NULL;
+    }
+    if (!perfect_size && details->interpolation->window == 0) {
+        CONTEXT_error(context, Invalid_argument);
+        return NULL;
+    }
+    RenderPass * pass = CONTEXT_calloc_array(context, 1, RenderPass);
+    if (pass == NULL) {
+        CONTEXT_error(context, Out_of_memory);
+        return NULL;
+    }
+    pass->band_count = Renderer_band_count(details, pSrc->h);
+    pass->halving_divisor = umax(1, halving_divisor);
+
+    if (!perfect_size) {
+        if (contrib == NULL) {
+            prof_start(context,"contributions_calc", false);
+            contrib = LineContributions_create_span(context, span, from_count, details->interpolation, 0, to_count);
+            if (contrib == NULL) {
+                CONTEXT_add_to_callstack (context);
+                RenderPass_destroy(context, pass);
+                return NULL;
+            }
+            prof_stop(context,"contributions_calc", true, false);
+            pass->destroy_contrib = true;
+        }
+        pass->contrib = contrib;
+        //Fixed-length windows let the vectorized kernels skip the per-window tails
+        const bool integer = RenderPass_can_use_integer_pipeline(context, details, pSrc, pDst, call_number, contrib);
+        if (integer || ScalePaddedRow_select(context->simd.active, BitmapPixelFormat_bytes_per_pixel(scaling_format), false) != NULL) {
+            pass->padded = PaddedContributions_create(context, contrib, from_count, 4, false);
+            if (pass->padded == NULL) {
+                CONTEXT_add_to_callstack (context);
+                RenderPass_destroy(context, pass);
+                return NULL;
+            }
+        }
+        if (integer) {
+            pass->fixed = FixedContributions_create(context, pass->padded);
+            if (pass->fixed == NULL) {
+                CONTEXT_add_to_callstack (context);
+                RenderPass_destroy(context, pass);
+                return NULL;
+            }
+        }
+    }
 
+    pass->color_matrix_per_channel = call_number == 2 && RenderDetails_color_matrix_per_channel(details, scaling_format);
+    if (pass->color_matrix_per_channel) {
+        ChannelTransform_from_color_matrix(details->color_matrix, &pass->channel_transform);
+    }
+    if (pass->color_matrix_per_channel && pass->fixed != NULL) {
+        pass->channel_luts = CONTEXT_calloc_array(context, 1, ChannelLuts);
+        if (pass->channel_luts == NULL) {
+            CONTEXT_error(context, Out_of_memory);
+            RenderPass_destroy(context, pass);
+            return NULL;
+        }
+        ChannelLuts_from_transform(context, &pass->channel_transform, pass->channel_luts);
+    }
+    if (call_number == 2 && details->color_lut != NULL) {
+        pass->color_lut = ColorLutStage_create(context, details->color_lut);
+        if (pass->color_lut == NULL) {
+            CONTEXT_add_to_callstack (context);
+            RenderPass_destroy(context, pass);
+            return NULL;
+        }
+    }
+
+    RenderBand prototype;
+    memset(&prototype, 0, sizeof(prototype));
+    prototype.details = *details;
+    prototype.contrib = pass->contrib;
+    prototype.padded = pass->padded;
+    prototype.fixed = pass->fixed;
+    prototype.channel_transform = pass->color_matrix_per_channel ? &pass->channel_transform : NULL;
+    prototype.channel_luts = pass->channel_luts;
+    prototype.color_lut = pass->color_lut;
+    //Decoding the source a strip at a time as it's scaled keeps the decoded floats in L1. Measured to pay off only for
+    //premultiplied rows, downscaled at least 2x, with the vectorized kernels.
+    prototype.decode_while_scaling = pass->padded != NULL && pass->fixed == NULL && scaling_format == Bgra32 && pSrc->fmt == Bgra32 &&
+                                     !pSrc->alpha_premultiplied &&
+                                     from_count >= 2 * to_count && ScalePaddedRow_select(context->simd.active, 4, false) != NULL;
+    prototype.transpose = transpose;
+    prototype.call_number = call_number;
+    prototype.render = perfect_size ? Render1D_band : (pass->fixed != NULL ? ScaleAndRender1D_band_fixed : ScaleAndRender1D_band);
+
+    //The integer pipeline needs no float buffers
+    const bool buffered = pass->fixed == NULL;
+    prof_start(context,"create_bitmap_float (buffers)", false);
+    pass->bands = RenderBands_create(context, &prototype, pass->band_count, pSrc->h, buffered ? from_count : 0, buffered && !perfect_size ? to_count : 0,
+                                     buffer_row_count, scaling_format, private_kernels);
+    if (pass->bands == NULL) {
+        CONTEXT_add_to_callstack (context);
+        RenderPass_destroy(context, pass);
+        return NULL;
+    }
+    //Halving in the pass reads halving_divisor times as many pixels as pSrc has
+    if (pass->halving_divisor > 1 && buffered &&
+        !RenderBands_create_halving_sums(context, pass->bands, pass->band_count,
+                                         from_count * pass->halving_divisor * BitmapPixelFormat_bytes_per_pixel(pSrc->fmt), false)) {
+        CONTEXT_add_to_callstack (context);
+        RenderPass_destroy(context, pass);
+        return NULL;
+    }
+    prof_stop(context,"create_bitmap_float (buffers)", true, false);
+    return pass;
+}
 
-    BitmapFloat * buf = BitmapFloat_create(context,pSrc->w, buffer_row_count, scaling_format, false);
-    if (buf == NULL)  {
+bool RenderPass_run(Context * context, RenderPass * pass, BitmapBgra * pSrc, BitmapBgra * pDst, uint32_t halving_divisor, bool flip_source,
+                    bool opaque_alpha)
+{
+    if (halving_divisor > 1 && (pass->fixed != NULL || halving_divisor != pass->halving_divisor)) {
+        CONTEXT_error(context, Invalid_internal_state);
         return false;
     }
-    buf->alpha_meaningful = pSrc->alpha_meaningful;
-    buf->alpha_premultiplied = buf->channels == 4;
+    for (uint32_t i = 0; i < pass->band_count; i++) {
+        pass->bands[i].src = pSrc;
+        pass->bands[i].dst = pDst;
+        pass->bands[i].divisor = (int)halving_divisor;
+        pass->bands[i].flip_source = flip_source;
+        pass->bands[i].opaque_alpha = opaque_alpha;
+    }
+    if (!RenderBands_run(context, pass->bands, pass->band_count)) {
+        CONTEXT_add_to_callstack (context);
+        return false;
+    }
+    return true;
+}
 
 
+static bool Renderer_can_stream(const Renderer * r)
+{
+    return r->details->enable_streaming_vertical_pass && r->canvas != NULL &&
+           r->details->kernel_a == NULL && r->details->kernel_b == NULL;
+}
 
-    /* Scale each set of lines */
-    for (uint32_t source_start_row = 0; source_start_row < pSrc->h; source_start_row += buffer_row_count) {
-        const uint32_t row_count = umin(pSrc->h - source_start_row, buffer_row_count);
+//Sets *scaler to the scaler a streaming render of r would use, or to NULL if streaming would change the output.
+//The two-pass render sharpens the rows of any pass whose weights fall short of sharpen_percent_goal; a ring of
+//horizontally scaled rows has no vertical rows to sharpen, so those renders aren't streamed.
+static bool Renderer_create_streaming_scaler(Context * context, const Renderer * r, StreamingScaler ** scaler)
+{
+    const RenderDetails * details = r->details;
+    const bool transpose = details->post_transpose;
+    const uint32_t output_w = transpose ? r->canvas->h : r->canvas->w;
+    const uint32_t output_h = transpose ? r->canvas->w : r->canvas->h;
+    const BitmapPixelFormat scaling_format = RenderDetails_scaling_format(details, r->source->fmt, r->source->alpha_meaningful, true);
+    *scaler = StreamingScaler_create(context, details->interpolation, r->source->w, r->source->h, scaling_format, output_w, output_h,
+                                     RenderDetails_source_span(details, false, output_w), RenderDetails_source_span(details, true, output_h));
+    if (*scaler == NULL) {
+        CONTEXT_add_to_callstack (context);
+        return false;
+    }
+    if (RenderDetails_sharpens_rows(details, (*scaler)->contrib_x) || RenderDetails_sharpens_rows(details, (*scaler)->contrib_y)) {
+        StreamingScaler_destroy(context, *scaler);
+        *scaler = NULL;
+    }
+    return true;
+}
+
+//Scales each source row once, and composes output rows as soon as their vertical window is complete.
+//Flips are applied to the output rows rather than the source; with post_transpose, blocks of rows are written as columns.
+//Takes ownership of scaler.
+static bool Renderer_perform_streaming_render(Context * context, Renderer * r, StreamingScaler * scaler)
+{
+    const RenderDetails * details = r->details;
+    const bool transpose = details->post_transpose;
+    const uint32_t output_w = transpose ? r->canvas->h : r->canvas->w;
+    const uint32_t output_h = transpose ? r->canvas->w : r->canvas->h;
+    const bool reverse_rows = transpose ? details->post_flip_x : details->post_flip_y;
+    const bool reverse_pixels = transpose ? details->post_flip_y : details->post_flip_x;
+
+    //Transposed writes touch a cache line per pixel, so group more rows before writing them
+    const uint32_t block_row_count = transpose ? 16 : 4;
+
+    BitmapPixelFormat scaling_format = RenderDetails_scaling_format(details, r->source->fmt, r->source->alpha_meaningful, true);
+
+    ChannelTransform transform;
+    const bool per_channel = RenderDetails_color_matrix_per_channel(details, scaling_format);
+    if (per_channel) {
+        ChannelTransform_from_color_matrix(details->color_matrix, &transform);
+    }
 
-        if (!BitmapBgra_convert_srgb_to_linear(context, pSrc, source_start_row, buf, 0, row_count)) {
+    bool success = true;
+    BitmapFloat * block = NULL;
+    ColorLutStage * color_lut = NULL;
+    block = BitmapFloat_create(context, output_w, block_row_count, scaling_format, false);
+    if (block == NULL) {
+        CONTEXT_add_to_callstack (context);
+        success = false;
+        goto cleanup;
+    }
+    if (details->color_lut != NULL) {
+        color_lut = ColorLutStage_create(context, details->color_lut);
+        if (color_lut == NULL) {
             CONTEXT_add_to_callstack (context);
-            success=false;
+            success = false;
             goto cleanup;
         }
-        if (!ApplyConvolutionsFloat1D(context, r, buf, 0, row_count, 0)) {
+    }
+
+    for (uint32_t source_row = 0; source_row < r->source->h; source_row++) {
+        if (!StreamingScaler_push_row(context, scaler, r->source, source_row)) {
             CONTEXT_add_to_callstack (context);
-            success=false;
+            success = false;
             goto cleanup;
         }
-        if (details->apply_color_matrix && call_number == 2) {
-            if (!ApplyColorMatrix(context, r, buf, row_count)) {
+        while (StreamingScaler_output_ready(scaler)) {
+            const uint32_t output_row = scaler->rows_pulled;
+            const uint32_t block_start = output_row - output_row % block_row_count;
+            const uint32_t block_count = umin(block_row_count, output_h - block_start);
+            //When flipping vertically, fill the block bottom-up so it can still be written in one piece
+            const uint32_t slot = reverse_rows ? block_count - 1 - (output_row - block_start) : output_row - block_start;
+
+            if (!StreamingScaler_pull_row(context, scaler, block, slot)) {
                 CONTEXT_add_to_callstack (context);
-                success=false;
+                success = false;
                 goto cleanup;
             }
-        }
+            if (reverse_pixels) {
+                BitmapFloat_reverse_row(block, slot);
+            }
+            if (output_row + 1 - block_start < block_count) continue;
 
-        if (!BitmapFloat_pivoting_composite_linear_over_srgb(context, buf, 0, pDst, source_start_row, row_count, transpose)) {
-            CONTEXT_add_to_callstack (context);
-            success=false;
-            goto cleanup;
+            block->alpha_meaningful = r->source->alpha_meaningful;
+            block->alpha_premultiplied = block->channels == 4;
+            if (details->apply_color_matrix && !per_channel && !ApplyColorMatrix(context, r->details, block, block_count)) {
+                CONTEXT_add_to_callstack (context);
+                success = false;
+                goto cleanup;
+            }
+            if (color_lut != NULL && !ApplyColorLut(context, color_lut, block, block_count)) {
+                CONTEXT_add_to_callstack (context);
+                success = false;
+                goto cleanup;
+            }
+            const uint32_t dest_row = reverse_rows ? output_h - block_start - block_count : block_start;
+            prof_start(context,"pivoting_composite_linear_over_srgb", false);
+            if (!BitmapFloat_pivoting_composite_linear_over_srgb(context, block, 0, r->canvas, dest_row, block_count, transpose,
+                                                                 per_channel ? &transform : NULL)) {
+                CONTEXT_add_to_callstack (context);
+                success = false;
+                goto cleanup;
+            }
+            prof_stop(context,"pivoting_composite_linear_over_srgb", true, false);
         }
     }
-    //sRGB sharpening
-    //Color matrix
-
+    if (scaler->rows_pulled != output_h) {
+        CONTEXT_error(context, Invalid_internal_state);
+        success = false;
+    }
 
 cleanup:
-    BitmapFloat_destroy(context,buf);
+    BitmapFloat_destroy(context, block);
+    ColorLutStage_destroy(context, color_lut);
+    StreamingScaler_destroy(context, scaler);
     return success;
 }
 
 
+//Runs one pass, with the RenderPass a plan prepared for it, or one made just for this call.
+//See RenderPass_run for halving_divisor and flip_source; alpha is taken as 1 if the renderer found the source opaque.
 static bool RenderWrapper1D(
     Context * context,
     const Renderer * r,
@@ -526,22 +1178,35 @@ static bool RenderWrapper1D(
     BitmapBgra * pDst,
     const RenderDetails * details,
     bool transpose,
-    int call_number)
+    int call_number,
+    uint32_t halving_divisor,
+    bool flip_source)
 {
-    bool perfect_size = transpose ? (pSrc->h == pDst->w && pDst->h == pSrc->w) : (pSrc->w == pDst->w && pSrc->h == pDst->h);
-    //String^ name = String::Format("{0}Render1D (call {1})", perfect_size ? "" : "ScaleAnd", call_number);
-
-    //try{
-    // p->Start(name, false);
-    if (perfect_size) {
-        return Render1D(context, r, pSrc, pDst, details, transpose, call_number);
-    } else {
-        return ScaleAndRender1D(context, r, pSrc, pDst, details, transpose, call_number);
+    RenderPass * prepared = r->passes[call_number - 1];
+    if (prepared != NULL) {
+        if (!RenderPass_run(context, prepared, pSrc, pDst, halving_divisor, flip_source, r->opaque_alpha)) {
+            CONTEXT_add_to_callstack (context);
+            return false;
+        }
+        return true;
+    }
+    //The pass is sized for the source as it will be read
+    BitmapBgra shape = *pSrc;
+    if (halving_divisor > 1) {
+        shape.w /= halving_divisor;
+        shape.h /= halving_divisor;
     }
-    // }
-    // finally{
-    // p->Stop(name, true, true);
-    //}
+    RenderPass * pass = RenderPass_create(context, details, &shape, pDst, transpose, call_number, NULL, false, halving_divisor);
+    if (pass == NULL) {
+        CONTEXT_add_to_callstack (context);
+        return false;
+    }
+    bool success = RenderPass_run(context, pass, pSrc, pDst, halving_divisor, flip_source, r->opaque_alpha);
+    if (!success) {
+        CONTEXT_add_to_callstack (context);
+    }
+    RenderPass_destroy(context, pass);
+    return success;
 }
 
 bool Renderer_perform_render(Context * context, Renderer * r)
@@ -552,17 +1217,47 @@ bool Renderer_perform_render(Context * context, Renderer * r)
         return false;
     }
     bool skip_last_transpose = r->details->post_transpose;
+    //The size of the source as the first pass reads it
+    const uint32_t fused = r->fused_halving_divisor;
+    const uint32_t source_w = fused > 1 ? r->source->w / fused : r->source->w;
+    const uint32_t source_h = fused > 1 ? r->source->h / fused : r->source->h;
 
     //We can optimize certain code paths - later, if needed
 
-    bool scaling_required = (r->canvas != NULL) && (r->details->post_transpose ? (r->canvas->w != r->source->h || r->canvas->h != r->source->w) :
-                            (r->canvas->h != r->source->h || r->canvas->w != r->source->w));
+    bool scaling_required = (r->canvas != NULL) && (r->details->post_transpose ? (r->canvas->w != source_h || r->canvas->h != source_w) :
+                            (r->canvas->h != source_h || r->canvas->w != source_w));
 
     if (scaling_required && r->details->interpolation == NULL) {
         CONTEXT_error(context, Interpolation_details_missing);
         return false;
     }
 
+    //Unsharpen when interpolating if we can
+    if (r->details->interpolation != NULL &&
+            r->details->sharpen_percent_goal > 0 &&
+            r->details->minimum_sample_window_to_interposharpen <= r->details->interpolation->window) {
+
+        r->details->interpolation->sharpen_percent_goal = r->details->sharpen_percent_goal;
+    }
+
+    if (Renderer_can_stream(r)) {
+        StreamingScaler * scaler = NULL;
+        if (!Renderer_create_streaming_scaler(context, r, &scaler)) {
+            CONTEXT_add_to_callstack (context);
+            return false;
+        }
+        if (scaler != NULL) {
+            prof_start(context,"streaming_render", false);
+            if (!Renderer_perform_streaming_render(context, r, scaler)) {
+                CONTEXT_add_to_callstack (context);
+                return false;
+            }
+            prof_stop(context,"streaming_render", true, false);
+            prof_stop(context,"perform_render", true, false);
+            return true;
+        }
+    }
+
     /*
     bool someTranspositionRequired = r->details->sharpen_percent_goal > 0 ||
         skip_last_transpose ||
@@ -581,6 +1276,9 @@ bool Renderer_perform_render(Context * context, Renderer * r)
     bool vflip_transposed = ((r->details->post_flip_x && !skip_last_transpose) || (skip_last_transpose && r->details->post_flip_y));
 
     //vertical flip before transposition is the same as a horizontal flip afterwards. Dealing with more pixels, though.
+    //A fused halving pass reads the rows in reverse instead.
+    const bool flip_fused_source = vflip_source && fused > 1;
+    vflip_source = vflip_source && !flip_fused_source;
     if (vflip_source && !BitmapBgra_flip_vertical(context,r->source)) {
         CONTEXT_add_to_callstack (context);
         return false;
@@ -590,35 +1288,30 @@ bool Renderer_perform_render(Context * context, Renderer * r)
     //p->Start("allocate temp image(sy x dx)", false);
 
     /* Scale horizontally  */
-    r->transposed = BitmapBgra_create(
-                        context,
-                        r->source->h,
-                        r->canvas == NULL ? r->source->w : (skip_last_transpose ? r->canvas->h : r->canvas->w),
-                        false,
-                        r->source->fmt);
+    if (r->transposed == NULL) {
+        r->transposed = BitmapBgra_create(
+                            context,
+                            source_h,
+                            r->canvas == NULL ? source_w : (skip_last_transpose ? r->canvas->h : r->canvas->w),
+                            false,
+                            BitmapPixelFormat_unpacked(r->source->fmt));
+    }
 
     if (r->transposed == NULL) {
         CONTEXT_add_to_callstack (context);
         return false;
     }
     r->transposed->compositing_mode = Replace_self;
+    //The first pass writes opaque pixels for an opaque source
+    r->transposed->alpha_meaningful = r->source->alpha_meaningful;
     //p->Stop("allocate temp image(sy x dx)", true, false);
 
     //Don't composite if we're working in-place
     if (r->canvas == NULL) {
         r->source->compositing_mode = Replace_self;
     }
-    //Unsharpen when interpolating if we can
-    if (r->details->interpolation != NULL &&
-            r->details->sharpen_percent_goal > 0 &&
-            r->details->minimum_sample_window_to_interposharpen <= r->details->interpolation->window) {
-
-        r->details->interpolation->sharpen_percent_goal = r->details->sharpen_percent_goal;
-    }
-
-
     //Apply kernels, scale, and transpose
-    if (!RenderWrapper1D(context, r, r->source, r->transposed, r->details, true, 1)) {
+    if (!RenderWrapper1D(context, r, r->source, r->transposed, r->details, true, 1, fused, flip_fused_source)) {
         CONTEXT_add_to_callstack (context);
         return false;
     }
@@ -638,7 +1331,7 @@ bool Renderer_perform_render(Context * context, Renderer * r)
 
     //Apply kernels, color matrix, scale,  (transpose?) and (compose?)
 
-    if (!RenderWrapper1D(context, r, r->transposed, finalDest, r->details, !skip_last_transpose, 2)) {
+    if (!RenderWrapper1D(context, r, r->transposed, finalDest, r->details, !skip_last_transpose, 2, 1, false)) {
         CONTEXT_add_to_callstack (context);
         return false;
     }
@@ -0,0 +1,190 @@
+/*
+ * Copyright (c) Imazen LLC.
+ * No part of this project, including this file, may be copied, modified,
+ * propagated, or distributed except as permitted in COPYRIGHT.txt.
+ * Licensed under the GNU Affero General Public License, Version 3.0.
+ * Commercial licenses available at http://imageresizing.net/
+ */
+#ifdef _MSC_VER
+#pragma unmanaged
+#endif
+
+#include "fastscaling_private.h"
+#include "simd.h"
+
+//Pixels are decoded as BitmapBgra_convert_srgb_to_linear would, and accumulated as BitmapFloat_scale_rows_padded would,
+//so the result is the same as decoding the row and then scaling it.
+
+//Without a vectorized kernel, each tap decodes its pixel as it's read
+static void ScaleDecodingRow_scalar(const float * lut, const uint8_t * src, uint32_t src_w, uint32_t bpp, uint32_t channels,
+                                    float * dest, const PaddedContributions * weights)
+{
+    const uint32_t taps = weights->Taps;
+    for (uint32_t ndx = 0; ndx < weights->LineLength; ndx++) {
+        float avg[4] = { 0, 0, 0, 0 };
+        const uint8_t * s = src + (size_t)weights->Left[ndx] * bpp;
+        const float * w = weights->Weights + (size_t)ndx * taps;
+        for (uint32_t t = 0; t < taps; t++) {
+            const uint8_t * p = s + t * bpp;
+            if (channels == 4) {
+                const float alpha = ((float)p[3]) / 255.0f;
+                avg[0] += w[t] * (alpha * lut[p[0]]);
+                avg[1] += w[t] * (alpha * lut[p[1]]);
+                avg[2] += w[t] * (alpha * lut[p[2]]);
+                avg[3] += w[t] * alpha;
+            } else {
+                avg[0] += w[t] * lut[p[0]];
+                avg[1] += w[t] * lut[p[1]];
+                avg[2] += w[t] * lut[p[2]];
+            }
+        }
+        for (uint32_t j = 0; j < channels; j++)
+            dest[ndx * channels + j] = avg[j];
+    }
+}
+
+//Strips are at least this many pixels (8KB of 4-channel floats, which stays in L1), and 4 windows wide
+#define DECODING_STRIP_PIXELS 512
+
+typedef void (*decode_strip_function)(const float * lut, const uint8_t * src, uint32_t bpp, uint32_t channels, float * strip, uint32_t count);
+
+static void decode_strip(const float * lut, const uint8_t * src, uint32_t bpp, uint32_t channels, float * strip, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++) {
+        const uint8_t * p = src + (size_t)i * bpp;
+        if (channels == 4) {
+            const float alpha = ((float)p[3]) / 255.0f;
+            strip[i * 4] = alpha * lut[p[0]];
+            strip[i * 4 + 1] = alpha * lut[p[1]];
+            strip[i * 4 + 2] = alpha * lut[p[2]];
+            strip[i * 4 + 3] = alpha;
+        } else {
+            strip[i * 3] = lut[p[0]];
+            strip[i * 3 + 1] = lut[p[1]];
+            strip[i * 3 + 2] = lut[p[2]];
+        }
+    }
+}
+
+#ifdef FASTSCALING_X86
+
+//Eight values per gather; two premultiplied pixels, or 8 of the strip's 3-channel values
+SIMD_TARGET_AVX2
+static void decode_strip_avx2(const float * lut, const uint8_t * src, uint32_t bpp, uint32_t channels, float * strip, uint32_t count)
+{
+    uint32_t i = 0;
+    if (channels == 4) {
+        for (; i + 2 <= count; i += 2) {
+            const __m256i bytes = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(src + (size_t)i * 4)));
+            const __m256 alpha = _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_shuffle_epi32(bytes, _MM_SHUFFLE(3, 3, 3, 3))), _mm256_set1_ps(255.0f));
+            _mm256_storeu_ps(strip + i * 4, _mm256_blend_ps(_mm256_mul_ps(alpha, _mm256_i32gather_ps(lut, bytes, 4)), alpha, 0x88));
+        }
+    } else if (bpp == 3) {
+        //8 bytes from pixel i stay within pixels [i, i + 3). The 2 values past pixel i + 1 are rewritten by the next step.
+        for (; i + 3 <= count; i += 2) {
+            const __m256i bytes = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(src + (size_t)i * 3)));
+            _mm256_storeu_ps(strip + i * 3, _mm256_i32gather_ps(lut, bytes, 4));
+        }
+    } else {
+        //Two 4-byte pixels, without their 4th bytes
+        const __m128i drop_fourth = _mm_setr_epi8(0, 1, 2, 4, 5, 6, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+        for (; i + 3 <= count; i += 2) {
+            const __m128i bytes = _mm_shuffle_epi8(_mm_loadl_epi64((const __m128i *)(src + (size_t)i * 4)), drop_fourth);
+            _mm256_storeu_ps(strip + i * 3, _mm256_i32gather_ps(lut, _mm256_cvtepu8_epi32(bytes), 4));
+        }
+    }
+    decode_strip(lut, src + (size_t)i * bpp, bpp, channels, strip + i * channels, count - i);
+}
+
+#endif
+
+//Decodes the row a strip at a time, and scales each strip with the vectorized padded kernel for every output window
+//that fits in it. Strips overlap by less than a window, so most pixels are decoded once, and the decoded floats stay
+//in cache. strip and left hold strip_pixels entries. Every window fits in the row, as PaddedContributions ensures.
+static void ScaleDecodingRow_strips(const float * lut, const uint8_t * src, uint32_t src_w, uint32_t bpp, uint32_t channels,
+                                    float * dest, const PaddedContributions * weights, scale_padded_row_function scale_strip,
+                                    decode_strip_function decode, float * strip, int * left, uint32_t strip_pixels)
+{
+    const uint32_t taps = weights->Taps;
+    //A view of the outputs whose windows fit in the strip, with Left relative to it
+    PaddedContributions view = *weights;
+    view.Left = left;
+
+    uint32_t ndx = 0;
+    while (ndx < weights->LineLength) {
+        const uint32_t strip_start = (uint32_t)weights->Left[ndx];
+        const uint32_t strip_end = strip_start + umin(src_w - strip_start, strip_pixels);
+        decode(lut, src + (size_t)strip_start * bpp, bpp, channels, strip, strip_end - strip_start);
+
+        //The 3-channel kernel reads pairs while a pixel follows them, so windows keep a pixel after them (unless at
+        //the end of the row) to be summed exactly as from the whole row. Upscaling may fit more outputs than strip_pixels
+        //in a strip; they go in the next one.
+        const uint32_t margin = strip_end < src_w ? 1 : 0;
+        uint32_t count = 0;
+        while (ndx + count < weights->LineLength && count < strip_pixels && (uint32_t)weights->Left[ndx + count] + taps + margin <= strip_end) {
+            left[count] = weights->Left[ndx + count] - (int)strip_start;
+            count++;
+        }
+        view.LineLength = count;
+        view.Weights = weights->Weights + (size_t)ndx * taps;
+        scale_strip(strip, strip_end - strip_start, dest + (size_t)ndx * channels, &view);
+        ndx += count;
+    }
+}
+
+DecodingStrip * DecodingStrip_create(Context * context, const PaddedContributions * weights)
+{
+    DecodingStrip * strip = CONTEXT_calloc_array(context, 1, DecodingStrip);
+    if (strip == NULL) {
+        CONTEXT_error(context, Out_of_memory);
+        return NULL;
+    }
+    strip->size = umax(DECODING_STRIP_PIXELS, weights->Taps * 4);
+    strip->pixels = (float *)CONTEXT_malloc(context, (size_t)strip->size * 4 * sizeof(float));
+    strip->left = (int *)CONTEXT_malloc(context, (size_t)strip->size * sizeof(int));
+    if (strip->pixels == NULL || strip->left == NULL) {
+        DecodingStrip_destroy(context, strip);
+        CONTEXT_error(context, Out_of_memory);
+        return NULL;
+    }
+    return strip;
+}
+
+void DecodingStrip_destroy(Context * context, DecodingStrip * strip)
+{
+    if (strip == NULL) return;
+    CONTEXT_free(context, strip->pixels);
+    CONTEXT_free(context, strip->left);
+    CONTEXT_free(context, strip);
+}
+
+bool BitmapBgra_scale_rows_decoding(Context * context, const BitmapBgra * src, uint32_t from_row, BitmapFloat * to, uint32_t to_row,
+                                    uint32_t row_count, const PaddedContributions * weights, DecodingStrip * strip)
+{
+    const uint32_t bpp = BitmapPixelFormat_bytes_per_pixel(src->fmt);
+    const uint32_t channels = to->channels;
+    if ((bpp != 3 && bpp != 4) || channels < 3 || channels > bpp || weights->TapMajor || to->w != weights->LineLength ||
+        src->w < weights->Taps || from_row + row_count > src->h || to_row + row_count > to->h || strip->size < weights->Taps * 4) {
+        CONTEXT_error(context, Invalid_internal_state);
+        return false;
+    }
+    const float * lut = context->colorspace.byte_to_float;
+    const scale_padded_row_function scale_strip = ScalePaddedRow_select(context->simd.active, channels, false);
+    if (scale_strip == NULL) {
+        for (uint32_t row = 0; row < row_count; row++) {
+            ScaleDecodingRow_scalar(lut, src->pixels + (size_t)(from_row + row) * src->stride, src->w, bpp, channels,
+                                    to->pixels + (size_t)(to_row + row) * to->float_stride, weights);
+        }
+        return true;
+    }
+    decode_strip_function decode = decode_strip;
+#ifdef FASTSCALING_X86
+    if (context->simd.active >= Simd_avx2) decode = decode_strip_avx2;
+#endif
+    for (uint32_t row = 0; row < row_count; row++) {
+        ScaleDecodingRow_strips(lut, src->pixels + (size_t)(from_row + row) * src->stride, src->w, bpp, channels,
+                                to->pixels + (size_t)(to_row + row) * to->float_stride, weights, scale_strip, decode, strip->pixels,
+                                strip->left, strip->size);
+    }
+    return true;
+}
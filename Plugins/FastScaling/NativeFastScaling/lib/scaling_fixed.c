@@ -0,0 +1,210 @@
+/*
+ * Copyright (c) Imazen LLC.
+ * No part of this project, including this file, may be copied, modified,
+ * propagated, or distributed except as permitted in COPYRIGHT.txt.
+ * Licensed under the GNU Affero General Public License, Version 3.0.
+ * Commercial licenses available at http://imageresizing.net/
+ */
+#ifdef _MSC_VER
+#pragma unmanaged
+#endif
+
+#include "fastscaling_private.h"
+#include "simd.h"
+
+//Bytes are scaled as-is with 14-bit weights: each product fits an int16 x int16 multiply, and a window's sum an int32
+#define FIXED_ROUNDING (1 << (FIXED_WEIGHT_BITS - 1))
+
+typedef void (*scale_fixed_row_function)(const uint8_t * src, uint32_t src_w, uint32_t bpp, uint8_t * dest, size_t dest_pixel_stride, const FixedContributions * weights);
+
+static inline uint8_t fixed_to_byte(int32_t sum)
+{
+    const int32_t v = (sum + FIXED_ROUNDING) >> FIXED_WEIGHT_BITS;
+    return (uint8_t)(v < 0 ? 0 : (v > 255 ? 255 : v));
+}
+
+static inline void write_pixel(uint8_t * dest, uint32_t bpp, uint32_t packed)
+{
+    dest[0] = (uint8_t)packed;
+    dest[1] = (uint8_t)(packed >> 8);
+    dest[2] = (uint8_t)(packed >> 16);
+    if (bpp == 4) {
+        dest[3] = 0xff;
+    }
+}
+
+static void ScaleFixedRow_scalar(const uint8_t * src, uint32_t src_w, uint32_t bpp, uint8_t * dest, size_t dest_pixel_stride, const FixedContributions * weights)
+{
+    const uint32_t taps = weights->Taps;
+    for (uint32_t ndx = 0; ndx < weights->LineLength; ndx++) {
+        const uint8_t * s = src + (size_t)weights->Left[ndx] * bpp;
+        const int16_t * w = weights->Weights + (size_t)ndx * taps;
+        int32_t b = 0, g = 0, r = 0;
+        for (uint32_t t = 0; t < taps; t++) {
+            b += w[t] * s[t * bpp];
+            g += w[t] * s[t * bpp + 1];
+            r += w[t] * s[t * bpp + 2];
+        }
+        write_pixel(dest, bpp, fixed_to_byte(b) | ((uint32_t)fixed_to_byte(g) << 8) | ((uint32_t)fixed_to_byte(r) << 16));
+        dest += dest_pixel_stride;
+    }
+}
+
+#ifdef FASTSCALING_X86
+
+//bpp is a constant wherever this is inlined. Never reads the 4th byte of a 3-byte pixel, which could be past the end of the row.
+static inline uint32_t read_pixel(const uint8_t * p, uint32_t bpp)
+{
+    if (bpp == 4) {
+        uint32_t v;
+        memcpy(&v, p, 4);
+        return v;
+    }
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16);
+}
+
+//Two pixels as int16 pairs: b0 b1 g0 g1 r0 r1 a0 a1, ready for pmaddwd against a (w0, w1) pair
+SIMD_TARGET_SSE2
+static inline __m128i pixel_pair_sse2(uint32_t p0, uint32_t p1)
+{
+    const __m128i bytes = _mm_unpacklo_epi8(_mm_cvtsi32_si128((int)p0), _mm_cvtsi32_si128((int)p1));
+    return _mm_unpacklo_epi8(bytes, _mm_setzero_si128());
+}
+
+SIMD_TARGET_SSE2
+static inline __m128i weight_pair_sse2(int16_t w0, int16_t w1)
+{
+    return _mm_set1_epi32((int)((uint32_t)(uint16_t)w0 | ((uint32_t)(uint16_t)w1 << 16)));
+}
+
+//Rounds, shifts and saturates the four channel sums to bytes
+SIMD_TARGET_SSE2
+static inline uint32_t pack_fixed_sse2(__m128i sums)
+{
+    const __m128i shifted = _mm_srai_epi32(_mm_add_epi32(sums, _mm_set1_epi32(FIXED_ROUNDING)), FIXED_WEIGHT_BITS);
+    const __m128i words = _mm_packs_epi32(shifted, shifted);
+    return (uint32_t)_mm_cvtsi128_si32(_mm_packus_epi16(words, words));
+}
+
+//Accumulates taps [t, taps) two at a time
+SIMD_TARGET_SSE2
+static inline __m128i scale_fixed_tail_sse2(const uint8_t * s, uint32_t bpp, const int16_t * w, uint32_t t, uint32_t taps, __m128i acc)
+{
+    for (; t + 1 < taps; t += 2) {
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(pixel_pair_sse2(read_pixel(s + t * bpp, bpp), read_pixel(s + (t + 1) * bpp, bpp)), weight_pair_sse2(w[t], w[t + 1])));
+    }
+    if (t < taps) {
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(pixel_pair_sse2(read_pixel(s + t * bpp, bpp), 0), weight_pair_sse2(w[t], 0)));
+    }
+    return acc;
+}
+
+SIMD_TARGET_SSE2
+static inline void ScaleFixedRow_sse2(const uint8_t * src, uint32_t bpp, uint8_t * dest, size_t dest_pixel_stride, const FixedContributions * weights)
+{
+    const uint32_t taps = weights->Taps;
+    for (uint32_t ndx = 0; ndx < weights->LineLength; ndx++) {
+        const uint8_t * s = src + (size_t)weights->Left[ndx] * bpp;
+        const int16_t * w = weights->Weights + (size_t)ndx * taps;
+        const __m128i acc = scale_fixed_tail_sse2(s, bpp, w, 0, taps, _mm_setzero_si128());
+        write_pixel(dest, bpp, pack_fixed_sse2(acc));
+        dest += dest_pixel_stride;
+    }
+}
+
+SIMD_TARGET_SSE2
+static void ScaleFixedRow_sse2_3ch(const uint8_t * src, uint32_t src_w, uint32_t bpp, uint8_t * dest, size_t dest_pixel_stride, const FixedContributions * weights)
+{
+    ScaleFixedRow_sse2(src, 3, dest, dest_pixel_stride, weights);
+}
+
+SIMD_TARGET_SSE2
+static void ScaleFixedRow_sse2_4ch(const uint8_t * src, uint32_t src_w, uint32_t bpp, uint8_t * dest, size_t dest_pixel_stride, const FixedContributions * weights)
+{
+    ScaleFixedRow_sse2(src, 4, dest, dest_pixel_stride, weights);
+}
+
+//Four taps per step: one 16-byte load, interleaved into two pixel pairs, against two weight pairs
+SIMD_TARGET_AVX2
+static void ScaleFixedRow_avx2_4ch(const uint8_t * src, uint32_t src_w, uint32_t bpp, uint8_t * dest, size_t dest_pixel_stride, const FixedContributions * weights)
+{
+    const __m128i interleave = _mm_setr_epi8(0, 4, 1, 5, 2, 6, 3, 7, 8, 12, 9, 13, 10, 14, 11, 15);
+    const __m256i pair_index = _mm256_setr_epi32(0, 0, 0, 0, 1, 1, 1, 1);
+    const uint32_t taps = weights->Taps;
+    const uint32_t quad_taps = taps & ~3u;
+
+    for (uint32_t ndx = 0; ndx < weights->LineLength; ndx++) {
+        const uint8_t * s = src + (size_t)weights->Left[ndx] * 4;
+        const int16_t * w = weights->Weights + (size_t)ndx * taps;
+
+        __m256i acc = _mm256_setzero_si256();
+        for (uint32_t t = 0; t < quad_taps; t += 4) {
+            const __m256i pixels = _mm256_cvtepu8_epi16(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(s + t * 4)), interleave));
+            const __m256i pairs = _mm256_permutevar8x32_epi32(_mm256_castsi128_si256(_mm_loadl_epi64((const __m128i *)(w + t))), pair_index);
+            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(pixels, pairs));
+        }
+        __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+        //Only when the line is narrower than the padded window
+        sum = scale_fixed_tail_sse2(s, 4, w, quad_taps, taps, sum);
+        write_pixel(dest, 4, pack_fixed_sse2(sum));
+        dest += dest_pixel_stride;
+    }
+}
+
+//As above; the unused fourth lane of each pair is zeroed by the shuffle. A 16-byte load at pixel i stays within the row
+//while i + 6 <= src_w, and the last few taps near the end of the row go two at a time instead.
+SIMD_TARGET_AVX2
+static void ScaleFixedRow_avx2_3ch(const uint8_t * src, uint32_t src_w, uint32_t bpp, uint8_t * dest, size_t dest_pixel_stride, const FixedContributions * weights)
+{
+    const __m128i interleave = _mm_setr_epi8(0, 3, 1, 4, 2, 5, -1, -1, 6, 9, 7, 10, 8, 11, -1, -1);
+    const __m256i pair_index = _mm256_setr_epi32(0, 0, 0, 0, 1, 1, 1, 1);
+    const uint32_t taps = weights->Taps;
+
+    for (uint32_t ndx = 0; ndx < weights->LineLength; ndx++) {
+        const uint32_t left = (uint32_t)weights->Left[ndx];
+        const uint8_t * s = src + (size_t)left * 3;
+        const int16_t * w = weights->Weights + (size_t)ndx * taps;
+        const uint32_t quad_taps = umin(taps, src_w >= left + 6 ? src_w - left - 2 : 0) & ~3u;
+
+        __m256i acc = _mm256_setzero_si256();
+        for (uint32_t t = 0; t < quad_taps; t += 4) {
+            const __m256i pixels = _mm256_cvtepu8_epi16(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(s + t * 3)), interleave));
+            const __m256i pairs = _mm256_permutevar8x32_epi32(_mm256_castsi128_si256(_mm_loadl_epi64((const __m128i *)(w + t))), pair_index);
+            acc = _mm256_add_epi32(acc, _mm256_madd_epi16(pixels, pairs));
+        }
+        __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+        sum = scale_fixed_tail_sse2(s, 3, w, quad_taps, taps, sum);
+        write_pixel(dest, 3, pack_fixed_sse2(sum));
+        dest += dest_pixel_stride;
+    }
+}
+
+#endif
+
+static scale_fixed_row_function ScaleFixedRow_select(SimdLevel level, uint32_t bpp)
+{
+#ifdef FASTSCALING_X86
+    if (level >= Simd_avx2) return bpp == 4 ? ScaleFixedRow_avx2_4ch : ScaleFixedRow_avx2_3ch;
+    if (level >= Simd_sse41) return bpp == 4 ? ScaleFixedRow_sse2_4ch : ScaleFixedRow_sse2_3ch;
+#endif
+    return ScaleFixedRow_scalar;
+}
+
+bool BitmapBgra_scale_rows_fixed(Context * context, const BitmapBgra * src, uint32_t from_row, uint32_t row_count, BitmapBgra * dst, bool transpose, const FixedContributions * weights)
+{
+    const uint32_t bpp = BitmapPixelFormat_bytes_per_pixel(src->fmt);
+    const bool fits = transpose ? (dst->h == weights->LineLength && from_row + row_count <= dst->w)
+                      : (dst->w == weights->LineLength && from_row + row_count <= dst->h);
+    if (src->fmt != dst->fmt || (bpp != 3 && bpp != 4) || !fits || from_row + row_count > src->h || src->w < weights->Taps) {
+        CONTEXT_error(context, Invalid_internal_state);
+        return false;
+    }
+    const scale_fixed_row_function scale_row = ScaleFixedRow_select(context->simd.active, bpp);
+    const size_t dest_pixel_stride = transpose ? dst->stride : bpp;
+
+    for (uint32_t row = from_row; row < from_row + row_count; row++) {
+        uint8_t * dest = transpose ? dst->pixels + (size_t)row * bpp : dst->pixels + (size_t)row * dst->stride;
+        scale_row(src->pixels + (size_t)row * src->stride, src->w, bpp, dest, dest_pixel_stride, weights);
+    }
+    return true;
+}
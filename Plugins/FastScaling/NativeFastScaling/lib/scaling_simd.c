@@ -0,0 +1,258 @@
+/*
+ * Copyright (c) Imazen LLC.
+ * No part of this project, including this file, may be copied, modified,
+ * propagated, or distributed except as permitted in COPYRIGHT.txt.
+ * Licensed under the GNU Affero General Public License, Version 3.0.
+ * Commercial licenses available at http://imageresizing.net/
+ */
+#ifdef _MSC_VER
+#pragma unmanaged
+#endif
+
+#include "fastscaling_private.h"
+#include "simd.h"
+
+#ifdef FASTSCALING_X86
+
+SIMD_TARGET_SSE41
+static void ScaleRow_sse41_4ch(const float * __restrict source, uint32_t source_w, float * __restrict dest, uint32_t dest_w, const PixelContributions * weights)
+{
+    for (uint32_t ndx = 0; ndx < dest_w; ndx++) {
+        const int left = weights[ndx].Left;
+        const int right = weights[ndx].Right;
+        const float * __restrict weightArray = weights[ndx].Weights;
+
+        __m128 acc = _mm_setzero_ps();
+        for (int i = left; i <= right; i++) {
+            acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(weightArray[i - left]), _mm_loadu_ps(source + i * 4)));
+        }
+        _mm_storeu_ps(dest + ndx * 4, acc);
+    }
+}
+
+SIMD_TARGET_SSE41
+static void ScaleRow_sse41_3ch(const float * __restrict source, uint32_t source_w, float * __restrict dest, uint32_t dest_w, const PixelContributions * weights)
+{
+    for (uint32_t ndx = 0; ndx < dest_w; ndx++) {
+        const int left = weights[ndx].Left;
+        const int right = weights[ndx].Right;
+        const float * __restrict weightArray = weights[ndx].Weights;
+
+        __m128 acc = _mm_setzero_ps();
+        //A 4-float load of the last pixel would read past the end of the row
+        const int last_wide = int_min(right, (int)source_w - 2);
+        int i = left;
+        for (; i <= last_wide; i++) {
+            acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(weightArray[i - left]), _mm_loadu_ps(source + i * 3)));
+        }
+        for (; i <= right; i++) {
+            acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(weightArray[i - left]), load3_ps(source + i * 3)));
+        }
+        store3_ps(dest + ndx * 3, acc);
+    }
+}
+
+
+//Broadcasts weights[0] to lanes 0..3 and weights[1] to lanes 4..7
+SIMD_TARGET_AVX2
+static inline __m256 broadcast_weight_pair(const float * weights, __m256i pair_index)
+{
+    const __m128 pair = _mm_castsi128_ps(_mm_loadl_epi64((const __m128i *)weights));
+    return _mm256_permutevar8x32_ps(_mm256_castps128_ps256(pair), pair_index);
+}
+
+SIMD_TARGET_AVX2
+static void ScaleRow_avx2_4ch(const float * __restrict source, uint32_t source_w, float * __restrict dest, uint32_t dest_w, const PixelContributions * weights)
+{
+    const __m256i pair_index = _mm256_setr_epi32(0, 0, 0, 0, 1, 1, 1, 1);
+
+    for (uint32_t ndx = 0; ndx < dest_w; ndx++) {
+        const int left = weights[ndx].Left;
+        const int right = weights[ndx].Right;
+        const float * __restrict weightArray = weights[ndx].Weights;
+
+        //Two accumulators hide the FMA latency; each holds two pixels.
+        __m256 acc_a = _mm256_setzero_ps();
+        __m256 acc_b = _mm256_setzero_ps();
+        int i = left;
+        for (; i + 3 <= right; i += 4) {
+            acc_a = _mm256_fmadd_ps(_mm256_loadu_ps(source + i * 4), broadcast_weight_pair(weightArray + i - left, pair_index), acc_a);
+            acc_b = _mm256_fmadd_ps(_mm256_loadu_ps(source + i * 4 + 8), broadcast_weight_pair(weightArray + i - left + 2, pair_index), acc_b);
+        }
+        if (i + 1 <= right) {
+            acc_a = _mm256_fmadd_ps(_mm256_loadu_ps(source + i * 4), broadcast_weight_pair(weightArray + i - left, pair_index), acc_a);
+            i += 2;
+        }
+        acc_a = _mm256_add_ps(acc_a, acc_b);
+        __m128 sum = _mm_add_ps(_mm256_castps256_ps128(acc_a), _mm256_extractf128_ps(acc_a, 1));
+        if (i <= right) {
+            sum = _mm_fmadd_ps(_mm_set1_ps(weightArray[i - left]), _mm_loadu_ps(source + i * 4), sum);
+        }
+        _mm_storeu_ps(dest + ndx * 4, sum);
+    }
+}
+
+SIMD_TARGET_AVX2
+static void ScaleRow_avx2_3ch(const float * __restrict source, uint32_t source_w, float * __restrict dest, uint32_t dest_w, const PixelContributions * weights)
+{
+    const __m256i pair_index = _mm256_setr_epi32(0, 0, 0, 0, 1, 1, 1, 1);
+    //Spreads two packed BGR pixels (6 floats) into BGR_ BGR_
+    const __m256i unpack_index = _mm256_setr_epi32(0, 1, 2, 2, 3, 4, 5, 5);
+
+    for (uint32_t ndx = 0; ndx < dest_w; ndx++) {
+        const int left = weights[ndx].Left;
+        const int right = weights[ndx].Right;
+        const float * __restrict weightArray = weights[ndx].Weights;
+
+        __m256 acc = _mm256_setzero_ps();
+        //An 8-float load starting at pixel i is only safe while i + 2 < source_w
+        const int last_pair = int_min(right, (int)source_w - 2);
+        int i = left;
+        for (; i + 1 <= last_pair; i += 2) {
+            const __m256 pixels = _mm256_permutevar8x32_ps(_mm256_loadu_ps(source + i * 3), unpack_index);
+            acc = _mm256_fmadd_ps(pixels, broadcast_weight_pair(weightArray + i - left, pair_index), acc);
+        }
+        __m128 sum = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+        for (; i <= right; i++) {
+            sum = _mm_fmadd_ps(_mm_set1_ps(weightArray[i - left]), load3_ps(source + i * 3), sum);
+        }
+        store3_ps(dest + ndx * 3, sum);
+    }
+}
+
+//With padded contributions every window has the same trip count, and no per-window tail
+
+SIMD_TARGET_AVX2
+static void ScalePaddedRow_avx2_4ch(const float * __restrict source, uint32_t source_w, float * __restrict dest, const PaddedContributions * weights)
+{
+    const __m256i pair_index = _mm256_setr_epi32(0, 0, 0, 0, 1, 1, 1, 1);
+    const int taps = (int)weights->Taps;
+    const int paired_taps = taps & ~3;
+
+    for (uint32_t ndx = 0; ndx < weights->LineLength; ndx++) {
+        const float * __restrict s = source + (size_t)weights->Left[ndx] * 4;
+        const float * __restrict w = weights->Weights + (size_t)ndx * taps;
+
+        __m256 acc_a = _mm256_setzero_ps();
+        __m256 acc_b = _mm256_setzero_ps();
+        int t = 0;
+        for (; t < paired_taps; t += 4) {
+            acc_a = _mm256_fmadd_ps(_mm256_loadu_ps(s + t * 4), broadcast_weight_pair(w + t, pair_index), acc_a);
+            acc_b = _mm256_fmadd_ps(_mm256_loadu_ps(s + t * 4 + 8), broadcast_weight_pair(w + t + 2, pair_index), acc_b);
+        }
+        acc_a = _mm256_add_ps(acc_a, acc_b);
+        __m128 sum = _mm_add_ps(_mm256_castps256_ps128(acc_a), _mm256_extractf128_ps(acc_a, 1));
+        //Only when the line is narrower than the padded window
+        for (; t < taps; t++) {
+            sum = _mm_fmadd_ps(_mm_set1_ps(w[t]), _mm_loadu_ps(s + t * 4), sum);
+        }
+        _mm_storeu_ps(dest + ndx * 4, sum);
+    }
+}
+
+SIMD_TARGET_AVX2
+static void ScalePaddedRow_avx2_3ch(const float * __restrict source, uint32_t source_w, float * __restrict dest, const PaddedContributions * weights)
+{
+    const __m256i pair_index = _mm256_setr_epi32(0, 0, 0, 0, 1, 1, 1, 1);
+    const __m256i unpack_index = _mm256_setr_epi32(0, 1, 2, 2, 3, 4, 5, 5);
+    const int taps = (int)weights->Taps;
+
+    for (uint32_t ndx = 0; ndx < weights->LineLength; ndx++) {
+        const int left = weights->Left[ndx];
+        const float * __restrict w = weights->Weights + (size_t)ndx * taps;
+
+        __m256 acc = _mm256_setzero_ps();
+        //An 8-float load starting at pixel i is only safe while i + 2 < source_w
+        const int last_pair = int_min(taps - 1, (int)source_w - 2 - left);
+        int t = 0;
+        for (; t + 1 <= last_pair; t += 2) {
+            const __m256 pixels = _mm256_permutevar8x32_ps(_mm256_loadu_ps(source + (left + t) * 3), unpack_index);
+            acc = _mm256_fmadd_ps(pixels, broadcast_weight_pair(w + t, pair_index), acc);
+        }
+        __m128 sum = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+        for (; t < taps; t++) {
+            sum = _mm_fmadd_ps(_mm_set1_ps(w[t]), load3_ps(source + (left + t) * 3), sum);
+        }
+        store3_ps(dest + ndx * 3, sum);
+    }
+}
+
+//Gray: one output per window, 8 (then 4) taps per vector, summed across the lanes at the end
+SIMD_TARGET_AVX2
+static void ScalePaddedRow_avx2_1ch(const float * __restrict source, uint32_t source_w, float * __restrict dest, const PaddedContributions * weights)
+{
+    const uint32_t taps = weights->Taps;
+    for (uint32_t ndx = 0; ndx < weights->LineLength; ndx++) {
+        const float * __restrict s = source + weights->Left[ndx];
+        const float * __restrict w = weights->Weights + (size_t)ndx * taps;
+
+        __m256 acc8 = _mm256_setzero_ps();
+        uint32_t t = 0;
+        for (; t + 8 <= taps; t += 8) {
+            acc8 = _mm256_fmadd_ps(_mm256_loadu_ps(s + t), _mm256_loadu_ps(w + t), acc8);
+        }
+        __m128 acc = _mm_add_ps(_mm256_castps256_ps128(acc8), _mm256_extractf128_ps(acc8, 1));
+        for (; t + 4 <= taps; t += 4) {
+            acc = _mm_fmadd_ps(_mm_loadu_ps(s + t), _mm_loadu_ps(w + t), acc);
+        }
+        acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+        float sum = _mm_cvtss_f32(_mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 1)));
+        //Only when the line is narrower than the padded window
+        for (; t < taps; t++) {
+            sum += w[t] * s[t];
+        }
+        dest[ndx] = sum;
+    }
+}
+
+//Eight output pixels per vector: each tap gathers one input pixel for each of them
+SIMD_TARGET_AVX2
+static void ScalePaddedRow_avx2_1ch_tap_major(const float * __restrict source, uint32_t source_w, float * __restrict dest, const PaddedContributions * weights)
+{
+    const uint32_t stride = weights->OutputStride;
+    for (uint32_t ndx = 0; ndx < weights->LineLength; ndx += 8) {
+        const __m256i left = _mm256_loadu_si256((const __m256i *)(weights->Left + ndx));
+        __m256 acc = _mm256_setzero_ps();
+        for (uint32_t t = 0; t < weights->Taps; t++) {
+            const __m256 pixels = _mm256_i32gather_ps(source, _mm256_add_epi32(left, _mm256_set1_epi32((int)t)), 4);
+            acc = _mm256_fmadd_ps(pixels, _mm256_load_ps(weights->Weights + (size_t)t * stride + ndx), acc);
+        }
+        if (ndx + 8 <= weights->LineLength) {
+            _mm256_storeu_ps(dest + ndx, acc);
+        } else {
+            float last[8];
+            _mm256_storeu_ps(last, acc);
+            memcpy(dest + ndx, last, (weights->LineLength - ndx) * sizeof(float));
+        }
+    }
+}
+
+#endif
+
+scale_padded_row_function ScalePaddedRow_select(SimdLevel level, uint32_t channels, bool tap_major)
+{
+#ifdef FASTSCALING_X86
+    if (level >= Simd_avx2) {
+        if (tap_major && channels == 1) return ScalePaddedRow_avx2_1ch_tap_major;
+        if (!tap_major && channels == 1) return ScalePaddedRow_avx2_1ch;
+        if (!tap_major && channels == 4) return ScalePaddedRow_avx2_4ch;
+        if (!tap_major && channels == 3) return ScalePaddedRow_avx2_3ch;
+    }
+#endif
+    return NULL;
+}
+
+scale_row_function ScaleRow_select(SimdLevel level, uint32_t channels)
+{
+#ifdef FASTSCALING_X86
+    if (level >= Simd_avx2) {
+        if (channels == 4) return ScaleRow_avx2_4ch;
+        if (channels == 3) return ScaleRow_avx2_3ch;
+    }
+    if (level >= Simd_sse41) {
+        if (channels == 4) return ScaleRow_sse41_4ch;
+        if (channels == 3) return ScaleRow_sse41_3ch;
+    }
+#endif
+    return NULL;
+}
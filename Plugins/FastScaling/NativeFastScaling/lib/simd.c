@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) Imazen LLC.
+ * No part of this project, including this file, may be copied, modified,
+ * propagated, or distributed except as permitted in COPYRIGHT.txt.
+ * Licensed under the GNU Affero General Public License, Version 3.0.
+ * Commercial licenses available at http://imageresizing.net/
+ */
+#ifdef _MSC_VER
+#pragma unmanaged
+#endif
+
+#include "fastscaling_private.h"
+#include "simd.h"
+
+#ifdef FASTSCALING_X86
+
+#ifdef _MSC_VER
+
+static SimdLevel detect_x86(void)
+{
+    int info[4];
+    __cpuid(info, 0);
+    const int max_leaf = info[0];
+    if (max_leaf < 1) return Simd_scalar;
+
+    __cpuid(info, 1);
+    const bool sse41 = (info[2] & (1 << 19)) != 0;
+    const bool fma = (info[2] & (1 << 12)) != 0;
+    const bool osxsave = (info[2] & (1 << 27)) != 0;
+    const bool avx = (info[2] & (1 << 28)) != 0;
+    if (!sse41) return Simd_scalar;
+
+    bool avx2 = false;
+    if (max_leaf >= 7 && osxsave && avx && fma) {
+        //The OS must also save the upper halves of the YMM registers
+        const bool ymm_enabled = (_xgetbv(0) & 6) == 6;
+        __cpuidex(info, 7, 0);
+        avx2 = ymm_enabled && (info[1] & (1 << 5)) != 0;
+    }
+    return avx2 ? Simd_avx2 : Simd_sse41;
+}
+
+#else
+
+static SimdLevel detect_x86(void)
+{
+    //Also verifies OS support for the AVX register state
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return Simd_avx2;
+    if (__builtin_cpu_supports("sse4.1")) return Simd_sse41;
+    return Simd_scalar;
+}
+
+#endif
+#endif
+
+SimdLevel Simd_detect_supported_level(void)
+{
+#ifdef FASTSCALING_X86
+    return detect_x86();
+#else
+    return Simd_scalar;
+#endif
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) Imazen LLC.
+ * No part of this project, including this file, may be copied, modified,
+ * propagated, or distributed except as permitted in COPYRIGHT.txt.
+ * Licensed under the GNU Affero General Public License, Version 3.0.
+ * Commercial licenses available at http://imageresizing.net/
+ */
+#pragma once
+#ifdef _MSC_VER
+#pragma unmanaged
+#endif
+
+// Only include this from translation units that contain vectorized kernels.
+// Kernels are compiled for a specific instruction set via SIMD_TARGET_*, and must only be
+// called after checking context->simd.active - never assume the build machine's CPU.
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define FASTSCALING_X86
+#endif
+
+#ifdef FASTSCALING_X86
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#include <immintrin.h>
+
+#if defined(__GNUC__) || defined(__clang__)
+#define SIMD_TARGET_SSE2 __attribute__((target("sse2")))
+#define SIMD_TARGET_SSE41 __attribute__((target("sse4.1")))
+#define SIMD_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#else
+//MSVC permits any intrinsic in any function
+#define SIMD_TARGET_SSE2
+#define SIMD_TARGET_SSE41
+#define SIMD_TARGET_AVX2
+#endif
+
+//Loads 3 floats into lanes 0..2 without reading past p[2]
+SIMD_TARGET_SSE2
+static inline __m128 load3_ps(const float * p)
+{
+    const __m128 bg = _mm_castsi128_ps(_mm_loadl_epi64((const __m128i *)p));
+    return _mm_movelh_ps(bg, _mm_load_ss(p + 2));
+}
+
+SIMD_TARGET_SSE2
+static inline void store3_ps(float * p, __m128 v)
+{
+    _mm_storel_pi((__m64 *)p, v);
+    _mm_store_ss(p + 2, _mm_movehl_ps(v, v));
+}
+
+//Vector form of floatspace_lut_index
+SIMD_TARGET_SSE2
+static inline __m128i floatspace_lut_index_sse2(__m128 v)
+{
+    const __m128 clamped = _mm_min_ps(_mm_max_ps(v, _mm_set1_ps(5.9604645e-8f)), _mm_set1_ps(1.0f));
+    return _mm_srli_epi32(_mm_sub_epi32(_mm_castps_si128(clamped), _mm_set1_epi32((int)FLOATSPACE_LUT_MIN_BITS)), FLOATSPACE_LUT_SHIFT);
+}
+
+#endif
@@ -0,0 +1,415 @@
+/*
+ * Copyright (c) Imazen LLC.
+ * No part of this project, including this file, may be copied, modified,
+ * propagated, or distributed except as permitted in COPYRIGHT.txt.
+ * Licensed under the GNU Affero General Public License, Version 3.0.
+ * Commercial licenses available at http://imageresizing.net/
+ */
+#ifdef _MSC_VER
+#pragma unmanaged
+#endif
+
+#include "fastscaling_private.h"
+
+#include <string.h>
+
+/*
+ * Instead of scaling every source row horizontally into a full-size transposed image and then scaling its rows again,
+ * we keep only the horizontally scaled rows that the remaining output rows can still reference.
+ * Output rows are produced (top-down) as soon as their contribution window has been pushed.
+ */
+
+void StreamingScaler_destroy(Context * context, StreamingScaler * s)
+{
+    if (s == NULL) return;
+    LineContributions_destroy(context, s->contrib_x);
+    LineContributions_destroy(context, s->contrib_y);
+    CONTEXT_free(context, s->min_left_y);
+    BitmapFloat_destroy(context, s->source_row);
+    BitmapFloat_destroy(context, s->ring);
+    CONTEXT_free(context, s);
+}
+
+static LineContributions * StreamingScaler_create_contributions(Context * context, const InterpolationDetails * interpolation, uint32_t output_size, uint32_t input_size, double span)
+{
+    if (output_size == input_size && span == output_size) {
+        return LineContributions_create_identity(context, output_size);
+    }
+    if (interpolation == NULL) {
+        CONTEXT_error(context, Interpolation_details_missing);
+        return NULL;
+    }
+    return LineContributions_create_span(context, span, input_size, interpolation, 0, output_size);
+}
+
+StreamingScaler * StreamingScaler_create_from_contributions(Context * context, LineContributions * contrib_x, LineContributions * contrib_y, uint32_t source_w, uint32_t source_h, uint32_t channels)
+{
+    StreamingScaler * s = CONTEXT_calloc_array(context, 1, StreamingScaler);
+    if (s == NULL) {
+        LineContributions_destroy(context, contrib_x);
+        LineContributions_destroy(context, contrib_y);
+        CONTEXT_error(context, Out_of_memory);
+        return NULL;
+    }
+    s->contrib_x = contrib_x;
+    s->contrib_y = contrib_y;
+    s->source_w = source_w;
+    s->source_h = source_h;
+    s->output_w = contrib_x == NULL ? source_w : contrib_x->LineLength;
+    s->output_h = contrib_y->LineLength;
+    const uint32_t output_h = s->output_h;
+
+    if (contrib_x != NULL) {
+        s->source_row = BitmapFloat_create(context, source_w, 1, channels, false);
+        if (s->source_row == NULL) {
+            CONTEXT_add_to_callstack (context);
+            StreamingScaler_destroy(context, s);
+            return NULL;
+        }
+    }
+
+    //Left isn't strictly increasing (zero weights are trimmed), so eviction has to look at every later window
+    s->min_left_y = CONTEXT_calloc_array(context, output_h + 1, int);
+    if (s->min_left_y == NULL) {
+        CONTEXT_error(context, Out_of_memory);
+        StreamingScaler_destroy(context, s);
+        return NULL;
+    }
+    const PixelContributions * windows = contrib_y->ContribRow;
+    s->min_left_y[output_h] = (int)source_h;
+    int ring_rows = 1;
+    for (int n = (int)output_h - 1; n >= 0; n--) {
+        s->min_left_y[n] = int_min(windows[n].Left, s->min_left_y[n + 1]);
+    }
+    for (uint32_t n = 0; n < output_h; n++) {
+        ring_rows = int_max(ring_rows, windows[n].Right + 1 - s->min_left_y[n]);
+    }
+
+    s->ring = BitmapFloat_create(context, s->output_w, ring_rows, channels, false);
+    if (s->ring == NULL) {
+        CONTEXT_add_to_callstack (context);
+        StreamingScaler_destroy(context, s);
+        return NULL;
+    }
+    return s;
+}
+
+StreamingScaler * StreamingScaler_create(Context * context, const InterpolationDetails * interpolation, uint32_t source_w, uint32_t source_h, uint32_t channels,
+                                         uint32_t output_w, uint32_t output_h, double span_x, double span_y)
+{
+    LineContributions * contrib_x = NULL;
+    if (source_w != output_w || span_x != output_w) {
+        contrib_x = StreamingScaler_create_contributions(context, interpolation, output_w, source_w, span_x);
+        if (contrib_x == NULL) {
+            CONTEXT_add_to_callstack (context);
+            return NULL;
+        }
+    }
+    LineContributions * contrib_y = StreamingScaler_create_contributions(context, interpolation, output_h, source_h, span_y);
+    if (contrib_y == NULL) {
+        CONTEXT_add_to_callstack (context);
+        LineContributions_destroy(context, contrib_x);
+        return NULL;
+    }
+    StreamingScaler * s = StreamingScaler_create_from_contributions(context, contrib_x, contrib_y, source_w, source_h, channels);
+    if (s == NULL) {
+        CONTEXT_add_to_callstack (context);
+    }
+    return s;
+}
+
+bool StreamingScaler_can_push(const StreamingScaler * s)
+{
+    return s->rows_pushed < s->source_h &&
+           (int)s->rows_pushed - (int)s->ring->h < s->min_left_y[s->rows_pulled];
+}
+
+bool StreamingScaler_output_ready(const StreamingScaler * s)
+{
+    return s->rows_pulled < s->output_h && s->contrib_y->ContribRow[s->rows_pulled].Right < (int)s->rows_pushed;
+}
+
+bool StreamingScaler_push_row(Context * context, StreamingScaler * s, BitmapBgra * source, uint32_t row)
+{
+    if (!StreamingScaler_can_push(s)) {
+        CONTEXT_error(context, Invalid_internal_state);
+        return false;
+    }
+    const uint32_t n = s->rows_pushed;
+    s->rows_pushed++;
+
+    //Rows outside every remaining window (e.g. after the last one) are consumed without decoding
+    if ((int)n < s->min_left_y[s->rows_pulled] || (s->output_h > 0 && (int)n > s->contrib_y->ContribRow[s->output_h - 1].Right)) {
+        return true;
+    }
+    const uint32_t slot = n % s->ring->h;
+    if (s->contrib_x == NULL) {
+        if (!BitmapBgra_convert_srgb_to_linear(context, source, row, s->ring, slot, 1)) {
+            CONTEXT_add_to_callstack (context);
+            return false;
+        }
+    } else {
+        if (!BitmapBgra_convert_srgb_to_linear(context, source, row, s->source_row, 0, 1)) {
+            CONTEXT_add_to_callstack (context);
+            return false;
+        }
+        if (!BitmapFloat_scale_rows(context, s->source_row, 0, s->ring, slot, 1, s->contrib_x->ContribRow)) {
+            CONTEXT_add_to_callstack (context);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool StreamingScaler_pull_row(Context * context, StreamingScaler * s, BitmapFloat * dest, uint32_t dest_row)
+{
+    if (!StreamingScaler_output_ready(s) || dest->w != s->output_w || dest->channels != s->ring->channels || dest_row >= dest->h) {
+        CONTEXT_error(context, Invalid_internal_state);
+        return false;
+    }
+    const PixelContributions * window = &s->contrib_y->ContribRow[s->rows_pulled];
+    const uint32_t float_count = s->output_w * s->ring->channels;
+    float * __restrict out = dest->pixels + (size_t)dest_row * dest->float_stride;
+
+    memset(out, 0, float_count * sizeof(float));
+    for (int i = window->Left; i <= window->Right; i++) {
+        const float weight = window->Weights[i - window->Left];
+        const float * __restrict in = s->ring->pixels + (size_t)((uint32_t)i % s->ring->h) * s->ring->float_stride;
+        for (uint32_t ix = 0; ix < float_count; ix++) {
+            out[ix] += weight * in[ix];
+        }
+    }
+    s->rows_pulled++;
+    return true;
+}
+
+
+/*
+ * StreamingRenderer: the public push/pull wrapper. Finished output rows wait in a small float queue until pulled, so
+ * memory is bounded by the scaler's ring plus the queue, regardless of image height. Pushing stops (and reports fewer
+ * rows consumed) while the queue is full.
+ */
+
+#define STREAMING_RENDERER_QUEUE_ROWS 16
+
+StreamingRenderer * StreamingRenderer_create(Context * context, RenderDetails * details, uint32_t source_w, uint32_t source_h, BitmapPixelFormat source_format, bool source_alpha_meaningful, uint32_t canvas_w, uint32_t canvas_h)
+{
+    if (details == NULL || details->post_transpose || details->post_flip_y || details->kernel_a != NULL || details->kernel_b != NULL) {
+        CONTEXT_error(context, Invalid_argument);
+        return NULL;
+    }
+    if (source_w == 0 || source_h == 0 || canvas_w == 0 || canvas_h == 0) {
+        CONTEXT_error(context, Invalid_BitmapBgra_dimensions);
+        return NULL;
+    }
+    if (BitmapPixelFormat_channels(source_format) == 0) {
+        CONTEXT_error(context, Unsupported_pixel_format);
+        return NULL;
+    }
+    if ((source_w != canvas_w || source_h != canvas_h) && details->interpolation == NULL) {
+        CONTEXT_error(context, Interpolation_details_missing);
+        return NULL;
+    }
+    //Unsharpen when interpolating if we can
+    if (details->interpolation != NULL &&
+            details->sharpen_percent_goal > 0 &&
+            details->minimum_sample_window_to_interposharpen <= details->interpolation->window) {
+
+        details->interpolation->sharpen_percent_goal = details->sharpen_percent_goal;
+    }
+
+    const uint32_t channels = RenderDetails_scaling_format(details, source_format, source_alpha_meaningful, true);
+    StreamingScaler * scaler = StreamingScaler_create(context, details->interpolation, source_w, source_h, channels, canvas_w, canvas_h,
+                                                      RenderDetails_source_span(details, false, canvas_w), RenderDetails_source_span(details, true, canvas_h));
+    if (scaler == NULL) {
+        CONTEXT_add_to_callstack (context);
+        return NULL;
+    }
+    //The two-pass render would sharpen what the weights don't, along both axes
+    if (RenderDetails_sharpens_rows(details, scaler->contrib_x) || RenderDetails_sharpens_rows(details, scaler->contrib_y)) {
+        StreamingScaler_destroy(context, scaler);
+        CONTEXT_error(context, Invalid_argument);
+        return NULL;
+    }
+    StreamingRenderer * r = StreamingRenderer_create_from_scaler(context, details, scaler, source_format, source_alpha_meaningful);
+    if (r == NULL) {
+        CONTEXT_add_to_callstack (context);
+    }
+    return r;
+}
+
+StreamingRenderer * StreamingRenderer_create_from_scaler(Context * context, RenderDetails * details, StreamingScaler * scaler, BitmapPixelFormat source_format, bool source_alpha_meaningful)
+{
+    StreamingRenderer * r = CONTEXT_calloc_array(context, 1, StreamingRenderer);
+    if (r == NULL) {
+        StreamingScaler_destroy(context, scaler);
+        CONTEXT_error(context, Out_of_memory);
+        return NULL;
+    }
+    r->details = details;
+    r->scaler = scaler;
+    r->source_format = source_format;
+    r->source_alpha_meaningful = source_alpha_meaningful;
+
+    r->queue = BitmapFloat_create(context, scaler->output_w, umin(STREAMING_RENDERER_QUEUE_ROWS, scaler->output_h), scaler->ring->channels, false);
+    if (r->queue == NULL) {
+        CONTEXT_add_to_callstack (context);
+        StreamingRenderer_destroy(context, r);
+        return NULL;
+    }
+    //Per-channel matrices are applied as the rows are encoded
+    r->color_matrix_per_channel = details->apply_color_matrix && details->color_lut == NULL &&
+                                  ColorMatrix_is_per_channel(details->color_matrix, scaler->ring->channels);
+    if (r->color_matrix_per_channel) {
+        ChannelTransform_from_color_matrix(details->color_matrix, &r->channel_transform);
+    }
+    if (details->color_lut != NULL) {
+        r->color_lut = ColorLutStage_create(context, details->color_lut);
+        if (r->color_lut == NULL) {
+            CONTEXT_add_to_callstack (context);
+            StreamingRenderer_destroy(context, r);
+            return NULL;
+        }
+    }
+    return r;
+}
+
+void StreamingRenderer_destroy(Context * context, StreamingRenderer * r)
+{
+    if (r == NULL) return;
+    StreamingScaler_destroy(context, r->scaler);
+    BitmapFloat_destroy(context, r->queue);
+    ColorLutStage_destroy(context, r->color_lut);
+    CONTEXT_free(context, r);
+}
+
+//Moves every ready output row into the queue, as long as there is room
+static bool StreamingRenderer_fill_queue(Context * context, StreamingRenderer * r)
+{
+    while (r->queue_count < r->queue->h && StreamingScaler_output_ready(r->scaler)) {
+        const uint32_t slot = (r->queue_start + r->queue_count) % r->queue->h;
+        if (!StreamingScaler_pull_row(context, r->scaler, r->queue, slot)) {
+            CONTEXT_add_to_callstack (context);
+            return false;
+        }
+        if (r->details->post_flip_x) {
+            BitmapFloat_reverse_row(r->queue, slot);
+        }
+        r->queue_count++;
+    }
+    return true;
+}
+
+bool StreamingRenderer_push_rows(Context * context, StreamingRenderer * r, BitmapBgra * rows, uint32_t * rows_consumed)
+{
+    *rows_consumed = 0;
+    if (rows->w != r->scaler->source_w || rows->fmt != r->source_format) {
+        CONTEXT_error(context, Invalid_BitmapBgra_dimensions);
+        return false;
+    }
+    if (rows->h > r->scaler->source_h - r->scaler->rows_pushed) {
+        CONTEXT_error(context, Invalid_argument);
+        return false;
+    }
+    bool success = true;
+    for (uint32_t row = 0; row < rows->h; row++) {
+        if (!StreamingRenderer_fill_queue(context, r)) {
+            CONTEXT_add_to_callstack (context);
+            success = false;
+            break;
+        }
+        if (!StreamingScaler_can_push(r->scaler)) break;
+
+        if (!StreamingScaler_push_row(context, r->scaler, rows, row)) {
+            CONTEXT_add_to_callstack (context);
+            success = false;
+            break;
+        }
+        (*rows_consumed)++;
+    }
+    if (success && !StreamingRenderer_fill_queue(context, r)) {
+        CONTEXT_add_to_callstack (context);
+        success = false;
+    }
+    return success;
+}
+
+//Encodes 'count' contiguous queue rows onto the canvas
+static bool StreamingRenderer_write_rows(Context * context, StreamingRenderer * r, uint32_t slot, BitmapBgra * canvas, uint32_t canvas_row, uint32_t count)
+{
+    r->queue->alpha_meaningful = r->source_alpha_meaningful;
+    r->queue->alpha_premultiplied = r->queue->channels == 4;
+    if (r->details->apply_color_matrix && !r->color_matrix_per_channel) {
+        prof_start(context,"apply_color_matrix_float", false);
+        if (!BitmapFloat_apply_color_matrix(context, r->queue, slot, count, r->details->color_matrix)) {
+            CONTEXT_add_to_callstack (context);
+            return false;
+        }
+        prof_stop(context,"apply_color_matrix_float", true, false);
+    }
+    if (r->color_lut != NULL) {
+        prof_start(context,"apply_color_lut", false);
+        if (!BitmapFloat_apply_color_lut(context, r->queue, slot, count, r->color_lut)) {
+            CONTEXT_add_to_callstack (context);
+            return false;
+        }
+        prof_stop(context,"apply_color_lut", true, false);
+    }
+    prof_start(context,"pivoting_composite_linear_over_srgb", false);
+    if (!BitmapFloat_pivoting_composite_linear_over_srgb(context, r->queue, slot, canvas, canvas_row, count, false,
+                                                         r->color_matrix_per_channel ? &r->channel_transform : NULL)) {
+        CONTEXT_add_to_callstack (context);
+        return false;
+    }
+    prof_stop(context,"pivoting_composite_linear_over_srgb", true, false);
+    return true;
+}
+
+bool StreamingRenderer_pull_rows(Context * context, StreamingRenderer * r, BitmapBgra * canvas, uint32_t canvas_row, uint32_t max_rows, uint32_t * rows_written)
+{
+    *rows_written = 0;
+    if (canvas->w != r->scaler->output_w || canvas_row > canvas->h) {
+        CONTEXT_error(context, Invalid_BitmapBgra_dimensions);
+        return false;
+    }
+    //GDI+ layouts are only ever read
+    if (BitmapPixelFormat_unpacked(canvas->fmt) != canvas->fmt) {
+        CONTEXT_error(context, Unsupported_pixel_format);
+        return false;
+    }
+    max_rows = umin(max_rows, canvas->h - canvas_row);
+    //Output and queue space can both become available, so alternate until one runs out
+    while (*rows_written < max_rows) {
+        if (!StreamingRenderer_fill_queue(context, r)) {
+            CONTEXT_add_to_callstack (context);
+            return false;
+        }
+        if (r->queue_count == 0) break;
+
+        //The queue wraps; write its leading run of contiguous rows
+        const uint32_t count = umin(umin(r->queue_count, r->queue->h - r->queue_start), max_rows - *rows_written);
+        if (!StreamingRenderer_write_rows(context, r, r->queue_start, canvas, canvas_row + *rows_written, count)) {
+            CONTEXT_add_to_callstack (context);
+            return false;
+        }
+        r->queue_start = (r->queue_start + count) % r->queue->h;
+        r->queue_count -= count;
+        *rows_written += count;
+    }
+    return true;
+}
+
+uint32_t StreamingRenderer_rows_pushed(const StreamingRenderer * r)
+{
+    return r->scaler->rows_pushed;
+}
+
+uint32_t StreamingRenderer_rows_pulled(const StreamingRenderer * r)
+{
+    return r->scaler->rows_pulled - r->queue_count;
+}
+
+bool StreamingRenderer_is_complete(const StreamingRenderer * r)
+{
+    return r->scaler->rows_pulled == r->scaler->output_h && r->queue_count == 0;
+}
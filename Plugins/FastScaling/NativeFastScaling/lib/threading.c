@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) Imazen LLC.
+ * No part of this project, including this file, may be copied, modified,
+ * propagated, or distributed except as permitted in COPYRIGHT.txt.
+ * Licensed under the GNU Affero General Public License, Version 3.0.
+ * Commercial licenses available at http://imageresizing.net/
+ */
+#ifdef _MSC_VER
+#pragma unmanaged
+#endif
+
+#include "fastscaling_private.h"
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+typedef struct {
+    parallel_work_function work;
+    void * item;
+} ThreadStart;
+
+#ifdef _WIN32
+
+static DWORD WINAPI Thread_main(LPVOID arg)
+{
+    ThreadStart * start = (ThreadStart *)arg;
+    start->work(start->item);
+    return 0;
+}
+
+#else
+
+static void * Thread_main(void * arg)
+{
+    ThreadStart * start = (ThreadStart *)arg;
+    start->work(start->item);
+    return NULL;
+}
+
+#endif
+
+void Threads_run_parallel(parallel_work_function work, void * items, size_t item_size, uint32_t count)
+{
+    ThreadStart starts[FASTSCALING_MAX_THREADS];
+    bool started[FASTSCALING_MAX_THREADS];
+#ifdef _WIN32
+    HANDLE threads[FASTSCALING_MAX_THREADS];
+#else
+    pthread_t threads[FASTSCALING_MAX_THREADS];
+#endif
+    count = umin(count, FASTSCALING_MAX_THREADS);
+
+    //Item 0 runs on the calling thread
+    for (uint32_t i = 1; i < count; i++) {
+        starts[i].work = work;
+        starts[i].item = (char *)items + i * item_size;
+#ifdef _WIN32
+        threads[i] = CreateThread(NULL, 0, Thread_main, &starts[i], 0, NULL);
+        started[i] = threads[i] != NULL;
+#else
+        started[i] = pthread_create(&threads[i], NULL, Thread_main, &starts[i]) == 0;
+#endif
+    }
+    if (count > 0) {
+        work(items);
+    }
+    //Anything we couldn't start a thread for still gets done, just not concurrently
+    for (uint32_t i = 1; i < count; i++) {
+        if (started[i]) {
+#ifdef _WIN32
+            WaitForSingleObject(threads[i], INFINITE);
+            CloseHandle(threads[i]);
+#else
+            pthread_join(threads[i], NULL);
+#endif
+        } else {
+            work((char *)items + i * item_size);
+        }
+    }
+}
+
+bool Threads_try_acquire(volatile long * flag)
+{
+#ifdef _WIN32
+    return InterlockedCompareExchange(flag, 1, 0) == 0;
+#else
+    return __sync_bool_compare_and_swap(flag, 0, 1);
+#endif
+}
+
+void Threads_release(volatile long * flag)
+{
+#ifdef _WIN32
+    InterlockedExchange(flag, 0);
+#else
+    __sync_lock_release(flag);
+#endif
+}
@@ -0,0 +1,336 @@
+/*
+ * Copyright (c) Imazen LLC.
+ * No part of this project, including this file, may be copied, modified,
+ * propagated, or distributed except as permitted in COPYRIGHT.txt.
+ * Licensed under the GNU Affero General Public License, Version 3.0.
+ * Commercial licenses available at http://imageresizing.net/
+ */
+#ifdef _MSC_VER
+#pragma unmanaged
+#endif
+
+#include "fastscaling_private.h"
+
+/*
+ * Each canvas rectangle is rendered by a StreamingRenderer over a view of its source window. Contributions are only
+ * built for the rectangle's own columns and rows, but each output pixel's weights don't depend on its neighbors, so
+ * every pixel sees exactly the weights and source pixels it would in a single full-size render; tile edges leave no
+ * seams, and the cost scales with the rectangle rather than the canvas. Flips are resolved by rendering the mirrored
+ * rectangle of the unflipped canvas.
+ */
+
+void TiledRenderer_destroy(Context * context, TiledRenderer * t)
+{
+    if (t == NULL) return;
+    CONTEXT_free(context, t);
+}
+
+//Sets *sharpens if a render would sharpen the rows (or columns) of this axis afterwards, which regions can't. Decided by
+//the whole line's weights, as the render's are, so they're only built when sharpening is asked for.
+static bool TiledRenderer_axis_sharpens(Context * context, const RenderDetails * details, uint32_t source_size, uint32_t canvas_size,
+                                        bool height, bool * sharpens)
+{
+    *sharpens = false;
+    if (!RenderDetails_sharpens_rows(details, NULL)) return true;
+    const double span = RenderDetails_source_span(details, height, canvas_size);
+    if (source_size == canvas_size && span == canvas_size) {
+        *sharpens = true;
+        return true;
+    }
+    if (details->interpolation == NULL) {
+        CONTEXT_error(context, Interpolation_details_missing);
+        return false;
+    }
+    LineContributions * contrib = LineContributions_create_span(context, span, source_size, details->interpolation, 0, canvas_size);
+    if (contrib == NULL) {
+        CONTEXT_add_to_callstack (context);
+        return false;
+    }
+    *sharpens = RenderDetails_sharpens_rows(details, contrib);
+    LineContributions_destroy(context, contrib);
+    return true;
+}
+
+TiledRenderer * TiledRenderer_create(Context * context, RenderDetails * details, uint32_t source_w, uint32_t source_h, BitmapPixelFormat source_format, bool source_alpha_meaningful, uint32_t canvas_w, uint32_t canvas_h)
+{
+    if (details == NULL || details->post_transpose || details->kernel_a != NULL || details->kernel_b != NULL) {
+        CONTEXT_error(context, Invalid_argument);
+        return NULL;
+    }
+    if (source_w == 0 || source_h == 0 || canvas_w == 0 || canvas_h == 0) {
+        CONTEXT_error(context, Invalid_BitmapBgra_dimensions);
+        return NULL;
+    }
+    if (BitmapPixelFormat_channels(source_format) == 0) {
+        CONTEXT_error(context, Unsupported_pixel_format);
+        return NULL;
+    }
+    if ((source_w != canvas_w || source_h != canvas_h) && details->interpolation == NULL) {
+        CONTEXT_error(context, Interpolation_details_missing);
+        return NULL;
+    }
+    //Unsharpen when interpolating if we can
+    if (details->interpolation != NULL &&
+            details->sharpen_percent_goal > 0 &&
+            details->minimum_sample_window_to_interposharpen <= details->interpolation->window) {
+
+        details->interpolation->sharpen_percent_goal = details->sharpen_percent_goal;
+    }
+    bool sharpens_x, sharpens_y;
+    if (!TiledRenderer_axis_sharpens(context, details, source_w, canvas_w, false, &sharpens_x) ||
+            !TiledRenderer_axis_sharpens(context, details, source_h, canvas_h, true, &sharpens_y)) {
+        CONTEXT_add_to_callstack (context);
+        return NULL;
+    }
+    if (sharpens_x || sharpens_y) {
+        CONTEXT_error(context, Invalid_argument);
+        return NULL;
+    }
+
+    TiledRenderer * t = CONTEXT_calloc_array(context, 1, TiledRenderer);
+    if (t == NULL) {
+        CONTEXT_error(context, Out_of_memory);
+        return NULL;
+    }
+    t->details = details;
+    t->source_w = source_w;
+    t->source_h = source_h;
+    t->canvas_w = canvas_w;
+    t->canvas_h = canvas_h;
+    t->source_format = source_format;
+    t->source_alpha_meaningful = source_alpha_meaningful;
+    return t;
+}
+
+//The source range read by a line's windows. Windows aren't strictly ordered, so check each one.
+static void LineContributions_source_range(const LineContributions * line, uint32_t * first, uint32_t * last)
+{
+    int left = line->ContribRow[0].Left;
+    int right = line->ContribRow[0].Right;
+    for (uint32_t u = 1; u < line->LineLength; u++) {
+        left = int_min(left, line->ContribRow[u].Left);
+        right = int_max(right, line->ContribRow[u].Right);
+    }
+    *first = (uint32_t)left;
+    *last = (uint32_t)int_max(left, right);
+}
+
+//Maps a canvas rectangle to the rectangle of the unflipped canvas it shows
+static bool TiledRenderer_unflip(Context * context, const TiledRenderer * t, uint32_t canvas_x, uint32_t canvas_y, uint32_t w, uint32_t h, uint32_t * x, uint32_t * y)
+{
+    if (w == 0 || h == 0 || (uint64_t)canvas_x + w > t->canvas_w || (uint64_t)canvas_y + h > t->canvas_h) {
+        CONTEXT_error(context, Invalid_argument);
+        return false;
+    }
+    *x = t->details->post_flip_x ? t->canvas_w - canvas_x - w : canvas_x;
+    *y = t->details->post_flip_y ? t->canvas_h - canvas_y - h : canvas_y;
+    return true;
+}
+
+//Builds the contributions for a canvas rectangle, and finds the source window they read from. contrib_x is NULL when the
+//width is unchanged. Windows are left in source coordinates, except those of an identity contrib_y (*scaled_y false),
+//which are relative to the rectangle already.
+static bool TiledRenderer_create_contributions(Context * context, TiledRenderer * t, uint32_t canvas_x, uint32_t canvas_y, uint32_t w, uint32_t h,
+        LineContributions ** contrib_x, LineContributions ** contrib_y, bool * scaled_y,
+        uint32_t * source_x, uint32_t * source_y, uint32_t * source_w, uint32_t * source_h)
+{
+    uint32_t x, y, last_x, last_y;
+    *contrib_x = NULL;
+    *contrib_y = NULL;
+    if (!TiledRenderer_unflip(context, t, canvas_x, canvas_y, w, h, &x, &y)) {
+        CONTEXT_add_to_callstack (context);
+        return false;
+    }
+    const double span_x = RenderDetails_source_span(t->details, false, t->canvas_w);
+    const double span_y = RenderDetails_source_span(t->details, true, t->canvas_h);
+    const bool scale_x = t->source_w != t->canvas_w || span_x != t->canvas_w;
+    const bool scale_y = t->source_h != t->canvas_h || span_y != t->canvas_h;
+    *scaled_y = scale_y;
+    if (scale_x) {
+        *contrib_x = LineContributions_create_span(context, span_x, t->source_w, t->details->interpolation, x, w);
+        if (*contrib_x == NULL) {
+            CONTEXT_add_to_callstack (context);
+            return false;
+        }
+        LineContributions_source_range(*contrib_x, source_x, &last_x);
+    } else {
+        *source_x = x;
+        last_x = x + w - 1;
+    }
+    *contrib_y = scale_y ? LineContributions_create_span(context, span_y, t->source_h, t->details->interpolation, y, h)
+                 : LineContributions_create_identity(context, h);
+    if (*contrib_y == NULL) {
+        CONTEXT_add_to_callstack (context);
+        LineContributions_destroy(context, *contrib_x);
+        *contrib_x = NULL;
+        return false;
+    }
+    if (scale_y) {
+        LineContributions_source_range(*contrib_y, source_y, &last_y);
+    } else {
+        //Identity windows are relative to the rectangle already
+        *source_y = y;
+        last_y = y + h - 1;
+    }
+    *source_w = last_x - *source_x + 1;
+    *source_h = last_y - *source_y + 1;
+    return true;
+}
+
+//Moves every window's source range down by offset
+static void LineContributions_shift(LineContributions * line, int offset)
+{
+    for (uint32_t u = 0; u < line->LineLength; u++) {
+        line->ContribRow[u].Left -= offset;
+        line->ContribRow[u].Right -= offset;
+    }
+}
+
+bool TiledRenderer_source_window(Context * context, TiledRenderer * t, uint32_t canvas_x, uint32_t canvas_y, uint32_t w, uint32_t h,
+                                 uint32_t * source_x, uint32_t * source_y, uint32_t * source_w, uint32_t * source_h)
+{
+    LineContributions * contrib_x, * contrib_y;
+    bool scaled_y;
+    if (!TiledRenderer_create_contributions(context, t, canvas_x, canvas_y, w, h, &contrib_x, &contrib_y, &scaled_y,
+                                            source_x, source_y, source_w, source_h)) {
+        CONTEXT_add_to_callstack (context);
+        return false;
+    }
+    LineContributions_destroy(context, contrib_x);
+    LineContributions_destroy(context, contrib_y);
+    return true;
+}
+
+bool TiledRenderer_render_region(Context * context, TiledRenderer * t, BitmapBgra * source, uint32_t source_x, uint32_t source_y,
+                                 uint32_t canvas_x, uint32_t canvas_y, BitmapBgra * region)
+{
+    //GDI+ layouts are only ever read
+    if (BitmapPixelFormat_unpacked(region->fmt) != region->fmt) {
+        CONTEXT_error(context, Unsupported_pixel_format);
+        return false;
+    }
+    uint32_t window_x, window_y, window_w, window_h;
+    LineContributions * contrib_x, * contrib_y;
+    bool scaled_y;
+    if (!TiledRenderer_create_contributions(context, t, canvas_x, canvas_y, region->w, region->h, &contrib_x, &contrib_y, &scaled_y,
+                                            &window_x, &window_y, &window_w, &window_h)) {
+        CONTEXT_add_to_callstack (context);
+        return false;
+    }
+    if (source->fmt != t->source_format || window_x < source_x || window_y < source_y ||
+            (uint64_t)window_x + window_w > (uint64_t)source_x + source->w || (uint64_t)window_y + window_h > (uint64_t)source_y + source->h) {
+        LineContributions_destroy(context, contrib_x);
+        LineContributions_destroy(context, contrib_y);
+        CONTEXT_error(context, Invalid_argument);
+        return false;
+    }
+
+    //A view of just the window; rows keep the source stride
+    BitmapBgra window = *source;
+    window.w = window_w;
+    window.h = window_h;
+    window.pixels = source->pixels + (size_t)(window_y - source_y) * source->stride +
+                    (size_t)(window_x - source_x) * BitmapPixelFormat_bytes_per_pixel(source->fmt);
+    window.borrowed_pixels = true;
+
+    if (contrib_x != NULL) {
+        LineContributions_shift(contrib_x, (int)window_x);
+    }
+    if (scaled_y) {
+        LineContributions_shift(contrib_y, (int)window_y);
+    }
+    const uint32_t channels = RenderDetails_scaling_format(t->details, t->source_format, t->source_alpha_meaningful, true);
+    StreamingScaler * scaler = StreamingScaler_create_from_contributions(context, contrib_x, contrib_y, window_w, window_h, channels);
+    if (scaler == NULL) {
+        CONTEXT_add_to_callstack (context);
+        return false;
+    }
+    StreamingRenderer * r = StreamingRenderer_create_from_scaler(context, t->details, scaler, t->source_format, t->source_alpha_meaningful);
+    if (r == NULL) {
+        CONTEXT_add_to_callstack (context);
+        return false;
+    }
+
+    //Alternate between pushing the window and pulling whatever that completed. Vertical flips pull one row at a time.
+    bool success = true;
+    BitmapBgra pending = window;
+    while (!StreamingRenderer_is_complete(r)) {
+        uint32_t consumed = 0, written = 0;
+        if (pending.h > 0) {
+            if (!StreamingRenderer_push_rows(context, r, &pending, &consumed)) {
+                success = false;
+                break;
+            }
+            pending.h -= consumed;
+            pending.pixels += (size_t)consumed * pending.stride;
+        }
+        do {
+            const uint32_t pulled = StreamingRenderer_rows_pulled(r);
+            const uint32_t row = t->details->post_flip_y ? region->h - 1 - pulled : pulled;
+            if (!StreamingRenderer_pull_rows(context, r, region, row, t->details->post_flip_y ? 1 : region->h - pulled, &written)) {
+                success = false;
+                break;
+            }
+        } while (written > 0 && !StreamingRenderer_is_complete(r));
+        if (!success) break;
+        if (consumed == 0 && written == 0 && !StreamingRenderer_is_complete(r)) {
+            CONTEXT_error(context, Invalid_internal_state);
+            success = false;
+            break;
+        }
+    }
+    if (!success) {
+        CONTEXT_add_to_callstack (context);
+    }
+    StreamingRenderer_destroy(context, r);
+    return success;
+}
+
+bool RenderDetails_render_tiled(Context * context, RenderDetails * details, BitmapBgra * source, BitmapBgra * canvas, uint32_t tile_size)
+{
+    if (tile_size == 0) {
+        CONTEXT_error(context, Invalid_argument);
+        return false;
+    }
+    TiledRenderer * t = TiledRenderer_create(context, details, source->w, source->h, source->fmt, source->alpha_meaningful, canvas->w, canvas->h);
+    if (t == NULL) {
+        CONTEXT_add_to_callstack (context);
+        return false;
+    }
+    bool success = true;
+    const uint32_t bytes_pp = BitmapPixelFormat_bytes_per_pixel(canvas->fmt);
+    for (uint32_t y = 0; y < canvas->h && success; y += tile_size) {
+        for (uint32_t x = 0; x < canvas->w && success; x += tile_size) {
+            BitmapBgra tile = *canvas;
+            tile.w = umin(tile_size, canvas->w - x);
+            tile.h = umin(tile_size, canvas->h - y);
+            tile.pixels = canvas->pixels + (size_t)y * canvas->stride + (size_t)x * bytes_pp;
+            tile.borrowed_pixels = true;
+            if (!TiledRenderer_render_region(context, t, source, 0, 0, x, y, &tile)) {
+                CONTEXT_add_to_callstack (context);
+                success = false;
+            }
+        }
+    }
+    TiledRenderer_destroy(context, t);
+    return success;
+}
+
+bool RenderDetails_render_roi(Context * context, RenderDetails * details, BitmapBgra * source, BitmapBgra * canvas)
+{
+    if (details->roi_output_w == 0 || details->roi_output_h == 0) {
+        CONTEXT_error(context, Invalid_argument);
+        return false;
+    }
+    TiledRenderer * t = TiledRenderer_create(context, details, source->w, source->h, source->fmt, source->alpha_meaningful, details->roi_output_w, details->roi_output_h);
+    if (t == NULL) {
+        CONTEXT_add_to_callstack (context);
+        return false;
+    }
+    bool success = TiledRenderer_render_region(context, t, source, 0, 0, details->roi_x, details->roi_y, canvas);
+    if (!success) {
+        CONTEXT_add_to_callstack (context);
+    }
+    TiledRenderer_destroy(context, t);
+    return success;
+}
@@ -18,6 +18,10 @@ const Rect RectFailure = {
 
 Rect detect_content(Context * context, BitmapBgra * b, uint8_t threshold)
 {
+    if (BitmapPixelFormat_is_wide(b->fmt) || BitmapPixelFormat_unpacked(b->fmt) != b->fmt) {
+        CONTEXT_error(context, Unsupported_pixel_format);
+        return RectFailure;
+    }
     SearchInfo info;
     info.w = b->w;
     info.h = b->h;
@@ -103,7 +107,7 @@ bool fill_buffer(Context * context, SearchInfo* __restrict info)
     const uint32_t h = info->buf_h;
     const uint32_t bytes_per_pixel = BitmapPixelFormat_bytes_per_pixel (info->bitmap->fmt);
     const uint32_t remnant = info->bitmap->stride - (bytes_per_pixel * w);
-    uint8_t  const  * __restrict bgra = info->bitmap->pixels + (info->bitmap->stride * info->buf_y) + (bytes_per_pixel * info->buf_x);
+    uint8_t  const  * __restrict bgra = info->bitmap->pixels + ((size_t)info->bitmap->stride * info->buf_y) + (bytes_per_pixel * info->buf_x);
     const uint8_t channels = bytes_per_pixel;
     if (channels == 4 && info->bitmap->alpha_meaningful) {
         uint32_t buf_ix = 0;
@@ -330,36 +330,28 @@ static LineContributions * LineContributions_alloc(Context * context, const uint
     }
     res->WindowSize = windows_size;
     res->LineLength = line_length;
-    res->ContribRow = (PixelContributions *)CONTEXT_malloc(context, line_length * sizeof(PixelContributions));
+    //The weights follow the windows in the same allocation. Trimming moves each window's Weights pointer, so
+    //no window (not even the first) can be relied on to point at the start of the weights.
+    res->ContribRow = (PixelContributions *)CONTEXT_calloc(context, 1, line_length * sizeof(PixelContributions) + (size_t)windows_size * line_length * sizeof(float));
     if (!res->ContribRow) {
         CONTEXT_free(context, res);
         CONTEXT_error(context, Out_of_memory);
         return NULL;
     }
 
-    float *allWeights = CONTEXT_calloc_array(context, windows_size * line_length, float);
-    if (!allWeights) {
-        CONTEXT_free(context, res->ContribRow);
-        CONTEXT_free(context, res);
-        CONTEXT_error(context, Out_of_memory);
-        return NULL;
-    }
-
+    float *allWeights = (float *)(res->ContribRow + line_length);
     for (uint32_t i = 0; i < line_length; i++)
         res->ContribRow[i].Weights = allWeights + (i * windows_size);
 
     return res;
 }
 
+
 void LineContributions_destroy(Context * context, LineContributions * p)
 {
 
     if (p != NULL) {
-        if (p->ContribRow != NULL) {
-            CONTEXT_free(context, p->ContribRow[0].Weights);
-        }
         CONTEXT_free(context, p->ContribRow);
-
     }
     CONTEXT_free(context, p);
 }
@@ -367,15 +359,38 @@ void LineContributions_destroy(Context * context, LineContributions * p)
 
 LineContributions *LineContributions_create(Context * context,  const uint32_t output_line_size, const uint32_t input_line_size,  const InterpolationDetails* details)
 {
+    return LineContributions_create_range(context, output_line_size, input_line_size, details, 0, output_line_size);
+}
+
+LineContributions * LineContributions_create_range(Context * context, const uint32_t output_line_size, const uint32_t input_line_size, const InterpolationDetails * details, const uint32_t from, const uint32_t count)
+{
+    if (from + count > output_line_size) {
+        CONTEXT_error(context, Invalid_internal_state);
+        return NULL;
+    }
+    LineContributions * res = LineContributions_create_span(context, output_line_size, input_line_size, details, from, count);
+    if (res == NULL) {
+        CONTEXT_add_to_callstack (context);
+    }
+    return res;
+}
+
+LineContributions * LineContributions_create_span(Context * context, const double output_span, const uint32_t input_line_size,
+                                                  const InterpolationDetails * details, const uint32_t from, const uint32_t count)
+{
+    if (output_span <= 0) {
+        CONTEXT_error(context, Invalid_internal_state);
+        return NULL;
+    }
     const double sharpen_ratio =  InterpolationDetails_percent_negative_weight(details);
     const double desired_sharpen_ratio = details->sharpen_percent_goal / 100.0;
-    const double scale_factor = (double)output_line_size / (double)input_line_size;
+    const double scale_factor = output_span / (double)input_line_size;
     const double downscale_factor = fmin(1.0, scale_factor);
     const double half_source_window = (details->window + 0.5) / downscale_factor;
    
     const uint32_t allocated_window_size = (int)ceil(2 * (half_source_window - TONY)) + 1;
     uint32_t u, ix;
-    LineContributions *res = LineContributions_alloc(context, output_line_size, allocated_window_size);
+    LineContributions *res = LineContributions_alloc(context, count, allocated_window_size);
     if (res == NULL){
         CONTEXT_add_to_callstack (context);
         return NULL;
@@ -385,7 +400,8 @@ LineContributions *LineContributions_create(Context * context,  const uint32_t o
     double negative_area = 0;
     double positive_area = 0;
 
-    for (u = 0; u < output_line_size; u++) {
+    for (u = from; u < from + count; u++) {
+        PixelContributions * contrib = &res->ContribRow[u - from];
         const double center_src_pixel = ((double)u + 0.5) / scale_factor - 0.5;
 
         const int left_edge = (int)floor(center_src_pixel) - ((allocated_window_size - 1) / 2);
@@ -405,11 +421,11 @@ LineContributions *LineContributions_create(Context * context,  const uint32_t o
             return NULL;
         }
 
-        res->ContribRow[u].Left = left_src_pixel;
-        res->ContribRow[u].Right = right_src_pixel;
+        contrib->Left = left_src_pixel;
+        contrib->Right = right_src_pixel;
 
 
-        float *weights = res->ContribRow[u].Weights;
+        float *weights = contrib->Weights;
 
         for (ix = left_src_pixel; ix <= right_src_pixel; ix++) {
             int tx = ix - left_src_pixel;
@@ -452,17 +468,157 @@ LineContributions *LineContributions_create(Context * context,  const uint32_t o
         for (iix = source_pixel_count - 1; iix >= 0; iix--) {
             if (weights[iix] != 0)
                 break;
-            res->ContribRow[u].Right--;
+            contrib->Right--;
         }
         // Shrink region from the left
         for (iix = 0; iix < (int32_t)source_pixel_count; iix++) {
             if (weights[0] != 0)
                 break;
-            res->ContribRow[u].Weights++;
+            contrib->Weights++;
             weights++;
-            res->ContribRow[u].Left++;
+            contrib->Left++;
         }
     }
     res->percent_negative = negative_area / positive_area;
     return res;
 }
+
+LineContributions * LineContributions_create_identity(Context * context, const uint32_t line_size)
+{
+    LineContributions * res = LineContributions_alloc(context, line_size, 1);
+    if (res == NULL) {
+        CONTEXT_add_to_callstack (context);
+        return NULL;
+    }
+    for (uint32_t u = 0; u < line_size; u++) {
+        res->ContribRow[u].Left = (int)u;
+        res->ContribRow[u].Right = (int)u;
+        res->ContribRow[u].Weights[0] = 1.0f;
+    }
+    res->percent_negative = 0;
+    return res;
+}
+
+float LineContributions_weight(const LineContributions * p, uint32_t output_pixel, uint32_t input_pixel)
+{
+    const PixelContributions * c = &p->ContribRow[output_pixel];
+    if ((int)input_pixel < c->Left || (int)input_pixel > c->Right) return 0;
+    return c->Weights[(int)input_pixel - c->Left];
+}
+
+void PaddedContributions_destroy(Context * context, PaddedContributions * p)
+{
+    if (p != NULL) {
+        CONTEXT_free(context, p->Left);
+        CONTEXT_free(context, p->allocation);
+    }
+    CONTEXT_free(context, p);
+}
+
+PaddedContributions * PaddedContributions_create(Context * context, const LineContributions * from, uint32_t input_line_size, uint32_t tap_multiple, bool tap_major)
+{
+    uint32_t widest = 1;
+    for (uint32_t u = 0; u < from->LineLength; u++) {
+        const PixelContributions * c = &from->ContribRow[u];
+        if (c->Left < 0 || c->Right >= (int)input_line_size) {
+            CONTEXT_error(context, Invalid_internal_state);
+            return NULL;
+        }
+        widest = umax(widest, (uint32_t)(c->Right - c->Left + 1));
+    }
+    PaddedContributions * res = CONTEXT_calloc_array(context, 1, PaddedContributions);
+    if (res == NULL) {
+        CONTEXT_error(context, Out_of_memory);
+        return NULL;
+    }
+    tap_multiple = umax(1, tap_multiple);
+    //Padding can't make a window wider than the line itself
+    res->Taps = umin(input_line_size, (widest + tap_multiple - 1) / tap_multiple * tap_multiple);
+    res->LineLength = from->LineLength;
+    res->OutputStride = tap_major ? (from->LineLength + 7) / 8 * 8 : from->LineLength;
+    res->TapMajor = tap_major;
+    res->percent_negative = from->percent_negative;
+
+    const size_t weight_count = (size_t)res->Taps * res->OutputStride;
+    //The padding outputs of a tap-major table get Left = 0 and no weights, so they can be computed (and discarded) safely
+    res->Left = CONTEXT_calloc_array(context, res->OutputStride, int);
+    res->allocation = CONTEXT_calloc(context, weight_count * sizeof(float) + 31, 1);
+    if (res->Left == NULL || res->allocation == NULL) {
+        PaddedContributions_destroy(context, res);
+        CONTEXT_error(context, Out_of_memory);
+        return NULL;
+    }
+    res->Weights = (float *)(((uintptr_t)res->allocation + 31) & ~(uintptr_t)31);
+
+    for (uint32_t u = 0; u < from->LineLength; u++) {
+        const PixelContributions * c = &from->ContribRow[u];
+        //Near the end of the line, start the window early (with leading zeros) rather than read past the last pixel
+        const int left = int_min(c->Left, (int)(input_line_size - res->Taps));
+        res->Left[u] = left;
+        for (int i = c->Left; i <= c->Right; i++) {
+            const uint32_t tap = (uint32_t)(i - left);
+            res->Weights[tap_major ? (size_t)tap * res->OutputStride + u : (size_t)u * res->Taps + tap] = c->Weights[i - c->Left];
+        }
+    }
+    return res;
+}
+
+float PaddedContributions_weight(const PaddedContributions * p, uint32_t output_pixel, uint32_t input_pixel)
+{
+    const int tap = (int)input_pixel - p->Left[output_pixel];
+    if (tap < 0 || tap >= (int)p->Taps) return 0;
+    return p->Weights[p->TapMajor ? (size_t)tap * p->OutputStride + output_pixel : (size_t)output_pixel * p->Taps + tap];
+}
+
+void FixedContributions_destroy(Context * context, FixedContributions * p)
+{
+    if (p != NULL) {
+        CONTEXT_free(context, p->Left);
+        CONTEXT_free(context, p->Weights);
+    }
+    CONTEXT_free(context, p);
+}
+
+FixedContributions * FixedContributions_create(Context * context, const PaddedContributions * from)
+{
+    if (from->TapMajor) {
+        CONTEXT_error(context, Invalid_internal_state);
+        return NULL;
+    }
+    FixedContributions * res = CONTEXT_calloc_array(context, 1, FixedContributions);
+    if (res == NULL) {
+        CONTEXT_error(context, Out_of_memory);
+        return NULL;
+    }
+    res->LineLength = from->LineLength;
+    res->Taps = from->Taps;
+    res->Left = CONTEXT_calloc_array(context, from->LineLength, int);
+    res->Weights = CONTEXT_calloc_array(context, (size_t)from->LineLength * from->Taps, int16_t);
+    if (res->Left == NULL || res->Weights == NULL) {
+        FixedContributions_destroy(context, res);
+        CONTEXT_error(context, Out_of_memory);
+        return NULL;
+    }
+    const int32_t one = 1 << FIXED_WEIGHT_BITS;
+    for (uint32_t u = 0; u < from->LineLength; u++) {
+        const float * weights = from->Weights + (size_t)u * from->Taps;
+        int16_t * fixed = res->Weights + (size_t)u * from->Taps;
+        int32_t sum = 0;
+        uint32_t largest = 0;
+        for (uint32_t t = 0; t < from->Taps; t++) {
+            const double scaled = floor((double)weights[t] * one + 0.5);
+            if (scaled < -32768 || scaled > 32767) {
+                FixedContributions_destroy(context, res);
+                CONTEXT_error(context, Invalid_internal_state);
+                return NULL;
+            }
+            fixed[t] = (int16_t)scaled;
+            sum += fixed[t];
+            if (abs(fixed[t]) > abs(fixed[largest])) largest = t;
+        }
+        //Rounding can leave the row a little off; the largest weight absorbs the difference, so flat areas stay exact
+        fixed[largest] = (int16_t)(fixed[largest] + (one - sum));
+        res->Left[u] = from->Left[u];
+    }
+    return res;
+}
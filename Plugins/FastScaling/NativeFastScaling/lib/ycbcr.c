@@ -0,0 +1,313 @@
+/*
+ * Copyright (c) Imazen LLC.
+ * No part of this project, including this file, may be copied, modified,
+ * propagated, or distributed except as permitted in COPYRIGHT.txt.
+ * Licensed under the GNU Affero General Public License, Version 3.0.
+ * Commercial licenses available at http://imageresizing.net/
+ */
+#ifdef _MSC_VER
+#pragma unmanaged
+#endif
+
+#include "fastscaling_private.h"
+#include <string.h>
+
+/*
+ * Y'CbCr is an affine transform of R'G'B', so scaling, convolving and sharpening each plane gives what doing so to the
+ * R'G'B' pixels would in Floatspace_as_is, short of clamping. Each plane is rendered as a Gray8 image, chroma from its
+ * own reduced size with contributions of its own, so nothing is upsampled beyond the canvas; only the canvas-sized
+ * planes are converted to BGR.
+ */
+
+//Full range BT.601, in 16-bit fixed point
+#define YCBCR_FIX(x) ((int32_t)((x) * 65536.0 + 0.5))
+
+uint32_t BitmapYCbCr_plane_width(const BitmapYCbCr * im, int plane)
+{
+    return plane == 0 ? im->w : (im->w + im->subsampling_x - 1) / im->subsampling_x;
+}
+
+uint32_t BitmapYCbCr_plane_height(const BitmapYCbCr * im, int plane)
+{
+    return plane == 0 ? im->h : (im->h + im->subsampling_y - 1) / im->subsampling_y;
+}
+
+void BitmapYCbCr_destroy(Context * context, BitmapYCbCr * im)
+{
+    if (im == NULL) return;
+    if (!im->borrowed_pixels) {
+        for (int plane = 0; plane < 3; plane++) {
+            CONTEXT_free(context, im->planes[plane]);
+        }
+    }
+    CONTEXT_free(context, im);
+}
+
+BitmapYCbCr * BitmapYCbCr_create(Context * context, uint32_t w, uint32_t h, uint32_t subsampling_x, uint32_t subsampling_y)
+{
+    if (w == 0 || h == 0 || w > 0x7fffffff / 4 || h > 0x7fffffff / 4) {
+        CONTEXT_error(context, Invalid_BitmapBgra_dimensions);
+        return NULL;
+    }
+    if (subsampling_x < 1 || subsampling_x > 4 || subsampling_y < 1 || subsampling_y > 4) {
+        CONTEXT_error(context, Invalid_argument);
+        return NULL;
+    }
+    BitmapYCbCr * im = CONTEXT_calloc_array(context, 1, BitmapYCbCr);
+    if (im == NULL) {
+        CONTEXT_error(context, Out_of_memory);
+        return NULL;
+    }
+    im->w = w;
+    im->h = h;
+    im->subsampling_x = subsampling_x;
+    im->subsampling_y = subsampling_y;
+    for (int plane = 0; plane < 3; plane++) {
+        im->strides[plane] = BitmapYCbCr_plane_width(im, plane);
+        im->planes[plane] = (unsigned char *)CONTEXT_malloc(context, (size_t)im->strides[plane] * BitmapYCbCr_plane_height(im, plane));
+        if (im->planes[plane] == NULL) {
+            BitmapYCbCr_destroy(context, im);
+            CONTEXT_error(context, Out_of_memory);
+            return NULL;
+        }
+    }
+    return im;
+}
+
+static inline uint8_t clamp_byte(int32_t v)
+{
+    return (uint8_t)(v < 0 ? 0 : (v > 255 ? 255 : v));
+}
+
+//Rounds v / 65536 to nearest; the bias keeps the shift off negative numbers
+static inline int32_t fixed_round(int32_t v)
+{
+    return ((v + (1 << 15) + (256 << 16)) >> 16) - 256;
+}
+
+static inline void ycbcr_to_bgr(int32_t luma, int32_t cb, int32_t cr, uint8_t * d)
+{
+    const int32_t b = cb - 128;
+    const int32_t r = cr - 128;
+    d[0] = clamp_byte(luma + fixed_round(YCBCR_FIX(1.772) * b));
+    d[1] = clamp_byte(luma + fixed_round(-YCBCR_FIX(0.344136) * b - YCBCR_FIX(0.714136) * r));
+    d[2] = clamp_byte(luma + fixed_round(YCBCR_FIX(1.402) * r));
+}
+
+bool BitmapYCbCr_to_bgra(Context * context, const BitmapYCbCr * src, BitmapBgra * dest)
+{
+    if (src->w != dest->w || src->h != dest->h) {
+        CONTEXT_error(context, Invalid_argument);
+        return false;
+    }
+    const uint32_t bytes_pp = BitmapPixelFormat_bytes_per_pixel(dest->fmt);
+    if (dest->fmt != Bgr24 && dest->fmt != Bgra32) {
+        CONTEXT_error(context, Unsupported_pixel_format);
+        return false;
+    }
+    for (uint32_t y = 0; y < src->h; y++) {
+        const uint8_t * luma = src->planes[0] + (size_t)y * src->strides[0];
+        const uint8_t * cb = src->planes[1] + (size_t)(y / src->subsampling_y) * src->strides[1];
+        const uint8_t * cr = src->planes[2] + (size_t)(y / src->subsampling_y) * src->strides[2];
+        uint8_t * d = dest->pixels + (size_t)y * dest->stride;
+        if (src->subsampling_x == 1) {
+            for (uint32_t x = 0; x < src->w; x++, d += bytes_pp) {
+                ycbcr_to_bgr(luma[x], cb[x], cr[x], d);
+            }
+        } else {
+            //Steps to the next chroma sample every subsampling_x pixels
+            uint32_t c = 0;
+            uint32_t phase = 0;
+            for (uint32_t x = 0; x < src->w; x++, d += bytes_pp) {
+                ycbcr_to_bgr(luma[x], cb[c], cr[c], d);
+                if (++phase == src->subsampling_x) {
+                    phase = 0;
+                    c++;
+                }
+            }
+        }
+        if (bytes_pp == 4) {
+            d = dest->pixels + (size_t)y * dest->stride;
+            for (uint32_t x = 0; x < src->w; x++) {
+                d[x * 4 + 3] = 0xff;
+            }
+        }
+    }
+    return true;
+}
+
+//A Gray8 view of one plane
+static BitmapBgra * BitmapYCbCr_plane_header(Context * context, const BitmapYCbCr * im, int plane)
+{
+    BitmapBgra * view = BitmapBgra_create_header(context, (int)BitmapYCbCr_plane_width(im, plane), (int)BitmapYCbCr_plane_height(im, plane));
+    if (view == NULL) {
+        CONTEXT_add_to_callstack (context);
+        return NULL;
+    }
+    view->fmt = Gray8;
+    view->stride = im->strides[plane];
+    view->pixels = im->planes[plane];
+    view->alpha_meaningful = false;
+    view->compositing_mode = Replace_self;
+    return view;
+}
+
+//How many output pixels a plane's samples span along one axis. Chroma samples are sited on the luma pixels they cover,
+//so those of an odd-sized image reach half a luma pixel past it, and stretching them onto the output would shift them.
+static double plane_span(uint32_t samples, uint32_t source_size, uint32_t source_subsampling, uint32_t output_size, uint32_t output_subsampling)
+{
+    return (double)samples * output_size * source_subsampling / ((double)source_size * output_subsampling);
+}
+
+//Renders one plane with a copy of details, without the color stages, onto the same plane of a canvas laid out as layout
+//(which only needs its sizes and subsampling). Chroma planes are smaller, so they pick their own halving divisor.
+static bool render_plane(Context * context, const RenderDetails * details, const BitmapYCbCr * source, int plane, BitmapBgra * canvas,
+                         const BitmapYCbCr * layout)
+{
+    BitmapBgra * view = BitmapYCbCr_plane_header(context, source, plane);
+    if (view == NULL) {
+        CONTEXT_add_to_callstack (context);
+        return false;
+    }
+    RenderDetails plane_details = *details;
+    plane_details.apply_color_matrix = false;
+    plane_details.color_lut = NULL;
+    if (plane > 0) {
+        plane_details.halving_divisor = 0;
+    }
+    //The whole output, in luma pixels, along the source's axes
+    const bool roi = details->roi_output_w > 0 || details->roi_output_h > 0;
+    const uint32_t output_w = roi ? details->roi_output_w : layout->w;
+    const uint32_t output_h = roi ? details->roi_output_h : layout->h;
+    const uint32_t source_subsampling_x = plane == 0 ? 1 : source->subsampling_x;
+    const uint32_t source_subsampling_y = plane == 0 ? 1 : source->subsampling_y;
+    const uint32_t canvas_subsampling_x = plane == 0 ? 1 : layout->subsampling_x;
+    const uint32_t canvas_subsampling_y = plane == 0 ? 1 : layout->subsampling_y;
+    if (details->post_transpose) {
+        plane_details.source_span_x = plane_span(view->w, source->w, source_subsampling_x, output_h, canvas_subsampling_y);
+        plane_details.source_span_y = plane_span(view->h, source->h, source_subsampling_y, output_w, canvas_subsampling_x);
+    } else {
+        plane_details.source_span_x = plane_span(view->w, source->w, source_subsampling_x, output_w, canvas_subsampling_x);
+        plane_details.source_span_y = plane_span(view->h, source->h, source_subsampling_y, output_h, canvas_subsampling_y);
+    }
+    const bool success = RenderDetails_render(context, &plane_details, view, canvas);
+    if (!success) {
+        CONTEXT_add_to_callstack (context);
+    }
+    BitmapBgra_destroy(context, view);
+    return success;
+}
+
+//Runs render_plane for each plane given a canvas, with the context's floatspace set aside
+static bool render_planes(Context * context, const RenderDetails * details, const BitmapYCbCr * source, BitmapBgra * canvases[3],
+                          const BitmapYCbCr * layout)
+{
+    ColorspaceInfo * saved = CONTEXT_calloc_array(context, 1, ColorspaceInfo);
+    if (saved == NULL) {
+        CONTEXT_error(context, Out_of_memory);
+        return false;
+    }
+    *saved = context->colorspace;
+    Context_set_floatspace(context, Floatspace_as_is, 0, 0, 0);
+    bool success = true;
+    for (int plane = 0; plane < 3 && success; plane++) {
+        if (canvases[plane] != NULL && !render_plane(context, details, source, plane, canvases[plane], layout)) {
+            CONTEXT_add_to_callstack (context);
+            success = false;
+        }
+    }
+    context->colorspace = *saved;
+    CONTEXT_free(context, saved);
+    return success;
+}
+
+bool RenderDetails_render_ycbcr_planes(Context * context, RenderDetails * details, BitmapYCbCr * source, BitmapYCbCr * canvas)
+{
+    const bool roi = details->roi_output_w > 0 || details->roi_output_h > 0;
+    if (roi && (canvas->subsampling_x > 1 || canvas->subsampling_y > 1)) {
+        CONTEXT_error(context, Invalid_argument);
+        return false;
+    }
+    BitmapBgra * canvases[3] = { NULL, NULL, NULL };
+    bool success = true;
+    for (int plane = 0; plane < 3 && success; plane++) {
+        canvases[plane] = BitmapYCbCr_plane_header(context, canvas, plane);
+        success = canvases[plane] != NULL;
+    }
+    if (success && !render_planes(context, details, source, canvases, canvas)) {
+        success = false;
+    }
+    if (!success) {
+        CONTEXT_add_to_callstack (context);
+    }
+    for (int plane = 0; plane < 3; plane++) {
+        BitmapBgra_destroy(context, canvases[plane]);
+    }
+    return success;
+}
+
+//Applies the color matrix and color LUT to the converted image as the final pass of a same-size render would
+static bool render_color_stages(Context * context, const RenderDetails * details, BitmapBgra * converted, BitmapBgra * canvas)
+{
+    RenderDetails finish = *details;
+    finish.kernel_a = NULL;
+    finish.kernel_b = NULL;
+    finish.sharpen_percent_goal = 0;
+    finish.post_transpose = false;
+    finish.post_flip_x = false;
+    finish.post_flip_y = false;
+    finish.halving_divisor = 1;
+    finish.roi_output_w = 0;
+    finish.roi_output_h = 0;
+    if (!RenderDetails_render(context, &finish, converted, canvas)) {
+        CONTEXT_add_to_callstack (context);
+        return false;
+    }
+    return true;
+}
+
+bool RenderDetails_render_ycbcr(Context * context, RenderDetails * details, BitmapYCbCr * source, BitmapBgra * canvas)
+{
+    const bool color_stages = details->apply_color_matrix || details->color_lut != NULL;
+    if (canvas->fmt == Gray8) {
+        if (color_stages) {
+            CONTEXT_error(context, Unsupported_pixel_format);
+            return false;
+        }
+        BitmapBgra * canvases[3] = { canvas, NULL, NULL };
+        BitmapYCbCr layout;
+        memset(&layout, 0, sizeof(layout));
+        layout.w = canvas->w;
+        layout.h = canvas->h;
+        layout.subsampling_x = 1;
+        layout.subsampling_y = 1;
+        if (!render_planes(context, details, source, canvases, &layout)) {
+            CONTEXT_add_to_callstack (context);
+            return false;
+        }
+        return true;
+    }
+    if (canvas->fmt != Bgr24 && canvas->fmt != Bgra32) {
+        CONTEXT_error(context, Unsupported_pixel_format);
+        return false;
+    }
+    BitmapYCbCr * planes = BitmapYCbCr_create(context, canvas->w, canvas->h, 1, 1);
+    if (planes == NULL) {
+        CONTEXT_add_to_callstack (context);
+        return false;
+    }
+    bool success = RenderDetails_render_ycbcr_planes(context, details, source, planes);
+    if (success && !color_stages) {
+        success = BitmapYCbCr_to_bgra(context, planes, canvas);
+    } else if (success) {
+        BitmapBgra * converted = BitmapBgra_create(context, (int)canvas->w, (int)canvas->h, false, Bgr24);
+        success = converted != NULL && BitmapYCbCr_to_bgra(context, planes, converted) &&
+                  render_color_stages(context, details, converted, canvas);
+        BitmapBgra_destroy(context, converted);
+    }
+    if (!success) {
+        CONTEXT_add_to_callstack (context);
+    }
+    BitmapYCbCr_destroy(context, planes);
+    return success;
+}
@@ -5,6 +5,8 @@
 #include "trim_whitespace.h"
 #include "string.h"
 
+#include <atomic>
+
 bool test (int sx, int sy, BitmapPixelFormat sbpp, int cx, int cy, BitmapPixelFormat cbpp, bool transpose, bool flipx, bool flipy, bool profile, InterpolationFilter filter)
 {
     Context context;
@@ -269,6 +271,30 @@ TEST_CASE("Roundtrip sRGB<->linear RGB<->LUV", "[fastscaling]")
     }
 }
 
+static void check_floatspace_encoding(WorkingFloatspace space, float gamma)
+{
+    Context context;
+    Context_initialize(&context);
+    Context_set_floatspace(&context, space, gamma, 0, 0);
+    for (int x = 0; x < 256; x++) {
+        CHECK(x == Context_floatspace_to_byte(&context, Context_byte_to_floatspace(&context, (uint8_t)x)));
+    }
+    //The table may only differ from pow() where the value is within a bucket of a rounding threshold
+    for (int i = -100; i <= 110000; i += 7) {
+        const float v = (float)i / 100000.0f;
+        CHECK(abs(Context_floatspace_to_srgb(&context, v) - Context_floatspace_to_srgb_uncached(&context, v)) <= 1);
+    }
+    Context_terminate(&context);
+}
+
+TEST_CASE("Floatspace encoding tables roundtrip", "[fastscaling]")
+{
+    check_floatspace_encoding(Floatspace_as_is, 0);
+    check_floatspace_encoding(Floatspace_linear, 0);
+    check_floatspace_encoding(Floatspace_gamma, 2.2f);
+    check_floatspace_encoding(Floatspace_gamma, 1.8f);
+}
+
 
 
 
@@ -377,3 +403,2744 @@ SCENARIO("sRGB roundtrip", "[fastscaling]")
     }
 }
 
+
+static void fill_random_floats(BitmapFloat * b, unsigned int seed)
+{
+    srand(seed);
+    for (uint32_t i = 0; i < b->float_count; i++){
+        b->pixels[i] = (float)rand() / (float)RAND_MAX;
+    }
+}
+
+static float max_scale_rows_difference(Context * context, SimdLevel level, uint32_t from_w, uint32_t to_w, uint32_t channels, InterpolationFilter filter)
+{
+    const uint32_t rows = 3;
+    BitmapFloat * source = BitmapFloat_create(context, from_w, rows, channels, false);
+    BitmapFloat * expected = BitmapFloat_create(context, to_w, rows, channels, true);
+    BitmapFloat * actual = BitmapFloat_create(context, to_w, rows, channels, true);
+    InterpolationDetails * details = InterpolationDetails_create_from(context, filter);
+    LineContributions * contrib = LineContributions_create(context, to_w, from_w, details);
+    fill_random_floats(source, from_w * 31 + to_w);
+
+    Context_set_simd_level(context, Simd_scalar);
+    BitmapFloat_scale_rows(context, source, 0, expected, 0, rows, contrib->ContribRow);
+    Context_set_simd_level(context, level);
+    BitmapFloat_scale_rows(context, source, 0, actual, 0, rows, contrib->ContribRow);
+
+    float max_diff = 0;
+    for (uint32_t y = 0; y < rows; y++){
+        for (uint32_t x = 0; x < to_w * channels; x++){
+            const float diff = fabs(expected->pixels[y * expected->float_stride + x] - actual->pixels[y * actual->float_stride + x]);
+            if (diff > max_diff) max_diff = diff;
+        }
+    }
+    LineContributions_destroy(context, contrib);
+    InterpolationDetails_destroy(context, details);
+    BitmapFloat_destroy(context, source);
+    BitmapFloat_destroy(context, expected);
+    BitmapFloat_destroy(context, actual);
+    return max_diff;
+}
+
+TEST_CASE("Vectorized row scaling matches scalar", "[fastscaling]")
+{
+    Context context;
+    Context_initialize(&context);
+    const SimdLevel supported = Context_simd_level_supported(&context);
+
+    const uint32_t widths[] = { 1, 2, 3, 5, 8, 17, 64, 133 };
+    for (int level = Simd_sse41; level <= (int)supported; level++){
+        for (uint32_t channels = 3; channels <= 4; channels++){
+            for (uint32_t from : widths){
+                for (uint32_t to : widths){
+                    CHECK(max_scale_rows_difference(&context, (SimdLevel)level, from, to, channels, Filter_Robidoux) < 0.0001);
+                    CHECK(max_scale_rows_difference(&context, (SimdLevel)level, from, to, channels, Filter_Lanczos) < 0.0001);
+                }
+            }
+        }
+    }
+    REQUIRE(Context_set_simd_level(&context, (SimdLevel)(supported + 1)) == supported);
+    Context_terminate(&context);
+}
+
+TEST_CASE("Padded contributions hold the same weights and sums in both layouts", "[fastscaling]")
+{
+    Context context;
+    Context_initialize(&context);
+    const SimdLevel supported = Context_simd_level_supported(&context);
+    InterpolationDetails * details = InterpolationDetails_create_from(&context, Filter_Lanczos);
+    const uint32_t widths[] = { 1, 2, 3, 5, 8, 17, 64, 133 };
+    for (uint32_t from : widths){
+        for (uint32_t to : widths){
+            LineContributions * contrib = LineContributions_create(&context, to, from, details);
+            for (int tap_major = 0; tap_major <= 1; tap_major++){
+                PaddedContributions * padded = PaddedContributions_create(&context, contrib, from, 4, tap_major != 0);
+                REQUIRE(padded != NULL);
+                CHECK(((uintptr_t)padded->Weights % 32) == 0);
+                int mismatches = 0;
+                for (uint32_t u = 0; u < to; u++){
+                    CHECK((padded->Left[u] >= 0 && padded->Left[u] + padded->Taps <= from));
+                    for (uint32_t i = 0; i < from; i++){
+                        if (LineContributions_weight(contrib, u, i) != PaddedContributions_weight(padded, u, i)) mismatches++;
+                    }
+                }
+                CHECK(mismatches == 0);
+
+                for (uint32_t channels = 1; channels <= 4; channels++){
+                    BitmapFloat * source = BitmapFloat_create(&context, from, 2, channels, false);
+                    BitmapFloat * expected = BitmapFloat_create(&context, to, 2, channels, true);
+                    BitmapFloat * actual = BitmapFloat_create(&context, to, 2, channels, true);
+                    fill_random_floats(source, from + to * 7 + channels);
+                    //The sums the unpadded windows describe
+                    for (uint32_t y = 0; y < 2; y++){
+                        for (uint32_t x = 0; x < to * channels; x++){
+                            double sum = 0;
+                            for (uint32_t i = 0; i < from; i++){
+                                sum += LineContributions_weight(contrib, x / channels, i) * source->pixels[y * source->float_stride + i * channels + x % channels];
+                            }
+                            expected->pixels[y * expected->float_stride + x] = (float)sum;
+                        }
+                    }
+                    for (int level = Simd_scalar; level <= (int)supported; level++){
+                        Context_set_simd_level(&context, (SimdLevel)level);
+                        REQUIRE(BitmapFloat_scale_rows_padded(&context, source, 0, actual, 0, 2, padded));
+                        float max_diff = 0;
+                        for (uint32_t y = 0; y < 2; y++){
+                            for (uint32_t x = 0; x < to * channels; x++){
+                                max_diff = fmax(max_diff, fabs(expected->pixels[y * expected->float_stride + x] - actual->pixels[y * actual->float_stride + x]));
+                            }
+                        }
+                        CHECK(max_diff < 0.0001);
+                    }
+                    BitmapFloat_destroy(&context, source);
+                    BitmapFloat_destroy(&context, expected);
+                    BitmapFloat_destroy(&context, actual);
+                }
+                PaddedContributions_destroy(&context, padded);
+            }
+            LineContributions_destroy(&context, contrib);
+        }
+    }
+    InterpolationDetails_destroy(&context, details);
+    Context_terminate(&context);
+}
+
+//Renders source onto a new cx by cy canvas of canvas_format, with details the caller configured and still owns.
+//matte may be NULL, or the color to blend the result onto.
+static BitmapBgra * render_canvas(Context * context, RenderDetails * details, BitmapBgra * source, int cx, int cy,
+                                  BitmapPixelFormat canvas_format, const uint8_t * matte)
+{
+    BitmapBgra * canvas = BitmapBgra_create(context, cx, cy, true, canvas_format);
+    REQUIRE(canvas != NULL);
+    if (matte != NULL) {
+        canvas->compositing_mode = Blend_with_matte;
+        memcpy(canvas->matte_color, matte, 4);
+    }
+    REQUIRE(RenderDetails_render(context, details, source, canvas));
+    return canvas;
+}
+
+TEST_CASE("Rendering is consistent across SIMD levels", "[fastscaling]")
+{
+    Context context;
+    Context_initialize(&context);
+    const SimdLevel supported = Context_simd_level_supported(&context);
+
+    RenderDetails * details = RenderDetails_create_with(&context, Filter_Robidoux);
+    details->post_transpose = true;
+
+    for (int bpp = 3; bpp <= 4; bpp++){
+        BitmapBgra * source = BitmapBgra_create(&context, 97, 61, false, (BitmapPixelFormat)bpp);
+        srand(bpp);
+        for (uint32_t i = 0; i < source->stride * source->h; i++){
+            source->pixels[i] = (uint8_t)rand();
+        }
+        Context_set_simd_level(&context, Simd_scalar);
+        BitmapBgra * expected = render_canvas(&context, details, source, 40, 33, source->fmt, NULL);
+        for (int level = Simd_sse41; level <= (int)supported; level++){
+            Context_set_simd_level(&context, (SimdLevel)level);
+            BitmapBgra * actual = render_canvas(&context, details, source, 40, 33, source->fmt, NULL);
+            int max_diff = 0;
+            for (uint32_t y = 0; y < actual->h; y++){
+                for (uint32_t x = 0; x < actual->w * bpp; x++){
+                    const int diff = abs(expected->pixels[y * expected->stride + x] - actual->pixels[y * actual->stride + x]);
+                    if (diff > max_diff) max_diff = diff;
+                }
+            }
+            CHECK(max_diff <= 1);
+            BitmapBgra_destroy(&context, actual);
+        }
+        BitmapBgra_destroy(&context, expected);
+        BitmapBgra_destroy(&context, source);
+    }
+    RenderDetails_destroy(&context, details);
+    Context_terminate(&context);
+}
+
+//Noise on a gradient. Pure noise is clipped by the 8-bit intermediate of the two-pass renderer when upscaling with negative lobes
+static void fill_noisy_gradient(BitmapBgra * b, unsigned int seed)
+{
+    srand(seed);
+    const uint32_t bpp = BitmapPixelFormat_bytes_per_pixel(b->fmt);
+    for (uint32_t y = 0; y < b->h; y++){
+        for (uint32_t x = 0; x < b->w * bpp; x++){
+            const int gradient = (int)((x / bpp) * 127 / b->w + y * 127 / b->h) + (int)(x % bpp) * 16;
+            const int value = int_max(0, int_min(255, gradient + rand() % 64 - 32));
+            //Keep alpha high, so the premultiplied intermediate doesn't dominate the comparison
+            b->pixels[y * b->stride + x] = (uint8_t)(bpp == 4 && x % 4 == 3 ? 128 + value / 2 : value);
+        }
+    }
+}
+
+static int max_byte_difference(BitmapBgra * a, BitmapBgra * b)
+{
+    int max_diff = 0;
+    const uint32_t bpp = BitmapPixelFormat_bytes_per_pixel(a->fmt);
+    for (uint32_t y = 0; y < a->h; y++){
+        for (uint32_t x = 0; x < a->w * bpp; x++){
+            const int diff = abs(a->pixels[y * a->stride + x] - b->pixels[y * b->stride + x]);
+            if (diff > max_diff) max_diff = diff;
+        }
+    }
+    return max_diff;
+}
+
+TEST_CASE("Streaming vertical pass matches the two-pass render", "[fastscaling]")
+{
+    Context context;
+    Context_initialize(&context);
+    const int sizes[][4] = { { 97, 61, 40, 33 }, { 31, 17, 64, 50 }, { 50, 80, 50, 20 }, { 64, 9, 20, 9 } };
+
+    for (int bpp = 1; bpp <= 4; bpp++){
+        if (bpp == 2) continue;
+        for (auto & size : sizes){
+            BitmapBgra * source = BitmapBgra_create(&context, size[0], size[1], false, (BitmapPixelFormat)bpp);
+            source->alpha_meaningful = bpp == 4;
+            //The two-pass renderer flips the source in place unless told otherwise
+            source->pixels_readonly = true;
+            fill_noisy_gradient(source, size[0] + bpp);
+            for (int flags = 0; flags < 8; flags++){
+                const bool transpose = (flags & 1) != 0;
+                const int cx = transpose ? size[3] : size[2];
+                const int cy = transpose ? size[2] : size[3];
+                RenderDetails * details = RenderDetails_create_with(&context, Filter_Robidoux);
+                details->post_transpose = transpose;
+                details->post_flip_x = (flags & 2) != 0;
+                details->post_flip_y = (flags & 4) != 0;
+                details->interpolate_last_percent = -1;
+                //Gray is widened to apply a matrix, which a Gray8 canvas can't hold
+                details->apply_color_matrix = bpp != Gray8;
+                for (int i = 0; i < 5; i++){
+                    details->color_matrix[i][i] = 1;
+                }
+                BitmapBgra * expected = render_canvas(&context, details, source, cx, cy, source->fmt, NULL);
+                details->enable_streaming_vertical_pass = true;
+                BitmapBgra * actual = render_canvas(&context, details, source, cx, cy, source->fmt, NULL);
+                CHECK(max_byte_difference(expected, actual) <= 2);
+                RenderDetails_destroy(&context, details);
+                BitmapBgra_destroy(&context, expected);
+                BitmapBgra_destroy(&context, actual);
+            }
+            BitmapBgra_destroy(&context, source);
+        }
+    }
+    Context_terminate(&context);
+}
+
+TEST_CASE("Streaming falls back to two passes for sharpening the weights can't provide", "[fastscaling]")
+{
+    Context context;
+    Context_initialize(&context);
+    BitmapBgra * source = BitmapBgra_create(&context, 97, 61, false, Bgra32);
+    source->pixels_readonly = true;
+    fill_noisy_gradient(source, 4);
+    //With and without interpolation sharpening, along one axis or both
+    const int sizes[][2] = { { 40, 33 }, { 97, 33 }, { 40, 61 } };
+    const float goals[] = { 0, 5, 20, 60 };
+    const float windows[] = { 1.5f, 100 };
+    for (auto & size : sizes){
+        for (float goal : goals){
+            for (float window : windows){
+                BitmapBgra * canvases[2];
+                for (int streaming = 0; streaming < 2; streaming++){
+                    canvases[streaming] = BitmapBgra_create(&context, size[0], size[1], true, Bgra32);
+                    RenderDetails * details = RenderDetails_create_with(&context, Filter_Robidoux);
+                    details->enable_streaming_vertical_pass = streaming == 1;
+                    details->sharpen_percent_goal = goal;
+                    details->minimum_sample_window_to_interposharpen = window;
+                    REQUIRE(RenderDetails_render(&context, details, source, canvases[streaming]));
+                    RenderDetails_destroy(&context, details);
+                }
+                CHECK(max_byte_difference(canvases[0], canvases[1]) <= 2);
+                BitmapBgra_destroy(&context, canvases[0]);
+                BitmapBgra_destroy(&context, canvases[1]);
+            }
+        }
+    }
+    BitmapBgra_destroy(&context, source);
+    Context_terminate(&context);
+}
+
+TEST_CASE("Multi-threaded rendering is identical to single-threaded", "[fastscaling]")
+{
+    Context context;
+    Context_initialize(&context);
+    Context_set_floatspace(&context, Floatspace_linear, 0, 0, 0);
+    //Downscaling (with halving into a temporary image), perfect size, and upscaling
+    const int sizes[][4] = { { 800, 601, 97, 70 }, { 300, 200, 300, 200 }, { 120, 90, 250, 330 } };
+    for (int bpp = 1; bpp <= 4; bpp++){
+        if (bpp == 2) continue;
+        for (auto & size : sizes){
+            BitmapBgra * source = BitmapBgra_create(&context, size[0], size[1], false, (BitmapPixelFormat)bpp);
+            source->alpha_meaningful = bpp == 4;
+            source->pixels_readonly = true;
+            fill_noisy_gradient(source, size[1] + bpp);
+            for (int flags = 0; flags < 4; flags++){
+                const bool transpose = (flags & 1) != 0;
+                const int cx = transpose ? size[3] : size[2];
+                const int cy = transpose ? size[2] : size[3];
+                RenderDetails * details = RenderDetails_create_with(&context, Filter_Robidoux);
+                details->post_transpose = transpose;
+                details->post_flip_y = true;
+                details->sharpen_percent_goal = 10;
+                details->halving_acceptable_pixel_loss = 1;
+                if (flags & 2) {
+                    details->kernel_a = ConvolutionKernel_create_guassian_normalized(&context, 1.4, 3);
+                    details->kernel_b = ConvolutionKernel_create_guassian_normalized(&context, 0.8, 2);
+                }
+                details->threads = 1;
+                BitmapBgra * expected = render_canvas(&context, details, source, cx, cy, source->fmt, NULL);
+                details->threads = 5;
+                BitmapBgra * actual = render_canvas(&context, details, source, cx, cy, source->fmt, NULL);
+                CHECK(max_byte_difference(expected, actual) == 0);
+                RenderDetails_destroy(&context, details);
+                BitmapBgra_destroy(&context, expected);
+                BitmapBgra_destroy(&context, actual);
+            }
+            BitmapBgra_destroy(&context, source);
+        }
+    }
+    Context_terminate(&context);
+}
+
+TEST_CASE("Worker profiling logs are merged", "[fastscaling]")
+{
+    Context context;
+    Context_initialize(&context);
+    BitmapBgra * source = BitmapBgra_create(&context, 400, 300, true, Bgra32);
+    BitmapBgra * canvas = BitmapBgra_create(&context, 200, 150, true, Bgra32);
+    RenderDetails * details = RenderDetails_create_with(&context, Filter_Robidoux);
+    details->threads = 4;
+    details->enable_profiling = true;
+    REQUIRE(RenderDetails_render(&context, details, source, canvas));
+
+    ProfilingLog * log = Context_get_profiler_log(&context);
+    int scale_calls = 0;
+    for (uint32_t i = 0; i < umin(log->count, log->capacity); i++){
+        const bool scaling = strcmp(log->log[i].name, "ScaleBgraFloatRows") == 0 || strcmp(log->log[i].name, "scale_rows_decoding") == 0;
+        if (scaling && log->log[i].flags == Profiling_start) scale_calls++;
+    }
+    //Both passes, 4 rows at a time, whether or not they decode while scaling
+    CHECK(scale_calls == 300 / 4 + 200 / 4);
+
+    RenderDetails_destroy(&context, details);
+    BitmapBgra_destroy(&context, source);
+    BitmapBgra_destroy(&context, canvas);
+    Context_terminate(&context);
+}
+
+//Feeds the source in batches of batch_rows, pulling whatever is ready after each push
+static BitmapBgra * render_push_pull(Context * context, BitmapBgra * source, int cx, int cy, uint32_t batch_rows, bool flipx)
+{
+    BitmapBgra * canvas = BitmapBgra_create(context, cx, cy, true, source->fmt);
+    RenderDetails * details = RenderDetails_create_with(context, Filter_Robidoux);
+    details->post_flip_x = flipx;
+    details->apply_color_matrix = source->fmt != Gray8;
+    for (int i = 0; i < 5; i++){
+        details->color_matrix[i][i] = 1;
+    }
+    StreamingRenderer * r = StreamingRenderer_create(context, details, source->w, source->h, source->fmt, source->alpha_meaningful, cx, cy);
+    REQUIRE(r != NULL);
+
+    BitmapBgra * batch = BitmapBgra_create_header(context, source->w, 1);
+    batch->fmt = source->fmt;
+    batch->stride = source->stride;
+    batch->borrowed_pixels = true;
+    uint32_t pulled = 0;
+    while (StreamingRenderer_rows_pushed(r) < source->h){
+        const uint32_t first = StreamingRenderer_rows_pushed(r);
+        batch->pixels = source->pixels + first * source->stride;
+        batch->h = umin(batch_rows, source->h - first);
+        uint32_t consumed = 0;
+        uint32_t written = 0;
+        REQUIRE(StreamingRenderer_push_rows(context, r, batch, &consumed));
+        REQUIRE(StreamingRenderer_pull_rows(context, r, canvas, pulled, 7, &written));
+        REQUIRE((consumed > 0 || written > 0));
+        pulled += written;
+        CHECK(StreamingRenderer_rows_pulled(r) == pulled);
+    }
+    uint32_t written = 0;
+    REQUIRE(StreamingRenderer_pull_rows(context, r, canvas, pulled, canvas->h, &written));
+    pulled += written;
+    CHECK(pulled == canvas->h);
+    CHECK(StreamingRenderer_is_complete(r));
+
+    BitmapBgra_destroy(context, batch);
+    StreamingRenderer_destroy(context, r);
+    RenderDetails_destroy(context, details);
+    return canvas;
+}
+
+TEST_CASE("Push/pull streaming renderer matches the streaming render", "[fastscaling]")
+{
+    Context context;
+    Context_initialize(&context);
+    const int sizes[][4] = { { 97, 61, 40, 33 }, { 31, 17, 64, 50 }, { 50, 80, 50, 20 }, { 64, 9, 20, 90 } };
+    const uint32_t batches[] = { 1, 5, 64 };
+
+    for (int bpp = 3; bpp <= 4; bpp++){
+        for (auto & size : sizes){
+            BitmapBgra * source = BitmapBgra_create(&context, size[0], size[1], false, (BitmapPixelFormat)bpp);
+            source->alpha_meaningful = bpp == 4;
+            source->pixels_readonly = true;
+            fill_noisy_gradient(source, size[0] + bpp);
+            for (int flipx = 0; flipx < 2; flipx++){
+                RenderDetails * details = RenderDetails_create_with(&context, Filter_Robidoux);
+                details->enable_streaming_vertical_pass = true;
+                details->post_flip_x = flipx != 0;
+                details->interpolate_last_percent = -1;
+                details->apply_color_matrix = true;
+                for (int i = 0; i < 5; i++){
+                    details->color_matrix[i][i] = 1;
+                }
+                BitmapBgra * expected = render_canvas(&context, details, source, size[2], size[3], source->fmt, NULL);
+                RenderDetails_destroy(&context, details);
+                for (uint32_t batch : batches){
+                    BitmapBgra * actual = render_push_pull(&context, source, size[2], size[3], batch, flipx != 0);
+                    CHECK(max_byte_difference(expected, actual) == 0);
+                    BitmapBgra_destroy(&context, actual);
+                }
+                BitmapBgra_destroy(&context, expected);
+            }
+            BitmapBgra_destroy(&context, source);
+        }
+    }
+    Context_terminate(&context);
+}
+
+TEST_CASE("Push/pull streaming renderer applies backpressure", "[fastscaling]")
+{
+    Context context;
+    Context_initialize(&context);
+    BitmapBgra * source = BitmapBgra_create(&context, 40, 300, true, Bgr24);
+    BitmapBgra * canvas = BitmapBgra_create(&context, 20, 3000, true, Bgr24);
+    RenderDetails * details = RenderDetails_create_with(&context, Filter_Robidoux);
+    StreamingRenderer * r = StreamingRenderer_create(&context, details, 40, 300, Bgr24, false, 20, 3000);
+    REQUIRE(r != NULL);
+
+    //Without pulling, only a handful of the source rows can be buffered
+    uint32_t consumed = 0;
+    REQUIRE(StreamingRenderer_push_rows(&context, r, source, &consumed));
+    CHECK(consumed > 0);
+    CHECK(consumed < 20);
+
+    uint32_t pulled = 0;
+    while (!StreamingRenderer_is_complete(r)){
+        uint32_t written = 0;
+        REQUIRE(StreamingRenderer_pull_rows(&context, r, canvas, pulled, canvas->h, &written));
+        pulled += written;
+        const uint32_t first = StreamingRenderer_rows_pushed(r);
+        if (first < source->h){
+            BitmapBgra * rest = BitmapBgra_create_header(&context, 40, source->h - first);
+            rest->fmt = Bgr24;
+            rest->stride = source->stride;
+            rest->pixels = source->pixels + first * source->stride;
+            rest->borrowed_pixels = true;
+            REQUIRE(StreamingRenderer_push_rows(&context, r, rest, &consumed));
+            BitmapBgra_destroy(&context, rest);
+        }
+    }
+    CHECK(pulled == 3000);
+
+    //Transposition needs the whole image
+    details->post_transpose = true;
+    CHECK(StreamingRenderer_create(&context, details, 40, 300, Bgr24, false, 300, 40) == NULL);
+    CHECK(Context_error_reason(&context) == Invalid_argument);
+    //So does sharpening the weights don't provide, which a render applies to whole columns
+    details->post_transpose = false;
+    details->sharpen_percent_goal = 20;
+    details->minimum_sample_window_to_interposharpen = 100;
+    CHECK(StreamingRenderer_create(&context, details, 40, 300, Bgr24, false, 20, 3000) == NULL);
+    CHECK(Context_error_reason(&context) == Invalid_argument);
+
+    StreamingRenderer_destroy(&context, r);
+    RenderDetails_destroy(&context, details);
+    BitmapBgra_destroy(&context, source);
+    BitmapBgra_destroy(&context, canvas);
+    Context_terminate(&context);
+}
+
+static BitmapBgra * render_tiled(Context * context, BitmapBgra * source, int cx, int cy, uint32_t tile_size, bool flipx, bool flipy)
+{
+    BitmapBgra * canvas = BitmapBgra_create(context, cx, cy, true, source->fmt);
+    RenderDetails * details = RenderDetails_create_with(context, Filter_Robidoux);
+    details->post_flip_x = flipx;
+    details->post_flip_y = flipy;
+    details->apply_color_matrix = source->fmt != Gray8;
+    for (int i = 0; i < 5; i++){
+        details->color_matrix[i][i] = 1;
+    }
+    REQUIRE(RenderDetails_render_tiled(context, details, source, canvas, tile_size));
+    RenderDetails_destroy(context, details);
+    return canvas;
+}
+
+TEST_CASE("Tiled rendering is independent of the tile size", "[fastscaling]")
+{
+    Context context;
+    Context_initialize(&context);
+    const int sizes[][4] = { { 97, 61, 40, 33 }, { 31, 17, 64, 50 }, { 50, 80, 50, 20 } };
+    const uint32_t tile_sizes[] = { 7, 16, 1000 };
+
+    for (int bpp = 3; bpp <= 4; bpp++){
+        for (auto & size : sizes){
+            BitmapBgra * source = BitmapBgra_create(&context, size[0], size[1], false, (BitmapPixelFormat)bpp);
+            source->alpha_meaningful = bpp == 4;
+            fill_noisy_gradient(source, size[1] + bpp);
+            for (int flipx = 0; flipx < 2; flipx++){
+                //Without tiling, this is the push/pull renderer's output (and the flipped version of it)
+                BitmapBgra * expected = render_push_pull(&context, source, size[2], size[3], 5, flipx != 0);
+                BitmapBgra * expected_flipped = render_push_pull(&context, source, size[2], size[3], 5, flipx != 0);
+                REQUIRE(BitmapBgra_flip_vertical(&context, expected_flipped));
+                for (uint32_t tile_size : tile_sizes){
+                    BitmapBgra * actual = render_tiled(&context, source, size[2], size[3], tile_size, flipx != 0, false);
+                    CHECK(max_byte_difference(expected, actual) == 0);
+                    BitmapBgra * flipped = render_tiled(&context, source, size[2], size[3], tile_size, flipx != 0, true);
+                    CHECK(max_byte_difference(expected_flipped, flipped) == 0);
+                    BitmapBgra_destroy(&context, actual);
+                    BitmapBgra_destroy(&context, flipped);
+                }
+                BitmapBgra_destroy(&context, expected);
+                BitmapBgra_destroy(&context, expected_flipped);
+            }
+            BitmapBgra_destroy(&context, source);
+        }
+    }
+    Context_terminate(&context);
+}
+
+TEST_CASE("Tiled regions render from just their source window", "[fastscaling]")
+{
+    Context context;
+    Context_initialize(&context);
+    BitmapBgra * source = BitmapBgra_create(&context, 400, 300, false, Bgra32);
+    fill_noisy_gradient(source, 3);
+    RenderDetails * details = RenderDetails_create_with(&context, Filter_Robidoux);
+    TiledRenderer * t = TiledRenderer_create(&context, details, 400, 300, Bgra32, true, 90, 130);
+    REQUIRE(t != NULL);
+
+    BitmapBgra * expected = BitmapBgra_create(&context, 20, 25, true, Bgra32);
+    BitmapBgra * actual = BitmapBgra_create(&context, 20, 25, true, Bgra32);
+    REQUIRE(TiledRenderer_render_region(&context, t, source, 0, 0, 30, 40, expected));
+
+    uint32_t x, y, w, h;
+    REQUIRE(TiledRenderer_source_window(&context, t, 30, 40, 20, 25, &x, &y, &w, &h));
+    //Downscaling 400 -> 90 reads about 4.4 source pixels per output pixel, plus the filter overlap
+    CHECK(w > 20 * 4);
+    CHECK(w < 20 * 4 + 30);
+    CHECK((x + w <= 400 && y + h <= 300));
+
+    //Render again from a copy of just the window
+    BitmapBgra * window = BitmapBgra_create(&context, w, h, false, Bgra32);
+    for (uint32_t row = 0; row < h; row++){
+        memcpy(window->pixels + row * window->stride, source->pixels + (y + row) * source->stride + x * 4, w * 4);
+    }
+    REQUIRE(TiledRenderer_render_region(&context, t, window, x, y, 30, 40, actual));
+    CHECK(max_byte_difference(expected, actual) == 0);
+
+    //A window one row short is rejected
+    window->h--;
+    CHECK_FALSE(TiledRenderer_render_region(&context, t, window, x, y, 30, 40, actual));
+    CHECK(Context_error_reason(&context) == Invalid_argument);
+
+    //So is sharpening the weights don't provide, which a render applies to whole rows and columns; an axis that isn't
+    //scaled provides none
+    details->sharpen_percent_goal = 20;
+    details->minimum_sample_window_to_interposharpen = 100;
+    CHECK(TiledRenderer_create(&context, details, 400, 300, Bgra32, true, 90, 130) == NULL);
+    CHECK(Context_error_reason(&context) == Invalid_argument);
+    details->minimum_sample_window_to_interposharpen = 1;
+    CHECK(TiledRenderer_create(&context, details, 400, 300, Bgra32, true, 90, 300) == NULL);
+    CHECK(Context_error_reason(&context) == Invalid_argument);
+    BitmapBgra * canvas = BitmapBgra_create(&context, 90, 130, true, Bgra32);
+    CHECK_FALSE(RenderDetails_render_tiled(&context, details, source, canvas, 64));
+    CHECK(Context_error_reason(&context) == Invalid_argument);
+    BitmapBgra_destroy(&context, canvas);
+
+    BitmapBgra_destroy(&context, window);
+    BitmapBgra_destroy(&context, expected);
+    BitmapBgra_destroy(&context, actual);
+    TiledRenderer_destroy(&context, t);
+    RenderDetails_destroy(&context, details);
+    BitmapBgra_destroy(&context, source);
+    Context_terminate(&context);
+}
+
+TEST_CASE("Bitmap dimensions beyond 32-bit byte offsets are accepted", "[fastscaling]")
+{
+    Context context;
+    Context_initialize(&context);
+    //40k x 40k BGRA is 6.4GB; only the header is allocated here. 32-bit builds can't address it.
+    if (sizeof(size_t) >= 8){
+        BitmapBgra * header = BitmapBgra_create_header(&context, 40000, 40000);
+        CHECK(header != NULL);
+        CHECK_FALSE(Context_has_error(&context));
+        BitmapBgra_destroy(&context, header);
+    }
+    Context_terminate(&context);
+}
+
+TEST_CASE("Contributions for a range match the same windows of the whole line", "[fastscaling]")
+{
+    Context context;
+    Context_initialize(&context);
+    InterpolationDetails * details = InterpolationDetails_create_from(&context, Filter_Robidoux);
+    const uint32_t lines[][4] = { { 300, 97, 40, 20 }, { 97, 300, 0, 300 }, { 64, 640, 600, 40 } };
+    for (auto & line : lines){
+        LineContributions * whole = LineContributions_create(&context, line[1], line[0], details);
+        LineContributions * range = LineContributions_create_range(&context, line[1], line[0], details, line[2], line[3]);
+        REQUIRE(whole != NULL);
+        REQUIRE(range != NULL);
+        REQUIRE(range->LineLength == line[3]);
+        for (uint32_t u = 0; u < line[3]; u++){
+            const PixelContributions & expected = whole->ContribRow[line[2] + u];
+            const PixelContributions & actual = range->ContribRow[u];
+            REQUIRE(expected.Left == actual.Left);
+            REQUIRE(expected.Right == actual.Right);
+            for (int i = 0; i <= expected.Right - expected.Left; i++){
+                CHECK(expected.Weights[i] == actual.Weights[i]);
+            }
+        }
+        LineContributions_destroy(&context, whole);
+        LineContributions_destroy(&context, range);
+    }
+    InterpolationDetails_destroy(&context, details);
+    Context_terminate(&context);
+}
+
+TEST_CASE("Rendering a region of interest matches the same region of the full canvas", "[fastscaling]")
+{
+    Context context;
+    Context_initialize(&context);
+    BitmapBgra * source = BitmapBgra_create(&context, 300, 200, false, Bgra32);
+    fill_noisy_gradient(source, 11);
+    BitmapBgra * full = render_tiled(&context, source, 700, 500, 128, true, false);
+
+    RenderDetails * details = RenderDetails_create_with(&context, Filter_Robidoux);
+    details->post_flip_x = true;
+    details->apply_color_matrix = true;
+    for (int i = 0; i < 5; i++){
+        details->color_matrix[i][i] = 1;
+    }
+    details->roi_output_w = 700;
+    details->roi_output_h = 500;
+    details->roi_x = 256;
+    details->roi_y = 244;
+    BitmapBgra * tile = BitmapBgra_create(&context, 256, 256, true, Bgra32);
+    REQUIRE(RenderDetails_render(&context, details, source, tile));
+
+    int max_diff = 0;
+    for (uint32_t y = 0; y < tile->h; y++){
+        for (uint32_t x = 0; x < tile->w * 4; x++){
+            const int diff = abs(tile->pixels[y * tile->stride + x] - full->pixels[(y + 244) * full->stride + 256 * 4 + x]);
+            max_diff = int_max(diff, max_diff);
+        }
+    }
+    CHECK(max_diff == 0);
+
+    //The rectangle must lie within the logical output
+    details->roi_y = 245;
+    CHECK_FALSE(RenderDetails_render(&context, details, source, tile));
+    CHECK(Context_error_reason(&context) == Invalid_argument);
+    RenderDetails_destroy(&context, details);
+
+    //A region covering the whole output is the two-pass render, rounded once less
+    details = RenderDetails_create_with(&context, Filter_Robidoux);
+    BitmapBgra * expected = render_canvas(&context, details, source, 120, 80, Bgra32, NULL);
+    details->roi_output_w = 120;
+    details->roi_output_h = 80;
+    BitmapBgra * actual = render_canvas(&context, details, source, 120, 80, Bgra32, NULL);
+    CHECK(max_byte_difference(expected, actual) <= 1);
+    //Sharpening the weights don't provide is applied to whole rows and columns, which a region can't be
+    details->sharpen_percent_goal = 20;
+    details->minimum_sample_window_to_interposharpen = 100;
+    CHECK_FALSE(RenderDetails_render(&context, details, source, actual));
+    CHECK(Context_error_reason(&context) == Invalid_argument);
+    BitmapBgra_destroy(&context, expected);
+    BitmapBgra_destroy(&context, actual);
+
+    RenderDetails_destroy(&context, details);
+    BitmapBgra_destroy(&context, tile);
+    BitmapBgra_destroy(&context, full);
+    BitmapBgra_destroy(&context, source);
+    Context_terminate(&context);
+}
+
+static BitmapBgra * render_with_plan(Context * context, RenderPlan * plan, BitmapBgra * source, int cx, int cy)
+{
+    BitmapBgra * canvas = BitmapBgra_create(context, cx, cy, true, source->fmt);
+    REQUIRE(RenderPlan_execute(context, plan, source, canvas));
+    return canvas;
+}
+
+TEST_CASE("RenderPlan executions match RenderDetails_render", "[fastscaling]")
+{
+    Context context;
+    Context_initialize(&context);
+    Context_set_floatspace(&context, Floatspace_linear, 0, 0, 0);
+    //Halving, perfect size, and upscaling
+    const int sizes[][4] = { { 800, 601, 97, 70 }, { 300, 200, 300, 200 }, { 120, 90, 250, 330 } };
+    for (auto & size : sizes){
+        for (int flags = 0; flags < 16; flags++){
+            const bool transpose = (flags & 1) != 0;
+            const bool kernels = (flags & 2) != 0;
+            const int cx = transpose ? size[3] : size[2];
+            const int cy = transpose ? size[2] : size[3];
+            RenderDetails * details = RenderDetails_create_with(&context, Filter_Robidoux);
+            details->enable_fused_halving = (flags & 8) != 0;
+            details->post_transpose = transpose;
+            details->post_flip_y = true;
+            details->sharpen_percent_goal = 10;
+            details->halving_acceptable_pixel_loss = 1;
+            details->threads = (flags & 4) != 0 ? 3 : 1;
+            if (kernels) {
+                details->kernel_a = ConvolutionKernel_create_guassian_normalized(&context, 1.4, 3);
+            }
+            RenderPlan * plan = RenderPlan_create(&context, details, size[0], size[1], Bgra32, true, cx, cy, 1);
+            REQUIRE(plan != NULL);
+            //Several images through the same plan
+            for (unsigned int seed = 0; seed < 3; seed++){
+                BitmapBgra * source = BitmapBgra_create(&context, size[0], size[1], false, Bgra32);
+                source->pixels_readonly = true;
+                fill_noisy_gradient(source, seed + flags);
+                BitmapBgra * expected = BitmapBgra_create(&context, cx, cy, true, Bgra32);
+                REQUIRE(RenderDetails_render(&context, details, source, expected));
+                BitmapBgra * actual = render_with_plan(&context, plan, source, cx, cy);
+                CHECK(max_byte_difference(expected, actual) == 0);
+                BitmapBgra_destroy(&context, expected);
+                BitmapBgra_destroy(&context, actual);
+                BitmapBgra_destroy(&context, source);
+            }
+            RenderPlan_destroy(&context, plan);
+            RenderDetails_destroy(&context, details);
+        }
+    }
+    Context_terminate(&context);
+}
+
+typedef struct {
+    RenderPlan * plan;
+    BitmapBgra * source;
+    BitmapBgra * canvas;
+    bool success;
+} PlanExecution;
+
+static void execute_plan(void * item)
+{
+    PlanExecution * e = (PlanExecution *)item;
+    Context context;
+    Context_initialize(&context);
+    e->success = true;
+    for (int i = 0; i < 4 && e->success; i++){
+        e->success = RenderPlan_execute(&context, e->plan, e->source, e->canvas);
+    }
+    Context_terminate(&context);
+}
+
+TEST_CASE("RenderPlan executions can run concurrently", "[fastscaling]")
+{
+    Context context;
+    Context_initialize(&context);
+    RenderDetails * details = RenderDetails_create_with(&context, Filter_Robidoux);
+    details->kernel_a = ConvolutionKernel_create_guassian_normalized(&context, 1.4, 3);
+    details->halving_acceptable_pixel_loss = 1;
+    //More executions than the plan was made for, so some use a temporary workspace
+    RenderPlan * plan = RenderPlan_create(&context, details, 400, 300, Bgra32, true, 90, 70, 2);
+    REQUIRE(plan != NULL);
+    PlanExecution executions[4];
+    for (int i = 0; i < 4; i++){
+        executions[i].plan = plan;
+        executions[i].source = BitmapBgra_create(&context, 400, 300, false, Bgra32);
+        executions[i].source->pixels_readonly = true;
+        fill_noisy_gradient(executions[i].source, i);
+        executions[i].canvas = BitmapBgra_create(&context, 90, 70, true, Bgra32);
+    }
+    Threads_run_parallel(execute_plan, executions, sizeof(PlanExecution), 4);
+    for (int i = 0; i < 4; i++){
+        CHECK(executions[i].success);
+        BitmapBgra * expected = BitmapBgra_create(&context, 90, 70, true, Bgra32);
+        REQUIRE(RenderDetails_render(&context, details, executions[i].source, expected));
+        CHECK(max_byte_difference(expected, executions[i].canvas) == 0);
+        BitmapBgra_destroy(&context, expected);
+        BitmapBgra_destroy(&context, executions[i].canvas);
+        BitmapBgra_destroy(&context, executions[i].source);
+    }
+    RenderPlan_destroy(&context, plan);
+    RenderDetails_destroy(&context, details);
+    Context_terminate(&context);
+}
+
+//Counts the allocations made through a context, which otherwise uses the default heap
+static std::atomic<int> counted_allocations(0);
+
+static void * counting_calloc(Context * context, size_t count, size_t element_size, const char * file, int line)
+{
+    counted_allocations++;
+    return calloc(count, element_size);
+}
+
+static void * counting_malloc(Context * context, size_t byte_count, const char * file, int line)
+{
+    counted_allocations++;
+    return malloc(byte_count);
+}
+
+TEST_CASE("RenderPlan executions don't allocate once the plan is made", "[fastscaling]")
+{
+    Context context;
+    Context_initialize(&context);
+    Context_set_floatspace(&context, Floatspace_linear, 0, 0, 0);
+    context.heap._calloc = counting_calloc;
+    context.heap._malloc = counting_malloc;
+    //Halving into a temporary image, fused halving, and kernels applied directly and by their sigma
+    const int sizes[][4] = { { 800, 600, 100, 75 }, { 301, 203, 120, 90 } };
+    for (auto & size : sizes){
+        for (int flags = 0; flags < 16; flags++){
+            const bool transpose = (flags & 1) != 0;
+            const int cx = transpose ? size[3] : size[2];
+            const int cy = transpose ? size[2] : size[3];
+            RenderDetails * details = RenderDetails_create_with(&context, Filter_Robidoux);
+            details->post_transpose = transpose;
+            details->post_flip_y = true;
+            details->sharpen_percent_goal = 10;
+            details->halving_acceptable_pixel_loss = 1;
+            details->enable_fused_halving = (flags & 2) != 0;
+            details->threads = (flags & 4) != 0 ? 3 : 1;
+            if ((flags & 8) != 0) {
+                details->kernel_a = ConvolutionKernel_create_guassian_normalized(&context, 1.4, 3);
+                details->kernel_b = ConvolutionKernel_create_guassian_sharpen(&context, 4, 12);
+            }
+            RenderPlan * plan = RenderPlan_create(&context, details, size[0], size[1], Bgra32, true, cx, cy, 1);
+            REQUIRE(plan != NULL);
+            BitmapBgra * source = BitmapBgra_create(&context, size[0], size[1], false, Bgra32);
+            source->pixels_readonly = true;
+            fill_noisy_gradient(source, flags);
+            BitmapBgra * canvas = BitmapBgra_create(&context, cx, cy, true, Bgra32);
+            //The first execution may build the context's tables
+            REQUIRE(RenderPlan_execute(&context, plan, source, canvas));
+            counted_allocations = 0;
+            REQUIRE(RenderPlan_execute(&context, plan, source, canvas));
+            CHECK(counted_allocations == 0);
+
+            BitmapBgra * expected = BitmapBgra_create(&context, cx, cy, true, Bgra32);
+            REQUIRE(RenderDetails_render(&context, details, source, expected));
+            CHECK(max_byte_difference(expected, canvas) == 0);
+            BitmapBgra_destroy(&context, expected);
+            BitmapBgra_destroy(&context, canvas);
+            BitmapBgra_destroy(&context, source);
+            RenderPlan_destroy(&context, plan);
+            RenderDetails_destroy(&context, details);
+        }
+    }
+    Context_terminate(&context);
+}
+
+TEST_CASE("Integer pipeline is within 1 of the float pipeline", "[fastscaling]")
+{
+    Context context;
+    Context_initialize(&context);
+    Context_set_floatspace(&context, Floatspace_as_is, 0, 0, 0);
+    const SimdLevel supported = Context_simd_level_supported(&context);
+    //Halving, one axis unchanged, upscaling, and lines narrower than the padded window
+    const int sizes[][4] = { { 800, 601, 97, 70 }, { 300, 200, 300, 77 }, { 120, 90, 250, 330 }, { 3, 2, 40, 30 } };
+    for (int level = Simd_scalar; level <= (int)supported; level++){
+        Context_set_simd_level(&context, (SimdLevel)level);
+        for (int bpp = 3; bpp <= 4; bpp++){
+            for (auto & size : sizes){
+                BitmapBgra * source = BitmapBgra_create(&context, size[0], size[1], false, (BitmapPixelFormat)bpp);
+                source->alpha_meaningful = false;
+                source->pixels_readonly = true;
+                fill_noisy_gradient(source, size[0] + bpp);
+                for (int flags = 0; flags < 4; flags++){
+                    const bool transpose = (flags & 1) != 0;
+                    const int cx = transpose ? size[3] : size[2];
+                    const int cy = transpose ? size[2] : size[3];
+                    RenderDetails * details = RenderDetails_create_with(&context, Filter_Robidoux);
+                    details->post_transpose = transpose;
+                    details->post_flip_x = (flags & 2) != 0;
+                    details->post_flip_y = true;
+                    details->halving_acceptable_pixel_loss = 1;
+                    BitmapBgra * expected = render_canvas(&context, details, source, cx, cy, source->fmt, NULL);
+                    details->enable_integer_pipeline = true;
+                    BitmapBgra * actual = render_canvas(&context, details, source, cx, cy, source->fmt, NULL);
+                    CHECK(max_byte_difference(expected, actual) <= 1);
+                    RenderDetails_destroy(&context, details);
+                    BitmapBgra_destroy(&context, expected);
+                    BitmapBgra_destroy(&context, actual);
+                }
+                BitmapBgra_destroy(&context, source);
+            }
+        }
+    }
+    Context_terminate(&context);
+}
+
+TEST_CASE("Vectorized halving matches scalar, in place or not", "[fastscaling]")
+{
+    Context context;
+    Context_initialize(&context);
+    const SimdLevel supported = Context_simd_level_supported(&context);
+    const WorkingFloatspace spaces[] = { Floatspace_as_is, Floatspace_linear };
+    for (auto space : spaces){
+        Context_set_floatspace(&context, space, 0, 0, 0);
+        for (int bpp = 3; bpp <= 4; bpp++){
+            for (int divisor = 2; divisor <= 16; divisor += (divisor < 5 ? 1 : 11)){
+                //Odd widths leave a remainder, and a partial block at the end of each row
+                BitmapBgra * source = BitmapBgra_create(&context, 97 + divisor, 41, false, (BitmapPixelFormat)bpp);
+                fill_noisy_gradient(source, divisor + bpp);
+                BitmapBgra * expected = BitmapBgra_create(&context, source->w / divisor, source->h / divisor, false, source->fmt);
+                Context_set_simd_level(&context, Simd_scalar);
+                REQUIRE(Halve(&context, source, expected, divisor, NULL));
+                //Scratch space is reused, so is left holding the last call's sums
+                HalvingSums * sums = HalvingSums_create(&context, source->w * bpp, false);
+                for (int level = Simd_scalar; level <= (int)supported; level++){
+                    Context_set_simd_level(&context, (SimdLevel)level);
+                    BitmapBgra * actual = BitmapBgra_create(&context, expected->w, expected->h, false, source->fmt);
+                    REQUIRE(Halve(&context, source, actual, divisor, sums));
+                    CHECK(max_byte_difference(expected, actual) == 0);
+                    BitmapBgra_destroy(&context, actual);
+
+                    BitmapBgra * in_place = BitmapBgra_create(&context, source->w, source->h, false, source->fmt);
+                    fill_noisy_gradient(in_place, divisor + bpp);
+                    REQUIRE(HalveInPlace(&context, in_place, divisor));
+                    REQUIRE(in_place->w == expected->w);
+                    CHECK(max_byte_difference(expected, in_place) == 0);
+                    BitmapBgra_destroy(&context, in_place);
+                }
+                HalvingSums_destroy(&context, sums);
+                BitmapBgra_destroy(&context, expected);
+                BitmapBgra_destroy(&context, source);
+            }
+        }
+    }
+    Context_terminate(&context);
+}
+
+TEST_CASE("Vectorized fused halving matches scalar", "[fastscaling]")
+{
+    Context context;
+    Context_initialize(&context);
+    Context_set_floatspace(&context, Floatspace_linear, 0, 0, 0);
+    const SimdLevel supported = Context_simd_level_supported(&context);
+    for (int bpp = 3; bpp <= 4; bpp++){
+        for (uint32_t channels = 3; channels <= (uint32_t)bpp; channels++){
+            for (uint32_t divisor = 2; divisor <= 5; divisor++){
+                BitmapBgra * source = BitmapBgra_create(&context, 61 + divisor, 23, false, (BitmapPixelFormat)bpp);
+                fill_noisy_gradient(source, divisor + channels);
+                const uint32_t to_w = source->w / divisor;
+                const uint32_t to_h = source->h / divisor;
+                BitmapFloat * expected = BitmapFloat_create(&context, to_w, to_h, (BitmapPixelFormat)channels, false);
+                BitmapFloat * actual = BitmapFloat_create(&context, to_w, to_h, (BitmapPixelFormat)channels, false);
+                Context_set_simd_level(&context, Simd_scalar);
+                REQUIRE(BitmapBgra_halve_srgb_to_linear(&context, source, divisor, 0, true, expected, 0, to_h, NULL));
+                HalvingSums * sums = HalvingSums_create(&context, source->w * bpp, false);
+                for (int level = Simd_scalar; level <= (int)supported; level++){
+                    Context_set_simd_level(&context, (SimdLevel)level);
+                    //In two pieces, to check the row offsets, and that reused sums start over
+                    REQUIRE(BitmapBgra_halve_srgb_to_linear(&context, source, divisor, 0, true, actual, 0, 2, sums));
+                    REQUIRE(BitmapBgra_halve_srgb_to_linear(&context, source, divisor, 2, true, actual, 2, to_h - 2, sums));
+                    for (uint32_t y = 0; y < to_h; y++){
+                        CHECK(memcmp(expected->pixels + y * expected->float_stride, actual->pixels + y * actual->float_stride,
+                                     to_w * channels * sizeof(float)) == 0);
+                    }
+                }
+                HalvingSums_destroy(&context, sums);
+                BitmapFloat_destroy(&context, expected);
+                BitmapFloat_destroy(&context, actual);
+                BitmapBgra_destroy(&context, source);
+            }
+        }
+    }
+    Context_terminate(&context);
+}
+
+TEST_CASE("Fused halving is close to halving into a temporary image", "[fastscaling]")
+{
+    Context context;
+    Context_initialize(&context);
+    Context_set_floatspace(&context, Floatspace_linear, 0, 0, 0);
+    for (int bpp = 3; bpp <= 4; bpp++){
+        BitmapBgra * source = BitmapBgra_create(&context, 640, 481, false, (BitmapPixelFormat)bpp);
+        source->pixels_readonly = true;
+        fill_noisy_gradient(source, bpp);
+        for (int flags = 0; flags < 8; flags++){
+            const bool transpose = (flags & 1) != 0;
+            const int cx = transpose ? 90 : 110;
+            const int cy = transpose ? 110 : 90;
+            BitmapBgra * canvas[2];
+            for (int fused = 0; fused < 2; fused++){
+                canvas[fused] = BitmapBgra_create(&context, cx, cy, true, source->fmt);
+                RenderDetails * details = RenderDetails_create_with(&context, Filter_Robidoux);
+                details->enable_fused_halving = fused == 1;
+                details->post_transpose = transpose;
+                details->post_flip_x = (flags & 2) != 0;
+                details->post_flip_y = (flags & 4) != 0;
+                details->halving_divisor = 3;
+                details->threads = 2;
+                REQUIRE(RenderDetails_render(&context, details, source, canvas[fused]));
+                RenderDetails_destroy(&context, details);
+            }
+            //The temporary image rounds each average to a byte
+            CHECK(max_byte_difference(canvas[0], canvas[1]) <= 2);
+            BitmapBgra_destroy(&context, canvas[0]);
+            BitmapBgra_destroy(&context, canvas[1]);
+        }
+        BitmapBgra_destroy(&context, source);
+    }
+    Context_terminate(&context);
+}
+
+TEST_CASE("Decoding while scaling matches decoding then scaling", "[fastscaling]")
+{
+    Context context;
+    Context_initialize(&context);
+    Context_set_floatspace(&context, Floatspace_linear, 0, 0, 0);
+    InterpolationDetails * interpolation = InterpolationDetails_create_from(&context, Filter_Robidoux);
+    const SimdLevel supported = Context_simd_level_supported(&context);
+    //Upscaling, many strips, a window wider than the line, and a window wider than a strip
+    const uint32_t sizes[][2] = { { 300, 700 }, { 1500, 311 }, { 5, 3 }, { 3000, 10 } };
+    for (int level = Simd_scalar; level <= (int)supported; level++){
+        Context_set_simd_level(&context, (SimdLevel)level);
+        for (int bpp = 3; bpp <= 4; bpp++){
+            for (uint32_t channels = 3; channels <= (uint32_t)bpp; channels++){
+                for (auto & size : sizes){
+                    BitmapBgra * source = BitmapBgra_create(&context, size[0], 5, false, (BitmapPixelFormat)bpp);
+                    fill_noisy_gradient(source, size[0] + channels);
+                    LineContributions * contrib = LineContributions_create(&context, size[1], size[0], interpolation);
+                    PaddedContributions * padded = PaddedContributions_create(&context, contrib, size[0], 4, false);
+                    BitmapFloat * decoded = BitmapFloat_create(&context, size[0], 5, (BitmapPixelFormat)channels, false);
+                    BitmapFloat * expected = BitmapFloat_create(&context, size[1], 5, (BitmapPixelFormat)channels, false);
+                    BitmapFloat * actual = BitmapFloat_create(&context, size[1], 5, (BitmapPixelFormat)channels, false);
+                    REQUIRE(BitmapBgra_convert_srgb_to_linear(&context, source, 0, decoded, 0, 5));
+                    REQUIRE(BitmapFloat_scale_rows_padded(&context, decoded, 0, expected, 0, 5, padded));
+                    DecodingStrip * strip = DecodingStrip_create(&context, padded);
+                    REQUIRE(BitmapBgra_scale_rows_decoding(&context, source, 1, actual, 1, 4, padded, strip));
+                    DecodingStrip_destroy(&context, strip);
+                    for (uint32_t y = 1; y < 5; y++){
+                        CHECK(memcmp(expected->pixels + y * expected->float_stride, actual->pixels + y * actual->float_stride,
+                                     size[1] * channels * sizeof(float)) == 0);
+                    }
+                    BitmapFloat_destroy(&context, decoded);
+                    BitmapFloat_destroy(&context, expected);
+                    BitmapFloat_destroy(&context, actual);
+                    PaddedContributions_destroy(&context, padded);
+                    LineContributions_destroy(&context, contrib);
+                    BitmapBgra_destroy(&context, source);
+                }
+            }
+        }
+    }
+    InterpolationDetails_destroy(&context, interpolation);
+    Context_terminate(&context);
+}
+
+//Premultiplied noise, with some fully transparent pixels
+static void fill_premultiplied(BitmapFloat * b, unsigned int seed)
+{
+    srand(seed);
+    for (uint32_t y = 0; y < b->h; y++){
+        for (uint32_t x = 0; x < b->w; x++){
+            float * p = b->pixels + y * b->float_stride + x * b->channels;
+            const float alpha = b->channels == 4 && rand() % 8 != 0 ? (float)rand() / (float)RAND_MAX : (b->channels == 4 ? 0.0f : 1.0f);
+            for (uint32_t c = 0; c < 3; c++){
+                p[c] = alpha * (float)rand() / (float)RAND_MAX;
+            }
+            if (b->channels == 4) p[3] = alpha;
+        }
+    }
+}
+
+TEST_CASE("Fused output stage matches blending, demultiplying and encoding separately", "[fastscaling]")
+{
+    Context context;
+    Context_initialize(&context);
+    const SimdLevel supported = Context_simd_level_supported(&context);
+    const uint8_t matte[4] = { 30, 200, 90, 160 };
+    //Several blocks of 8 pixels and a remainder, and 4 rows and a remainder
+    const uint32_t w = 37, h = 7;
+    for (int space = 0; space < 2; space++){
+        Context_set_floatspace(&context, space == 0 ? Floatspace_linear : Floatspace_as_is, 0, 0, 0);
+        for (int bpp = 3; bpp <= 4; bpp++){
+            for (uint32_t channels = 3; channels <= 4; channels++){
+                for (int mode = 0; mode < 2; mode++){
+                    for (int transpose = 0; transpose < 2; transpose++){
+                        BitmapFloat * source = BitmapFloat_create(&context, w, h, channels, false);
+                        BitmapFloat * separate = BitmapFloat_create(&context, w, h, channels, false);
+                        BitmapFloat * original = BitmapFloat_create(&context, w, h, channels, false);
+                        fill_premultiplied(source, bpp * 16 + channels * 4 + mode * 2 + transpose);
+                        source->alpha_meaningful = true;
+                        source->alpha_premultiplied = channels == 4;
+                        memcpy(separate->pixels, source->pixels, separate->float_stride * h * sizeof(float));
+                        memcpy(original->pixels, source->pixels, original->float_stride * h * sizeof(float));
+
+                        Context_set_simd_level(&context, Simd_scalar);
+                        if (channels == 4 && mode == 1){
+                            const float matte_alpha = matte[3] / 255.0f;
+                            for (uint32_t i = 0; i < w * h; i++){
+                                float * p = separate->pixels + i * 4;
+                                const float a = (1.0f - p[3]) * matte_alpha;
+                                const float final_alpha = p[3] + a;
+                                for (int c = 0; c < 3; c++){
+                                    p[c] = (p[c] + Context_byte_to_floatspace(&context, matte[c]) * a) / final_alpha;
+                                }
+                                p[3] = final_alpha;
+                            }
+                        } else if (channels == 4){
+                            REQUIRE(BitmapFloat_demultiply_alpha(&context, separate, 0, h));
+                        }
+                        BitmapBgra * expected = transpose ? BitmapBgra_create(&context, h, w, true, (BitmapPixelFormat)bpp) : BitmapBgra_create(&context, w, h, true, (BitmapPixelFormat)bpp);
+                        REQUIRE(BitmapFloat_copy_linear_over_srgb(&context, separate, 0, expected, 0, h, 0, w, transpose != 0));
+
+                        for (int level = Simd_scalar; level <= (int)supported; level++){
+                            Context_set_simd_level(&context, (SimdLevel)level);
+                            BitmapBgra * actual = transpose ? BitmapBgra_create(&context, h, w, true, (BitmapPixelFormat)bpp) : BitmapBgra_create(&context, w, h, true, (BitmapPixelFormat)bpp);
+                            actual->compositing_mode = mode == 1 ? Blend_with_matte : Replace_self;
+                            memcpy(actual->matte_color, matte, 4);
+                            REQUIRE(BitmapFloat_pivoting_composite_linear_over_srgb(&context, source, 0, actual, 0, h, transpose != 0, NULL));
+                            //The reciprocal is multiplied rather than divided by, and AVX2 may fuse the blend's multiply-add
+                            CHECK(max_byte_difference(expected, actual) <= 1);
+                            BitmapBgra_destroy(&context, actual);
+                        }
+                        //The buffer is left as it was
+                        CHECK(memcmp(source->pixels, original->pixels, original->float_stride * h * sizeof(float)) == 0);
+
+                        BitmapBgra_destroy(&context, expected);
+                        BitmapFloat_destroy(&context, separate);
+                        BitmapFloat_destroy(&context, original);
+                        BitmapFloat_destroy(&context, source);
+                    }
+                }
+            }
+        }
+    }
+    Context_terminate(&context);
+}
+
+TEST_CASE("Large Gaussian kernels use the recursive filter unless told otherwise", "[fastscaling]")
+{
+    Context context;
+    Context_initialize(&context);
+    ConvolutionKernel * small = ConvolutionKernel_create_guassian_normalized(&context, 1.4, 3);
+    ConvolutionKernel * large = ConvolutionKernel_create_guassian_sharpen(&context, 6, 18);
+    ConvolutionKernel * arbitrary = ConvolutionKernel_create(&context, 18);
+    CHECK(ConvolutionKernel_select_method(small) == Convolution_direct);
+    CHECK(ConvolutionKernel_select_method(large) == Convolution_recursive);
+    CHECK(ConvolutionKernel_select_method(arbitrary) == Convolution_direct);
+    small->method = Convolution_box;
+    large->method = Convolution_direct;
+    CHECK(ConvolutionKernel_select_method(small) == Convolution_box);
+    CHECK(ConvolutionKernel_select_method(large) == Convolution_direct);
+    ConvolutionKernel_destroy(&context, small);
+    ConvolutionKernel_destroy(&context, large);
+    ConvolutionKernel_destroy(&context, arbitrary);
+    Context_terminate(&context);
+}
+
+static float max_float_difference(BitmapFloat * a, BitmapFloat * b, uint32_t from_x, uint32_t to_x)
+{
+    float max_diff = 0;
+    for (uint32_t y = 0; y < a->h; y++){
+        for (uint32_t x = from_x * a->channels; x < to_x * a->channels; x++){
+            const float diff = fabsf(a->pixels[y * a->float_stride + x] - b->pixels[y * b->float_stride + x]);
+            if (diff > max_diff) max_diff = diff;
+        }
+    }
+    return max_diff;
+}
+
+TEST_CASE("Recursive and box blurs approximate direct convolution", "[fastscaling]")
+{
+    Context context;
+    Context_initialize(&context);
+    const SimdLevel supported = Context_simd_level_supported(&context);
+    const uint32_t w = 301, h = 5;
+    for (uint32_t channels = 3; channels <= 4; channels++){
+        for (int sharpen = 0; sharpen < 2; sharpen++){
+            for (double sigma = 3; sigma <= 9; sigma += 6){
+                const uint32_t radius = (uint32_t)(sigma * 3);
+                ConvolutionKernel * kernel = sharpen ? ConvolutionKernel_create_guassian_sharpen(&context, sigma, radius)
+                                             : ConvolutionKernel_create_guassian_normalized(&context, sigma, radius);
+                BitmapFloat * source = BitmapFloat_create(&context, w, h, channels, false);
+                BitmapFloat * expected = BitmapFloat_create(&context, w, h, channels, false);
+                BitmapFloat * scalar = BitmapFloat_create(&context, w, h, channels, false);
+                BitmapFloat * actual = BitmapFloat_create(&context, w, h, channels, false);
+                srand(channels + (unsigned)sigma);
+                for (uint32_t y = 0; y < h; y++){
+                    for (uint32_t x = 0; x < w * channels; x++){
+                        source->pixels[y * source->float_stride + x] = 0.5f * x / (w * channels) + 0.5f * (float)rand() / (float)RAND_MAX;
+                    }
+                }
+                const size_t bytes = source->float_stride * h * sizeof(float);
+                memcpy(expected->pixels, source->pixels, bytes);
+                //The recursive filter's coefficients come with the kernel; scratch space can be reused across calls
+                CHECK(kernel->recursive.sigma == kernel->sigma);
+                float * scratch = (float *)malloc(w * BLUR_SCRATCH_FLOATS_PER_PIXEL * sizeof(float));
+                kernel->method = Convolution_direct;
+                REQUIRE(BitmapFloat_convolve_rows(&context, expected, kernel, channels, 1, -1, NULL));
+
+                for (int method = Convolution_recursive; method <= Convolution_box; method++){
+                    kernel->method = (ConvolutionMethod)method;
+                    for (int level = Simd_scalar; level <= (int)supported; level++){
+                        Context_set_simd_level(&context, (SimdLevel)level);
+                        BitmapFloat * result = level == Simd_scalar ? scalar : actual;
+                        memcpy(result->pixels, source->pixels, bytes);
+                        //Rows 1..4, with both halves of a row pair used
+                        REQUIRE(BitmapFloat_convolve_rows(&context, result, kernel, channels, 1, -1, scratch));
+                        //Direct convolution renormalizes at the edges rather than repeating the edge pixel
+                        CHECK(max_float_difference(expected, result, radius, w - radius) <= (sharpen ? 0.04f : 0.02f));
+                        CHECK(memcmp(result->pixels, source->pixels, source->float_stride * sizeof(float)) == 0);
+                        if (level != Simd_scalar) CHECK(max_float_difference(scalar, actual, 0, w) <= 1e-4f);
+                    }
+                    Context_set_simd_level(&context, supported);
+                    //Rows of a single value stay that value, up to the edges
+                    for (uint32_t i = 0; i < actual->float_stride * h; i++) actual->pixels[i] = 0.25f;
+                    REQUIRE(BitmapFloat_convolve_rows(&context, actual, kernel, channels, 0, h, NULL));
+                    for (uint32_t i = 0; i < w * channels; i++){
+                        CHECK(actual->pixels[i] == Approx(0.25f).epsilon(1e-4));
+                    }
+                }
+                BitmapFloat_destroy(&context, source);
+                BitmapFloat_destroy(&context, expected);
+                BitmapFloat_destroy(&context, scalar);
+                BitmapFloat_destroy(&context, actual);
+                ConvolutionKernel_destroy(&context, kernel);
+                free(scratch);
+            }
+        }
+    }
+    Context_terminate(&context);
+}
+
+TEST_CASE("Unsharp masks are vectorized and respect their threshold", "[fastscaling]")
+{
+    Context context;
+    Context_initialize(&context);
+    const SimdLevel supported = Context_simd_level_supported(&context);
+    const uint32_t w = 67, h = 3;
+    for (uint32_t channels = 3; channels <= 4; channels++){
+        for (uint32_t radius = 2; radius <= 5; radius += 3){
+            ConvolutionKernel * kernel = ConvolutionKernel_create_unsharp_mask(&context, radius / 2.0, radius, 1.5, 0.1f);
+            REQUIRE(kernel != NULL);
+            CHECK(ConvolutionKernel_select_method(kernel) == Convolution_direct);
+            CHECK(ConvolutionKernel_sum(kernel) == Approx(1));
+            BitmapFloat * source = BitmapFloat_create(&context, w, h, channels, false);
+            BitmapFloat * scalar = BitmapFloat_create(&context, w, h, channels, false);
+            BitmapFloat * actual = BitmapFloat_create(&context, w, h, channels, false);
+            srand(channels + radius);
+            for (uint32_t y = 0; y < h; y++){
+                for (uint32_t x = 0; x < w * channels; x++){
+                    //The last row only has noise below the threshold
+                    const float noise = (float)rand() / (float)RAND_MAX;
+                    source->pixels[y * source->float_stride + x] = y == h - 1 ? 0.5f + 0.001f * noise : noise;
+                }
+            }
+            const size_t bytes = source->float_stride * h * sizeof(float);
+            for (int level = Simd_scalar; level <= (int)supported; level++){
+                Context_set_simd_level(&context, (SimdLevel)level);
+                BitmapFloat * result = level == Simd_scalar ? scalar : actual;
+                memcpy(result->pixels, source->pixels, bytes);
+                REQUIRE(BitmapFloat_convolve_rows(&context, result, kernel, channels, 0, h, NULL));
+                if (level != Simd_scalar) CHECK(max_float_difference(scalar, actual, 0, w) <= 1e-5f);
+            }
+            Context_set_simd_level(&context, supported);
+            CHECK(max_float_difference(source, actual, 0, w) > 0.1f);
+            CHECK(memcmp(actual->pixels + (h - 1) * actual->float_stride, source->pixels + (h - 1) * source->float_stride, w * channels * sizeof(float)) == 0);
+            BitmapFloat_destroy(&context, source);
+            BitmapFloat_destroy(&context, scalar);
+            BitmapFloat_destroy(&context, actual);
+            ConvolutionKernel_destroy(&context, kernel);
+        }
+    }
+    Context_terminate(&context);
+}
+
+TEST_CASE("Vectorized color matrices match the scalar ones", "[fastscaling]")
+{
+    Context context;
+    Context_initialize(&context);
+    const SimdLevel supported = Context_simd_level_supported(&context);
+    //Every coefficient distinct, so a misplaced one shows
+    float data[25];
+    float * m[5];
+    for (int i = 0; i < 25; i++) data[i] = 0.05f * (float)((i * 7) % 11) - 0.2f;
+    for (int i = 0; i < 5; i++) m[i] = &data[i * 5];
+    const uint32_t w = 37, h = 3;
+    for (uint32_t channels = 3; channels <= 4; channels++){
+        BitmapFloat * source = BitmapFloat_create(&context, w, h, channels, false);
+        BitmapFloat * scalar = BitmapFloat_create(&context, w, h, channels, false);
+        BitmapFloat * actual = BitmapFloat_create(&context, w, h, channels, false);
+        BitmapBgra * bytes_source = BitmapBgra_create(&context, w, h, false, (BitmapPixelFormat)channels);
+        BitmapBgra * bytes_scalar = BitmapBgra_create(&context, w, h, false, (BitmapPixelFormat)channels);
+        BitmapBgra * bytes_actual = BitmapBgra_create(&context, w, h, false, (BitmapPixelFormat)channels);
+        fill_noisy_gradient(bytes_source, channels);
+        for (uint32_t i = 0; i < source->float_stride * h; i++) source->pixels[i] = (float)rand() / (float)RAND_MAX;
+        const size_t float_bytes = source->float_stride * h * sizeof(float);
+        const size_t byte_count = bytes_source->stride * h;
+        for (int level = Simd_scalar; level <= (int)supported; level++){
+            Context_set_simd_level(&context, (SimdLevel)level);
+            BitmapFloat * result = level == Simd_scalar ? scalar : actual;
+            BitmapBgra * byte_result = level == Simd_scalar ? bytes_scalar : bytes_actual;
+            memcpy(result->pixels, source->pixels, float_bytes);
+            memcpy(byte_result->pixels, bytes_source->pixels, byte_count);
+            //Rows 1 and 2
+            REQUIRE(BitmapFloat_apply_color_matrix(&context, result, 1, h, m));
+            REQUIRE(BitmapBgra_apply_color_matrix(&context, byte_result, 1, h, m));
+            CHECK(memcmp(result->pixels, source->pixels, source->float_stride * sizeof(float)) == 0);
+            if (level != Simd_scalar){
+                CHECK(max_float_difference(scalar, actual, 0, w) <= 1e-5f);
+                CHECK(max_byte_difference(bytes_scalar, bytes_actual) <= 1);
+            }
+        }
+        Context_set_simd_level(&context, supported);
+        BitmapFloat_destroy(&context, source);
+        BitmapFloat_destroy(&context, scalar);
+        BitmapFloat_destroy(&context, actual);
+        BitmapBgra_destroy(&context, bytes_source);
+        BitmapBgra_destroy(&context, bytes_scalar);
+        BitmapBgra_destroy(&context, bytes_actual);
+    }
+    Context_terminate(&context);
+}
+
+TEST_CASE("Per-channel color matrices are applied as pixels are encoded", "[fastscaling]")
+{
+    Context context;
+    Context_initialize(&context);
+    //Contrast and brightness, then inversion; rows are r, g, b, a, offset
+    const float contrast[25] = { 1.2f, 0, 0, 0, 0, 0, 1.1f, 0, 0, 0, 0, 0, 0.9f, 0, 0, 0, 0, 0, 0.8f, 0, -0.05f, 0.02f, 0.1f, 0.1f, 1 };
+    const float invert[25] = { -1, 0, 0, 0, 0, 0, -1, 0, 0, 0, 0, 0, -1, 0, 0, 0, 0, 0, 1, 0, 1, 1, 1, 0, 1 };
+    const float * matrices[2] = { contrast, invert };
+
+    float data[25];
+    float * m[5];
+    for (int i = 0; i < 5; i++) m[i] = &data[i * 5];
+    memcpy(data, contrast, sizeof(data));
+    CHECK(ColorMatrix_is_per_channel(m, 4));
+    //Alpha's contribution to red only matters with 4 channels
+    data[15] = 0.5f;
+    CHECK(ColorMatrix_is_per_channel(m, 3));
+    CHECK_FALSE(ColorMatrix_is_per_channel(m, 4));
+
+    for (int bpp = 3; bpp <= 4; bpp++){
+        BitmapBgra * source = BitmapBgra_create(&context, 97, 61, false, (BitmapPixelFormat)bpp);
+        source->alpha_meaningful = bpp == 4;
+        source->pixels_readonly = true;
+        fill_noisy_gradient(source, 17 + bpp);
+        for (int space = 0; space < 2; space++){
+            Context_set_floatspace(&context, space == 0 ? Floatspace_as_is : Floatspace_linear, 0, 0, 0);
+            for (const float * matrix : matrices){
+                memcpy(data, matrix, sizeof(data));
+                //A negligible cross term keeps the separate pass
+                data[5] = 1e-7f;
+                REQUIRE_FALSE(ColorMatrix_is_per_channel(m, 3));
+                for (int flags = 0; flags < 8; flags++){
+                    RenderDetails * details = RenderDetails_create_with(&context, Filter_Robidoux);
+                    details->enable_streaming_vertical_pass = (flags & 1) != 0;
+                    details->post_transpose = (flags & 2) != 0;
+                    details->enable_integer_pipeline = (flags & 4) != 0;
+                    details->apply_color_matrix = true;
+                    memcpy(details->color_matrix_data, data, sizeof(data));
+                    BitmapBgra * expected = render_canvas(&context, details, source, 40, 33, source->fmt, NULL);
+                    memcpy(details->color_matrix_data, matrix, sizeof(data));
+                    BitmapBgra * actual = render_canvas(&context, details, source, 40, 33, source->fmt, NULL);
+                    //The integer pipeline maps bytes through tables, rounding twice
+                    const bool tables = details->enable_integer_pipeline && space == 0 && bpp == 3;
+                    CHECK(max_byte_difference(expected, actual) <= (tables ? 2 : 1));
+                    RenderDetails_destroy(&context, details);
+                    BitmapBgra_destroy(&context, expected);
+                    BitmapBgra_destroy(&context, actual);
+                }
+            }
+        }
+        BitmapBgra_destroy(&context, source);
+    }
+    Context_terminate(&context);
+}
+
+//A .cube of the given size, whose entries are 1 - each input (or each input, for an identity)
+static std::string cube_text(uint32_t size, bool invert)
+{
+    std::string text = "# Generated\nTITLE \"test\"\nLUT_3D_SIZE " + std::to_string(size) + "\n\n";
+    char line[64];
+    for (uint32_t b = 0; b < size; b++)
+        for (uint32_t g = 0; g < size; g++)
+            for (uint32_t r = 0; r < size; r++){
+                const float v[3] = { r / (float)(size - 1), g / (float)(size - 1), b / (float)(size - 1) };
+                snprintf(line, sizeof(line), "%.7f %.7f %.7f\r\n", invert ? 1 - v[0] : v[0], invert ? 1 - v[1] : v[1], invert ? 1 - v[2] : v[2]);
+                text += line;
+            }
+    return text;
+}
+
+TEST_CASE("Parse .cube color LUTs", "[fastscaling]")
+{
+    Context context;
+    Context_initialize(&context);
+    ColorLut3D * lut = ColorLut3D_parse_cube(&context, "TITLE \"Warm\"\n# comment\nLUT_3D_SIZE 2\nDOMAIN_MIN 0 0 0\nDOMAIN_MAX 1 1 2\n"
+                                                       "0 0 0\n1 0 0\n0 1 0\n1 1 0\n0 0 1\n1 0 1\n0 1 1\n1 1 1\n");
+    REQUIRE(lut != NULL);
+    CHECK(lut->size == 2);
+    CHECK(lut->domain_max[2] == 2);
+    CHECK(lut->table[3] == 1);
+    CHECK(lut->table[7 * 3 + 2] == 1);
+    ColorLut3D_destroy(&context, lut);
+
+    lut = ColorLut3D_parse_cube(&context, cube_text(33, true).c_str());
+    REQUIRE(lut != NULL);
+    CHECK(lut->size == 33);
+    CHECK(lut->table[0] == 1);
+    ColorLut3D_destroy(&context, lut);
+
+    const char * invalid[] = {
+        "LUT_1D_SIZE 2\n0 0 0\n1 1 1\n",
+        "LUT_3D_SIZE 1\n0 0 0\n",
+        "LUT_3D_SIZE 2\n0 0 0\n",
+        "LUT_3D_SIZE 2\n0 0\n0 0 0\n0 0 0\n0 0 0\n0 0 0\n0 0 0\n0 0 0\n0 0 0\n",
+        "LUT_3D_SIZE 2\nDOMAIN_MIN 1 1 1\nDOMAIN_MAX 0 0 0\n0 0 0\n0 0 0\n0 0 0\n0 0 0\n0 0 0\n0 0 0\n0 0 0\n0 0 0\n",
+        "0 0 0\n",
+        "LUT_3D_SIZE 2.5\n",
+        "",
+    };
+    for (const char * text : invalid){
+        CHECK(ColorLut3D_parse_cube(&context, text) == NULL);
+        CHECK(Context_error_reason(&context) == Invalid_argument);
+    }
+    std::string extra = cube_text(2, false) + "1 1 1\n";
+    CHECK(ColorLut3D_parse_cube(&context, extra.c_str()) == NULL);
+    Context_terminate(&context);
+}
+
+TEST_CASE("Color LUTs are applied after the color matrix, on the final pass", "[fastscaling]")
+{
+    Context context;
+    Context_initialize(&context);
+    const float invert[25] = { -1, 0, 0, 0, 0, 0, -1, 0, 0, 0, 0, 0, -1, 0, 0, 0, 0, 0, 1, 0, 1, 1, 1, 0, 1 };
+    const std::string inverse = cube_text(17, true);
+
+    for (int bpp = 3; bpp <= 4; bpp++){
+        BitmapBgra * source = BitmapBgra_create(&context, 97, 61, false, (BitmapPixelFormat)bpp);
+        source->alpha_meaningful = bpp == 4;
+        source->pixels_readonly = true;
+        fill_noisy_gradient(source, 31 + bpp);
+        for (int space = 0; space < 2; space++){
+            Context_set_floatspace(&context, space == 0 ? Floatspace_as_is : Floatspace_linear, 0, 0, 0);
+            for (int flags = 0; flags < 16; flags++){
+                RenderDetails * details = RenderDetails_create_with(&context, Filter_Robidoux);
+                details->enable_streaming_vertical_pass = (flags & 1) != 0;
+                details->post_transpose = (flags & 2) != 0;
+                details->enable_integer_pipeline = (flags & 4) != 0;
+                details->threads = (flags & 8) != 0 ? 3 : 0;
+                BitmapBgra * plain = render_canvas(&context, details, source, 40, 33, source->fmt, NULL);
+                //Tetrahedral interpolation reproduces a linear table exactly, so this is the inverse of each sRGB byte
+                details->color_lut = ColorLut3D_parse_cube(&context, inverse.c_str());
+                REQUIRE(details->color_lut != NULL);
+                BitmapBgra * inverted = render_canvas(&context, details, source, 40, 33, source->fmt, NULL);
+                int difference = 0;
+                for (uint32_t y = 0; y < plain->h; y++)
+                    for (uint32_t x = 0; x < plain->w * bpp; x++){
+                        const uint8_t p = plain->pixels[y * plain->stride + x];
+                        const uint8_t expected = x % bpp == 3 ? p : 255 - p;
+                        difference = std::max(difference, abs(expected - inverted->pixels[y * inverted->stride + x]));
+                    }
+                CHECK(difference <= 1);
+                //Only in the working space, and without premultiplied alpha, is the matrix's inversion the same as the
+                //table's, and they cancel out
+                if (space == 0 && bpp == 3){
+                    details->apply_color_matrix = true;
+                    memcpy(details->color_matrix_data, invert, sizeof(invert));
+                    BitmapBgra * twice = render_canvas(&context, details, source, 40, 33, source->fmt, NULL);
+                    CHECK(max_byte_difference(plain, twice) <= 1);
+                    BitmapBgra_destroy(&context, twice);
+                }
+                RenderDetails_destroy(&context, details);
+                BitmapBgra_destroy(&context, plain);
+                BitmapBgra_destroy(&context, inverted);
+            }
+        }
+        BitmapBgra_destroy(&context, source);
+    }
+    Context_terminate(&context);
+}
+
+TEST_CASE("Vectorized color LUTs match the scalar ones", "[fastscaling]")
+{
+    Context context;
+    Context_initialize(&context);
+    //Not linear, so every tetrahedron is different
+    std::string cube = "LUT_3D_SIZE 5\n";
+    char line[64];
+    for (int b = 0; b < 5; b++)
+        for (int g = 0; g < 5; g++)
+            for (int r = 0; r < 5; r++){
+                snprintf(line, sizeof(line), "%f %f %f\n", (r * r) / 16.0, (g + r) / 8.0, (4 - b) * (g + 1) / 20.0);
+                cube += line;
+            }
+    ColorLut3D * lut = ColorLut3D_parse_cube(&context, cube.c_str());
+    REQUIRE(lut != NULL);
+    ColorLutStage * stage = ColorLutStage_create(&context, lut);
+    REQUIRE(stage != NULL);
+    for (uint32_t ch = 3; ch <= 4; ch++){
+        BitmapFloat * scalar = BitmapFloat_create(&context, 61, 3, ch, false);
+        BitmapFloat * vectorized = BitmapFloat_create(&context, 61, 3, ch, false);
+        REQUIRE(scalar != NULL);
+        REQUIRE(vectorized != NULL);
+        scalar->alpha_premultiplied = vectorized->alpha_premultiplied = ch == 4;
+        for (uint32_t i = 0; i < scalar->float_stride * scalar->h; i++){
+            scalar->pixels[i] = vectorized->pixels[i] = ((i * 37) % 101) / 90.0f - 0.05f;
+        }
+        Context_set_simd_level(&context, Simd_scalar);
+        REQUIRE(BitmapFloat_apply_color_lut(&context, scalar, 0, 3, stage));
+        Context_set_simd_level(&context, Simd_avx2);
+        REQUIRE(BitmapFloat_apply_color_lut(&context, vectorized, 0, 3, stage));
+        for (uint32_t i = 0; i < scalar->float_stride * scalar->h; i++){
+            CHECK(scalar->pixels[i] == Approx(vectorized->pixels[i]).epsilon(1e-5));
+        }
+        BitmapFloat_destroy(&context, scalar);
+        BitmapFloat_destroy(&context, vectorized);
+    }
+    ColorLutStage_destroy(&context, stage);
+    ColorLut3D_destroy(&context, lut);
+    Context_terminate(&context);
+}
+
+static BitmapBgra * compose_over(Context * context, BitmapBgra * source, BitmapBgra * background, int cx, int cy, bool transpose)
+{
+    BitmapBgra * canvas = BitmapBgra_create(context, cx, cy, false, background->fmt);
+    memcpy(canvas->pixels, background->pixels, (size_t)background->stride * background->h);
+    canvas->alpha_meaningful = background->alpha_meaningful;
+    canvas->alpha_premultiplied = background->alpha_premultiplied;
+    canvas->compositing_mode = Blend_with_self;
+    RenderDetails * details = RenderDetails_create_with(context, Filter_Robidoux);
+    details->post_transpose = transpose;
+    REQUIRE(RenderDetails_render(context, details, source, canvas));
+    RenderDetails_destroy(context, details);
+    return canvas;
+}
+
+TEST_CASE("Vectorized composition over the canvas matches the scalar one", "[fastscaling]")
+{
+    Context context;
+    Context_initialize(&context);
+    //Transparent on the left, opaque in the middle, and translucent on the right
+    BitmapBgra * source = BitmapBgra_create(&context, 90, 40, false, Bgra32);
+    source->alpha_meaningful = true;
+    source->pixels_readonly = true;
+    fill_noisy_gradient(source, 9);
+    for (uint32_t y = 0; y < source->h; y++)
+        for (uint32_t x = 0; x < source->w; x++){
+            uint8_t * p = source->pixels + y * source->stride + x * 4;
+            if (x < 30) memset(p, 0, 4);
+            else if (x < 60) p[3] = 255;
+        }
+    const SimdLevel levels[3] = { Simd_scalar, Simd_sse41, Simd_avx2 };
+    for (int fmt = 0; fmt < 3; fmt++){
+        for (int transpose = 0; transpose < 2; transpose++){
+            const int cx = transpose ? 40 : 90, cy = transpose ? 90 : 40;
+            BitmapBgra * background = BitmapBgra_create(&context, cx, cy, false, fmt == 2 ? Bgr24 : Bgra32);
+            background->alpha_meaningful = fmt == 0;
+            fill_noisy_gradient(background, 10 + fmt);
+            for (int space = 0; space < 2; space++){
+                Context_set_floatspace(&context, space == 0 ? Floatspace_as_is : Floatspace_linear, 0, 0, 0);
+                Context_set_simd_level(&context, Simd_scalar);
+                BitmapBgra * expected = compose_over(&context, source, background, cx, cy, transpose != 0);
+                //The reference, where the source is opaque or (far from the edge) transparent
+                const uint32_t bpp = BitmapPixelFormat_bytes_per_pixel(background->fmt);
+                for (uint32_t i = 0; i < 40; i++){
+                    const uint32_t transparent = transpose ? 10 * expected->stride + i * bpp : i * expected->stride + 10 * bpp;
+                    CHECK(memcmp(expected->pixels + transparent, background->pixels + transparent, bpp) == 0);
+                    const uint32_t opaque = transpose ? 45 * expected->stride + i * bpp : i * expected->stride + 45 * bpp;
+                    const uint32_t from = i * source->stride + 45 * 4;
+                    for (uint32_t c = 0; c < bpp; c++){
+                        const int value = c == 3 ? (fmt == 0 ? 255 : background->pixels[opaque + 3]) : source->pixels[from + c];
+                        CHECK(abs(expected->pixels[opaque + c] - value) <= 1);
+                    }
+                }
+                for (SimdLevel level : levels){
+                    if (level > Context_simd_level_supported(&context)) continue;
+                    Context_set_simd_level(&context, level);
+                    BitmapBgra * actual = compose_over(&context, source, background, cx, cy, transpose != 0);
+                    CHECK(max_byte_difference(expected, actual) <= 1);
+                    BitmapBgra_destroy(&context, actual);
+                }
+                BitmapBgra_destroy(&context, expected);
+            }
+            BitmapBgra_destroy(&context, background);
+        }
+    }
+    BitmapBgra_destroy(&context, source);
+    Context_terminate(&context);
+}
+
+TEST_CASE("Opaque Bgra32 sources are detected and scaled with 3 channels", "[fastscaling]")
+{
+    Context context;
+    Context_initialize(&context);
+    BitmapBgra * source = BitmapBgra_create(&context, 67, 41, false, Bgra32);
+    fill_noisy_gradient(source, 3);
+    for (uint32_t y = 0; y < source->h; y++)
+        for (uint32_t x = 0; x < source->w; x++)
+            source->pixels[y * source->stride + x * 4 + 3] = 255;
+
+    const SimdLevel levels[3] = { Simd_scalar, Simd_sse41, Simd_avx2 };
+    for (SimdLevel level : levels){
+        if (level > Context_simd_level_supported(&context)) continue;
+        Context_set_simd_level(&context, level);
+        CHECK(BitmapBgra_is_opaque(&context, source));
+        //A single translucent pixel anywhere, including the row tails, is found
+        const uint32_t spots[4] = { 3, 40 * source->stride + 66 * 4 + 3, 20 * source->stride + 64 * 4 + 3, 7 * source->stride + 31 * 4 + 3 };
+        for (uint32_t spot : spots){
+            source->pixels[spot] = 254;
+            CHECK_FALSE(BitmapBgra_is_opaque(&context, source));
+            source->pixels[spot] = 255;
+        }
+    }
+    Context_set_simd_level(&context, Context_simd_level_supported(&context));
+    Context_set_floatspace(&context, Floatspace_as_is, 0, 0, 0);
+
+    BitmapBgra * outputs[2];
+    for (int detect = 0; detect < 2; detect++){
+        outputs[detect] = BitmapBgra_create(&context, 29, 53, true, Bgra32);
+        RenderDetails * details = RenderDetails_create_with(&context, Filter_Robidoux);
+        details->detect_opaque_alpha = detect != 0;
+        details->enable_integer_pipeline = true;
+        CHECK(RenderDetails_render(&context, details, source, outputs[detect]));
+        RenderDetails_destroy(&context, details);
+    }
+    CHECK(source->alpha_meaningful);
+    CHECK(max_byte_difference(outputs[0], outputs[1]) <= 1);
+    for (uint32_t y = 0; y < outputs[1]->h; y++)
+        for (uint32_t x = 0; x < outputs[1]->w; x++)
+            CHECK(outputs[1]->pixels[y * outputs[1]->stride + x * 4 + 3] == 255);
+
+    //A translucent source renders identically either way
+    source->pixels[10 * source->stride + 10 * 4 + 3] = 0;
+    for (int detect = 0; detect < 2; detect++){
+        RenderDetails * details = RenderDetails_create_with(&context, Filter_Robidoux);
+        details->detect_opaque_alpha = detect != 0;
+        details->enable_integer_pipeline = true;
+        CHECK(RenderDetails_render(&context, details, source, outputs[detect]));
+        RenderDetails_destroy(&context, details);
+    }
+    CHECK(max_byte_difference(outputs[0], outputs[1]) == 0);
+
+    BitmapBgra_destroy(&context, outputs[0]);
+    BitmapBgra_destroy(&context, outputs[1]);
+    BitmapBgra_destroy(&context, source);
+    Context_terminate(&context);
+}
+
+TEST_CASE("Opaque Bgra32 sources skip premultiplying on the float pipeline", "[fastscaling]")
+{
+    Context context;
+    Context_initialize(&context);
+    Context_set_floatspace(&context, Floatspace_linear, 0, 0, 0);
+    BitmapBgra * source = BitmapBgra_create(&context, 301, 203, false, Bgra32);
+    fill_noisy_gradient(source, 5);
+    source->pixels_readonly = true;
+    //The same colors, opaque
+    BitmapBgra * opaque = BitmapBgra_create(&context, 301, 203, false, Bgra32);
+    memcpy(opaque->pixels, source->pixels, (size_t)source->stride * source->h);
+    for (uint32_t y = 0; y < opaque->h; y++)
+        for (uint32_t x = 0; x < opaque->w; x++)
+            opaque->pixels[y * opaque->stride + x * 4 + 3] = 255;
+    opaque->pixels_readonly = true;
+
+    //Halving, kernels and sharpening, transposed, and onto a matte
+    for (int flags = 0; flags < 16; flags++){
+        const bool transpose = (flags & 4) != 0;
+        const int cx = transpose ? 45 : 70;
+        const int cy = transpose ? 70 : 45;
+        const uint8_t matte[4] = { 0, 200, 0, 255 };
+        RenderDetails * details = RenderDetails_create_with(&context, Filter_Robidoux);
+        details->halving_acceptable_pixel_loss = (flags & 1) != 0 ? 1 : 0;
+        if (flags & 2) {
+            details->kernel_a = ConvolutionKernel_create_guassian_normalized(&context, 1.4, 3);
+            details->sharpen_percent_goal = 20;
+            details->minimum_sample_window_to_interposharpen = 100;
+        }
+        details->post_transpose = transpose;
+        details->detect_opaque_alpha = false;
+        BitmapBgra * expected = render_canvas(&context, details, opaque, cx, cy, Bgra32, (flags & 8) != 0 ? matte : NULL);
+        details->detect_opaque_alpha = true;
+        BitmapBgra * actual = render_canvas(&context, details, opaque, cx, cy, Bgra32, (flags & 8) != 0 ? matte : NULL);
+        CHECK(max_byte_difference(expected, actual) <= 1);
+        RenderDetails_destroy(&context, details);
+        BitmapBgra_destroy(&context, expected);
+        BitmapBgra_destroy(&context, actual);
+    }
+
+    //A renderer taking alpha as 1 never reads it: a translucent source renders like the opaque one, without being
+    //premultiplied or matted
+    BitmapBgra * expected = BitmapBgra_create(&context, 70, 45, true, Bgra32);
+    BitmapBgra * actual = BitmapBgra_create(&context, 70, 45, true, Bgra32);
+    actual->compositing_mode = Blend_with_matte;
+    RenderDetails * details = RenderDetails_create_with(&context, Filter_Robidoux);
+    details->detect_opaque_alpha = false;
+    REQUIRE(RenderDetails_render(&context, details, opaque, expected));
+    Renderer * r = Renderer_create(&context, source, actual, details);
+    REQUIRE(r != NULL);
+    r->opaque_alpha = true;
+    REQUIRE(Renderer_perform_render(&context, r));
+    Renderer_destroy(&context, r);
+    CHECK(max_byte_difference(expected, actual) == 0);
+    RenderDetails_destroy(&context, details);
+    BitmapBgra_destroy(&context, expected);
+    BitmapBgra_destroy(&context, actual);
+    BitmapBgra_destroy(&context, opaque);
+    BitmapBgra_destroy(&context, source);
+    Context_terminate(&context);
+}
+
+TEST_CASE("Gray8 sources render like the same gray in Bgr24", "[fastscaling]")
+{
+    Context context;
+    Context_initialize(&context);
+    //Halving, perfect size, and upscaling
+    const int sizes[][4] = { { 301, 203, 70, 45 }, { 120, 90, 120, 90 }, { 67, 41, 150, 101 } };
+    const SimdLevel levels[3] = { Simd_scalar, Simd_sse41, Simd_avx2 };
+    for (auto & size : sizes){
+        BitmapBgra * gray = BitmapBgra_create(&context, size[0], size[1], false, Gray8);
+        fill_noisy_gradient(gray, size[0]);
+        BitmapBgra * color = BitmapBgra_create(&context, size[0], size[1], false, Bgr24);
+        for (uint32_t y = 0; y < gray->h; y++)
+            for (uint32_t x = 0; x < gray->w; x++)
+                memset(color->pixels + y * color->stride + x * 3, gray->pixels[y * gray->stride + x], 3);
+        //Transposing with post_flip_x flips the source in place, and only restores a readonly one
+        gray->pixels_readonly = true;
+        color->pixels_readonly = true;
+
+        for (int space = 0; space < 2; space++){
+            Context_set_floatspace(&context, space == 0 ? Floatspace_as_is : Floatspace_linear, 0, 0, 0);
+            for (int index = 0; index < 11; index++){
+                //Sharpened by the rows' own pass, rather than through the weights
+                RenderDetails * details = RenderDetails_create_with(&context, Filter_Robidoux);
+                details->sharpen_percent_goal = 20;
+                details->minimum_sample_window_to_interposharpen = 100;
+                details->post_flip_x = true;
+                switch (index) {
+                case 1: details->enable_streaming_vertical_pass = true; break;
+                case 2: details->post_transpose = true; break;
+                case 3: details->halving_acceptable_pixel_loss = 1; break;
+                case 4: details->halving_acceptable_pixel_loss = 1; details->enable_fused_halving = true; break;
+                case 5: case 6:
+                    details->kernel_a = ConvolutionKernel_create_guassian_normalized(&context, 1.4, 3);
+                    details->kernel_b = ConvolutionKernel_create_guassian_normalized(&context, 4, 12);
+                    details->post_transpose = index == 6;
+                    break;
+                //Inverting gray, alone, streamed, or after halving
+                case 7: case 8: case 9:
+                    details->apply_color_matrix = true;
+                    for (int i = 0; i < 3; i++){
+                        for (int j = 0; j < 3; j++){
+                            details->color_matrix[i][j] = -1.0f / 3;
+                        }
+                        details->color_matrix[4][i] = 1;
+                    }
+                    details->color_matrix[3][3] = 1;
+                    details->enable_streaming_vertical_pass = index == 8;
+                    details->halving_acceptable_pixel_loss = index == 9 ? 1 : 0;
+                    break;
+                //Regions can't be sharpened after scaling
+                case 10: details->roi_output_w = size[2]; details->roi_output_h = size[3]; details->sharpen_percent_goal = 0; break;
+                }
+                const int cx = details->post_transpose ? size[3] : size[2];
+                const int cy = details->post_transpose ? size[2] : size[3];
+                Context_set_simd_level(&context, Simd_scalar);
+                BitmapBgra * expected = render_canvas(&context, details, color, cx, cy, Bgr24, NULL);
+                for (SimdLevel level : levels){
+                    if (level > Context_simd_level_supported(&context)) continue;
+                    Context_set_simd_level(&context, level);
+                    //Onto color canvases, gray is expanded (with opaque alpha); only colorless results fit a Gray8 one
+                    BitmapBgra * bgr = render_canvas(&context, details, gray, cx, cy, Bgr24, NULL);
+                    BitmapBgra * bgra = render_canvas(&context, details, gray, cx, cy, Bgra32, NULL);
+                    CHECK(max_byte_difference(expected, bgr) <= 1);
+                    for (uint32_t y = 0; y < bgra->h; y++){
+                        for (uint32_t x = 0; x < bgra->w; x++){
+                            CHECK(memcmp(bgra->pixels + y * bgra->stride + x * 4, bgr->pixels + y * bgr->stride + x * 3, 3) == 0);
+                            CHECK(bgra->pixels[y * bgra->stride + x * 4 + 3] == 255);
+                        }
+                    }
+                    if (!details->apply_color_matrix){
+                        BitmapBgra * single = render_canvas(&context, details, gray, cx, cy, Gray8, NULL);
+                        for (uint32_t y = 0; y < single->h; y++)
+                            for (uint32_t x = 0; x < single->w; x++)
+                                CHECK(single->pixels[y * single->stride + x] == bgr->pixels[y * bgr->stride + x * 3]);
+                        BitmapBgra_destroy(&context, single);
+                    }
+                    BitmapBgra_destroy(&context, bgr);
+                    BitmapBgra_destroy(&context, bgra);
+                }
+                RenderDetails_destroy(&context, details);
+                BitmapBgra_destroy(&context, expected);
+            }
+        }
+        BitmapBgra_destroy(&context, gray);
+        BitmapBgra_destroy(&context, color);
+    }
+
+    //Color can't be written to a Gray8 canvas
+    BitmapBgra * color = BitmapBgra_create(&context, 40, 30, true, Bgr24);
+    BitmapBgra * canvas = BitmapBgra_create(&context, 20, 15, true, Gray8);
+    RenderDetails * details = RenderDetails_create_with(&context, Filter_Robidoux);
+    CHECK_FALSE(RenderDetails_render(&context, details, color, canvas));
+    CHECK(Context_error_reason(&context) == Unsupported_pixel_format);
+    RenderDetails_destroy(&context, details);
+    BitmapBgra_destroy(&context, canvas);
+    BitmapBgra_destroy(&context, color);
+    Context_terminate(&context);
+}
+
+TEST_CASE("Gray halving, scaling and convolution match their scalar versions", "[fastscaling]")
+{
+    Context context;
+    Context_initialize(&context);
+    BitmapBgra * gray = BitmapBgra_create(&context, 203, 37, false, Gray8);
+    fill_noisy_gradient(gray, 5);
+    InterpolationDetails * interpolation = InterpolationDetails_create_from(&context, Filter_Robidoux);
+    LineContributions * contrib = LineContributions_create(&context, 61, 203, interpolation);
+    PaddedContributions * padded = PaddedContributions_create(&context, contrib, 203, 4, false);
+    ConvolutionKernel * kernels[2] = { ConvolutionKernel_create_guassian_normalized(&context, 1.4, 5),
+                                       ConvolutionKernel_create_guassian_normalized(&context, 3, 9) };
+    BitmapFloat * expected[5] = {};
+    const SimdLevel levels[3] = { Simd_scalar, Simd_sse41, Simd_avx2 };
+    for (SimdLevel level : levels){
+        if (level > Context_simd_level_supported(&context)) continue;
+        Context_set_simd_level(&context, level);
+        BitmapFloat * rows = BitmapFloat_create(&context, 203, 37, 1, false);
+        BitmapFloat * scaled = BitmapFloat_create(&context, 61, 37, 1, false);
+        BitmapFloat * padded_scaled = BitmapFloat_create(&context, 61, 37, 1, false);
+        BitmapFloat * halved = BitmapFloat_create(&context, 67, 12, 1, false);
+        BitmapBgra * halved_bytes = BitmapBgra_create(&context, 67, 12, false, Gray8);
+        REQUIRE(BitmapBgra_convert_srgb_to_linear(&context, gray, 0, rows, 0, 37));
+        REQUIRE(BitmapFloat_scale_rows(&context, rows, 0, scaled, 0, 37, contrib->ContribRow));
+        REQUIRE(BitmapFloat_scale_rows_padded(&context, rows, 0, padded_scaled, 0, 37, padded));
+        REQUIRE(BitmapBgra_halve_srgb_to_linear(&context, gray, 3, 0, false, halved, 0, 12, NULL));
+        REQUIRE(Halve(&context, gray, halved_bytes, 3, NULL));
+        for (ConvolutionKernel * kernel : kernels){
+            REQUIRE(BitmapFloat_convolve_rows(&context, rows, kernel, 1, 0, 37, NULL));
+        }
+        BitmapFloat * results[5] = { rows, scaled, padded_scaled, halved, NULL };
+        for (int i = 0; i < 4; i++){
+            if (expected[i] == NULL) {
+                expected[i] = results[i];
+                continue;
+            }
+            float max_diff = 0;
+            for (uint32_t y = 0; y < results[i]->h; y++)
+                for (uint32_t x = 0; x < results[i]->w; x++)
+                    max_diff = std::max(max_diff, std::abs(results[i]->pixels[y * results[i]->float_stride + x] - expected[i]->pixels[y * expected[i]->float_stride + x]));
+            CHECK(max_diff < 1e-4f);
+            BitmapFloat_destroy(&context, results[i]);
+        }
+        //The scalar scaling paths agree with each other, too
+        if (level == Simd_scalar) {
+            for (uint32_t x = 0; x < 61; x++)
+                CHECK(std::abs(scaled->pixels[x] - padded_scaled->pixels[x]) < 1e-4f);
+        }
+        //Halving to bytes averages the same blocks
+        for (uint32_t y = 0; y < 12; y++){
+            for (uint32_t x = 0; x < 67; x++){
+                int sum = 0;
+                for (int k = 0; k < 9; k++)
+                    sum += gray->pixels[(y * 3 + k / 3) * gray->stride + x * 3 + k % 3];
+                CHECK(halved_bytes->pixels[y * halved_bytes->stride + x] == sum / 9);
+            }
+        }
+        BitmapBgra_destroy(&context, halved_bytes);
+    }
+    for (int i = 0; i < 4; i++) BitmapFloat_destroy(&context, expected[i]);
+    ConvolutionKernel_destroy(&context, kernels[0]);
+    ConvolutionKernel_destroy(&context, kernels[1]);
+    PaddedContributions_destroy(&context, padded);
+    LineContributions_destroy(&context, contrib);
+    InterpolationDetails_destroy(&context, interpolation);
+    BitmapBgra_destroy(&context, gray);
+    Context_terminate(&context);
+}
+
+//Smooth luma and chroma, well within the range that converts to BGR without clamping
+static BitmapYCbCr * create_smooth_ycbcr(Context * context, uint32_t w, uint32_t h, uint32_t subsampling_x, uint32_t subsampling_y)
+{
+    BitmapYCbCr * im = BitmapYCbCr_create(context, w, h, subsampling_x, subsampling_y);
+    REQUIRE(im != NULL);
+    for (int plane = 0; plane < 3; plane++){
+        const uint32_t sx = plane == 0 ? 1 : subsampling_x;
+        const uint32_t sy = plane == 0 ? 1 : subsampling_y;
+        for (uint32_t y = 0; y < BitmapYCbCr_plane_height(im, plane); y++){
+            for (uint32_t x = 0; x < BitmapYCbCr_plane_width(im, plane); x++){
+                //In luma coordinates, so every subsampling describes the same picture
+                const double lx = (x + 0.5) * sx;
+                const double ly = (y + 0.5) * sy;
+                const double v = plane == 0 ? 100 + 50 * sin(lx * 0.05) * cos(ly * 0.04)
+                                            : 128 + 25 * (plane == 1 ? sin(lx * 0.04 + ly * 0.03) : cos(lx * 0.03 - ly * 0.05));
+                im->planes[plane][y * im->strides[plane] + x] = (uint8_t)(v + 0.5);
+            }
+        }
+    }
+    return im;
+}
+
+static RenderDetails * create_ycbcr_details(Context * context, bool transpose, bool kernels, bool matrix)
+{
+    RenderDetails * details = RenderDetails_create_with(context, Filter_Robidoux);
+    details->post_transpose = transpose;
+    details->post_flip_x = transpose;
+    details->post_flip_y = !transpose;
+    details->sharpen_percent_goal = 15;
+    details->minimum_sample_window_to_interposharpen = 100;
+    if (kernels) {
+        details->kernel_a = ConvolutionKernel_create_guassian_normalized(context, 1.4, 3);
+    }
+    if (matrix) {
+        //Swaps blue and red, and darkens green
+        details->apply_color_matrix = true;
+        details->color_matrix[0][2] = 1;
+        details->color_matrix[1][1] = 0.8f;
+        details->color_matrix[2][0] = 1;
+        details->color_matrix[3][3] = 1;
+    }
+    return details;
+}
+
+TEST_CASE("Planar YCbCr renders like its BGR conversion", "[fastscaling]")
+{
+    Context context;
+    Context_initialize(&context);
+    const int sizes[][4] = { { 301, 203, 70, 45 }, { 67, 41, 150, 101 }, { 640, 480, 100, 75 } };
+    const uint32_t subsamplings[][2] = { { 1, 1 }, { 2, 2 }, { 2, 1 } };
+    for (auto & size : sizes){
+        for (auto & subsampling : subsamplings){
+            BitmapYCbCr * source = create_smooth_ycbcr(&context, size[0], size[1], subsampling[0], subsampling[1]);
+            BitmapBgra * converted = BitmapBgra_create(&context, size[0], size[1], false, Bgr24);
+            REQUIRE(BitmapYCbCr_to_bgra(&context, source, converted));
+            converted->pixels_readonly = true;
+            for (int variant = 0; variant < 4; variant++){
+                const bool transpose = variant == 1;
+                const int cx = transpose ? size[3] : size[2];
+                const int cy = transpose ? size[2] : size[3];
+                RenderDetails * details = create_ycbcr_details(&context, transpose, variant == 2, variant == 3);
+                details->halving_acceptable_pixel_loss = 1;
+
+                Context_set_floatspace(&context, Floatspace_as_is, 0, 0, 0);
+                BitmapBgra * expected = BitmapBgra_create(&context, cx, cy, true, Bgra32);
+                REQUIRE(RenderDetails_render(&context, details, converted, expected));
+
+                //The planes are scaled as they're stored whatever the context's floatspace; the matrix isn't
+                Context_set_floatspace(&context, variant == 3 ? Floatspace_as_is : Floatspace_linear, 0, 0, 0);
+                BitmapBgra * actual = BitmapBgra_create(&context, cx, cy, true, Bgra32);
+                REQUIRE(RenderDetails_render_ycbcr(&context, details, source, actual));
+                CHECK(context.colorspace.floatspace == (variant == 3 ? Floatspace_as_is : Floatspace_linear));
+                //Each plane is rounded before conversion; chroma is scaled from fewer samples than the upsampled copy has
+                CHECK(max_byte_difference(expected, actual) <= (subsampling[0] == 1 && subsampling[1] == 1 ? 3 : 5));
+                for (uint32_t y = 0; y < actual->h; y++)
+                    for (uint32_t x = 0; x < actual->w; x++)
+                        CHECK(actual->pixels[y * actual->stride + x * 4 + 3] == 255);
+
+                if (variant != 3) {
+                    //The luma alone, for Gray8 canvases, and each plane for encoders
+                    BitmapBgra * luma = BitmapBgra_create(&context, cx, cy, true, Gray8);
+                    REQUIRE(RenderDetails_render_ycbcr(&context, details, source, luma));
+                    BitmapYCbCr * planes = BitmapYCbCr_create(&context, cx, cy, 1, 1);
+                    REQUIRE(RenderDetails_render_ycbcr_planes(&context, details, source, planes));
+                    BitmapBgra * from_planes = BitmapBgra_create(&context, cx, cy, true, Bgra32);
+                    REQUIRE(BitmapYCbCr_to_bgra(&context, planes, from_planes));
+                    CHECK(max_byte_difference(from_planes, actual) == 0);
+                    for (uint32_t y = 0; y < (uint32_t)cy; y++){
+                        CHECK(memcmp(luma->pixels + y * luma->stride, planes->planes[0] + y * planes->strides[0], cx) == 0);
+                    }
+                    BitmapBgra_destroy(&context, luma);
+                    BitmapBgra_destroy(&context, from_planes);
+                    BitmapYCbCr_destroy(&context, planes);
+                }
+                BitmapBgra_destroy(&context, expected);
+                BitmapBgra_destroy(&context, actual);
+                RenderDetails_destroy(&context, details);
+            }
+            BitmapBgra_destroy(&context, converted);
+            BitmapYCbCr_destroy(&context, source);
+        }
+    }
+    Context_terminate(&context);
+}
+
+TEST_CASE("Planar YCbCr can be rendered to subsampled planes", "[fastscaling]")
+{
+    Context context;
+    Context_initialize(&context);
+    BitmapYCbCr * source = create_smooth_ycbcr(&context, 640, 480, 2, 2);
+    RenderDetails * details = RenderDetails_create_with(&context, Filter_Robidoux);
+    BitmapYCbCr * full = BitmapYCbCr_create(&context, 100, 76, 1, 1);
+    REQUIRE(RenderDetails_render_ycbcr_planes(&context, details, source, full));
+    BitmapYCbCr * subsampled = BitmapYCbCr_create(&context, 100, 76, 2, 2);
+    REQUIRE(RenderDetails_render_ycbcr_planes(&context, details, source, subsampled));
+    for (uint32_t y = 0; y < 76; y++){
+        CHECK(memcmp(subsampled->planes[0] + y * subsampled->strides[0], full->planes[0] + y * full->strides[0], 100) == 0);
+    }
+    //Half-size chroma is close to the average of the full-size chroma it covers
+    int worst = 0;
+    for (int plane = 1; plane < 3; plane++){
+        for (uint32_t y = 0; y < 76; y += 2){
+            for (uint32_t x = 0; x < 100; x += 2){
+                const uint8_t * p = full->planes[plane] + y * full->strides[plane] + x;
+                const int average = (p[0] + p[1] + p[full->strides[plane]] + p[full->strides[plane] + 1] + 2) / 4;
+                worst = std::max(worst, abs(average - subsampled->planes[plane][(y / 2) * subsampled->strides[plane] + x / 2]));
+            }
+        }
+    }
+    CHECK(worst <= 2);
+    BitmapYCbCr_destroy(&context, full);
+    BitmapYCbCr_destroy(&context, subsampled);
+    RenderDetails_destroy(&context, details);
+    BitmapYCbCr_destroy(&context, source);
+    Context_terminate(&context);
+}
+
+TEST_CASE("Odd-sized 4:2:0 chroma stays sited on the luma it covers", "[fastscaling]")
+{
+    Context context;
+    Context_initialize(&context);
+    //Chroma ramps, so a sample's position shows in its value: Cb rises 10 per sample across, Cr 12 per sample down
+    BitmapYCbCr * source = BitmapYCbCr_create(&context, 41, 31, 2, 2);
+    const uint32_t chroma_w = BitmapYCbCr_plane_width(source, 1);
+    const uint32_t chroma_h = BitmapYCbCr_plane_height(source, 1);
+    memset(source->planes[0], 128, (size_t)source->strides[0] * source->h);
+    for (uint32_t y = 0; y < chroma_h; y++){
+        for (uint32_t x = 0; x < chroma_w; x++){
+            source->planes[1][y * source->strides[1] + x] = (uint8_t)(16 + 10 * x);
+            source->planes[2][y * source->strides[2] + x] = (uint8_t)(16 + 12 * y);
+        }
+    }
+    const int sizes[][2] = { { 61, 47 }, { 15, 11 } };
+    for (auto & size : sizes){
+        for (int transpose = 0; transpose < 2; transpose++){
+            RenderDetails * details = RenderDetails_create_with(&context, Filter_Robidoux);
+            details->post_transpose = transpose == 1;
+            const uint32_t cx = transpose ? size[1] : size[0];
+            const uint32_t cy = transpose ? size[0] : size[1];
+            BitmapYCbCr * canvas = BitmapYCbCr_create(&context, cx, cy, 1, 1);
+            REQUIRE(RenderDetails_render_ycbcr_planes(&context, details, source, canvas));
+            //Output pixel u's center is at luma (u + 0.5) * 41 / size[0], which is chroma sample (that / 2 - 0.5).
+            //Windows that reach past the chroma's edges are clamped, so only the interior follows the ramp.
+            double worst = 0;
+            for (uint32_t v = 0; v < (uint32_t)size[1]; v++){
+                for (uint32_t u = 0; u < (uint32_t)size[0]; u++){
+                    const double sample_x = (u + 0.5) * 41 / size[0] / 2 - 0.5;
+                    const double sample_y = (v + 0.5) * 31 / size[1] / 2 - 0.5;
+                    const double reach_x = 2.5 * std::max(1.0, 20.5 / size[0]);
+                    const double reach_y = 2.5 * std::max(1.0, 15.5 / size[1]);
+                    const uint32_t x = transpose ? v : u;
+                    const uint32_t y = transpose ? u : v;
+                    if (sample_x - reach_x >= 0 && sample_x + reach_x <= chroma_w - 1){
+                        worst = std::max(worst, fabs(canvas->planes[1][y * canvas->strides[1] + x] - (16 + 10 * sample_x)));
+                    }
+                    if (sample_y - reach_y >= 0 && sample_y + reach_y <= chroma_h - 1){
+                        worst = std::max(worst, fabs(canvas->planes[2][y * canvas->strides[2] + x] - (16 + 12 * sample_y)));
+                    }
+                }
+            }
+            CHECK(worst <= 1.5);
+            BitmapYCbCr_destroy(&context, canvas);
+            RenderDetails_destroy(&context, details);
+        }
+    }
+    BitmapYCbCr_destroy(&context, source);
+    Context_terminate(&context);
+}
+
+TEST_CASE("Odd-height 4:2:0 regions match the same rows of the full render", "[fastscaling]")
+{
+    Context context;
+    Context_initialize(&context);
+    //51 rows of chroma render to 51 output rows, but reach half a luma row past the image, so span 51.5 of them
+    BitmapYCbCr * source = create_smooth_ycbcr(&context, 64, 101, 2, 2);
+    RenderDetails * details = RenderDetails_create_with(&context, Filter_Robidoux);
+    BitmapBgra * full = BitmapBgra_create(&context, 32, 51, true, Bgr24);
+    REQUIRE(RenderDetails_render_ycbcr(&context, details, source, full));
+    details->roi_output_w = 32;
+    details->roi_output_h = 51;
+    for (uint32_t y = 0; y + 16 <= 51; y += 10){
+        details->roi_y = y;
+        BitmapBgra * tile = BitmapBgra_create(&context, 32, 16, true, Bgr24);
+        REQUIRE(RenderDetails_render_ycbcr(&context, details, source, tile));
+        BitmapBgra expected = *full;
+        expected.pixels = full->pixels + (size_t)y * full->stride;
+        expected.h = 16;
+        CHECK(max_byte_difference(&expected, tile) <= 1);
+        BitmapBgra_destroy(&context, tile);
+    }
+    BitmapBgra_destroy(&context, full);
+    RenderDetails_destroy(&context, details);
+    BitmapYCbCr_destroy(&context, source);
+    Context_terminate(&context);
+}
+
+TEST_CASE("Planar YCbCr rejects what it can't render", "[fastscaling]")
+{
+    Context context;
+    Context_initialize(&context);
+    CHECK(BitmapYCbCr_create(&context, 10, 10, 5, 1) == NULL);
+    CHECK(Context_error_reason(&context) == Invalid_argument);
+
+    BitmapYCbCr * source = create_smooth_ycbcr(&context, 40, 30, 2, 2);
+    CHECK(BitmapYCbCr_plane_width(source, 1) == 20);
+    BitmapYCbCr * odd = BitmapYCbCr_create(&context, 41, 31, 2, 2);
+    CHECK(BitmapYCbCr_plane_width(odd, 2) == 21);
+    CHECK(BitmapYCbCr_plane_height(odd, 2) == 16);
+    CHECK(BitmapYCbCr_plane_height(odd, 0) == 31);
+    BitmapYCbCr_destroy(&context, odd);
+
+    //Color stages need color
+    RenderDetails * details = create_ycbcr_details(&context, false, false, true);
+    BitmapBgra * gray = BitmapBgra_create(&context, 20, 15, true, Gray8);
+    CHECK_FALSE(RenderDetails_render_ycbcr(&context, details, source, gray));
+    CHECK(Context_error_reason(&context) == Unsupported_pixel_format);
+
+    //A region of interest can't be mapped onto subsampled planes
+    details->apply_color_matrix = false;
+    details->roi_output_w = 40;
+    details->roi_output_h = 30;
+    BitmapYCbCr * canvas = BitmapYCbCr_create(&context, 20, 15, 2, 2);
+    CHECK_FALSE(RenderDetails_render_ycbcr_planes(&context, details, source, canvas));
+    CHECK(Context_error_reason(&context) == Invalid_argument);
+
+    BitmapYCbCr_destroy(&context, canvas);
+    BitmapBgra_destroy(&context, gray);
+    RenderDetails_destroy(&context, details);
+    BitmapYCbCr_destroy(&context, source);
+    Context_terminate(&context);
+}
+
+//The same pixels in a wider format: bytes scaled to 16 bits, or the half float nearest their 0..1 value
+static BitmapBgra * widen_bitmap(Context * context, BitmapBgra * b, BitmapPixelFormat format)
+{
+    BitmapBgra * wide = BitmapBgra_create(context, b->w, b->h, false, format);
+    wide->alpha_meaningful = b->alpha_meaningful;
+    wide->pixels_readonly = b->pixels_readonly;
+    const uint32_t from_bpp = BitmapPixelFormat_bytes_per_pixel(b->fmt);
+    const uint32_t ch = BitmapPixelFormat_channels(format);
+    for (uint32_t y = 0; y < b->h; y++){
+        for (uint32_t x = 0; x < b->w; x++){
+            for (uint32_t c = 0; c < ch; c++){
+                //Bgr pixels get opaque alpha
+                const uint8_t v = c < from_bpp ? b->pixels[y * b->stride + x * from_bpp + c] : 255;
+                const uint16_t w = format == BgraHalf ? unit_to_half(v / 255.0f) : (uint16_t)(v * 257);
+                memcpy(wide->pixels + y * wide->stride + (x * ch + c) * 2, &w, 2);
+            }
+        }
+    }
+    return wide;
+}
+
+//A channel of a wide bitmap, on the 0..255 scale
+static float wide_channel(Context * context, BitmapBgra * b, uint32_t x, uint32_t y, uint32_t c)
+{
+    uint16_t v;
+    memcpy(&v, b->pixels + y * b->stride + (x * BitmapPixelFormat_channels(b->fmt) + c) * 2, 2);
+    return (b->fmt == BgraHalf ? context->wide.half_to_unit[v] : v / 65535.0f) * 255.0f;
+}
+
+static float max_wide_difference(Context * context, BitmapBgra * bytes, BitmapBgra * wide)
+{
+    REQUIRE(Context_prepare_wide_tables(context));
+    //Bgr pixels may be compared to the color channels of wider Bgra ones
+    const uint32_t ch = umin(BitmapPixelFormat_channels(wide->fmt), BitmapPixelFormat_channels(bytes->fmt));
+    const uint32_t bpp = BitmapPixelFormat_bytes_per_pixel(bytes->fmt);
+    float max_diff = 0;
+    for (uint32_t y = 0; y < wide->h; y++)
+        for (uint32_t x = 0; x < wide->w; x++)
+            for (uint32_t c = 0; c < ch; c++)
+                max_diff = std::max(max_diff, (float)fabs(wide_channel(context, wide, x, y, c) - bytes->pixels[y * bytes->stride + x * bpp + c]));
+    return max_diff;
+}
+
+//The renders wide, premultiplied and GDI+ sources are compared across
+enum RenderCase {
+    Case_plain,
+    Case_streaming,
+    Case_kernels,
+    Case_transposed,
+    Case_region, //A region of interest covering the whole canvas
+    Case_matted,
+    Case_matted_transposed,
+    Case_threaded,
+    Case_streaming_transposed
+};
+
+//Details for a RenderCase onto a cx by cy canvas, sharpened by the rows' own pass rather than through the weights (except
+//Case_region), and flipped
+static RenderDetails * create_case_details(Context * context, RenderCase c, int cx, int cy)
+{
+    RenderDetails * details = RenderDetails_create_with(context, Filter_Robidoux);
+    details->sharpen_percent_goal = 20;
+    details->minimum_sample_window_to_interposharpen = 100;
+    details->post_flip_x = true;
+    details->threads = c == Case_threaded ? 3 : 1;
+    details->enable_streaming_vertical_pass = c == Case_streaming || c == Case_streaming_transposed;
+    details->post_transpose = c == Case_transposed || c == Case_matted_transposed || c == Case_streaming_transposed;
+    if (c == Case_kernels) {
+        details->kernel_a = ConvolutionKernel_create_guassian_normalized(context, 1.4, 3);
+        details->kernel_b = ConvolutionKernel_create_guassian_normalized(context, 4, 12);
+    }
+    //Regions can't be sharpened after scaling
+    if (c == Case_region) {
+        details->roi_output_w = cx;
+        details->roi_output_h = cy;
+        details->sharpen_percent_goal = 0;
+    }
+    return details;
+}
+
+//The matte to pass render_canvas for a RenderCase, or NULL
+static const uint8_t * case_matte(RenderCase c)
+{
+    static const uint8_t matte[4] = { 200, 100, 30, 255 };
+    return c == Case_matted || c == Case_matted_transposed ? matte : NULL;
+}
+
+TEST_CASE("16-bit and half float sources render like the same pixels in 8 bits", "[fastscaling]")
+{
+    Context context;
+    Context_initialize(&context);
+    const int sizes[][4] = { { 301, 203, 70, 45 }, { 67, 41, 150, 101 } };
+    const RenderCase cases[] = { Case_plain, Case_streaming, Case_kernels, Case_transposed, Case_region, Case_matted,
+                                 Case_matted_transposed, Case_streaming_transposed };
+    for (auto & size : sizes){
+        for (int bpp = 3; bpp <= 4; bpp++){
+            BitmapBgra * source = BitmapBgra_create(&context, size[0], size[1], false, (BitmapPixelFormat)bpp);
+            fill_noisy_gradient(source, size[0] + bpp);
+            source->pixels_readonly = true;
+            const BitmapPixelFormat wide_formats[] = { bpp == 3 ? Bgr48 : Bgra64, BgraHalf };
+            for (int space = 0; space < 2; space++){
+                Context_set_floatspace(&context, space == 0 ? Floatspace_as_is : Floatspace_linear, 0, 0, 0);
+                for (BitmapPixelFormat format : wide_formats){
+                    BitmapBgra * wide = widen_bitmap(&context, source, format);
+                    if (format == BgraHalf && bpp == 3) {
+                        wide->alpha_meaningful = false;
+                    }
+                    for (RenderCase c : cases){
+                        RenderDetails * details = create_case_details(&context, c, size[2], size[3]);
+                        const int cx = details->post_transpose ? size[3] : size[2];
+                        const int cy = details->post_transpose ? size[2] : size[3];
+                        BitmapBgra * expected = render_canvas(&context, details, source, cx, cy, source->fmt, case_matte(c));
+                        BitmapBgra * actual = render_canvas(&context, details, wide, cx, cy, format, case_matte(c));
+                        CHECK(max_wide_difference(&context, expected, actual) <= 1.5f);
+                        //Onto 8-bit canvases, as the 8-bit source would be
+                        BitmapBgra * narrowed = render_canvas(&context, details, wide, cx, cy, source->fmt, case_matte(c));
+                        CHECK(max_byte_difference(expected, narrowed) <= 1);
+                        RenderDetails_destroy(&context, details);
+                        BitmapBgra_destroy(&context, expected);
+                        BitmapBgra_destroy(&context, actual);
+                        BitmapBgra_destroy(&context, narrowed);
+                    }
+                    //Threads share tables built beforehand, on a context that hasn't built them yet
+                    Context fresh;
+                    Context_initialize(&fresh);
+                    Context_set_floatspace(&fresh, context.colorspace.floatspace, 0, 0, 0);
+                    RenderDetails * details = create_case_details(&context, Case_plain, size[2], size[3]);
+                    RenderDetails * threaded_details = create_case_details(&fresh, Case_threaded, size[2], size[3]);
+                    BitmapBgra * single = render_canvas(&context, details, wide, size[2], size[3], format, NULL);
+                    BitmapBgra * threaded = render_canvas(&fresh, threaded_details, wide, size[2], size[3], format, NULL);
+                    CHECK(memcmp(single->pixels, threaded->pixels, (size_t)single->stride * single->h) == 0);
+                    RenderDetails_destroy(&fresh, threaded_details);
+                    RenderDetails_destroy(&context, details);
+                    BitmapBgra_destroy(&context, single);
+                    BitmapBgra_destroy(&fresh, threaded);
+                    Context_terminate(&fresh);
+                    BitmapBgra_destroy(&context, wide);
+                }
+            }
+            BitmapBgra_destroy(&context, source);
+        }
+    }
+    Context_terminate(&context);
+}
+
+TEST_CASE("16-bit and half float channels keep their precision", "[fastscaling]")
+{
+    Context context;
+    Context_initialize(&context);
+    const WorkingFloatspace spaces[] = { Floatspace_as_is, Floatspace_linear, Floatspace_gamma };
+    for (WorkingFloatspace space : spaces){
+        Context_set_floatspace(&context, space, 2.2f, 0, 0);
+        REQUIRE(Context_prepare_wide_tables(&context));
+        int worst_word = 0;
+        for (uint32_t n = 0; n < 65536; n++){
+            worst_word = std::max(worst_word, abs((int)Context_floatspace_to_word(&context, context.wide.word_to_float[n]) - (int)n));
+        }
+        CHECK(worst_word <= 1);
+        int worst_half = 0;
+        for (uint32_t n = 0; n <= 0x3C00; n++){
+            worst_half = std::max(worst_half, abs((int)unit_to_half(Context_floatspace_to_unit(&context, context.wide.half_to_float[n])) - (int)n));
+        }
+        CHECK(worst_half <= 1);
+    }
+
+    //A same-size render of a gradient too fine for bytes comes back as it was
+    Context_set_floatspace(&context, Floatspace_linear, 0, 0, 0);
+    BitmapBgra * source = BitmapBgra_create(&context, 1000, 4, false, Bgra64);
+    for (uint32_t y = 0; y < source->h; y++){
+        for (uint32_t x = 0; x < source->w; x++){
+            const uint16_t pixel[4] = { (uint16_t)(x * 13), (uint16_t)(20000 + x * 7), (uint16_t)(x * 3 + y), 65535 };
+            memcpy(source->pixels + y * source->stride + x * 8, pixel, 8);
+        }
+    }
+    BitmapBgra * canvas = BitmapBgra_create(&context, 1000, 4, true, Bgra64);
+    RenderDetails * details = RenderDetails_create_with(&context, Filter_Robidoux);
+    REQUIRE(RenderDetails_render(&context, details, source, canvas));
+    int worst = 0;
+    for (uint32_t y = 0; y < source->h; y++){
+        const uint16_t * a = (const uint16_t *)(source->pixels + y * source->stride);
+        const uint16_t * b = (const uint16_t *)(canvas->pixels + y * canvas->stride);
+        for (uint32_t i = 0; i < source->w * 4; i++){
+            worst = std::max(worst, abs((int)a[i] - (int)b[i]));
+        }
+    }
+    CHECK(worst <= 1);
+    RenderDetails_destroy(&context, details);
+    BitmapBgra_destroy(&context, canvas);
+    BitmapBgra_destroy(&context, source);
+    Context_terminate(&context);
+}
+
+TEST_CASE("Rendering leaves the halving divisor of its details as it was", "[fastscaling]")
+{
+    Context context;
+    Context_initialize(&context);
+    BitmapBgra * source = BitmapBgra_create(&context, 301, 203, false, Bgra32);
+    fill_noisy_gradient(source, 9);
+    source->pixels_readonly = true;
+    BitmapBgra * wide = widen_bitmap(&context, source, Bgra64);
+    RenderDetails * details = RenderDetails_create_with(&context, Filter_Robidoux);
+    details->halving_acceptable_pixel_loss = 1;
+    //A wide render isn't halved, and a byte one is; neither should change what the next one picks
+    BitmapBgra * wide_canvas = BitmapBgra_create(&context, 30, 20, true, Bgra64);
+    REQUIRE(RenderDetails_render(&context, details, wide, wide_canvas));
+    CHECK(details->halving_divisor == 0);
+    BitmapBgra * reused = BitmapBgra_create(&context, 30, 20, true, Bgra32);
+    REQUIRE(RenderDetails_render(&context, details, source, reused));
+    CHECK(details->halving_divisor == 0);
+    RenderDetails * fresh = RenderDetails_create_with(&context, Filter_Robidoux);
+    fresh->halving_acceptable_pixel_loss = 1;
+    BitmapBgra * expected = BitmapBgra_create(&context, 30, 20, true, Bgra32);
+    REQUIRE(RenderDetails_render(&context, fresh, source, expected));
+    CHECK(max_byte_difference(expected, reused) == 0);
+    //Not halving at all gives a different result, so the comparison above means something
+    fresh->halving_divisor = 1;
+    BitmapBgra * unhalved = BitmapBgra_create(&context, 30, 20, true, Bgra32);
+    REQUIRE(RenderDetails_render(&context, fresh, source, unhalved));
+    CHECK(max_byte_difference(expected, unhalved) > 0);
+    BitmapBgra_destroy(&context, unhalved);
+    BitmapBgra_destroy(&context, expected);
+    BitmapBgra_destroy(&context, reused);
+    BitmapBgra_destroy(&context, wide_canvas);
+    RenderDetails_destroy(&context, fresh);
+    RenderDetails_destroy(&context, details);
+    BitmapBgra_destroy(&context, wide);
+    BitmapBgra_destroy(&context, source);
+    Context_terminate(&context);
+}
+
+//Multiplies the colors of a Bgra32 bitmap by alpha, in place, as GDI+ PArgb stores them
+static void premultiply_bitmap(BitmapBgra * b)
+{
+    for (uint32_t y = 0; y < b->h; y++)
+        for (uint32_t x = 0; x < b->w; x++){
+            uint8_t * p = b->pixels + y * b->stride + x * 4;
+            for (int c = 0; c < 3; c++) p[c] = (uint8_t)((p[c] * p[3] + 127) / 255);
+        }
+    b->alpha_premultiplied = true;
+}
+
+//Compares straight Bgra32 bitmaps by their premultiplied colors, which is all that's left of a translucent pixel
+static float max_premultiplied_difference(BitmapBgra * a, BitmapBgra * b)
+{
+    float max_diff = 0;
+    for (uint32_t y = 0; y < a->h; y++)
+        for (uint32_t x = 0; x < a->w; x++){
+            const uint8_t * p = a->pixels + y * a->stride + x * 4;
+            const uint8_t * q = b->pixels + y * b->stride + x * 4;
+            for (int c = 0; c < 3; c++)
+                max_diff = std::max(max_diff, (float)fabs(p[c] * p[3] / 255.0f - q[c] * q[3] / 255.0f));
+            max_diff = std::max(max_diff, (float)abs(p[3] - q[3]));
+        }
+    return max_diff;
+}
+
+TEST_CASE("Premultiplied sources render like their straight equivalents", "[fastscaling]")
+{
+    Context context;
+    Context_initialize(&context);
+    BitmapBgra * source = BitmapBgra_create(&context, 301, 203, false, Bgra32);
+    fill_noisy_gradient(source, 31);
+    source->pixels_readonly = true;
+    BitmapBgra * premultiplied = BitmapBgra_create(&context, 301, 203, false, Bgra32);
+    memcpy(premultiplied->pixels, source->pixels, (size_t)source->stride * source->h);
+    premultiply_bitmap(premultiplied);
+    premultiplied->pixels_readonly = true;
+    const RenderCase cases[] = { Case_plain, Case_streaming, Case_kernels, Case_transposed, Case_region, Case_matted,
+                                 Case_threaded, Case_streaming_transposed };
+    for (int space = 0; space < 2; space++){
+        Context_set_floatspace(&context, space == 0 ? Floatspace_as_is : Floatspace_linear, 0, 0, 0);
+        for (RenderCase c : cases){
+            RenderDetails * details = create_case_details(&context, c, 70, 45);
+            const int cx = details->post_transpose ? 45 : 70;
+            const int cy = details->post_transpose ? 70 : 45;
+            BitmapBgra * expected = render_canvas(&context, details, source, cx, cy, Bgra32, case_matte(c));
+            BitmapBgra * actual = render_canvas(&context, details, premultiplied, cx, cy, Bgra32, case_matte(c));
+            CHECK(max_premultiplied_difference(expected, actual) <= 1.5f);
+            RenderDetails_destroy(&context, details);
+            BitmapBgra_destroy(&context, expected);
+            BitmapBgra_destroy(&context, actual);
+        }
+        //16-bit channels, premultiplied the same way (and not halved, unlike bytes)
+        BitmapBgra * straight_wide = widen_bitmap(&context, source, Bgra64);
+        BitmapBgra * wide = widen_bitmap(&context, premultiplied, Bgra64);
+        wide->alpha_premultiplied = true;
+        RenderDetails * details = create_case_details(&context, Case_plain, 70, 45);
+        BitmapBgra * expected = render_canvas(&context, details, straight_wide, 70, 45, Bgra32, NULL);
+        BitmapBgra * actual = render_canvas(&context, details, wide, 70, 45, Bgra32, NULL);
+        CHECK(max_premultiplied_difference(expected, actual) <= 1.5f);
+        RenderDetails_destroy(&context, details);
+        BitmapBgra_destroy(&context, expected);
+        BitmapBgra_destroy(&context, actual);
+        BitmapBgra_destroy(&context, wide);
+        BitmapBgra_destroy(&context, straight_wide);
+    }
+    BitmapBgra_destroy(&context, premultiplied);
+    BitmapBgra_destroy(&context, source);
+    Context_terminate(&context);
+}
+
+TEST_CASE("Premultiplied canvases receive and compose premultiplied colors", "[fastscaling]")
+{
+    Context context;
+    Context_initialize(&context);
+    BitmapBgra * source = BitmapBgra_create(&context, 90, 40, false, Bgra32);
+    fill_noisy_gradient(source, 33);
+    source->pixels_readonly = true;
+    const SimdLevel levels[3] = { Simd_scalar, Simd_sse41, Simd_avx2 };
+    for (int space = 0; space < 2; space++){
+        Context_set_floatspace(&context, space == 0 ? Floatspace_as_is : Floatspace_linear, 0, 0, 0);
+        for (int matted = 0; matted < 2; matted++){
+            const RenderCase c = matted ? Case_matted : Case_plain;
+            Context_set_simd_level(&context, Simd_scalar);
+            RenderDetails * details = create_case_details(&context, c, 70, 31);
+            BitmapBgra * expected = render_canvas(&context, details, source, 70, 31, Bgra32, case_matte(c));
+            if (!matted) premultiply_bitmap(expected);
+            for (SimdLevel level : levels){
+                if (level > Context_simd_level_supported(&context)) continue;
+                Context_set_simd_level(&context, level);
+                BitmapBgra * canvas = BitmapBgra_create(&context, 70, 31, true, Bgra32);
+                canvas->alpha_premultiplied = true;
+                if (matted) {
+                    canvas->compositing_mode = Blend_with_matte;
+                    memcpy(canvas->matte_color, case_matte(c), 4);
+                }
+                REQUIRE(RenderDetails_render(&context, details, source, canvas));
+                //Matted pixels are opaque either way
+                CHECK(max_byte_difference(expected, canvas) <= 1);
+                BitmapBgra_destroy(&context, canvas);
+            }
+            RenderDetails_destroy(&context, details);
+            BitmapBgra_destroy(&context, expected);
+        }
+
+        //Composed over a translucent background, premultiplied or not
+        BitmapBgra * background = BitmapBgra_create(&context, 90, 40, false, Bgra32);
+        fill_noisy_gradient(background, 34);
+        background->alpha_meaningful = true;
+        Context_set_simd_level(&context, Simd_scalar);
+        BitmapBgra * expected = compose_over(&context, source, background, 90, 40, false);
+        premultiply_bitmap(background);
+        BitmapBgra * actual = compose_over(&context, source, background, 90, 40, false);
+        premultiply_bitmap(expected);
+        CHECK(max_byte_difference(expected, actual) <= 2);
+        BitmapBgra_destroy(&context, expected);
+        BitmapBgra_destroy(&context, actual);
+        BitmapBgra_destroy(&context, background);
+    }
+    BitmapBgra_destroy(&context, source);
+    Context_terminate(&context);
+}
+
+//Noise in a GDI+ layout: the gradient of fill_noisy_gradient for bytes, 13-bit linear values (premultiplied if asked)
+//for the 48 and 64 bpp formats, and a palette for Indexed8
+static BitmapBgra * create_gdi_bitmap(Context * context, int w, int h, BitmapPixelFormat format, uint8_t * palette, bool premultiplied)
+{
+    BitmapBgra * b = BitmapBgra_create(context, w, h, false, format);
+    b->pixels_readonly = true;
+    b->palette = palette;
+    b->alpha_premultiplied = premultiplied;
+    fill_noisy_gradient(b, (unsigned int)format + w);
+    if (format == Bgr48Linear || format == Bgra64Linear){
+        const uint32_t ch = BitmapPixelFormat_channels(format);
+        for (uint32_t y = 0; y < b->h; y++)
+            for (uint32_t x = 0; x < b->w; x++){
+                uint16_t v[4];
+                v[3] = (uint16_t)(GDI_LINEAR_MAX / 2 + rand() % (GDI_LINEAR_MAX / 2 + 1));
+                for (int c = 0; c < 3; c++){
+                    v[c] = (uint16_t)((x * 20 + y * 10 + c * 2000 + rand() % 500) % (GDI_LINEAR_MAX + 1));
+                    if (premultiplied) v[c] = (uint16_t)(v[c] * v[3] / GDI_LINEAR_MAX);
+                }
+                memcpy(b->pixels + y * b->stride + x * ch * 2, v, ch * 2);
+            }
+    }
+    return b;
+}
+
+//What the renderer sees of b: its rows, unpacked
+static BitmapBgra * unpack_bitmap(Context * context, BitmapBgra * b)
+{
+    REQUIRE(Context_prepare_wide_tables(context));
+    BitmapBgra * unpacked = BitmapBgra_create(context, b->w, b->h, false, BitmapPixelFormat_unpacked(b->fmt));
+    unpacked->alpha_meaningful = b->alpha_meaningful;
+    unpacked->pixels_readonly = true;
+    for (uint32_t y = 0; y < b->h; y++){
+        REQUIRE(BitmapBgra_unpack_pixels(context, b, 0, y, b->w, unpacked->pixels + y * unpacked->stride));
+    }
+    return unpacked;
+}
+
+TEST_CASE("GDI+ layouts render as their unpacked pixels would", "[fastscaling]")
+{
+    Context context;
+    Context_initialize(&context);
+    uint8_t palette[1024];
+    for (int i = 0; i < 1024; i++) palette[i] = (uint8_t)(i % 4 == 3 ? 255 - (i / 4) % 64 : (i * 37) % 256);
+    const BitmapPixelFormat formats[] = { Indexed8, Bgr565, Bgr555, Bgra5551, Bgr48Linear, Bgra64Linear };
+    //Downscaled (and halved, for the byte layouts) and upscaled
+    const int sizes[][4] = { { 301, 203, 70, 45 }, { 67, 41, 150, 101 } };
+    const RenderCase cases[] = { Case_plain, Case_streaming, Case_kernels, Case_transposed, Case_region, Case_matted,
+                                 Case_threaded, Case_streaming_transposed };
+    for (BitmapPixelFormat format : formats){
+        for (int premultiplied = 0; premultiplied < (format == Bgra64Linear ? 2 : 1); premultiplied++){
+            for (auto & size : sizes){
+                BitmapBgra * source = create_gdi_bitmap(&context, size[0], size[1], format, palette, premultiplied != 0);
+                BitmapBgra * unpacked = unpack_bitmap(&context, source);
+                for (int space = 0; space < 2; space++){
+                    Context_set_floatspace(&context, space == 0 ? Floatspace_as_is : Floatspace_linear, 0, 0, 0);
+                    for (RenderCase c : cases){
+                        RenderDetails * case_details = create_case_details(&context, c, size[2], size[3]);
+                        const int cx = case_details->post_transpose ? size[3] : size[2];
+                        const int cy = case_details->post_transpose ? size[2] : size[3];
+                        BitmapBgra * expected = render_canvas(&context, case_details, unpacked, cx, cy, Bgra32, case_matte(c));
+                        BitmapBgra * actual = render_canvas(&context, case_details, source, cx, cy, Bgra32, case_matte(c));
+                        CHECK(max_byte_difference(expected, actual) == 0);
+                        RenderDetails_destroy(&context, case_details);
+                        BitmapBgra_destroy(&context, expected);
+                        BitmapBgra_destroy(&context, actual);
+                    }
+                    //Plans halve into a buffer of the unpacked format
+                    RenderDetails * details = RenderDetails_create_with(&context, Filter_Robidoux);
+                    RenderPlan * plan = RenderPlan_create(&context, details, size[0], size[1], format, source->alpha_meaningful, size[2], size[3], 1);
+                    REQUIRE(plan != NULL);
+                    BitmapBgra * expected = BitmapBgra_create(&context, size[2], size[3], true, Bgra32);
+                    BitmapBgra * actual = BitmapBgra_create(&context, size[2], size[3], true, Bgra32);
+                    REQUIRE(RenderDetails_render(&context, details, unpacked, expected));
+                    REQUIRE(RenderPlan_execute(&context, plan, source, actual));
+                    CHECK(max_byte_difference(expected, actual) == 0);
+                    BitmapBgra_destroy(&context, expected);
+                    BitmapBgra_destroy(&context, actual);
+                    RenderPlan_destroy(&context, plan);
+                    RenderDetails_destroy(&context, details);
+                }
+                BitmapBgra_destroy(&context, unpacked);
+                BitmapBgra_destroy(&context, source);
+            }
+        }
+    }
+    //Without a palette, or as a canvas, there's nothing to go on
+    BitmapBgra * indexed = create_gdi_bitmap(&context, 40, 30, Indexed8, NULL, false);
+    BitmapBgra * canvas = BitmapBgra_create(&context, 20, 15, true, Bgra32);
+    RenderDetails * details = RenderDetails_create_with(&context, Filter_Robidoux);
+    CHECK_FALSE(RenderDetails_render(&context, details, indexed, canvas));
+    CHECK(Context_error_reason(&context) == Invalid_argument);
+    RenderDetails_destroy(&context, details);
+    BitmapBgra_destroy(&context, canvas);
+    BitmapBgra_destroy(&context, indexed);
+    Context_terminate(&context);
+}
+
+TEST_CASE("GDI+ layouts are refused as canvases by every entry point", "[fastscaling]")
+{
+    Context context;
+    Context_initialize(&context);
+    BitmapBgra * source = BitmapBgra_create(&context, 40, 30, false, Bgra32);
+    fill_noisy_gradient(source, 2);
+    source->pixels_readonly = true;
+    const BitmapPixelFormat formats[] = { Indexed8, Bgr565, Bgr555, Bgra5551, Bgr48Linear, Bgra64Linear };
+    for (BitmapPixelFormat format : formats){
+        BitmapBgra * canvas = BitmapBgra_create(&context, 20, 15, true, format);
+        for (int path = 0; path < 3; path++){
+            RenderDetails * details = RenderDetails_create_with(&context, Filter_Robidoux);
+            details->enable_streaming_vertical_pass = path == 1;
+            if (path == 2){
+                details->roi_output_w = 20;
+                details->roi_output_h = 15;
+            }
+            CHECK_FALSE(RenderDetails_render(&context, details, source, canvas));
+            CHECK(Context_error_reason(&context) == Unsupported_pixel_format);
+            RenderDetails_destroy(&context, details);
+        }
+        RenderDetails * details = RenderDetails_create_with(&context, Filter_Robidoux);
+        CHECK_FALSE(RenderDetails_render_tiled(&context, details, source, canvas, 8));
+        CHECK(Context_error_reason(&context) == Unsupported_pixel_format);
+        CHECK_FALSE(RenderDetails_render_in_place(&context, details, canvas));
+        CHECK(Context_error_reason(&context) == Unsupported_pixel_format);
+
+        RenderPlan * plan = RenderPlan_create(&context, details, 40, 30, Bgra32, true, 20, 15, 1);
+        REQUIRE(plan != NULL);
+        CHECK_FALSE(RenderPlan_execute(&context, plan, source, canvas));
+        CHECK(Context_error_reason(&context) == Unsupported_pixel_format);
+        RenderPlan_destroy(&context, plan);
+
+        StreamingRenderer * r = StreamingRenderer_create(&context, details, 40, 30, Bgra32, true, 20, 15);
+        REQUIRE(r != NULL);
+        uint32_t consumed = 0;
+        uint32_t written = 0;
+        REQUIRE(StreamingRenderer_push_rows(&context, r, source, &consumed));
+        CHECK_FALSE(StreamingRenderer_pull_rows(&context, r, canvas, 0, 15, &written));
+        CHECK(Context_error_reason(&context) == Unsupported_pixel_format);
+        CHECK(written == 0);
+        StreamingRenderer_destroy(&context, r);
+        RenderDetails_destroy(&context, details);
+
+        //Nothing was written
+        bool untouched = true;
+        for (uint32_t i = 0; i < canvas->stride * canvas->h; i++) untouched = untouched && canvas->pixels[i] == 0;
+        CHECK(untouched);
+        BitmapBgra_destroy(&context, canvas);
+    }
+    BitmapBgra_destroy(&context, source);
+    Context_terminate(&context);
+}
+
+TEST_CASE("Pixel format conversion unpacks, widens and narrows exactly", "[fastscaling]")
+{
+    Context context;
+    Context_initialize(&context);
+    const SimdLevel levels[3] = { Simd_scalar, Simd_sse41, Simd_avx2 };
+    //Every 16-bit value, at every level
+    BitmapBgra * packed = BitmapBgra_create(&context, 65536, 1, false, Bgr565);
+    for (uint32_t n = 0; n < 65536; n++){
+        packed->pixels[n * 2] = (uint8_t)n;
+        packed->pixels[n * 2 + 1] = (uint8_t)(n >> 8);
+    }
+    BitmapBgra * reference_row = BitmapBgra_create(&context, 65536, 1, false, Bgra32);
+    BitmapBgra * unpacked_row = BitmapBgra_create(&context, 65536, 1, false, Bgra32);
+    uint8_t * reference = reference_row->pixels;
+    uint8_t * unpacked = unpacked_row->pixels;
+    const BitmapPixelFormat packed_formats[] = { Bgr565, Bgr555, Bgra5551 };
+    for (BitmapPixelFormat format : packed_formats){
+        packed->fmt = format;
+        Context_set_simd_level(&context, Simd_scalar);
+        REQUIRE(BitmapBgra_unpack_pixels(&context, packed, 0, 0, 65536, reference));
+        int worst = 0;
+        for (uint32_t n = 0; n < 65536; n++){
+            const uint8_t * p = &reference[n * 4];
+            const int green_bits = format == Bgr565 ? 6 : 5;
+            const int fields[3] = { (int)(n & 31), (int)(n >> 5) & ((1 << green_bits) - 1), (int)(n >> (5 + green_bits)) & 31 };
+            for (int c = 0; c < 3; c++){
+                const int max = c == 1 ? (1 << green_bits) - 1 : 31;
+                worst = std::max(worst, abs(p[c] - (fields[c] * 255 + max / 2) / max));
+            }
+            CHECK(p[3] == (format == Bgra5551 && n < 0x8000 ? 0 : 255));
+        }
+        CHECK(worst <= 1);
+        for (SimdLevel level : levels){
+            if (level > Context_simd_level_supported(&context)) continue;
+            Context_set_simd_level(&context, level);
+            //An odd count leaves a scalar tail
+            memset(unpacked, 0, 65536 * 4);
+            REQUIRE(BitmapBgra_unpack_pixels(&context, packed, 0, 0, 65535, unpacked));
+            CHECK(memcmp(reference, unpacked, 65535 * 4) == 0);
+            CHECK(unpacked[65535 * 4] == 0);
+        }
+    }
+    BitmapBgra_destroy(&context, unpacked_row);
+    BitmapBgra_destroy(&context, reference_row);
+    BitmapBgra_destroy(&context, packed);
+
+    //Palettes, and Bgr24 to Bgra32 and back, at every level
+    uint8_t palette[1024];
+    for (int i = 0; i < 1024; i++) palette[i] = (uint8_t)(i * 7 + 3);
+    BitmapBgra * indexed = create_gdi_bitmap(&context, 259, 7, Indexed8, palette, false);
+    BitmapBgra * bgr = BitmapBgra_create(&context, 259, 7, false, Bgr24);
+    fill_noisy_gradient(bgr, 5);
+    for (SimdLevel level : levels){
+        if (level > Context_simd_level_supported(&context)) continue;
+        Context_set_simd_level(&context, level);
+        BitmapBgra * bgra = BitmapBgra_create(&context, 259, 7, false, Bgra32);
+        REQUIRE(BitmapBgra_convert(&context, indexed, bgra));
+        for (uint32_t y = 0; y < indexed->h; y++)
+            for (uint32_t x = 0; x < indexed->w; x++)
+                CHECK(memcmp(bgra->pixels + y * bgra->stride + x * 4, palette + indexed->pixels[y * indexed->stride + x] * 4, 4) == 0);
+        REQUIRE(BitmapBgra_convert(&context, bgr, bgra));
+        BitmapBgra * back = BitmapBgra_create(&context, 259, 7, false, Bgr24);
+        REQUIRE(BitmapBgra_convert(&context, bgra, back));
+        CHECK(max_byte_difference(bgr, back) == 0);
+        for (uint32_t y = 0; y < bgra->h; y++)
+            for (uint32_t x = 0; x < bgra->w; x++)
+                CHECK(bgra->pixels[y * bgra->stride + x * 4 + 3] == 255);
+        BitmapBgra_destroy(&context, back);
+        BitmapBgra_destroy(&context, bgra);
+    }
+    BitmapBgra_destroy(&context, bgr);
+    BitmapBgra_destroy(&context, indexed);
+
+    //16-bit channels round to the nearest byte; 13-bit linear ones are encoded first, and divided by alpha if premultiplied
+    BitmapBgra * words = BitmapBgra_create(&context, 16384, 1, false, Bgra64);
+    for (uint32_t n = 0; n < 65536; n++){
+        const uint16_t v = (uint16_t)n;
+        memcpy(words->pixels + n * 2, &v, 2);
+    }
+    for (SimdLevel level : levels){
+        if (level > Context_simd_level_supported(&context)) continue;
+        Context_set_simd_level(&context, level);
+        BitmapBgra * bytes = BitmapBgra_create(&context, 16384, 1, false, Bgra32);
+        REQUIRE(BitmapBgra_convert(&context, words, bytes));
+        int mismatches = 0;
+        for (uint32_t n = 0; n < 65536; n++){
+            if (bytes->pixels[n] != (n * 255 + 32767) / 65535) mismatches++;
+        }
+        CHECK(mismatches == 0);
+        BitmapBgra_destroy(&context, bytes);
+    }
+    BitmapBgra_destroy(&context, words);
+    BitmapBgra * linear = BitmapBgra_create(&context, 3, 1, false, Bgra64Linear);
+    const uint16_t pixels[12] = { 0, GDI_LINEAR_MAX, 100, GDI_LINEAR_MAX, 1000, 2000, 3000, 4000, 0, 0, 0, 0 };
+    memcpy(linear->pixels, pixels, sizeof(pixels));
+    BitmapBgra * bytes = BitmapBgra_create(&context, 3, 1, false, Bgra32);
+    REQUIRE(BitmapBgra_convert(&context, linear, bytes));
+    const uint8_t straight[12] = { 0, 255, 29, 255, 98, 135, 163, 125, 0, 0, 0, 0 };
+    CHECK(memcmp(bytes->pixels, straight, 12) == 0);
+    linear->alpha_premultiplied = true;
+    REQUIRE(BitmapBgra_convert(&context, linear, bytes));
+    //1000, 2000 and 3000 of 4000 are a quarter, half and three quarters in linear light
+    const uint8_t demultiplied[12] = { 0, 255, 29, 255, 137, 188, 225, 125, 0, 0, 0, 0 };
+    CHECK(memcmp(bytes->pixels, demultiplied, 12) == 0);
+    CHECK_FALSE(bytes->alpha_premultiplied);
+    BitmapBgra_destroy(&context, bytes);
+    BitmapBgra_destroy(&context, linear);
+    Context_terminate(&context);
+}
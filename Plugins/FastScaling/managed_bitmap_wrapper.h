@@ -45,17 +45,44 @@ namespace ImageResizer{
                     BitmapBgra* bgra;
                     Rectangle crop_window;
                     ExecutionContext^ c;
+                    IntPtr palette;
                 public:
-                    WrappedBitmap (ExecutionContext^ c, BitmapOptions^ opts)
+                    //The layout FastScaling reads the format as, or 0 if it can't
+                    static ::BitmapPixelFormat NativeFormat (PixelFormat format){
+                        switch (format){
+                        case PixelFormat::Format24bppRgb: return Bgr24;
+                        case PixelFormat::Format32bppRgb:
+                        case PixelFormat::Format32bppArgb:
+                        case PixelFormat::Format32bppPArgb: return Bgra32;
+                        case PixelFormat::Format8bppIndexed: return Indexed8;
+                        case PixelFormat::Format16bppRgb565: return Bgr565;
+                        case PixelFormat::Format16bppRgb555: return Bgr555;
+                        case PixelFormat::Format16bppArgb1555: return Bgra5551;
+                        case PixelFormat::Format48bppRgb: return Bgr48Linear;
+                        case PixelFormat::Format64bppArgb:
+                        case PixelFormat::Format64bppPArgb: return Bgra64Linear;
+                        default: return (::BitmapPixelFormat)0;
+                        }
+                    }
+
+                    //written is set for canvases, and for bitmaps edited in place
+                    WrappedBitmap (ExecutionContext^ c, BitmapOptions^ opts, bool written)
                     {
                         this->c = c;
                         Bitmap^ source = opts->Bitmap;
                         PixelFormat format = opts->Bitmap->PixelFormat;
 
-                        bool hasAlpha = format == PixelFormat::Format32bppArgb || format == PixelFormat::Format32bppPArgb;
-                        if (!hasAlpha && format != PixelFormat::Format32bppRgb && format != PixelFormat::Format24bppRgb){
+                        ::BitmapPixelFormat native_format = NativeFormat (format);
+                        if (native_format == 0){
                             throw gcnew ArgumentOutOfRangeException ("source", "Invalid pixel format " + source->PixelFormat.ToString ());
                         }
+                        bool hasAlpha = format == PixelFormat::Format32bppArgb || format == PixelFormat::Format32bppPArgb ||
+                            format == PixelFormat::Format16bppArgb1555 || format == PixelFormat::Format64bppArgb || format == PixelFormat::Format64bppPArgb;
+                        //Packed layouts are unpacked as they're read, never written
+                        bool packed = BitmapPixelFormat_unpacked (native_format) != native_format;
+                        if (packed && written){
+                            throw gcnew ArgumentOutOfRangeException ("canvas", "Pixel format " + source->PixelFormat.ToString () + " can only be read");
+                        }
 
                         Rectangle from = opts->Crop;
                         if (from.X < 0 || from.Y < 0 || from.Right > source->Width || from.Bottom > source->Height || from.Width < 1 || from.Height < 1) {
@@ -66,24 +93,41 @@ namespace ImageResizer{
                         BitmapBgra* im = BitmapBgra_create_header (c->GetContext (), sx, sy);
                         if (im == NULL) throw gcnew FastScalingException (c);
 
+                        if (native_format == Indexed8){
+                            //Copied, as Bitmap::Palette hands out a copy anyway
+                            array<Color>^ entries = source->Palette->Entries;
+                            this->palette = Marshal::AllocHGlobal (1024);
+                            uint8_t* p = (uint8_t*)this->palette.ToPointer ();
+                            for (int i = 0; i < 256; i++){
+                                Color entry = i < entries->Length ? entries[i] : Color::Black;
+                                p[i * 4] = entry.B;
+                                p[i * 4 + 1] = entry.G;
+                                p[i * 4 + 2] = entry.R;
+                                p[i * 4 + 3] = entry.A;
+                            }
+                            im->palette = p;
+                            hasAlpha = (source->Palette->Flags & 1) != 0; //PaletteFlagsHasAlpha
+                        }
+
                         this->underlying_bitmap = source;
                         this->crop_window = from;
 
 
                         //LockBits handles cropping for us.
                         this->locked_bitmap_data = source->LockBits (from, opts->Readonly ? ImageLockMode::ReadOnly : ImageLockMode::ReadWrite, source->PixelFormat);
-                        im->fmt = hasAlpha ? Bgra32 : Bgr24;
+                        im->fmt = native_format;
                         im->pixels = (unsigned char *)safe_cast<void *>(this->locked_bitmap_data->Scan0);
                         im->stride = this->locked_bitmap_data->Stride;
 
-                        im->pixels_readonly = opts->Readonly;
-                        im->stride_readonly = opts->Readonly || (im->stride - (BitmapPixelFormat_bytes_per_pixel (im->fmt) * im->w) > BitmapPixelFormat_bytes_per_pixel (im->fmt)); //We can never mess with the stride when lockbits is used - unless there is no padding.
+                        im->pixels_readonly = opts->Readonly || packed;
+                        im->stride_readonly = im->pixels_readonly || (im->stride - (BitmapPixelFormat_bytes_per_pixel (im->fmt) * im->w) > BitmapPixelFormat_bytes_per_pixel (im->fmt)); //We can never mess with the stride when lockbits is used - unless there is no padding.
                         im->can_reuse_space = !im->stride_readonly && opts->AllowSpaceReuse;
 
                         im->w = sx;
                         im->h = sy;
 
                         im->alpha_meaningful = hasAlpha && opts->AlphaMeaningful;
+                        im->alpha_premultiplied = format == PixelFormat::Format32bppPArgb || format == PixelFormat::Format64bppPArgb;
 
                         im->compositing_mode = (::BitmapCompositingMode)(int)opts->Compositing;
                         if (opts->Matte_Color != nullptr){
@@ -102,6 +146,10 @@ namespace ImageResizer{
                         }
                         BitmapBgra_destroy (c->GetContext (), bgra);
                         bgra = NULL;
+                        if (palette != IntPtr::Zero){
+                            Marshal::FreeHGlobal (palette);
+                            palette = IntPtr::Zero;
+                        }
 
                     }
 
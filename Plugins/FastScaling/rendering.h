@@ -143,7 +143,7 @@ namespace ImageResizer{
                         }
                         CopyBasics (opts, details);
                         if (p != nullptr) p->Start ("SysDrawingToBgra", false);
-                        wbSource = gcnew WrappedBitmap (c, editInPlace);
+                        wbSource = gcnew WrappedBitmap (c, editInPlace, true);
                         if (p != nullptr) p->Stop ("SysDrawingToBgra", true, false);
 
                     }
@@ -161,8 +161,8 @@ namespace ImageResizer{
                         details->enable_profiling = p != nullptr && p->Active;
                         CopyBasics (opts, details);
                         if (p != nullptr) p->Start ("SysDrawingToBgra", false);
-                        wbSource = gcnew WrappedBitmap (c, source);
-                        wbCanvas = gcnew WrappedBitmap (c, canvas);
+                        wbSource = gcnew WrappedBitmap (c, source, false);
+                        wbCanvas = gcnew WrappedBitmap (c, canvas, true);
                         if (p != nullptr) p->Stop ("SysDrawingToBgra", true, false);
 
                     }